@@ -0,0 +1,46 @@
+.section .text
+
+# Runs the cpuid instruction.
+# Leaf to query at %esp + 4 goes into %eax
+# Pointer to four words for %eax, %ebx, %ecx and %edx at %esp + 8
+.global cpuid
+cpuid:
+    push %ebx
+    push %edi
+    mov 12(%esp), %eax
+    mov 16(%esp), %edi
+    xor %ecx, %ecx
+    cpuid
+    mov %eax, (%edi)
+    mov %ebx, 4(%edi)
+    mov %ecx, 8(%edi)
+    mov %edx, 12(%edi)
+    pop %edi
+    pop %ebx
+    ret
+
+# Reads a model specific register. The 64 bit value is returned in %edx:%eax.
+# Register number at %esp + 4 goes into %ecx
+.global read_msr
+read_msr:
+    mov 4(%esp), %ecx
+    rdmsr
+    ret
+
+# Writes a model specific register.
+# Register number at %esp + 4 goes into %ecx
+# Low word of the value at %esp + 8 goes into %eax
+# High word of the value at %esp + 12 goes into %edx
+.global write_msr
+write_msr:
+    mov 4(%esp), %ecx
+    mov 8(%esp), %eax
+    mov 12(%esp), %edx
+    wrmsr
+    ret
+
+# Reads the time stamp counter. The 64 bit value is returned in %edx:%eax.
+.global rdtsc
+rdtsc:
+    rdtsc
+    ret
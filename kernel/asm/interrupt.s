@@ -32,6 +32,23 @@ enable_interrupts:
     sti
     ret
 
+# Enables interrupts and halts until one arrives, then disables them again. The
+# sti only takes effect after the following instruction, so an interrupt can't
+# sneak in between the sti and the hlt and leave us halted.
+.global wait_for_interrupt
+wait_for_interrupt:
+    sti
+    hlt
+    cli
+    ret
+
+# Hints to the processor that it's in a spin wait loop, which saves power and
+# lets a hyperthreaded sibling run.
+.global cpu_relax
+cpu_relax:
+    pause
+    ret
+
 # Interrupt handler when there is no error code.
 # Push an extra zero onto the stack to simulate an error code.
 # Push the interrupt number onto the stack.
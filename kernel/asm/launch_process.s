@@ -1,5 +1,3 @@
-.extern switch_blocked_for_switch
-
 # Transfers to a user mode process, using an iret (ie fooling the processor into
 # thinking it was already in user mode).
 # Value for edi at %esp + 4
@@ -15,6 +13,7 @@
 # Value for eflags at %esp + 44
 # Value for esp at %esp + 48
 # Value for ss (and other segment registers) at %esp + 52
+# Top of the process kernel stack at %esp + 56
 # For the iret, the stack state must be:
 #  %esp + 16: ss
 #  %esp + 12: esp
@@ -27,16 +26,27 @@ launch_process:
     # Get rid of the return address, since we won't be needing it.
     add $4, %esp
 
+    # We may be on the kernel stack of the process that was switched out, which
+    # another processor can resume as soon as we give up the kernel lock. Move
+    # the register values onto the top of the new process's kernel stack, which
+    # nothing else uses while it's in user mode, and give up the lock from
+    # there. We're always well down the old stack, so the two can't overlap.
+    mov 52(%esp), %edi
+    sub $52, %edi
+    mov %esp, %esi
+    mov $13, %ecx
+    cld
+    rep movsl
+    sub $52, %edi
+    mov %edi, %esp
+    call leave_kernel_lock
+
     # Restore general purpose register values. The value for esp is ignored, so
     # the effect on esp is just to add 32.
     popal
 
     # The stack is now correctly set for the iret
 
-    # Unblock task switching for switch in progress. We do this at the last
-    # possible moment.
-    movl $0, switch_blocked_for_switch
-
     # Segment registers other than cs and ss.
     push %eax
     mov 20(%esp), %ax
@@ -107,10 +117,6 @@ launch_kernel_process:
     # value.
     mov (%ebp), %ebp 
 
-    # Unblock task switching for switch in progress. We do this at the last
-    # possible moment.
-    movl $0, switch_blocked_for_switch
-
     # Testing
 #    mov $0xCAFEBABE, %ecx
 #    .test: jmp .test
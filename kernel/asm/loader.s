@@ -58,9 +58,9 @@ BootPdt:
     .long BootPt
     .long BootPt2
     .skip (1024 - KERNEL_PAGE_NUMBER - 2)*4, 0
-# There's another 4 bytes at the end which is the last_alloc of the Page Frame
-# Allocator. We'll set it 0, as it's only for speed and we'll overwrite it in
-# initialisation anyway.
+# There's another 4 bytes at the end which is the Page Frame Allocator member.
+# It holds no data of its own (all the state is static), so this is just
+# padding to make the size match.
     .long 0
 # This is where we'll have our first kernel Page Table. For simplicity, we'll
 # map the whole 4MB.
@@ -127,10 +127,6 @@ kernel_virtual_max: .long KERNEL_VIRTUAL_BASE + 0x00800000
 .align 16
     stack_base: .skip KERNEL_STACK_SIZE
     stack_top:
-# We reserve one page (4KB) to make sure there's always somewhere to create a
-# new page table.
-.align 4096
-    page_table_temp: .skip 4096
 
 .section .text
 # This is where GRUB will transfer control to. Just to confuse everyone, even
@@ -151,9 +147,10 @@ loader:
     or $0x00000010, %eax
     mov %eax, %cr4
 
-    # Enable paging
+    # Enable paging, and write protection in ring 0 so that the kernel faults
+    # on writes to copy on write pages the same as user mode does
     mov %cr0, %eax
-    or $0x80000000, %eax
+    or $0x80010000, %eax
     mov %eax, %cr0
 
     # Jump to a virtual address to continue. Note that real addresses are still
@@ -180,10 +177,6 @@ StartInHigherHalf:
     # have to let the kernel sort it out later.
     push %ebx
 
-    # Pass the location we reserved for temporary page tables.
-    lea page_table_temp, %eax
-    push %eax
-
     # Pass the location of the current PDT.
     lea BootPdt, %eax
     push %eax
@@ -23,6 +23,14 @@ enable_pse:
     mov %eax, %cr4
     ret
 
+# Enables global pages, so mappings marked global survive a cr3 reload
+.global enable_global_pages
+enable_global_pages:
+    mov %cr4, %eax
+    or $0x00000080, %eax
+    mov %eax, %cr4
+    ret
+
 # Invalidates the page at the given virtual address.
 # Address to invalidate at %esp + 4
 .global invalidate_page
@@ -0,0 +1,90 @@
+# Startup code for the application processors. This gets copied to a page in
+# low memory, AP_TRAMPOLINE, and each processor starts running it in real mode
+# when it gets a startup interrupt. It gets into protected mode with a flat
+# GDT of its own, turns on paging with the PDT in ap_cr3, which must identity
+# map the first 4MB as well as the kernel, then calls ap_entry in the higher
+# half on the stack in ap_stack, passing ap_index. The kernel fills in those
+# fields in the copy before starting each processor. Addresses in the copy are
+# worked out as (label - ap_trampoline_start + AP_TRAMPOLINE).
+
+# Physical address the trampoline is copied to. Must be page aligned and below
+# 1MB.
+.set AP_TRAMPOLINE, 0x8000
+
+.section .text
+.code16
+.global ap_trampoline_start
+ap_trampoline_start:
+    cli
+    cld
+
+    # Data accesses are relative to segment 0, since the addresses are
+    # physical.
+    xor %ax, %ax
+    mov %ax, %ds
+
+    # Load the trampoline GDT and switch to protected mode.
+    lgdtl (ap_gdt_pointer - ap_trampoline_start + AP_TRAMPOLINE)
+    mov %cr0, %eax
+    or $0x1, %eax
+    mov %eax, %cr0
+
+    # Far jump to reload cs with the 32 bit code segment.
+    ljmpl $0x8, $(ap_protected_mode - ap_trampoline_start + AP_TRAMPOLINE)
+
+.code32
+ap_protected_mode:
+    # Flat data segments.
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    mov %ax, %ss
+
+    # Paging, the same way the loader does it, plus global pages, which the
+    # kernel has turned on by now.
+    mov (ap_cr3 - ap_trampoline_start + AP_TRAMPOLINE), %eax
+    mov %eax, %cr3
+    mov %cr4, %eax
+    or $0x00000090, %eax
+    mov %eax, %cr4
+    mov %cr0, %eax
+    or $0x80010000, %eax
+    mov %eax, %cr0
+
+    # Move to the kernel stack and call into the higher half.
+    mov (ap_stack - ap_trampoline_start + AP_TRAMPOLINE), %esp
+    pushl (ap_index - ap_trampoline_start + AP_TRAMPOLINE)
+    mov (ap_entry - ap_trampoline_start + AP_TRAMPOLINE), %eax
+    call *%eax
+
+    # The entry point shouldn't return, but just in case.
+.ap_hang:
+    cli
+    hlt
+    jmp .ap_hang
+
+# Flat code and data segments, enough to get to the kernel.
+.align 8
+ap_gdt:
+    .quad 0x0000000000000000
+    .quad 0x00CF9A000000FFFF
+    .quad 0x00CF92000000FFFF
+ap_gdt_pointer:
+    .word 3 * 8 - 1
+    .long (ap_gdt - ap_trampoline_start + AP_TRAMPOLINE)
+
+# Fields filled in by the kernel.
+.align 4
+.global ap_cr3
+ap_cr3: .long 0
+.global ap_stack
+ap_stack: .long 0
+.global ap_entry
+ap_entry: .long 0
+.global ap_index
+ap_index: .long 0
+
+.global ap_trampoline_end
+ap_trampoline_end:
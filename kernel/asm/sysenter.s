@@ -0,0 +1,92 @@
+.section .data
+
+# User mode code and stack segment selectors, filled in by the kernel when it
+# sets up the SYSENTER MSRs. SYSEXIT always returns to these.
+.global sysenter_user_cs
+sysenter_user_cs: .long 0
+.global sysenter_user_ss
+sysenter_user_ss: .long 0
+
+.section .text
+
+# Fast syscall entry, where SYSENTER lands. The user stub puts the syscall
+# index and arguments in registers as for int $0x80, pushes its return address
+# and points %ebp at it. SYSENTER gives us the kernel code and stack segments
+# and interrupts disabled, but nothing else, so we build the same stack frame
+# an int $0x80 from user mode would have made. Everything after that (fork,
+# execve, yield, saving the process state) works the same for both entries.
+# SYSENTER_ESP points at the TSS, from which we take the process kernel stack.
+#
+# The frame, from the bottom, is the same as common_interrupt_handler uses:
+# ss                   user stack segment
+# esp                  %ebp + 4, the user stack after the return address
+# eflags               current flags with interrupts enabled
+# cs                   user code segment
+# eip                  return address from the user stack at %ebp
+# code                 zero
+# interrupt number     0x80
+# general registers    pushal
+.global sysenter_entry
+sysenter_entry:
+    # Switch to esp0 from the TSS.
+    mov 4(%esp), %esp
+
+    pushl sysenter_user_ss
+    pushl %ebp
+    addl $4, (%esp)
+    pushfl
+    orl $0x200, (%esp)
+    pushl sysenter_user_cs
+
+    # The return address has to come from user space. If it doesn't, return to
+    # zero instead, which will fault in user mode. The stub's words run from
+    # %ebp to %ebp + 8, all of which must be below the kernel. Compare %ebp
+    # against the base less 8, so the end can't wrap round past zero.
+    pushl %ecx
+    mov kernel_virtual_base, %ecx
+    sub $8, %ecx
+    cmp %ecx, %ebp
+    popl %ecx
+    ja bad_return
+    pushl (%ebp)
+    jmp push_regs
+    bad_return:
+    pushl $0
+
+    push_regs:
+    pushl $0
+    pushl $0x80
+    pushal
+
+    # The data segments are still the user ones.
+    pushw %ss
+    popw %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+
+    # Syscalls run with interrupts enabled, the same as through the trap gate.
+    sti
+    # The handler returns with interrupts disabled, having given up the kernel
+    # lock, so nothing can interrupt the rest and find the kernel in use or
+    # switch away with half the user state loaded.
+    call sysenter_handler
+    mov %eax, 28(%esp)
+
+    # Restore the user data segments and registers.
+    mov 56(%esp), %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    popal
+    add $8, %esp
+
+    # SYSEXIT takes the return address in %edx and the stack in %ecx. Those
+    # are caller saved, so the stub doesn't expect them kept. STI only takes
+    # effect after the next instruction, which is the SYSEXIT.
+    mov (%esp), %edx
+    mov 12(%esp), %ecx
+    sti
+    sysexit
@@ -0,0 +1,176 @@
+#include "Apic.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Kernel.h"
+#include "PageDescriptorTable.h"
+#include "Pit.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+LocalApic::LocalApic(uint32_t phys) :
+    base{static_cast<volatile uint32_t*>(global_kernel->get_pdt()->map(
+        reinterpret_cast<void*>(phys), PageDescriptorTable::page_size))}
+{
+    if (base == nullptr)
+        global_kernel->panic("No virtual memory for the local APIC");
+}
+
+/******************************************************************************/
+
+void LocalApic::enable(uint8_t spurious)
+{
+    // Accept all priorities and stop errors interrupting.
+    write(reg_tpr, 0);
+    write(reg_lvt_error, lvt_masked);
+    write(reg_svr, svr_enable | spurious);
+}
+
+/******************************************************************************/
+
+uint8_t LocalApic::id() const
+{
+    return read(reg_id) >> 24;
+}
+
+/******************************************************************************/
+
+void LocalApic::send_init(uint8_t apic_id)
+{
+    send_ipi(apic_id, icr_init | icr_assert);
+}
+
+/******************************************************************************/
+
+void LocalApic::send_startup(uint8_t apic_id, uint32_t page)
+{
+    send_ipi(apic_id, icr_startup | (page >> 12));
+}
+
+/******************************************************************************/
+
+void LocalApic::send_interrupt(uint8_t apic_id, uint8_t vector)
+{
+    send_ipi(apic_id, vector);
+}
+
+/******************************************************************************/
+
+uint32_t LocalApic::calibrate_timer(Pit& pit)
+{
+    // Line up with the start of a PIT tick.
+    pit.sleep(1);
+
+    // Count down from the top for a while, without interrupting.
+    constexpr uint32_t ms = 50;
+    write(reg_timer_divide, timer_divide_16);
+    write(reg_lvt_timer, lvt_masked);
+    write(reg_timer_initial, 0xFFFFFFFF);
+    pit.sleep(ms);
+    uint32_t counted = 0xFFFFFFFF - read(reg_timer_current);
+    write(reg_timer_initial, 0);
+
+    return counted / ms;
+}
+
+/******************************************************************************/
+
+void LocalApic::start_timer(uint32_t count, uint8_t vector)
+{
+    write(reg_timer_divide, timer_divide_16);
+    write(reg_lvt_timer, lvt_periodic | vector);
+    write(reg_timer_initial, (count == 0 ? 1 : count));
+}
+
+/******************************************************************************/
+
+void LocalApic::send_ipi(uint8_t apic_id, uint32_t command)
+{
+    // Clear any old errors, then send. The write to the low half sends it.
+    write(reg_esr, 0);
+    write(reg_icr_high, static_cast<uint32_t>(apic_id) << 24);
+    write(reg_icr_low, command);
+
+    while (read(reg_icr_low) & icr_pending)
+        ;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+IoApic::IoApic(uint32_t phys, uint32_t gsi) :
+    base{static_cast<volatile uint32_t*>(global_kernel->get_pdt()->map(
+        reinterpret_cast<void*>(phys), PageDescriptorTable::page_size))},
+    gsi_base{gsi},
+    inputs{0}
+{
+    if (base == nullptr)
+        global_kernel->panic("No virtual memory for the I/O APIC");
+
+    // The version register has the highest redirection entry.
+    inputs = ((read(reg_version) >> 16) & 0xFF) + 1;
+
+    // Nothing should interrupt until it's been routed.
+    for (uint32_t i = 0; i < inputs; ++i)
+    {
+        write(reg_redirect + 2 * i, redirect_masked);
+        write(reg_redirect + 2 * i + 1, 0);
+    }
+}
+
+/******************************************************************************/
+
+void IoApic::route(uint32_t gsi, uint8_t vector, uint8_t apic_id,
+    bool active_low, bool level)
+{
+    if (!handles(gsi))
+        return;
+
+    // Fixed delivery to a physical APIC ID.
+    uint8_t pin = gsi - gsi_base;
+    uint32_t low = redirect_masked | vector;
+    if (active_low)
+        low |= redirect_active_low;
+    if (level)
+        low |= redirect_level;
+    write(reg_redirect + 2 * pin, redirect_masked);
+    write(reg_redirect + 2 * pin + 1, static_cast<uint32_t>(apic_id) << 24);
+    write(reg_redirect + 2 * pin, low);
+}
+
+/******************************************************************************/
+
+void IoApic::set_masked(uint32_t gsi, bool masked)
+{
+    if (!handles(gsi))
+        return;
+
+    uint8_t reg = reg_redirect + 2 * (gsi - gsi_base);
+    uint32_t low = read(reg);
+    if (masked)
+        low |= redirect_masked;
+    else
+        low &= ~redirect_masked;
+    write(reg, low);
+}
+
+/******************************************************************************/
+
+uint32_t IoApic::read(uint8_t reg) const
+{
+    base[reg_select] = reg;
+    return base[reg_window];
+}
+
+/******************************************************************************/
+
+void IoApic::write(uint8_t reg, uint32_t val)
+{
+    base[reg_select] = reg;
+    base[reg_window] = val;
+}
+
+/******************************************************************************
+ ******************************************************************************/
@@ -0,0 +1,294 @@
+#include "BlockQueue.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+
+#include "Clock.h"
+#include "Device.h"
+#include "interrupt.h"
+#include "Kernel.h"
+#include "Process.h"
+#include "ProcTable.h"
+#include "Scheduler.h"
+#include "SignalManager.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+// Gets the process to put to sleep while a request is done by someone else,
+// or nullptr if there isn't one or interrupts are off, in which case the
+// caller can't wait for anyone else.
+static Process* sleeping_process()
+{
+    if (switch_blocked_for_init || !(get_eflags() & 0x200))
+        return nullptr;
+
+    size_t pid = global_kernel->get_scheduler().get_last();
+    return (pid == 0 ?
+        nullptr : global_kernel->get_proc_table().get_process(pid));
+}
+
+// Waiter for a process sleeping until a request is done.
+struct request_waiter : Waiter {
+    explicit request_waiter(Process* p) : Waiter{wake}, proc{p} {}
+    static void wake(Waiter& w, PollType)
+    {
+        Process* p = static_cast<request_waiter&>(w).proc;
+        if (p->get_status() == ProcStatus::sleeping)
+            p->set_status(ProcStatus::runnable);
+    }
+    Process* proc;
+};
+
+/******************************************************************************
+ ******************************************************************************/
+
+void BlockRequest::complete(size_t res)
+{
+    // The request may be destroyed as soon as it's finished, so take what the
+    // function needs first.
+    void (*f)(void*) = callback;
+    void* d = data;
+
+    result = res;
+    finished = true;
+    if (f != nullptr)
+        f(d);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+BlockQueue::BlockQueue(BlockDevice& d, size_t max) :
+    dev{d},
+    max_sectors{max},
+    head{nullptr},
+    position{0},
+    running{false},
+    guard{},
+    waiters{}
+{}
+
+/******************************************************************************/
+
+void BlockQueue::submit(BlockRequest& r)
+{
+    Clock* clock = global_kernel->get_clock();
+    r.deadline = (clock == nullptr ? 0 : clock->now_ns()) +
+        (r.write ? write_expiry : read_expiry);
+    r.result = 0;
+    r.finished = false;
+
+    // Requests for the same offset stay in the order they were made.
+    LockGuard<Spinlock> lg {guard};
+    BlockRequest** link = &head;
+    while (*link != nullptr && (*link)->off <= r.off)
+        link = &(*link)->next;
+    r.next = *link;
+    *link = &r;
+}
+
+/******************************************************************************/
+
+void BlockQueue::run()
+{
+    guard.lock();
+    if (running)
+    {
+        guard.unlock();
+        return;
+    }
+    running = true;
+
+    while (BlockRequest* batch = next_batch())
+    {
+        guard.unlock();
+        transfer(batch);
+        guard.lock();
+        waiters.wake(PollType::pollnone);
+    }
+
+    running = false;
+    guard.unlock();
+}
+
+/******************************************************************************/
+
+size_t BlockQueue::wait(BlockRequest& r)
+{
+    while (true)
+    {
+        run();
+
+        guard.lock();
+        if (r.finished)
+        {
+            guard.unlock();
+            break;
+        }
+
+        // If nothing's running the queue, it stopped just before the request
+        // went on, so go round and run it.
+        if (!running)
+        {
+            guard.unlock();
+            continue;
+        }
+
+        // Otherwise sleep until the runner finishes something. Anyone who
+        // can't sleep gets their request back unfinished rather than wait on
+        // a runner which may not get the processor again. If the runner has
+        // the request already there's no way out, but it can only finish
+        // while interrupts are on.
+        Process* p = sleeping_process();
+        if (p == nullptr)
+        {
+            if (remove(r))
+            {
+                guard.unlock();
+                r.complete(0);
+                break;
+            }
+            bool stuck = switch_blocked_for_init || !(get_eflags() & 0x200);
+            guard.unlock();
+            if (stuck)
+                global_kernel->panic(
+                    "Waiting for a block request which can't finish");
+            cpu_relax();
+            continue;
+        }
+
+        request_waiter w {p};
+        waiters.add(w);
+        p->set_status(ProcStatus::sleeping);
+        guard.unlock();
+        global_kernel->get_scheduler().yield();
+        waiters.remove(w);
+    }
+
+    return r.result;
+}
+
+/******************************************************************************/
+
+BlockRequest* BlockQueue::next_batch()
+{
+    if (head == nullptr)
+        return nullptr;
+
+    // The oldest request past its deadline goes first.
+    BlockRequest** link = nullptr;
+    Clock* clock = global_kernel->get_clock();
+    if (clock != nullptr)
+    {
+        uint64_t now = clock->now_ns();
+        for (BlockRequest** l = &head; *l != nullptr; l = &(*l)->next)
+        {
+            if ((*l)->deadline <= now &&
+                (link == nullptr || (*l)->deadline < (*link)->deadline))
+                link = l;
+        }
+    }
+
+    // Otherwise carry on up the disk, going back to the bottom at the top.
+    if (link == nullptr)
+    {
+        link = &head;
+        while (*link != nullptr && (*link)->off < position)
+            link = &(*link)->next;
+        if (*link == nullptr)
+            link = &head;
+    }
+
+    // Take the request, and any after it which carry on where it ends.
+    size_t sz = dev.sector_size();
+    BlockRequest* batch = *link;
+    *link = batch->next;
+    BlockRequest* tail = batch;
+    size_t sectors = batch->count;
+    uint64_t end = batch->off + batch->count * sz;
+    while (*link != nullptr && (*link)->write == batch->write &&
+        (*link)->off == end && sectors + (*link)->count <= max_sectors)
+    {
+        BlockRequest* r = *link;
+        *link = r->next;
+        tail->next = r;
+        tail = r;
+        sectors += r->count;
+        end += r->count * sz;
+    }
+    tail->next = nullptr;
+
+    position = end;
+    return batch;
+}
+
+/******************************************************************************/
+
+bool BlockQueue::remove(BlockRequest& r)
+{
+    for (BlockRequest** link = &head; *link != nullptr; link = &(*link)->next)
+    {
+        if (*link == &r)
+        {
+            *link = r.next;
+            r.next = nullptr;
+            return true;
+        }
+    }
+    return false;
+}
+
+/******************************************************************************/
+
+void BlockQueue::transfer(BlockRequest* batch)
+{
+    size_t sz = dev.sector_size();
+    bool write = batch->write;
+    uint64_t off = batch->off;
+    size_t sectors = 0;
+    for (BlockRequest* r = batch; r != nullptr; r = r->next)
+        sectors += r->count;
+
+    // A lone request uses its own memory. Merged ones share a buffer, so the
+    // device gets one transfer.
+    bool merged = (batch->next != nullptr);
+    char* buf = (merged ? new char[sectors * sz] : batch->addr);
+    if (merged && write)
+    {
+        size_t pos = 0;
+        for (BlockRequest* r = batch; r != nullptr; r = r->next)
+        {
+            klib::memcpy(buf + pos, r->addr, r->count * sz);
+            pos += r->count * sz;
+        }
+    }
+
+    size_t moved = dev.transfer(write, off, buf, sectors);
+
+    // Share out what was transferred. Requests may be destroyed once they're
+    // complete, so get the next one first.
+    size_t pos = 0;
+    BlockRequest* r = batch;
+    while (r != nullptr)
+    {
+        BlockRequest* next = r->next;
+        size_t len = r->count * sz;
+        size_t got = (moved <= pos ? 0 : moved - pos);
+        if (got > len)
+            got = len;
+        if (merged && !write)
+            klib::memcpy(r->addr, buf + pos, got);
+        pos += len;
+        r->complete(got);
+        r = next;
+    }
+
+    if (merged)
+        delete[] buf;
+}
+
+/******************************************************************************
+ ******************************************************************************/
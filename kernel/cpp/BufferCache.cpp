@@ -0,0 +1,649 @@
+#include "BufferCache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "BlockQueue.h"
+#include "Device.h"
+#include "Kernel.h"
+#include "Logger.h"
+#include "PageFrameAllocator.h"
+#include "Process.h"
+#include "ProcTable.h"
+#include "Scheduler.h"
+#include "SignalManager.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+// Gets the process to put to sleep while another reads or writes a buffer, or
+// nullptr if there isn't one or interrupts are off, in which case the caller
+// can't wait.
+static Process* sleeping_process()
+{
+    if (switch_blocked_for_init || !(get_eflags() & 0x200))
+        return nullptr;
+
+    size_t pid = global_kernel->get_scheduler().get_last();
+    return (pid == 0 ?
+        nullptr : global_kernel->get_proc_table().get_process(pid));
+}
+
+// Waiter for a process sleeping until a buffer is no longer busy.
+struct io_waiter : Waiter {
+    explicit io_waiter(Process* p) : Waiter{wake}, proc{p} {}
+    static void wake(Waiter& w, PollType)
+    {
+        Process* p = static_cast<io_waiter&>(w).proc;
+        if (p->get_status() == ProcStatus::sleeping)
+            p->set_status(ProcStatus::runnable);
+    }
+    Process* proc;
+};
+
+/******************************************************************************
+ ******************************************************************************/
+
+BufferCache::Handle& BufferCache::Handle::operator=(Handle&& other)
+{
+    if (this != &other)
+    {
+        release();
+        cache = other.cache;
+        buf = other.buf;
+        other.buf = nullptr;
+    }
+    return *this;
+}
+
+/******************************************************************************/
+
+char* BufferCache::Handle::data() const
+{
+    return buf->data;
+}
+
+/******************************************************************************/
+
+void BufferCache::Handle::mark_dirty()
+{
+    if (buf != nullptr)
+        cache->set_dirty(*buf);
+}
+
+/******************************************************************************/
+
+void BufferCache::Handle::release()
+{
+    if (buf != nullptr)
+    {
+        cache->put(*buf);
+        buf = nullptr;
+    }
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+BufferCache::BufferCache(size_t max) :
+    max_buffers{max},
+    max_dirty{max / 2},
+    count{0},
+    dirty_count{0},
+    index{},
+    head{nullptr},
+    tail{nullptr},
+    hits{0},
+    misses{0},
+    lock{},
+    io_guard{},
+    io_waiters{}
+{}
+
+/******************************************************************************/
+
+BufferCache::~BufferCache()
+{
+    sync();
+    for (auto& p : index)
+    {
+        delete[] p.second->data;
+        delete p.second;
+    }
+}
+
+/******************************************************************************/
+
+BufferCache::Handle BufferCache::get(BlockDevice& dev, uint64_t off, bool fill)
+{
+    // Work on the physical device, so partitions share buffers with the disk.
+    size_t sz = dev.sector_size();
+    if (off % sz != 0 || off + sz > dev.get_size())
+        return Handle {};
+    BlockDevice& base = dev.base_device();
+    off += dev.base_offset();
+
+    LockGuard<Mutex> lg {lock};
+
+    buffer* b = nullptr;
+    auto it = index.find(key {&base, off});
+    if (it != index.end())
+    {
+        b = it->second;
+        ++hits;
+        unlink(*b);
+    }
+    else
+    {
+        ++misses;
+        b = new_buffer(base, off);
+        index[key {&base, off}] = b;
+        ++count;
+    }
+    ++b->refs;
+    push_front(*b);
+
+    // Someone else may be reading the sector in already. If they fail, it's
+    // left invalid and read again below.
+    while (b->loading)
+    {
+        if (!wait_io(*b))
+        {
+            --b->refs;
+            return Handle {};
+        }
+    }
+
+    if (!b->valid)
+    {
+        if (!fill)
+            b->valid = true;
+        else if (!load(*b))
+        {
+            --b->refs;
+            return Handle {};
+        }
+    }
+
+    return Handle {this, b};
+}
+
+/******************************************************************************/
+
+size_t BufferCache::read(BlockDevice& dev, uint64_t off, void* addr)
+{
+    Handle h = get(dev, off);
+    if (!h.valid())
+        return 0;
+
+    klib::memcpy(addr, h.data(), dev.sector_size());
+    return dev.sector_size();
+}
+
+/******************************************************************************/
+
+size_t BufferCache::write(BlockDevice& dev, uint64_t off, const void* addr)
+{
+    // The whole sector is replaced, so there's no need to read it first.
+    Handle h = get(dev, off, false);
+    if (!h.valid())
+        return 0;
+
+    klib::memcpy(h.data(), addr, dev.sector_size());
+    h.mark_dirty();
+    return dev.sector_size();
+}
+
+/******************************************************************************/
+
+size_t BufferCache::read_blocks(BlockDevice& dev, uint64_t off, void* addr,
+    size_t count)
+{
+    size_t sz = dev.sector_size();
+    if (off % sz != 0 || off + count * sz > dev.get_size())
+        return 0;
+    BlockDevice& base = dev.base_device();
+    off += dev.base_offset();
+
+    size_t ret_val = base.read_blocks(off, addr, count);
+
+    // Cached sectors may have been changed since they were last written.
+    // Sectors still being read in come from the disk, the same as these.
+    LockGuard<Mutex> lg {lock};
+    char* dest = static_cast<char*>(addr);
+    for (auto it = index.lower_bound(key {&base, off});
+        it != index.end() && it->first.first == &base &&
+        it->first.second < off + ret_val; ++it)
+    {
+        if (it->second->valid)
+            klib::memcpy(dest + (it->first.second - off), it->second->data,
+                sz);
+    }
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
+size_t BufferCache::write_blocks(BlockDevice& dev, uint64_t off,
+    const void* addr, size_t count)
+{
+    size_t sz = dev.sector_size();
+    if (off % sz != 0 || off + count * sz > dev.get_size())
+        return 0;
+    BlockDevice& base = dev.base_device();
+    off += dev.base_offset();
+
+    size_t ret_val = base.write_blocks(off, addr, count);
+
+    // Sectors being read in meanwhile may have the old contents, so wait for
+    // them before bringing the cached copies up to date. If the caller can't
+    // wait, those still being read are marked stale, so they're read again
+    // once the current read is over.
+    LockGuard<Mutex> lg {lock};
+    bool waited = wait_busy(&base, off, off + ret_val);
+
+    // A write back started before this one may land after it, so leave the
+    // cached copies dirty to be written again with the new contents.
+    const char* src = static_cast<const char*>(addr);
+    for (auto it = index.lower_bound(key {&base, off});
+        it != index.end() && it->first.first == &base &&
+        it->first.second < off + ret_val; ++it)
+    {
+        buffer& b = *it->second;
+        if (!waited && b.loading)
+        {
+            b.stale = true;
+            continue;
+        }
+        klib::memcpy(b.data, src + (b.off - off), sz);
+        b.valid = true;
+        if (!b.dirty)
+        {
+            b.dirty = true;
+            ++dirty_count;
+        }
+    }
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
+size_t BufferCache::prefetch(BlockDevice& dev, uint64_t off, size_t n)
+{
+    size_t sz = dev.sector_size();
+    if (off % sz != 0 || off >= dev.get_size())
+        return 0;
+    n = klib::min(n, static_cast<size_t>((dev.get_size() - off) / sz));
+    BlockDevice& base = dev.base_device();
+    off += dev.base_offset();
+
+    LockGuard<Mutex> lg {lock};
+    n = klib::min(n, max_buffers / prefetch_share);
+
+    // Make buffers for the sectors which aren't cached yet and queue a read
+    // into each before waiting for any, so the device can merge them.
+    klib::vector<buffer*> bufs;
+    klib::vector<BlockRequest*> reqs;
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t o = off + i * sz;
+        if (index.find(key {&base, o}) != index.end())
+            continue;
+
+        buffer* b = new_buffer(base, o);
+        index[key {&base, o}] = b;
+        push_front(*b);
+        ++count;
+        b->refs = 1;
+        b->loading = true;
+        bufs.push_back(b);
+        reqs.push_back(new BlockRequest {false, o, b->data, 1});
+        base.submit(*reqs.back());
+    }
+
+    lock.unlock();
+    for (BlockRequest* r : reqs)
+        base.wait(*r);
+    lock.lock();
+
+    size_t ret_val = 0;
+    for (size_t i = 0; i < bufs.size(); ++i)
+    {
+        buffer& b = *bufs[i];
+        // A sector written meanwhile is left to be read again on first use.
+        b.valid = (reqs[i]->bytes() == sz && !b.stale);
+        b.stale = false;
+        if (b.valid)
+            ++ret_val;
+        --b.refs;
+        end_io(b);
+        delete reqs[i];
+    }
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
+int BufferCache::flush(BlockDevice& dev)
+{
+    BlockDevice* base = &dev.base_device();
+
+    // Writes which have already started must reach the disk too.
+    LockGuard<Mutex> lg {lock};
+    if (!wait_busy(base, 0, ~0ULL))
+        return -1;
+
+    // The buffers of a device are together in the index.
+    klib::vector<buffer*> bufs;
+    for (auto it = index.lower_bound(key {base, 0ULL});
+        it != index.end() && it->first.first == base; ++it)
+    {
+        if (it->second->dirty)
+            bufs.push_back(it->second);
+    }
+
+    return (write_back(bufs) ? 0 : -1);
+}
+
+/******************************************************************************/
+
+int BufferCache::sync()
+{
+    LockGuard<Mutex> lg {lock};
+    if (!wait_busy(nullptr, 0, ~0ULL))
+        return -1;
+
+    klib::vector<buffer*> bufs;
+    for (auto& p : index)
+    {
+        if (p.second->dirty)
+            bufs.push_back(p.second);
+    }
+
+    return (write_back(bufs) ? 0 : -1);
+}
+
+/******************************************************************************/
+
+void BufferCache::dump(klib::ostream& dest) const
+{
+    dest << "Buffer cache has " << count << " buffers, " << dirty_count <<
+        " dirty, with " << hits << " hits and " << misses << " misses\n";
+    dest.flush();
+}
+
+/******************************************************************************/
+
+bool BufferCache::load(buffer& b)
+{
+    // Read again if the sector was written while it was being read.
+    bool ret_val;
+    b.loading = true;
+    do {
+        b.stale = false;
+        lock.unlock();
+        ret_val = (b.dev->read_block(b.off, b.data) == b.dev->sector_size());
+        lock.lock();
+    } while (ret_val && b.stale);
+
+    b.valid = ret_val;
+    end_io(b);
+    return ret_val;
+}
+
+/******************************************************************************/
+
+bool BufferCache::write_back(const klib::vector<buffer*>& bufs)
+{
+    // Write copies, so the buffers can go on changing while the writes are
+    // going on. Anything changed meanwhile is dirty again afterwards. Put
+    // every write on its device's queue before waiting for any, so
+    // neighbouring sectors go to the disk together.
+    klib::vector<char*> copies;
+    klib::vector<BlockRequest*> reqs;
+    copies.reserve(bufs.size());
+    reqs.reserve(bufs.size());
+    for (buffer* b : bufs)
+    {
+        size_t sz = b->dev->sector_size();
+        copies.push_back(new char[sz]);
+        klib::memcpy(copies.back(), b->data, sz);
+        reqs.push_back(new BlockRequest {true, b->off, copies.back(), 1});
+        b->dirty = false;
+        --dirty_count;
+        b->writing = true;
+        ++b->refs;
+        b->dev->submit(*reqs.back());
+    }
+
+    lock.unlock();
+    for (size_t i = 0; i < bufs.size(); ++i)
+        bufs[i]->dev->wait(*reqs[i]);
+    lock.lock();
+
+    bool ret_val = true;
+    for (size_t i = 0; i < bufs.size(); ++i)
+    {
+        buffer& b = *bufs[i];
+        if (reqs[i]->bytes() != b.dev->sector_size())
+        {
+            global_kernel->syslog()->warn(
+                "Buffer cache failed to write back sector at %llu\n", b.off);
+            ret_val = false;
+            if (!b.dirty)
+            {
+                b.dirty = true;
+                ++dirty_count;
+            }
+        }
+        --b.refs;
+        end_io(b);
+        delete reqs[i];
+        delete[] copies[i];
+    }
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
+bool BufferCache::wait_io(buffer& b)
+{
+    Process* p = sleeping_process();
+    if (p == nullptr)
+        return false;
+
+    // The flags change under the guard, so the wake up can't be missed
+    // between checking them and going to sleep.
+    lock.unlock();
+    io_guard.lock();
+    while (b.loading || b.writing)
+    {
+        io_waiter w {p};
+        io_waiters.add(w);
+        p->set_status(ProcStatus::sleeping);
+        io_guard.unlock();
+        global_kernel->get_scheduler().yield();
+        io_waiters.remove(w);
+        io_guard.lock();
+    }
+    io_guard.unlock();
+    lock.lock();
+
+    return true;
+}
+
+/******************************************************************************/
+
+bool BufferCache::wait_busy(BlockDevice* dev, uint64_t start, uint64_t end)
+{
+    while (true)
+    {
+        // Waiting lets go of the lock, so look again from the start each time.
+        buffer* busy = nullptr;
+        auto it = (dev == nullptr ?
+            index.begin() : index.lower_bound(key {dev, start}));
+        for (; it != index.end(); ++it)
+        {
+            if (dev != nullptr &&
+                (it->first.first != dev || it->first.second >= end))
+                break;
+            if (it->second->loading || it->second->writing)
+            {
+                busy = it->second;
+                break;
+            }
+        }
+        if (busy == nullptr)
+            return true;
+
+        ++busy->refs;
+        bool waited = wait_io(*busy);
+        --busy->refs;
+        if (!waited)
+            return false;
+    }
+}
+
+/******************************************************************************/
+
+void BufferCache::end_io(buffer& b)
+{
+    io_guard.lock();
+    b.loading = false;
+    b.writing = false;
+    io_waiters.wake(PollType::pollnone);
+    io_guard.unlock();
+}
+
+/******************************************************************************/
+
+BufferCache::buffer* BufferCache::new_buffer(BlockDevice& dev, uint64_t off)
+{
+    size_t sz = dev.sector_size();
+    buffer* b = nullptr;
+
+    // Reuse the least recently used buffer once the cache is full, or if
+    // memory is getting short.
+    if (count >= max_buffers ||
+        PageFrameAllocator {}.free_pages() < low_free_pages)
+    {
+        b = evict();
+        if (b != nullptr && b->dev->sector_size() != sz)
+        {
+            delete[] b->data;
+            b->data = new char[sz];
+        }
+    }
+
+    if (b == nullptr)
+    {
+        b = new buffer {nullptr, 0, new char[sz], 0, false, false, false,
+            false, false, nullptr, nullptr};
+    }
+
+    b->dev = &dev;
+    b->off = off;
+    b->refs = 0;
+    b->dirty = false;
+    b->valid = false;
+    b->loading = false;
+    b->writing = false;
+    b->stale = false;
+    return b;
+}
+
+/******************************************************************************/
+
+BufferCache::buffer* BufferCache::evict()
+{
+    // Only clean buffers are reused, so nothing has to be written with the
+    // lock held. Dirty ones go once they've been written back.
+    for (buffer* b = tail; b != nullptr; b = b->prev)
+    {
+        if (b->refs != 0 || b->dirty)
+            continue;
+
+        unlink(*b);
+        index.erase(index.find(key {b->dev, b->off}));
+        --count;
+        return b;
+    }
+
+    return nullptr;
+}
+
+/******************************************************************************/
+
+void BufferCache::unlink(buffer& b)
+{
+    if (b.prev != nullptr)
+        b.prev->next = b.next;
+    else
+        head = b.next;
+    if (b.next != nullptr)
+        b.next->prev = b.prev;
+    else
+        tail = b.prev;
+    b.prev = nullptr;
+    b.next = nullptr;
+}
+
+/******************************************************************************/
+
+void BufferCache::push_front(buffer& b)
+{
+    b.prev = nullptr;
+    b.next = head;
+    if (head != nullptr)
+        head->prev = &b;
+    else
+        tail = &b;
+    head = &b;
+}
+
+/******************************************************************************/
+
+void BufferCache::put(buffer& b)
+{
+    LockGuard<Mutex> lg {lock};
+    --b.refs;
+}
+
+/******************************************************************************/
+
+void BufferCache::set_dirty(buffer& b)
+{
+    LockGuard<Mutex> lg {lock};
+    if (!b.dirty)
+    {
+        b.dirty = true;
+        ++dirty_count;
+    }
+    if (dirty_count <= max_dirty)
+        return;
+
+    // Write back the least recently used dirty buffers until there are few
+    // enough. Ones already being written will be done again later.
+    klib::vector<buffer*> bufs;
+    size_t left = dirty_count;
+    for (buffer* d = tail; d != nullptr && left > max_dirty; d = d->prev)
+    {
+        if (d->dirty && !d->writing)
+        {
+            bufs.push_back(d);
+            --left;
+        }
+    }
+    write_back(bufs);
+}
+
+/******************************************************************************
+ ******************************************************************************/
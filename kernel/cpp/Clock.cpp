@@ -0,0 +1,113 @@
+#include "Clock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "Pit.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+// CPUID leaf 1 EDX bit for the time stamp counter.
+static constexpr uint32_t cpuid_tsc = 0x10;
+// Extended CPUID leaf with the invariant TSC bit, and the bit in EDX.
+static constexpr uint32_t cpuid_power_leaf = 0x80000007;
+static constexpr uint32_t cpuid_invariant_tsc = 0x100;
+
+/******************************************************************************
+ ******************************************************************************/
+
+uint64_t PitClock::now_ns() const
+{
+    return pit.time_ns();
+}
+
+/******************************************************************************/
+
+uint32_t PitClock::resolution_ns() const
+{
+    // The period is rounded down to whole milliseconds, so could be 0 if the
+    // PIT is running faster than 1kHz.
+    uint32_t ms = pit.period();
+    return (ms == 0 ? 1 : ms) * 1000000;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+bool TscClock::supported()
+{
+    uint32_t regs[4];
+    cpuid(1, regs);
+    return (regs[3] & cpuid_tsc);
+}
+
+/******************************************************************************/
+
+bool TscClock::invariant()
+{
+    // Check the extended leaf exists first.
+    uint32_t regs[4];
+    cpuid(0x80000000, regs);
+    if (regs[0] < cpuid_power_leaf)
+        return false;
+
+    cpuid(cpuid_power_leaf, regs);
+    return (regs[3] & cpuid_invariant_tsc);
+}
+
+/******************************************************************************/
+
+TscClock::TscClock(Pit& pit) :
+    start_tsc{0},
+    start_ns{0},
+    freq{0},
+    mult{0}
+{
+    // Line up with the start of a PIT tick, so the PIT time is exact.
+    pit.sleep(1);
+    uint64_t first_tsc = rdtsc();
+    uint64_t first_ns = pit.time_ns();
+
+    // Count for a while, ending on another tick.
+    pit.sleep(calibrate_ms);
+    start_tsc = rdtsc();
+    start_ns = pit.time_ns();
+
+    uint64_t elapsed = start_ns - first_ns;
+    if (elapsed == 0)
+        return;
+    freq = (start_tsc - first_tsc) * 1000000000ULL / elapsed;
+    if (!usable())
+        return;
+
+    mult = static_cast<uint32_t>((1000000000ULL << shift) / freq);
+}
+
+/******************************************************************************/
+
+uint64_t TscClock::now_ns() const
+{
+    // Another processor's counter might be a little behind.
+    uint64_t tsc = rdtsc();
+    if (tsc <= start_tsc)
+        return start_ns;
+
+    // Multiply the two halves of the count separately, so that nothing
+    // overflows, whatever the count.
+    uint64_t counts = tsc - start_tsc;
+    uint64_t high = (counts >> 32) * mult;
+    uint64_t low = (counts & 0xFFFFFFFF) * mult;
+    return start_ns + (high << (32 - shift)) + (low >> shift);
+}
+
+/******************************************************************************/
+
+uint32_t TscClock::resolution_ns() const
+{
+    return static_cast<uint32_t>((1000000000ULL + freq - 1) / freq);
+}
+
+/******************************************************************************
+ ******************************************************************************/
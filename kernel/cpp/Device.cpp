@@ -1,9 +1,13 @@
 #include "Device.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <map>
 #include <string>
 #include <utility>
 
+#include "BlockQueue.h"
 #include "Kernel.h"
 #include "Logger.h"
 #include "util.h"
@@ -18,6 +22,63 @@ void BlockDevice::dump(klib::ostream& dest) const
     dest.flush();
 }
 
+/******************************************************************************/
+
+size_t BlockDevice::read_blocks(uint64_t off, void* addr, size_t count)
+{
+    char* dest = static_cast<char*>(addr);
+    size_t done = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t ret_val = read_block(off + done, dest + done);
+        done += ret_val;
+        if (ret_val != sector_size())
+            break;
+    }
+
+    return done;
+}
+
+/******************************************************************************/
+
+size_t BlockDevice::write_blocks(uint64_t off, const void* addr, size_t count)
+{
+    const char* src = static_cast<const char*>(addr);
+    size_t done = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t ret_val = write_block(off + done, src + done);
+        done += ret_val;
+        if (ret_val != sector_size())
+            break;
+    }
+
+    return done;
+}
+
+/******************************************************************************/
+
+void BlockDevice::submit(BlockRequest& r)
+{
+    r.complete(transfer(r.write, r.off, r.addr, r.count));
+}
+
+/******************************************************************************/
+
+size_t BlockDevice::wait(BlockRequest& r)
+{
+    return r.bytes();
+}
+
+/******************************************************************************/
+
+size_t BlockDevice::transfer(bool write, uint64_t off, void* addr,
+    size_t count)
+{
+    return (write ?
+        write_blocks(off, addr, count) : read_blocks(off, addr, count));
+}
+
 /******************************************************************************
  ******************************************************************************/
 
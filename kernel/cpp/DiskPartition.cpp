@@ -8,6 +8,7 @@
 #include <ostream>
 #include <vector>
 
+#include "BufferCache.h"
 #include "Device.h"
 #include "DevFileSystem.h"
 #include "File.h"
@@ -33,15 +34,31 @@ void PartitionDriver::dump(klib::ostream& dest) const
 
 size_t PartitionDriver::read_block(uint64_t off, void* addr)
 {
-    size_t ret_val = drv->read_block(off + offset, addr);
-    return ret_val;
+    return global_kernel->get_buffer_cache()->read(*this, off, addr);
 }
 
 /******************************************************************************/
 
 size_t PartitionDriver::write_block(uint64_t off, const void* addr)
 {
-    return drv->write_block(off + offset, addr);
+    return global_kernel->get_buffer_cache()->write(*this, off, addr);
+}
+
+/******************************************************************************/
+
+size_t PartitionDriver::read_blocks(uint64_t off, void* addr, size_t count)
+{
+    return global_kernel->get_buffer_cache()->read_blocks(*this, off, addr,
+        count);
+}
+
+/******************************************************************************/
+
+size_t PartitionDriver::write_blocks(uint64_t off, const void* addr,
+    size_t count)
+{
+    return global_kernel->get_buffer_cache()->write_blocks(*this, off, addr,
+        count);
 }
 
 /******************************************************************************
@@ -659,9 +659,11 @@ void ElfSectionTab::remap_sections(PageDescriptorTable& pdt)
                 }
                 // Open the section as a file.
                 MemoryFileSystem* tmpfs;
+                VirtualFileSystem* vfs = global_kernel->get_vfs();
+                ReadGuard<VirtualFileSystem> rg {*vfs};
                 try {
                     tmpfs = dynamic_cast<MemoryFileSystem*>(
-                        global_kernel->get_vfs()->lookup("/tmp"));
+                        vfs->lookup("/tmp"));
                 }
                 catch (klib::bad_cast&)
                 {
@@ -1068,7 +1070,8 @@ Elf::Elf(const klib::string& name) :
     file_name {name},
     file_hdr {nullptr},
     section_hdrs {nullptr},
-    program_hdrs {nullptr}
+    program_hdrs {nullptr},
+    file {nullptr}
 {
     // Create a stream to read the file.
     klib::ifstream ifs {name};
@@ -1136,7 +1139,10 @@ Elf::Elf(const klib::string& name) :
 
 /******************************************************************************/
 
-Elf::Elf(const Elf& other) : val{other.val}, file_name{other.file_name}
+Elf::Elf(const Elf& other) :
+    val{other.val},
+    file_name{other.file_name},
+    file{nullptr}
 {
     file_hdr = new ElfFileHeader {*other.file_hdr};
     section_hdrs = new ElfSectionTab {*other.section_hdrs};
@@ -1150,11 +1156,13 @@ Elf::Elf(Elf&& other) :
     file_name {other.file_name},
     file_hdr{other.file_hdr},
     section_hdrs{other.section_hdrs},
-    program_hdrs{other.program_hdrs}
+    program_hdrs{other.program_hdrs},
+    file{other.file}
 {
     other.file_hdr = nullptr;
     other.section_hdrs = nullptr;
     other.program_hdrs = nullptr;
+    other.file = nullptr;
 }
 
 /******************************************************************************/
@@ -1167,10 +1175,12 @@ Elf& Elf::operator=(const Elf& other)
     delete file_hdr;
     delete section_hdrs;
     delete program_hdrs;
+    delete file;
 
     file_hdr = new ElfFileHeader {*other.file_hdr};
     section_hdrs = new ElfSectionTab {*other.section_hdrs};
     program_hdrs = new ElfProgramTab {*other.program_hdrs};
+    file = nullptr;
 
     return *this;
 }
@@ -1185,14 +1195,17 @@ Elf& Elf::operator=(Elf&& other)
     delete file_hdr;
     delete section_hdrs;
     delete program_hdrs;
+    delete file;
 
     file_hdr = other.file_hdr;
     section_hdrs = other.section_hdrs;
     program_hdrs = other.program_hdrs;
+    file = other.file;
 
     other.file_hdr = nullptr;
     other.section_hdrs = nullptr;
     other.program_hdrs = nullptr;
+    other.file = nullptr;
 
     return *this;
 }
@@ -1204,48 +1217,65 @@ Elf::~Elf()
     delete file_hdr;
     delete section_hdrs;
     delete program_hdrs;
+    delete file;
 }
 
 /******************************************************************************/
 
-void Elf::allocate(PageDescriptorTable& pdt) const
+bool Elf::allocate(PageDescriptorTable& pdt, const void* virt_addr) const
 {
     // Do nothing if the ELF is not valid.
     if (!valid())
-        return;
-
-    // The page configuration must be set to present and user mode. It does need
-    // to be writable to copy the data to it. We might consider setting .text
-    // and .rodata to unwritable later.
-    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) | 
-        static_cast<uint32_t>(PdeSettings::writable) |
-        static_cast<uint32_t>(PdeSettings::user_access);
+        return false;
 
-    // Cycle through the segments.
-    for (size_t i = 0; i < file_hdr->get_phnum(); ++i)
+    // Get the page boundaries.
+    uintptr_t page = reinterpret_cast<uintptr_t>(virt_addr);
+    page -= page % PageDescriptorTable::page_size;
+    uintptr_t page_end = page + PageDescriptorTable::page_size;
+
+    // Cycle through the segments which cover the page. More than one might
+    // share it, in which case it's writable if any of them are.
+    bool found = false;
+    bool writable = false;
+    bool file_data = false;
+    for (const auto& p_hdr : *program_hdrs)
     {
-        const ElfProgramHeader& p_hdr = (*program_hdrs)[i];
-
         // We only load segments of type LOAD.
         if (p_hdr.get_type() != ElfProgramHeader::pt_load)
             continue;
 
-        // Get the start address. Round the start down to a page boundary.
         uintptr_t start = reinterpret_cast<uintptr_t>(p_hdr.get_vaddr());
-        start -= start % PageDescriptorTable::page_size;
+        if (start >= page_end || start + p_hdr.get_memsz() <= page)
+            continue;
 
-        // Allocate the pages.
-        for (uintptr_t i = start; i < start + p_hdr.get_memsz();
-            i += PageDescriptorTable::page_size)
-        {
-            if (!pdt.allocate(reinterpret_cast<void*>(i), conf))
-            {
-                global_kernel->panic(
-                    "Failed to allocate virtual memory for new process.\n");
-                return;
-            }
-        }
+        found = true;
+        if (p_hdr.get_flags() & ElfProgramHeader::pt_write)
+            writable = true;
+        if (start + p_hdr.get_filesz() > page)
+            file_data = true;
     }
+    if (!found)
+        return false;
+
+    // A writable page with nothing from the file, such as most of .bss, can
+    // share the zero page until it's written, like the heap and stack.
+    if (writable && !file_data)
+        return pdt.map_zero_page(reinterpret_cast<void*>(page));
+
+    // The page configuration must be set to present and user mode. It needs to
+    // be writable to copy the data to it, and is write protected afterwards if
+    // the segments don't allow writes, so .text and .rodata can't be changed.
+    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) | 
+        static_cast<uint32_t>(PdeSettings::writable) |
+        static_cast<uint32_t>(PdeSettings::user_access);
+    if (!pdt.allocate(reinterpret_cast<void*>(page), conf))
+        return false;
+
+    load(reinterpret_cast<void*>(page));
+    if (!writable)
+        pdt.write_protect(reinterpret_cast<void*>(page));
+
+    return true;
 }
 
 /******************************************************************************/
@@ -1308,35 +1338,50 @@ uintptr_t* Elf::get_break_point() const
 
 /******************************************************************************/
 
-void Elf::load() const
+void Elf::load(const void* virt_addr) const
 {
     // Do nothing if the ELF is invalid.
     if (!valid())
         return;
 
-    // Open the binary for reading.
-    klib::ifstream ifs {file_name};
-    if (!ifs)
-        return;
+    // Get the page boundaries.
+    uintptr_t page = reinterpret_cast<uintptr_t>(virt_addr);
+    page -= page % PageDescriptorTable::page_size;
+    uintptr_t page_end = page + PageDescriptorTable::page_size;
 
-    // We are assuming that the virtual mappings are already in place.
-    // Cycle through the segments.
-    for (size_t i = 0; i < file_hdr->get_phnum(); ++i)
-    {
-        const ElfProgramHeader& p_hdr = (*program_hdrs)[i];
+    // First we need to clear the page. Anything not covered by file data is
+    // either .bss or padding.
+    klib::memset(reinterpret_cast<void*>(page), 0,
+        PageDescriptorTable::page_size);
 
+    // Cycle through the segments. More than one might share the page.
+    for (const auto& p_hdr : *program_hdrs)
+    {
         // We only load segments of type LOAD.
         if (p_hdr.get_type() != ElfProgramHeader::pt_load)
             continue;
 
-        // First we need to clear bytes up to memsz.
-        for (uintptr_t i = 0; i < p_hdr.get_memsz() / sizeof(uint32_t); ++i)
-            *(p_hdr.get_vaddr() + i) = 0;
+        // Find the part of the page backed by the file.
+        uintptr_t start = reinterpret_cast<uintptr_t>(p_hdr.get_vaddr());
+        uintptr_t from = klib::max(start, page);
+        uintptr_t to = klib::min(start + p_hdr.get_filesz(), page_end);
+        if (from >= to)
+            continue;
+
+        // Open the binary for reading, if we haven't already.
+        if (file == nullptr)
+            file = new klib::ifstream {file_name};
+        if (!*file)
+        {
+            global_kernel->syslog()->error(
+                "Failed to read %s to load a page.\n", file_name.c_str());
+            return;
+        }
 
-        // Now copy any data from the file.
-        ifs.seekg(p_hdr.get_offset(), klib::ios_base::beg);
-        ifs.read(reinterpret_cast<klib::istream::char_type*>(p_hdr.get_vaddr()),
-            p_hdr.get_filesz() / sizeof(klib::istream::char_type));
+        // Now copy the data from the file.
+        file->seekg(p_hdr.get_offset() + (from - start), klib::ios_base::beg);
+        file->read(reinterpret_cast<klib::istream::char_type*>(from),
+            (to - from) / sizeof(klib::istream::char_type));
     }
 }
 
@@ -245,7 +245,10 @@ void Ext2Inode::os_2(const klib::array<uint8_t, os_2_size>& v)
 
 Ext2File::Ext2File(const char* m, size_t indx, Ext2FileSystem& fs) :
     DiskFile{m, fs, fs.file_size(indx)},
-    inode_index{indx}
+    inode_index{indx},
+    ra_next{0},
+    ra_window{0},
+    ra_end{0}
 {}
 
 /******************************************************************************/
@@ -320,6 +323,13 @@ size_t Ext2File::read(void* buf, size_t size, size_t count)
     // Number of characters read.
     klib::streamoff char_read = 0;
 
+    // Read ahead if this carries on from the last read.
+    klib::streamoff read_end = klib::min(
+        static_cast<klib::streamoff>(position) + n, sz);
+    if (read_end > static_cast<klib::streamoff>(position))
+        readahead(static_cast<klib::streamoff>(position) / bl_sz,
+            (read_end - 1) / bl_sz);
+
     // Anything left in the current block.
     size_t buf_pos = static_cast<klib::streamoff>(position) % bl_sz;
     if (buf_pos != 0)
@@ -380,6 +390,7 @@ size_t Ext2File::read(void* buf, size_t size, size_t count)
 
     if (static_cast<klib::streamoff>(position) >= sz)
         eof = true;
+    ra_next = static_cast<klib::streamoff>(position) / bl_sz;
 
     return char_read / size;
 }
@@ -662,6 +673,14 @@ int Ext2File::seek(long offset, int origin)
     }
     }
 
+    // Jumping anywhere but where the last read finished ends a sequential
+    // run.
+    if (static_cast<klib::streamoff>(position) / fs.block_size() != ra_next)
+    {
+        ra_window = 0;
+        ra_end = 0;
+    }
+
     // Return 0 for success.
     return 0;
 }
@@ -741,6 +760,54 @@ int Ext2File::truncate()
 
 /******************************************************************************/
 
+void Ext2File::readahead(size_t first, size_t last)
+{
+    // A read from anywhere else is random access, so don't guess.
+    if (first != ra_next)
+    {
+        ra_window = 0;
+        ra_end = 0;
+        return;
+    }
+
+    // Wait until the reader is half way through what's been read ahead
+    // before reading more.
+    if (ra_window != 0 && last + ra_window / 2 < ra_end)
+        return;
+    ra_window = (ra_window == 0 ?
+        min_readahead : klib::min(ra_window * 2, max_readahead));
+
+    Ext2FileSystem& ext2fs = dynamic_cast<Ext2FileSystem&>(fs);
+    size_t bl_sz = fs.block_size();
+    size_t file_blocks = (sz + bl_sz - 1) / bl_sz;
+    size_t from = klib::max(ra_end, first);
+    size_t to = klib::min(last + 1 + ra_window, file_blocks);
+    ra_end = to;
+
+    // Blocks which are next to each other on the disk are fetched together.
+    size_t run_start = 0;
+    size_t run_len = 0;
+    for (size_t i = from; i < to; ++i)
+    {
+        size_t block = ext2fs.inode_lookup(inode_index, i);
+        if (block == 0)
+            break;
+        if (run_len != 0 && block == run_start + run_len)
+        {
+            ++run_len;
+            continue;
+        }
+        if (run_len != 0)
+            fs.prefetch(run_start * bl_sz, run_len * bl_sz);
+        run_start = block;
+        run_len = 1;
+    }
+    if (run_len != 0)
+        fs.prefetch(run_start * bl_sz, run_len * bl_sz);
+}
+
+/******************************************************************************/
+
 bool Ext2File::truncate_recursive(size_t bl, size_t depth)
 {
     // Don't do anything if the block is zero. Return indicating finished.
@@ -2531,8 +2598,7 @@ int Ext2FileSystem::cache_inode(size_t index)
         offset * super_block.first.inode_size();
     klib::ifstream in {drv_name};
     in.seekg(loc);
-    klib::pair<klib::map<size_t, klib::pair<Ext2Inode, bool>>::iterator,
-        bool> p = inodes.emplace(index, klib::pair<Ext2Inode, bool>
+    klib::pair<decltype(inodes)::iterator, bool> p = inodes.emplace(index, klib::pair<Ext2Inode, bool>
         {Ext2Inode {in, super_block.first.inode_size()}, false});
     // p.second is a bool indicating whether the emplacement succeeded. If it
     // did, p.first is an iterator to the new element.
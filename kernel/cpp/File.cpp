@@ -6,6 +6,7 @@
 #include <cstring>
 #include <string>
 
+#include "BufferCache.h"
 #include "FileSystem.h"
 #include "Kernel.h"
 #include "Logger.h"
@@ -50,6 +51,14 @@ size_t CharacterFile::read(void* buffer, size_t size, size_t count)
 /******************************************************************************
  ******************************************************************************/
 
+// Block files read and write through the buffer cache.
+static BufferCache& buffer_cache()
+{
+    return *global_kernel->get_buffer_cache();
+}
+
+/******************************************************************************/
+
 BlockFile::BlockFile(BlockDevice& d, const char* mode) :
     klib::FILE {mode}, dev {d}, current {false}
 {
@@ -84,8 +93,9 @@ size_t BlockFile::write(const void* buf, size_t size, size_t count)
     // only if we're not covering a whole block.
     if (!current && (buf_pos != 0 || n < dev.sector_size()))
     {
-        if (dev.read_block(static_cast<klib::streamoff>(position) - buf_pos,
-            buffer) != dev.sector_size())
+        if (buffer_cache().read(dev,
+            static_cast<klib::streamoff>(position) - buf_pos, buffer) !=
+            dev.sector_size())
             return written;
         else
             current = true;
@@ -101,6 +111,24 @@ size_t BlockFile::write(const void* buf, size_t size, size_t count)
             return written;
         }
 
+        // Write long runs of whole sectors in one go.
+        size_t run = (n - written) / dev.sector_size();
+        if (buf_pos == 0 && run >= bulk_sectors)
+        {
+            uint64_t left = (dev.get_size() - static_cast<uint64_t>(position)) /
+                dev.sector_size();
+            if (run > left)
+                run = left;
+            size_t ret_val = buffer_cache().write_blocks(dev, position,
+                char_buf + written, run);
+            written += ret_val;
+            position += ret_val;
+            current = false;
+            if (ret_val != run * dev.sector_size())
+                return written;
+            continue;
+        }
+
         // We need to write whole sectors.
         size_t ret_val = 0;
         if (buf_pos != 0)
@@ -109,13 +137,13 @@ size_t BlockFile::write(const void* buf, size_t size, size_t count)
             // buffer from the input, then write the whole sector.
             klib::memcpy(buffer + buf_pos, char_buf + written,
                 dev.sector_size() - buf_pos);
-            ret_val = dev.write_block(
+            ret_val = buffer_cache().write(dev,
                 position - static_cast<klib::streamoff>(buf_pos), buffer);
         }
         else
             // We're writing a whole sector. No need to copy to the internal
             // buffer, just get it straight from the input.
-            ret_val = dev.write_block(position, char_buf + written);
+            ret_val = buffer_cache().write(dev, position, char_buf + written);
 
         written += ret_val;
         position += ret_val;
@@ -130,8 +158,8 @@ size_t BlockFile::write(const void* buf, size_t size, size_t count)
     {
         // Update the buffer, so we can modify the active block without
         // destroying the whole block.
-        if (dev.read_block(static_cast<klib::streamoff>(position), buffer) !=
-            dev.sector_size())
+        if (buffer_cache().read(dev, static_cast<klib::streamoff>(position),
+            buffer) != dev.sector_size())
             return written;
         else
             current = true;
@@ -172,11 +200,30 @@ size_t BlockFile::read(void* buf, size_t size, size_t count)
             return char_read;
         }
 
+        // Read long runs of whole sectors in one go.
+        size_t run = (n - char_read) / dev.sector_size();
+        if (buf_pos == 0 && run >= bulk_sectors)
+        {
+            uint64_t left = (dev.get_size() - static_cast<uint64_t>(position)) /
+                dev.sector_size();
+            if (run > left)
+                run = left;
+            size_t ret_val = buffer_cache().read_blocks(dev, position,
+                char_buf + char_read, run);
+            char_read += ret_val;
+            position += ret_val;
+            current = false;
+            if (ret_val != run * dev.sector_size())
+                return char_read;
+            continue;
+        }
+
         // If current is false, we need to read in the current block.
         if (!current)
         {
-            if (dev.read_block(static_cast<klib::streamoff>(position) - buf_pos,
-                buffer) != dev.sector_size())
+            if (buffer_cache().read(dev,
+                static_cast<klib::streamoff>(position) - buf_pos, buffer) !=
+                dev.sector_size())
                 return char_read;
             else
                 current = true;
@@ -196,8 +243,9 @@ size_t BlockFile::read(void* buf, size_t size, size_t count)
         // If current is false, we need to read in the current block.
         if (!current)
         {
-            if (dev.read_block(static_cast<klib::streamoff>(position) - buf_pos,
-                buffer) != dev.sector_size())
+            if (buffer_cache().read(dev,
+                static_cast<klib::streamoff>(position) - buf_pos, buffer) !=
+                dev.sector_size())
                 return char_read;
             else
                 current = true;
@@ -226,8 +274,8 @@ int BlockFile::flush()
     // We just need to overwrite the current sector with the current buffer.
     klib::streamoff buf_pos =
         static_cast<klib::streamoff>(position) % dev.sector_size();
-    return (dev.write_block(position - buf_pos, buffer) == dev.sector_size() ?
-        0 : EOF);
+    return (buffer_cache().write(dev, position - buf_pos, buffer) ==
+        dev.sector_size() ? 0 : EOF);
 }
 
 /******************************************************************************/
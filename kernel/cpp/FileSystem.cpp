@@ -2,12 +2,14 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <map>
 #include <string>
 #include <utility>
 
+#include "BufferCache.h"
 #include "DevFileSystem.h"
 #include "Ext.h"
 #include "Kernel.h"
@@ -18,25 +20,90 @@
 
 size_t FileSystem::read(uint64_t offset, char* buf, size_t n)
 {
-    klib::ifstream in {drv_name};
-    in.seekg(offset);
-    in.read(buf, n);
-    return in.gcount();
+    BlockDevice* dev = device();
+    if (dev == nullptr)
+        return 0;
+
+    // Copy straight out of the buffer cache, a sector at a time.
+    BufferCache& cache = *global_kernel->get_buffer_cache();
+    size_t sz = dev->sector_size();
+    size_t done = 0;
+    while (done < n)
+    {
+        uint64_t pos = offset + done;
+        size_t start = pos % sz;
+        BufferCache::Handle h = cache.get(*dev, pos - start);
+        if (!h.valid())
+            break;
+
+        size_t len = klib::min(sz - start, n - done);
+        klib::memcpy(buf + done, h.data() + start, len);
+        done += len;
+    }
+
+    return done;
+}
+
+/******************************************************************************/
+
+void FileSystem::prefetch(uint64_t offset, size_t n)
+{
+    BlockDevice* dev = device();
+    if (dev == nullptr || n == 0)
+        return;
+
+    size_t sz = dev->sector_size();
+    uint64_t start = offset - offset % sz;
+    size_t sectors = (offset + n - start + sz - 1) / sz;
+    global_kernel->get_buffer_cache()->prefetch(*dev, start, sectors);
 }
 
 /******************************************************************************/
 
 void FileSystem::write(uint64_t offset, const char* buf, size_t n)
 {
-    klib::string tmp;
+    BlockDevice* dev = device();
+    if (dev == nullptr)
+        return;
     if (n == 0)
-        tmp = klib::string {reinterpret_cast<const char*>(buf)};
-    else
-        tmp = klib::string{reinterpret_cast<const char*>(buf), n};
+        n = klib::strlen(buf);
+
+    BufferCache& cache = *global_kernel->get_buffer_cache();
+    size_t sz = dev->sector_size();
+    size_t done = 0;
+    while (done < n)
+    {
+        uint64_t pos = offset + done;
+        size_t start = pos % sz;
+        size_t len = klib::min(sz - start, n - done);
+        // Only read the old contents if part of the sector is kept.
+        BufferCache::Handle h = cache.get(*dev, pos - start, len != sz);
+        if (!h.valid())
+        {
+            global_kernel->syslog()->warn(
+                "%s failed to write at %llu\n", drv_name.c_str(), pos);
+            return;
+        }
+
+        klib::memcpy(h.data() + start, buf + done, len);
+        h.mark_dirty();
+        done += len;
+    }
+}
+
+/******************************************************************************/
 
-    klib::ofstream out {drv_name};
-    out.seekp(offset);
-    out << tmp;
+BlockDevice* FileSystem::device()
+{
+    if (dev_drv == nullptr && !drv_name.empty())
+    {
+        Device* d =
+            global_kernel->get_vfs()->get_dev()->get_device_driver(drv_name);
+        if (d != nullptr && d->get_type() == DeviceType::ata_disk)
+            dev_drv = static_cast<BlockDevice*>(d);
+    }
+
+    return dev_drv;
 }
 
 /******************************************************************************
@@ -101,6 +168,7 @@ static klib::string sanitise_name(const klib::string& name)
 Directory* VirtualFileSystem::diropen(const klib::string& name)
 {
     klib::string tmp {sanitise_name(name)};
+    ReadGuard<Rcu> rg {mtab_rcu};
     FileSystem* fs = lookup(tmp);
     return fs->diropen(tmp);
 }
@@ -110,6 +178,7 @@ Directory* VirtualFileSystem::diropen(const klib::string& name)
 klib::FILE* VirtualFileSystem::fopen(const klib::string& name, const char* mode)
 {
     klib::string tmp {sanitise_name(name)};
+    ReadGuard<Rcu> rg {mtab_rcu};
     FileSystem* fs = lookup(tmp);
     klib::FILE* f = fs->fopen(tmp, mode);
 
@@ -141,6 +210,7 @@ int VirtualFileSystem::mkdir(const klib::string& name, int mode)
 {
     // Look up the file system.
     klib::string tmp {sanitise_name(name)};
+    ReadGuard<Rcu> rg {mtab_rcu};
     FileSystem* fs = lookup(tmp);
 
     // Pass the call onto the file system.
@@ -153,6 +223,7 @@ int VirtualFileSystem::rmdir(const klib::string& name)
 {
     // Look up the file system.
     klib::string tmp {sanitise_name(name)};
+    ReadGuard<Rcu> rg {mtab_rcu};
     FileSystem* fs = lookup(tmp);
 
     // Pass the call onto the file system.
@@ -165,6 +236,7 @@ int VirtualFileSystem::unlink(const klib::string& name)
 {
     // Look up the file system.
     klib::string tmp {sanitise_name(name)};
+    ReadGuard<Rcu> rg {mtab_rcu};
     FileSystem* fs = lookup(tmp);
 
     // Pass the call onto the file system.
@@ -182,10 +254,12 @@ FileSystem* VirtualFileSystem::lookup(const klib::string& fname) const
 
 FileSystem* VirtualFileSystem::lookup(klib::string& fname) const
 {
+    const mount_table& tab = *mtab.load(klib::memory_order_acquire);
+
     // Search for the longest match.
-    klib::map<klib::string, FileSystem*>::const_iterator best = mtab.end();
+    mount_table::const_iterator best = tab.end();
     size_t best_len = 0;
-    for (auto it = mtab.begin(); it != mtab.end(); ++it)
+    for (auto it = tab.begin(); it != tab.end(); ++it)
     {
         size_t len = it->first.size();
         if (len > best_len && fname.compare(0, len, it->first) == 0)
@@ -200,13 +274,14 @@ FileSystem* VirtualFileSystem::lookup(klib::string& fname) const
     if (fname.empty() || fname[0] != '/')
         fname = '/' + fname;
 
-    // Return the file system.
-    if (best == mtab.end() && mtab.find("/") != mtab.end())
-        return mtab.find("/")->second;
-    else if (best == mtab.end())
-        return nullptr;
-    
-    return best->second;
+    // Get the file system.
+    FileSystem* fs = nullptr;
+    if (best == tab.end() && tab.find("/") != tab.end())
+        fs = tab.find("/")->second;
+    else if (best != tab.end())
+        fs = best->second;
+
+    return fs;
 }
 
 FileSystem* VirtualFileSystem::lookup(klib::string&& fname) const
@@ -218,11 +293,13 @@ FileSystem* VirtualFileSystem::lookup(klib::string&& fname) const
 
 DevFileSystem* VirtualFileSystem::get_dev() const
 {
-    auto it = mtab.find("/dev");
-    if (it == mtab.end())
-        return nullptr;
+    ReadGuard<Rcu> rg {mtab_rcu};
+    const mount_table& tab = *mtab.load(klib::memory_order_acquire);
 
-    return dynamic_cast<DevFileSystem*>(it->second);
+    auto it = tab.find("/dev");
+    DevFileSystem* dev = (it == tab.end() ?
+        nullptr : dynamic_cast<DevFileSystem*>(it->second));
+    return dev;
 }
 
 /******************************************************************************/
@@ -237,7 +314,8 @@ bool VirtualFileSystem::mount(const klib::string& mount_point,
         return false;
 
     // Check that the device is not already mounted.
-    for (auto p : mtab)
+    LockGuard<Mutex> lk {mtab_lock};
+    for (auto p : *mtab.load())
         if (p.second->get_drv_name() == dev_name)
             return false;
 
@@ -246,7 +324,9 @@ bool VirtualFileSystem::mount(const klib::string& mount_point,
     if (fs == nullptr)
         return false;
 
-    mtab[sanitise_name(mount_point)] = fs;
+    mount_table* tab = new mount_table {*mtab.load()};
+    (*tab)[sanitise_name(mount_point)] = fs;
+    replace_mtab(tab);
     return true;
 }
 
@@ -258,7 +338,10 @@ bool VirtualFileSystem::mount_virtual(const klib::string& m, FileSystem* fs)
         return false;
 
     // Create a mapping.
-    mtab[sanitise_name(m)] = fs;
+    LockGuard<Mutex> lk {mtab_lock};
+    mount_table* tab = new mount_table {*mtab.load()};
+    (*tab)[sanitise_name(m)] = fs;
+    replace_mtab(tab);
     return true;
 }
 
@@ -268,6 +351,7 @@ void VirtualFileSystem::rename(const klib::string& f, const klib::string& n)
 {
     // Lookup the file system.
     klib::string tmp {sanitise_name(f)};
+    ReadGuard<Rcu> rg {mtab_rcu};
     FileSystem* fs = lookup(tmp);
     fs->rename(tmp, n);
 }
@@ -277,25 +361,45 @@ void VirtualFileSystem::rename(const klib::string& f, const klib::string& n)
 void VirtualFileSystem::umount(const klib::string& n)
 {
     klib::string tmp {sanitise_name(n)};
+    LockGuard<Mutex> lk {mtab_lock};
+    mount_table* tab = new mount_table {*mtab.load()};
+
     // Test for a mount point named n first, since that's easier.
-    klib::map<klib::string, FileSystem*>::iterator it = mtab.find(tmp);
-    if (it != mtab.end())
+    mount_table::iterator it = tab->find(tmp);
+    if (it == tab->end())
     {
-        delete it->second;
-        mtab.erase(it);
-        return;
+        // Now search for devices.
+        for (it = tab->begin(); it != tab->end(); ++it)
+            if (it->second->get_drv_name() == tmp)
+                break;
     }
-
-    // Now search for devices.
-    for (it = mtab.begin(); it != mtab.end(); ++it)
+    if (it == tab->end())
     {
-        if (it->second->get_drv_name() == tmp)
-        {
-            delete it->second;
-            mtab.erase(it);
-            return;
-        }
+        delete tab;
+        return;
     }
+
+    // Nothing can find the file system once the old table has gone, and
+    // replacing the table waits for every read section which might still be
+    // using it.
+    FileSystem* fs = it->second;
+    tab->erase(it);
+    replace_mtab(tab);
+    BlockDevice* dev = fs->device();
+    delete fs;
+
+    // Make sure everything the file system wrote reaches the disk.
+    if (dev != nullptr)
+        dev->flush();
+}
+
+/******************************************************************************/
+
+void VirtualFileSystem::replace_mtab(mount_table* tab)
+{
+    mount_table* old = mtab.exchange(tab, klib::memory_order_acq_rel);
+    mtab_rcu.synchronize();
+    delete old;
 }
 
 /******************************************************************************
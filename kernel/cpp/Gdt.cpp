@@ -182,6 +182,25 @@ bool Gdt::load() const
     return true;
 }
 
+/******************************************************************************/
+
+bool Gdt::load_secondary(size_t n) const
+{
+    if (kernel_cs == 0 || kernel_ds == 0 || user_tss == 0 ||
+        user_tss + n >= entries.size())
+        return false;
+
+    GdtRegister cs {kernel_cs, true, false};
+    GdtRegister ds {kernel_ds, true, false};
+
+    load_gdt(reinterpret_cast<uint32_t>(entries.data()),
+        static_cast<uint16_t>(entries.size() * 8));
+    reset_segments(cs.val(), ds.val());
+    load_tss(GdtRegister{user_tss + n, false, false}.val());
+
+    return true;
+}
+
 /******************************************************************************
  ******************************************************************************/
 
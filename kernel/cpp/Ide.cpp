@@ -1,19 +1,59 @@
 #include "Ide.h"
 
+#include <stdint.h>
+
 #include <cstdio>
 #include <ostream>
 #include <string>
 
+#include "BufferCache.h"
 #include "DevFileSystem.h"
 #include "FileSystem.h"
 #include "InterruptHandler.h"
 #include "io.h"
 #include "Kernel.h"
+#include "Lock.h"
 #include "Logger.h"
+#include "PageDescriptorTable.h"
+#include "PageFrameAllocator.h"
+#include "paging.h"
 #include "Pci.h"
+#include "Pit.h"
+#include "Process.h"
+#include "ProcTable.h"
+#include "Scheduler.h"
 #include "SignalManager.h"
+#include "TimerWheel.h"
 #include "util.h"
 
+/******************************************************************************
+ ******************************************************************************/
+
+// Gets the process to put to sleep while waiting for a DMA transfer, or
+// nullptr if there isn't one or interrupts are off, in which case the
+// controller is polled.
+static Process* sleeping_process()
+{
+    if (switch_blocked_for_init || !(get_eflags() & 0x200))
+        return nullptr;
+
+    size_t pid = global_kernel->get_scheduler().get_last();
+    return (pid == 0 ?
+        nullptr : global_kernel->get_proc_table().get_process(pid));
+}
+
+// Waiter for a process sleeping through a DMA transfer.
+struct dma_waiter : Waiter {
+    explicit dma_waiter(Process* p) : Waiter{wake}, proc{p} {}
+    static void wake(Waiter& w, PollType)
+    {
+        Process* p = static_cast<dma_waiter&>(w).proc;
+        if (p->get_status() == ProcStatus::sleeping)
+            p->set_status(ProcStatus::runnable);
+    }
+    Process* proc;
+};
+
 /******************************************************************************
  ******************************************************************************/
 
@@ -93,9 +133,15 @@ DiskIoError IdeController::ata_read(channel cha, rank ra, uint64_t off,
 {
     size_t dev = 2 * static_cast<uint8_t>(cha) + static_cast<uint8_t>(ra);
     address_mode mode;
+    LockGuard<Mutex> lg {channels[static_cast<uint8_t>(cha)].state->lock};
+
+    // Let the controller do the work if it can.
+    DiskIoError ret_val;
+    if (ata_dma(cha, ra, off, addr, sz, false, ret_val))
+        return ret_val;
 
     // Prepare mode and address.
-    DiskIoError ret_val = prepare_io(cha, ra, off, sz, mode);
+    ret_val = prepare_io(cha, ra, off, sz, mode);
     if (ret_val != DiskIoError::success)
         return ret_val;
 
@@ -109,7 +155,7 @@ DiskIoError IdeController::ata_read(channel cha, rank ra, uint64_t off,
 
     // Do the actual read.
     char* v_addr = static_cast<char*>(addr);
-    uint8_t no_sects = sz / devs[dev].sector_size;
+    size_t no_sects = sz / devs[dev].sector_size;
     for (size_t i = 0; i < no_sects; ++i)
     {
         polling_response perr = polling(static_cast<channel>(cha), true);
@@ -136,9 +182,15 @@ DiskIoError IdeController::ata_write(channel cha, rank ra, uint64_t off,
 {
     size_t dev = 2 * static_cast<uint8_t>(cha) + static_cast<uint8_t>(ra);
     address_mode mode;
+    LockGuard<Mutex> lg {channels[static_cast<uint8_t>(cha)].state->lock};
+
+    // Let the controller do the work if it can.
+    DiskIoError ret_val;
+    if (ata_dma(cha, ra, off, addr, sz, true, ret_val))
+        return ret_val;
 
     // Prepare mode and address.
-    DiskIoError ret_val = prepare_io(cha, ra, off, sz, mode);
+    ret_val = prepare_io(cha, ra, off, sz, mode);
     if (ret_val != DiskIoError::success)
         return ret_val;
 
@@ -159,7 +211,7 @@ DiskIoError IdeController::ata_write(channel cha, rank ra, uint64_t off,
 
     // Do the actual write.
     const char* v_addr = static_cast<const char*>(addr);
-    uint8_t no_sects = sz / devs[dev].sector_size;
+    size_t no_sects = sz / devs[dev].sector_size;
     for (size_t i = 0; i < no_sects; ++i)
     {
         outsw(channels[static_cast<uint8_t>(cha)].base +
@@ -196,6 +248,10 @@ void IdeController::configure()
         get_subclass() != scl_mass_storage_ide)
         ex = false;
 
+    // There's no channel state until the ports are known.
+    channels[static_cast<uint8_t>(channel::primary)].state = nullptr;
+    channels[static_cast<uint8_t>(channel::secondary)].state = nullptr;
+
     // Don't do anything if the PCI device does not exist.
     if (!ex)
         return;
@@ -214,7 +270,8 @@ void IdeController::configure_bar()
     uint16_t primary_control_addr = static_cast<uint16_t>(get_bar(1)); 
     uint16_t secondary_addr = static_cast<uint16_t>(get_bar(2));
     uint16_t secondary_control_addr = static_cast<uint16_t>(get_bar(3));
-    uint16_t bmide_addr = static_cast<uint16_t>(get_bar(4));
+    uint32_t bmide_bar = get_bar(4);
+    uint16_t bmide_addr = static_cast<uint16_t>(bmide_bar & 0xFFFC);
 
     // I/O port addresses must be 4 byte aligned. Bit 1 is reserved.
     // If I/O and the value is 0x0, use the defaults instead.
@@ -231,13 +288,36 @@ void IdeController::configure_bar()
 
     // Set the addresses and set the interrupts disable (nien) to true.
     channels[static_cast<uint8_t>(channel::primary)] = ChannelRegisters {
-        primary_addr, primary_control_addr, bmide_addr, true, rank::unknown
+        primary_addr, primary_control_addr, bmide_addr, true, rank::unknown,
+        new ChannelState {}
     };
     channels[static_cast<uint8_t>(channel::secondary)] = ChannelRegisters {
         secondary_addr, secondary_control_addr,
-        static_cast<uint16_t>(bmide_addr + 8), true, rank::unknown
+        static_cast<uint16_t>(bmide_addr + 8), true, rank::unknown,
+        new ChannelState {}
     };
 
+    // Bus master DMA needs the bus master registers in I/O space, and a page
+    // for each channel's PRD table.
+    if ((bmide_bar & 0x1) && bmide_addr != 0)
+    {
+        enable_bus_master();
+        for (ChannelRegisters& ch : channels)
+        {
+            PageFrameAllocator pfa {};
+            void* phys = pfa.allocate();
+            void* virt = phys_to_virt(phys);
+            if (virt == nullptr)
+            {
+                pfa.free(phys);
+                continue;
+            }
+            ch.state->prdt = static_cast<prd*>(virt);
+            ch.state->prdt_phys =
+                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(phys));
+        }
+    }
+
     // Disable interrupts.
     ide_write(channel::primary, register_offset::control,
         static_cast<uint8_t>(control_bits::nien));
@@ -414,6 +494,29 @@ void IdeController::add_drivers(klib::map<klib::string, Device*>& drvs)
 
 /******************************************************************************/
 
+void IdeController::handle_interrupt(InterruptNumber inum)
+{
+    for (uint8_t c = 0; c < 2; ++c)
+    {
+        // Serial controllers use the first interrupt for both channels.
+        channel cha = static_cast<channel>(c);
+        ChannelState* st = channels[c].state;
+        if (st == nullptr || inum != (c == 0 || serial ? int1 : int2))
+            continue;
+
+        // Only finish the transfer if this channel raised the interrupt.
+        LockGuard<Spinlock> lg {st->guard};
+        if (!st->waiting || !(ide_read(cha, register_offset::bmide_status) &
+            static_cast<uint8_t>(bmide_status_bits::irq)))
+            continue;
+
+        dma_finish(cha);
+        st->waiters.wake(PollType::pollnone);
+    }
+}
+
+/******************************************************************************/
+
 void IdeController::read_identify(channel cha, rank ra, char* ident_buf)
 {
     size_t dev = 2 * static_cast<uint8_t>(cha) + static_cast<uint8_t>(ra);
@@ -434,6 +537,19 @@ void IdeController::read_identify(channel cha, rank ra, char* ident_buf)
     devs[dev].dma_support = devs[dev].features &
         static_cast<uint16_t>(capabilities_bits::dma);
 
+    // Tell the controller the device can do DMA, in case the BIOS didn't.
+    if (devs[dev].dma_support &&
+        channels[static_cast<uint8_t>(cha)].state->prdt != nullptr)
+    {
+        // Don't clear the error or interrupt bits by writing 1 to them.
+        uint8_t bm = ide_read(cha, register_offset::bmide_status) &
+            ~(static_cast<uint8_t>(bmide_status_bits::error) |
+            static_cast<uint8_t>(bmide_status_bits::irq));
+        bm |= static_cast<uint8_t>(ra == rank::master ?
+            bmide_status_bits::master_dma : bmide_status_bits::slave_dma);
+        ide_write(cha, register_offset::bmide_status, bm);
+    }
+
     // Sector size. This is 512 unless bit 12 of the sector properties
     // is set. Multiply by 2 as the size is given in words (16 bits).
     if (*reinterpret_cast<uint16_t*>(ident_buf +
@@ -657,7 +773,7 @@ DiskIoError IdeController::prepare_io(channel cha, rank ra, uint64_t off,
     uint8_t lba[6];
     uint8_t head;
     uint64_t sect = off / devs[dev].sector_size;
-    uint8_t no_sect = sz / devs[dev].sector_size;
+    size_t no_sect = sz / devs[dev].sector_size;
     if (devs[dev].lba_support)
     {
         if (sect >= (1 << 28))
@@ -722,12 +838,15 @@ DiskIoError IdeController::prepare_io(channel cha, rank ra, uint64_t off,
     // Load up the rest of the address and the number of sectors.
     if (mode == address_mode::lba48)
     {
-        ide_write(static_cast<channel>(cha), register_offset::seccount1, 0);
+        ide_write(static_cast<channel>(cha), register_offset::seccount1,
+            (no_sect >> 8) & 0xFF);
         ide_write(static_cast<channel>(cha), register_offset::lba3, lba[3]);
         ide_write(static_cast<channel>(cha), register_offset::lba4, lba[4]);
         ide_write(static_cast<channel>(cha), register_offset::lba5, lba[5]);
     }
-    ide_write(static_cast<channel>(cha), register_offset::seccount0, no_sect);
+    // A count of 0 means 256 sectors for LBA28 and CHS.
+    ide_write(static_cast<channel>(cha), register_offset::seccount0,
+        no_sect & 0xFF);
     ide_write(static_cast<channel>(cha), register_offset::lba0, lba[0]);
     ide_write(static_cast<channel>(cha), register_offset::lba1, lba[1]);
     ide_write(static_cast<channel>(cha), register_offset::lba2, lba[2]);
@@ -826,6 +945,211 @@ IdeController::polling_response IdeController::switch_device(channel cha,
     return perr;
 }
 
+/******************************************************************************/
+
+bool IdeController::build_prd(channel cha, const void* addr, size_t sz)
+{
+    // User memory could be copy on write, or not there yet, which the
+    // controller wouldn't know about.
+    if (reinterpret_cast<uintptr_t>(addr) < kernel_virtual_base)
+        return false;
+
+    prd* table = channels[static_cast<uint8_t>(cha)].state->prdt;
+    const char* v_addr = static_cast<const char*>(addr);
+    size_t n = 0;
+    uint32_t len = 0;
+
+    while (sz != 0)
+    {
+        // Memory that isn't mapped in the kernel, or is above 4GB, can't be
+        // used.
+        uintptr_t phys = reinterpret_cast<uintptr_t>(virt_to_phys(v_addr));
+        if (phys == 0 || (phys & 0x1) != 0)
+            return false;
+
+        // Go to the end of the page, since the next page could be anywhere.
+        size_t chunk = PageDescriptorTable::page_size -
+            (phys % PageDescriptorTable::page_size);
+        if (chunk > sz)
+            chunk = sz;
+
+        // Carry on the last entry if this follows on from it without crossing
+        // a 64KB boundary.
+        if (n != 0 && table[n - 1].addr + len == phys &&
+            (table[n - 1].addr / prd_boundary) ==
+            (phys + chunk - 1) / prd_boundary)
+            len += chunk;
+        else
+        {
+            if (n == max_prds)
+                return false;
+            table[n++].addr = static_cast<uint32_t>(phys);
+            len = chunk;
+        }
+        table[n - 1].count = static_cast<uint16_t>(len);
+        table[n - 1].flags = 0;
+
+        v_addr += chunk;
+        sz -= chunk;
+    }
+
+    if (n == 0)
+        return false;
+    table[n - 1].flags = prd_end;
+    return true;
+}
+
+/******************************************************************************/
+
+bool IdeController::ata_dma(channel cha, rank ra, uint64_t off,
+    const void* addr, size_t sz, bool write, DiskIoError& err)
+{
+    size_t dev = 2 * static_cast<uint8_t>(cha) + static_cast<uint8_t>(ra);
+    ChannelRegisters& ch = channels[static_cast<uint8_t>(cha)];
+
+    // The DMA commands only take LBA addresses.
+    if (ch.state->prdt == nullptr || !devs[dev].dma_support ||
+        !devs[dev].lba_support || !build_prd(cha, addr, sz))
+        return false;
+
+    address_mode mode;
+    err = prepare_io(cha, ra, off, sz, mode);
+    if (err != DiskIoError::success)
+        return true;
+
+    // Point the controller at the table, set the direction and clear the
+    // status from last time.
+    uint8_t direction = (write ?
+        0 : static_cast<uint8_t>(bmide_command_bits::read));
+    outl(ch.state->prdt_phys, ch.bmide +
+        static_cast<uint16_t>(register_offset::bmide_prdt) - bmide_adjust);
+    ide_write(cha, register_offset::bmide_command, direction);
+    ide_write(cha, register_offset::bmide_status,
+        ide_read(cha, register_offset::bmide_status) |
+        static_cast<uint8_t>(bmide_status_bits::error) |
+        static_cast<uint8_t>(bmide_status_bits::irq));
+
+    // The device only needs to interrupt if a process is going to sleep.
+    Process* p = sleeping_process();
+    if (p != nullptr)
+    {
+        ch.nien = false;
+        ide_write(cha, register_offset::control, 0);
+    }
+    ch.state->guard.lock();
+    ch.state->waiting = true;
+    ch.state->guard.unlock();
+
+    // Send the command, then start the controller.
+    commands cmd;
+    if (mode == address_mode::lba48)
+        cmd = (write ? commands::write_dma_ext : commands::read_dma_ext);
+    else
+        cmd = (write ? commands::write_dma : commands::read_dma);
+    ide_write(cha, register_offset::command, static_cast<uint8_t>(cmd));
+    ide_write(cha, register_offset::bmide_command,
+        direction | static_cast<uint8_t>(bmide_command_bits::start));
+
+    bool finished = dma_wait(cha, p);
+
+    // PIO runs with interrupts off.
+    ch.nien = true;
+    ide_write(cha, register_offset::control,
+        static_cast<uint8_t>(control_bits::nien));
+
+    if (!finished ||
+        (ch.state->bm_status & static_cast<uint8_t>(bmide_status_bits::error))
+        || (ch.state->ata_status & (static_cast<uint8_t>(status_bits::err) |
+        static_cast<uint8_t>(status_bits::df))))
+    {
+        err = DiskIoError::hardware_fault;
+        return true;
+    }
+
+    // Get the data out of the disk's cache, as PIO writes do.
+    if (write)
+    {
+        ide_write(cha, register_offset::command, static_cast<uint8_t>(
+            mode == address_mode::lba48 ?
+            commands::cache_flush_ext : commands::cache_flush));
+        polling(cha, false);
+    }
+
+    err = DiskIoError::success;
+    return true;
+}
+
+/******************************************************************************/
+
+bool IdeController::dma_wait(channel cha, Process* p)
+{
+    ChannelState& st = *channels[static_cast<uint8_t>(cha)].state;
+
+    if (p == nullptr)
+    {
+        // Watch the controller until it's moved all the data or failed, then
+        // wait for the device to finish.
+        uint8_t bm;
+        do {
+            bm = ide_read(cha, register_offset::bmide_status);
+        } while ((bm & static_cast<uint8_t>(bmide_status_bits::active)) &&
+            !(bm & (static_cast<uint8_t>(bmide_status_bits::error) |
+            static_cast<uint8_t>(bmide_status_bits::irq))));
+        polling(cha, false);
+
+        LockGuard<Spinlock> lg {st.guard};
+        dma_finish(cha);
+        return true;
+    }
+
+    // Sleep until the interrupt handler finishes the transfer. The process
+    // timer wakes us if the interrupt never comes.
+    TimerWheel* timers = global_kernel->get_timers();
+    timers->add(p->get_timer(),
+        global_kernel->get_pit()->ms_to_ticks(dma_timeout_ms));
+
+    st.guard.lock();
+    while (st.waiting && p->get_timer().pending())
+    {
+        // The guard keeps interrupts off until the status is set, so the
+        // wake up can't be missed.
+        dma_waiter w {p};
+        st.waiters.add(w);
+        p->set_status(ProcStatus::sleeping);
+        st.guard.unlock();
+        global_kernel->get_scheduler().yield();
+        st.waiters.remove(w);
+        st.guard.lock();
+    }
+    timers->cancel(p->get_timer());
+
+    bool finished = !st.waiting;
+    if (!finished)
+    {
+        global_kernel->syslog()->warn("IDE DMA transfer timed out\n");
+        dma_finish(cha);
+    }
+    st.guard.unlock();
+
+    return finished;
+}
+
+/******************************************************************************/
+
+void IdeController::dma_finish(channel cha)
+{
+    ChannelState& st = *channels[static_cast<uint8_t>(cha)].state;
+
+    // Stop the controller, then read the device status, which also clears
+    // its interrupt. Writing the status back clears the error and interrupt
+    // bits.
+    ide_write(cha, register_offset::bmide_command, 0);
+    st.bm_status = ide_read(cha, register_offset::bmide_status);
+    st.ata_status = ide_read(cha, register_offset::status);
+    ide_write(cha, register_offset::bmide_status, st.bm_status);
+    st.waiting = false;
+}
+
 /******************************************************************************
  ******************************************************************************/
 
@@ -834,9 +1158,7 @@ size_t PataDriver::read_block(uint64_t off, void* addr)
     if (off > size || off % s_sz != 0)
         return 0;
 
-    DiskIoError ret_val = cont.ata_read(cha, ra, off, addr, s_sz);
-
-    return (ret_val == DiskIoError::success ? s_sz : 0);
+    return queue_io(false, off, addr, 1);
 }
 
 /******************************************************************************/
@@ -846,9 +1168,48 @@ size_t PataDriver::write_block(uint64_t off, const void* addr)
    if (off > size || off % s_sz != 0)
         return 0;
 
-    DiskIoError ret_val = cont.ata_write(cha, ra, off, addr, s_sz);
+    return queue_io(true, off, const_cast<void*>(addr), 1);
+}
+
+/******************************************************************************/
+
+size_t PataDriver::read_blocks(uint64_t off, void* addr, size_t count)
+{
+    if (off % s_sz != 0 || off + count * s_sz > size)
+        return 0;
+
+    return queue_io(false, off, addr, count);
+}
+
+/******************************************************************************/
+
+size_t PataDriver::write_blocks(uint64_t off, const void* addr, size_t count)
+{
+    if (off % s_sz != 0 || off + count * s_sz > size)
+        return 0;
+
+    return queue_io(true, off, const_cast<void*>(addr), count);
+}
+
+/******************************************************************************/
+
+void PataDriver::submit(BlockRequest& r)
+{
+    queue.submit(r);
+}
+
+/******************************************************************************/
+
+size_t PataDriver::wait(BlockRequest& r)
+{
+    return queue.wait(r);
+}
+
+/******************************************************************************/
 
-    return (ret_val == DiskIoError::success ? s_sz : 0);
+int PataDriver::flush()
+{
+    return (global_kernel->get_buffer_cache()->flush(*this) == 0 ? 0 : EOF);
 }
 
 /******************************************************************************/
@@ -857,8 +1218,8 @@ PollType PataDriver::poll_check(PollType cond) const
 {
     PollType ret_val = PollType::pollnone;
 
-    // For now, the device is always ready, since we haven't done DMA for
-    // asynchronous writing. We do have a busy flag in preparation.
+    // The device is busy while a transfer is running, which may be a while
+    // if the process that started it is asleep waiting for DMA.
     if ((cond & PollType::pollin) != PollType::pollnone && !busy)
         ret_val |= PollType::pollin;
     if ((cond & PollType::pollout) != PollType::pollnone && !busy)
@@ -867,5 +1228,57 @@ PollType PataDriver::poll_check(PollType cond) const
     return ret_val;
 }
 
+/******************************************************************************/
+
+size_t PataDriver::transfer(bool write, uint64_t off, void* addr,
+    size_t count)
+{
+    if (off % s_sz != 0 || off + count * s_sz > size)
+        return 0;
+
+    // Split the run into the largest transfers the controller can do.
+    char* mem = static_cast<char*>(addr);
+    size_t moved = 0;
+    busy = true;
+    while (count != 0)
+    {
+        size_t n = (count < IdeController::max_sectors ?
+            count : IdeController::max_sectors);
+        DiskIoError err = (write ?
+            cont.ata_write(cha, ra, off + moved, mem + moved, n * s_sz) :
+            cont.ata_read(cha, ra, off + moved, mem + moved, n * s_sz));
+        if (err != DiskIoError::success)
+            break;
+        moved += n * s_sz;
+        count -= n;
+    }
+    done();
+
+    return moved;
+}
+
+/******************************************************************************/
+
+void PataDriver::done()
+{
+    busy = false;
+
+    SignalManager* sig = global_kernel->get_signal_manager();
+    if (sig != nullptr)
+        sig->notify_file(this, PollType::pollin | PollType::pollout);
+}
+
+/******************************************************************************/
+
+size_t PataDriver::queue_io(bool write, uint64_t off, void* addr,
+    size_t count)
+{
+    // The queue only writes from the memory, so it's safe to cast away const
+    // for writes.
+    BlockRequest r {write, off, addr, count};
+    queue.submit(r);
+    return queue.wait(r);
+}
+
 /******************************************************************************
  ******************************************************************************/
@@ -5,8 +5,12 @@
 #include <exception>
 #include <string>
 
+#include "Apic.h"
+#include "Ide.h"
+#include "interrupt.h"
 #include "Kernel.h"
 #include "Keyboard.h"
+#include "Lock.h"
 #include "Logger.h"
 #include "paging.h"
 #include "Pic.h"
@@ -14,8 +18,12 @@
 #include "Process.h"
 #include "ProcTable.h"
 #include "Scheduler.h"
+#include "Serial.h"
 #include "SignalManager.h"
+#include "Smp.h"
 #include "Syscall.h"
+#include "TimePage.h"
+#include "TimerWheel.h"
 
 /******************************************************************************
  ******************************************************************************/
@@ -38,6 +46,10 @@ uint32_t interrupt_handler(uint32_t edi,
 {
     uint32_t ret_val = 0;
 
+    // Take the kernel lock, unless this processor already holds it because
+    // the interrupt came from the kernel.
+    bool entered = kernel_lock.enter();
+
     try {
         InterruptRegisters ireg {edi, esi, ebp, esp, ebx, edx, ecx, eax};
         InterruptStack istack {err, eip, cs, eflags, esp_int, ss};
@@ -77,9 +89,20 @@ uint32_t interrupt_handler(uint32_t edi,
         case InterruptNumber::pit:
             PitHandler{ireg, istack, inum}.handle();
             break;
+        case InterruptNumber::apic_timer:
+        case InterruptNumber::reschedule:
+            ScheduleHandler{ireg, istack, inum}.handle();
+            break;
         case InterruptNumber::ps2_keyboard:
             Ps2KeyboardHandler{ireg, istack, inum}.handle();
             break;
+        case InterruptNumber::com1:
+            SerialHandler{ireg, istack, inum}.handle();
+            break;
+        case InterruptNumber::ata1:
+        case InterruptNumber::ata2:
+            IdeHandler{ireg, istack, inum}.handle();
+            break;
         case InterruptNumber::syscall:
             SysCallHandler{ireg, istack, inum}.handle();
             // The return value gets put into ireg.eax(). We return it from this
@@ -107,14 +130,80 @@ uint32_t interrupt_handler(uint32_t edi,
             "Uncaught unknown exception during interrupt handling: %s\n");
     }
 
+    // Give the lock up on the way back out to user space, or back to the idle
+    // task, which runs without it. Otherwise the interrupted code carries on
+    // holding it, even if it hadn't got round to taking it itself.
+    if (eip < kernel_virtual_base ||
+        (entered && global_kernel->get_scheduler().idling()))
+    {
+        disable_interrupts();
+        kernel_lock.leave();
+    }
+
     return ret_val;
 }
 
+/******************************************************************************/
+
+uint32_t sysenter_handler(uint32_t edi,
+                       uint32_t esi,
+                       uint32_t ebp,
+                       uint32_t esp,
+                       uint32_t ebx,
+                       uint32_t edx,
+                       uint32_t ecx,
+                       uint32_t eax,
+                       uint32_t,
+                       uint32_t err,
+                       uint32_t eip,
+                       uint16_t cs,
+                       uint32_t eflags,
+                       uint32_t esp_int,
+                       uint16_t ss)
+{
+    // Straight to the syscall table. The frame is the same as int 0x80 would
+    // have made, so there's nothing else to do.
+    InterruptRegisters ireg {edi, esi, ebp, esp, ebx, edx, ecx, eax};
+    InterruptStack istack {err, eip, cs, eflags, esp_int, ss};
+
+    kernel_lock.enter();
+    try {
+        syscall(ireg, istack);
+    }
+    catch (klib::exception& e)
+    {
+        global_kernel->panic(
+            "Uncaught exception during syscall handling: %s\n", e.what());
+    }
+    catch (...)
+    {
+        global_kernel->panic(
+            "Uncaught unknown exception during syscall handling\n");
+    }
+
+    // Always back to user space, which runs without the kernel lock.
+    disable_interrupts();
+    kernel_lock.leave();
+
+    return ireg.eax();
+}
+
 /******************************************************************************
  ******************************************************************************/
 
 void DefaultHandler::handle()
 {
+    // Interrupts through the I/O APIC are acknowledged at the local APIC.
+    // Spurious interrupts from the local APIC don't need acknowledging at all.
+    Smp* smp = global_kernel->get_smp();
+    if (smp != nullptr && smp->apic_routing())
+    {
+        if (inum >= InterruptNumber::pic1_start &&
+            inum <= InterruptNumber::pic2_end)
+            smp->local_apic()->eoi();
+        return;
+    }
+
     if (inum == InterruptNumber::pic1_end)
     {
         // Need to not send an ack if the master has sent a spurious IRQ
@@ -151,17 +240,46 @@ void PitHandler::handle()
     if (global_kernel->get_pit() == nullptr)
         return;
 
-    // Advance the tick.
+    // Advance the clock. There may be several ticks to catch up on if the PIT
+    // was skipping them while idle.
     Pit* pit {global_kernel->get_pit()};
-    pit->tick();
+    uint32_t ticks = pit->tick();
 
-    // Tick down pending event timeouts, if the signal manager exists.
-    if (global_kernel->get_signal_manager() != nullptr)
-        global_kernel->get_signal_manager()->tick_down(pit->period());
+    // Let user space see the new time, unless it reads the TSC instead.
+    update_time_page(pit->time_ns());
+
+    // Run any timers that have expired.
+    for (; ticks > 0; --ticks)
+        global_kernel->get_timers()->tick();
 
     // Send acknowledgement.
     DefaultHandler::handle();
 
+    // With a local APIC timer on each processor, those preempt processes, and
+    // the PIT just keeps time.
+    Smp* smp = global_kernel->get_smp();
+    if (smp != nullptr && smp->cpu_timers())
+        return;
+
+    // If task switching is not blocked for some reason, we call the scheduler
+    // to switch to the next process.
+    if (!switch_blocked_for_switch && !switch_blocked_for_init &&
+        !switch_blocked_for_exec && !switch_blocked_for_notify)
+    {
+        switch_blocked_for_switch = true;
+        global_kernel->get_scheduler().next_proc(ir, is);
+        switch_blocked_for_switch = false;
+    }
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+void ScheduleHandler::handle()
+{
+    // Both come from the local APIC, so that's where they're acknowledged.
+    global_kernel->get_smp()->local_apic()->eoi();
+
     // If task switching is not blocked for some reason, we call the scheduler
     // to switch to the next process.
     if (!switch_blocked_for_switch && !switch_blocked_for_init &&
@@ -184,6 +302,27 @@ void Ps2KeyboardHandler::handle()
     DefaultHandler::handle();
 }
 
+/******************************************************************************
+ ******************************************************************************/
+
+void SerialHandler::handle()
+{
+    Serial* ser = global_kernel->get_serial();
+    if (ser != nullptr)
+        ser->handle_interrupt();
+    DefaultHandler::handle();
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+void IdeHandler::handle()
+{
+    for (IdeController& c : global_kernel->get_ide())
+        c.handle_interrupt(inum);
+    DefaultHandler::handle();
+}
+
 /******************************************************************************
  ******************************************************************************/
 
@@ -218,14 +357,35 @@ void GpfHandler::handle()
 
 void PageFaultHandler::handle()
 {
+    // Faults in user space are handled with the active process's PDT.
+    Process* p = nullptr;
+    if (get_cr2() < kernel_virtual_base)
+        p = global_kernel->get_proc_table().get_process(
+            global_kernel->get_scheduler().get_last());
+
+    // A write to a present page in user space might be to a copy on write page
+    // left by fork. This can come from kernel mode too, when a syscall writes
+    // to a user buffer.
+    if (p != nullptr && (is.code() & 0x3) == 0x3 &&
+        p->get_pdt().copy_on_write(reinterpret_cast<void*>(get_cr2())))
+        return;
+
+    // An access to a page not present in user space might be part of the
+    // binary that hasn't been loaded yet, or part of the heap or stack that
+    // hasn't been touched yet. Again, this can come from kernel mode.
+    bool write = is.code() & 0x2;
+    if (p != nullptr && (is.code() & 0x1) == 0 &&
+        (p->load_page(reinterpret_cast<void*>(get_cr2())) == 0 ||
+        p->anonymous_page(reinterpret_cast<void*>(get_cr2()), write) == 0))
+        return;
+
     // If the page fault has come from user mode, and it's an attempted user
     // space access, we can try to expand the stack.
     if (is.code() & 0x4 && get_cr2() < kernel_virtual_base)
     {
-        Process* p = global_kernel->get_proc_table().get_process(
-            global_kernel->get_scheduler().get_last());
         size_t new_size = kernel_virtual_base - get_cr2();
-        if (p != nullptr && p->set_user_stack(new_size) == 0)
+        if (p != nullptr && p->set_user_stack(new_size) == 0 &&
+            p->anonymous_page(reinterpret_cast<void*>(get_cr2()), write) == 0)
         {
             // We've succeeded in expanding the stack. We can safely return to
             // user mode.
@@ -0,0 +1,211 @@
+#include "IoRing.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <ios>
+#include <limits>
+
+#include "Kernel.h"
+#include "Logger.h"
+#include "paging.h"
+#include "Process.h"
+#include "ProcTable.h"
+#include "Scheduler.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+IoRingTable::~IoRingTable()
+{
+    for (auto& p : rings)
+        delete p.second;
+}
+
+/******************************************************************************/
+
+int IoRingTable::create(io_ring* mem, uint32_t entries)
+{
+    size_t pid = global_kernel->get_scheduler().get_last();
+    if (global_kernel->get_proc_table().get_process(pid) == nullptr)
+        return -1;
+
+    // Check the size and that the whole ring is in user space.
+    if (entries == 0 || entries > max_entries ||
+        (entries & (entries - 1)) != 0)
+    {
+        global_kernel->syslog()->warn(
+            "io_ring_setup: %u entries is not a power of 2 up to %u.\n",
+            entries, max_entries);
+        return -1;
+    }
+    size_t sz = ring_size(entries);
+    size_t addr = reinterpret_cast<size_t>(mem);
+    if (mem == nullptr || addr % alignof(io_sqe) != 0 ||
+        addr >= kernel_virtual_base || sz > kernel_virtual_base - addr)
+    {
+        global_kernel->syslog()->warn(
+            "io_ring_setup syscall was given an invalid ring address.\n");
+        return -1;
+    }
+
+    // Touch all the memory now, so nothing needs mapping later with a lock
+    // held.
+    klib::memset(mem, 0, sz);
+    mem->entries = entries;
+
+    ring* r = new ring {};
+    r->pid = pid;
+    r->shared = mem;
+    r->sqes = reinterpret_cast<io_sqe*>(mem + 1);
+    r->cqes = reinterpret_cast<io_cqe*>(r->sqes + entries);
+    r->entries = entries;
+    r->mask = entries - 1;
+
+    // Find an unused identifier, wrapping round if we run out.
+    LockGuard<Spinlock> lg {table_lock};
+    int id = last_id;
+    do {
+        id = (id == klib::numeric_limits<int>::max() ? 1 : id + 1);
+        if (id == last_id)
+        {
+            delete r;
+            return -1;
+        }
+    } while (rings.find(id) != rings.end());
+    last_id = id;
+
+    rings[id] = r;
+    return id;
+}
+
+/******************************************************************************/
+
+int IoRingTable::enter(int id, uint32_t to_submit)
+{
+    ring* r = get_ring(id);
+    if (r == nullptr)
+        return -1;
+    io_ring& sh = *r->shared;
+
+    uint32_t submitted = 0;
+    while (submitted < to_submit)
+    {
+        // Stop when the submission ring is empty, or if user space has made
+        // nonsense of it.
+        uint32_t head = sh.sq_head;
+        uint32_t waiting = sh.sq_tail - head;
+        if (waiting == 0 || waiting > r->entries)
+            break;
+
+        // Only take an entry if there's room for its result.
+        if (cq_ready(*r) == r->entries)
+            break;
+
+        // Copy the entry, so user space can't change it under us.
+        io_sqe sqe = r->sqes[head & r->mask];
+        sh.sq_head = head + 1;
+        ++submitted;
+
+        int32_t res = submit(sqe);
+        r->cqes[sh.cq_tail & r->mask] = io_cqe {sqe.user_data, res};
+        ++sh.cq_tail;
+    }
+
+    return submitted;
+}
+
+/******************************************************************************/
+
+int IoRingTable::close(int id)
+{
+    if (get_ring(id) == nullptr)
+        return -1;
+
+    table_lock.lock();
+    ring* r = rings[id];
+    rings.erase(id);
+    table_lock.unlock();
+
+    delete r;
+    return 0;
+}
+
+/******************************************************************************/
+
+void IoRingTable::purge_process(size_t pid)
+{
+    LockGuard<Spinlock> lg {table_lock};
+    for (auto it = rings.begin(); it != rings.end(); )
+    {
+        if (it->second->pid == pid)
+        {
+            delete it->second;
+            it = rings.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+/******************************************************************************/
+
+IoRingTable::ring* IoRingTable::get_ring(int id)
+{
+    LockGuard<Spinlock> lg {table_lock};
+    auto it = rings.find(id);
+    if (it == rings.end())
+        return nullptr;
+    if (it->second->pid != global_kernel->get_scheduler().get_last())
+        return nullptr;
+
+    return it->second;
+}
+
+/******************************************************************************/
+
+int32_t IoRingTable::submit(const io_sqe& sqe)
+{
+    // The syscall functions check the addresses, as they would for a normal
+    // syscall.
+    switch (static_cast<io_op>(sqe.opcode))
+    {
+    case io_op::nop:
+        return 0;
+    case io_op::read:
+        return syscalls::read(sqe.fd, reinterpret_cast<char*>(sqe.addr),
+            sqe.len);
+    case io_op::write:
+        return syscalls::write(sqe.fd, reinterpret_cast<const char*>(sqe.addr),
+            sqe.len);
+    case io_op::open:
+        return syscalls::open(reinterpret_cast<const char*>(sqe.addr),
+            static_cast<open_flags>(sqe.flags), sqe.mode);
+    case io_op::close:
+        return syscalls::close(sqe.fd);
+    case io_op::llseek:
+        return syscalls::llseek(sqe.fd, static_cast<int32_t>(sqe.off >> 32),
+            static_cast<int32_t>(sqe.off & 0xFFFFFFFF),
+            reinterpret_cast<klib::fpos_t*>(sqe.addr), sqe.flags);
+    case io_op::unlink:
+        return syscalls::unlink(reinterpret_cast<const char*>(sqe.addr));
+    default:
+        global_kernel->syslog()->warn("io_ring: unknown operation %u\n",
+            sqe.opcode);
+        return -1;
+    }
+}
+
+/******************************************************************************/
+
+uint32_t IoRingTable::cq_ready(const ring& r)
+{
+    // User space owns cq_head, so it could be anything. Treat a nonsense value
+    // as a full ring.
+    uint32_t ready = r.shared->cq_tail - r.shared->cq_head;
+    return (ready > r.entries ? r.entries : ready);
+}
+
+/******************************************************************************
+ ******************************************************************************/
@@ -9,6 +9,9 @@
 #include <utility>
 #include <vector>
 
+#include "BufferCache.h"
+#include "Clock.h"
+#include "cpu.h"
 #include "DevFileSystem.h"
 #include "DiskPartition.h"
 #include "File.h"
@@ -16,9 +19,11 @@
 #include "Gdt.h"
 #include "Ide.h"
 #include "Idt.h"
+#include "IoRing.h"
 #include "interrupt.h"
 #include "KernelHeap.h"
 #include "Keyboard.h"
+#include "Lock.h"
 #include "Logger.h"
 #include "MemoryFileSystem.h"
 #include "MultiBoot.h"
@@ -34,6 +39,10 @@
 #include "Scheduler.h"
 #include "Serial.h"
 #include "SignalManager.h"
+#include "Smp.h"
+#include "Syscall.h"
+#include "TimePage.h"
+#include "TimerWheel.h"
 
 /******************************************************************************
  ******************************************************************************/
@@ -48,16 +57,24 @@ Kernel::Kernel(void* kvs,
                void* kps,
                void* kpe,
                void* void_pdt,
-               void* tpt,
                void* mbp) :
     virtual_start{kvs},
     virtual_end{kve},
     physical_start{kps},
-    physical_end{kpe}
+    physical_end{kpe},
+    clock{nullptr},
+    smp{nullptr},
+    serial{nullptr},
+    buffers{nullptr},
+    sysenter{false}
 {
     // Set the global kernel pointer.
     global_kernel = this;
 
+    // Initialisation runs on the bootstrap processor in the kernel, so holds
+    // the kernel lock until the first process starts.
+    kernel_lock.enter();
+
     // Make a temporary serial port and system log, for use until the heap is
     // up and running.
     Serial ser {SerialAddress::com1};
@@ -73,7 +90,7 @@ Kernel::Kernel(void* kvs,
     dump_address();
 
     // Set up paging stuff.
-    default_paging(void_pdt, tpt);
+    default_paging(void_pdt);
 
     // Create a heap.
     default_heap();
@@ -101,9 +118,18 @@ Kernel::Kernel(void* kvs,
         // Create an IDT.
         default_idt();
 
+        // Set up the syscall table and fast syscall entry.
+        default_syscalls();
+
         // Set up the PIT driver and start timing.
         default_pit();
 
+        // Pick the clock for measuring time.
+        default_clock();
+
+        // Find the processors and start the others.
+        default_smp();
+
         // Set up the PS/2 controller.
         default_ps2();
 
@@ -159,6 +185,34 @@ KernelHeap* Kernel::get_heap()
 
 /******************************************************************************/
 
+Scheduler& Kernel::get_scheduler() const
+{
+    return *sched[this_cpu()];
+}
+
+/******************************************************************************/
+
+Tss& Kernel::get_tss() const
+{
+    return *tss[this_cpu()];
+}
+
+/******************************************************************************/
+
+void Kernel::load_sysenter(size_t n)
+{
+    if (!sysenter)
+        return;
+
+    // The entry takes the kernel stack from the TSS, so SYSENTER_ESP points
+    // there rather than at a stack.
+    write_msr(0x174, gdt->kernel_mode_cs().val(), 0);
+    write_msr(0x175, reinterpret_cast<uint32_t>(tss[n]->base()), 0);
+    write_msr(0x176, reinterpret_cast<uint32_t>(sysenter_entry), 0);
+}
+
+/******************************************************************************/
+
 void Kernel::panic(const char* fmt, ...)
 {
     // Write to the system log, if it exists.
@@ -206,8 +260,12 @@ void Kernel::panic(const klib::string& msg)
 
 void Kernel::shutdown()
 {
-    // TODO clean up things like disc IO. For now, we're not expecting to
-    // shutdown, so we'll panic instead.
+    // Get anything still in the buffer cache onto the disks.
+    if (buffers != nullptr && buffers->sync() != 0)
+        log->warn("Failed to write back the buffer cache\n");
+
+    // The disks are all that outlive the kernel, so that's everything cleaned
+    // up. There's no way to power off yet, so stop here.
     panic("System shutdown requested.");
 }
 
@@ -225,19 +283,24 @@ void Kernel::dump_address()
 
 /******************************************************************************/
 
-void Kernel::default_paging(void* void_pdt, void* void_tpt)
+void Kernel::default_paging(void* void_pdt)
 {
     // Set the current page descriptor table to that provided from assembly.
     pdt = static_cast<PageDescriptorTable*>(void_pdt);
     log->info("Page Descriptor Table loaded at %p\n", pdt);
 
-    // Set the location for the reserved temporary page table space.
-    PageDescriptorTable::temp_page_table = static_cast<PageTable*>(void_tpt);
-
     // Give the PDT a default allocator.
     pdt->set_allocator(PageFrameAllocator{});
     pfa_initialise(physical_start, physical_end);
 
+    // Map physical memory into kernel space. Everything from here on that
+    // needs to get at a physical page, including making Page Tables, goes
+    // through this.
+    pdt->map_physical_memory();
+    log->info("Mapped physical memory up to %X at %p\n",
+        PageDescriptorTable::phys_map_size,
+        reinterpret_cast<void*>(PageDescriptorTable::phys_map_base));
+
     // Now trim the pdt to get rid of any pages unused by the kernel.
     trim_pdt(pdt, reinterpret_cast<size_t>(virtual_end), kernel_virtual_max);
     log->info("Freed memory: end of kernel at %p, freed up to %X\n",
@@ -251,6 +314,9 @@ void Kernel::default_heap()
     // Create a heap, starting after the kernel, using the current PDT.
     heap = KernelHeap{virtual_end, pdt};
 
+    // Fill in the kernel Page Tables, so that process PDTs can share them.
+    pdt->prepare_kernel_space();
+
     log->info("Initialised kernel heap at %p, heap begins at %p\n",
         &heap, heap.get_start());
     //heap.dump_state(log->device());
@@ -283,15 +349,19 @@ void Kernel::default_gdt()
             false});
     gdt->set_user_mode_ds(gdt->size() - 1);
 
-    // Add a TSS entry. We'll leave it pointing at nothing for now, as we don't
-    // have any processes to worry about yet.
+    // Add a TSS entry for each processor there could be, as the GDT can't
+    // move once it's loaded. We'll leave them pointing at nothing for now, as
+    // we don't have any processes to worry about yet.
     GdtRegister ss {gdt->kernel_mode_ds().index(), true, false};
-    tss = new Tss {nullptr, ss};
-    log->info("TSS starts at %p, size is %X.\n", tss, Tss::tss_size);
-    gdt->push_back(
-        GdtEntry{reinterpret_cast<uint32_t>(tss->base()), Tss::tss_size, false,
-            true, true, true, true, false, false, true});
-    gdt->set_user_mode_tss(gdt->size() - 1);
+    for (size_t i = 0; i < max_cpus; ++i)
+    {
+        tss.push_back(new Tss {nullptr, ss});
+        gdt->push_back(
+            GdtEntry{reinterpret_cast<uint32_t>(tss[i]->base()), Tss::tss_size,
+                false, true, true, true, true, false, false, true});
+    }
+    log->info("TSS starts at %p, size is %X.\n", tss[0], Tss::tss_size);
+    gdt->set_user_mode_tss(gdt->size() - max_cpus);
 
     log->info("Initialised GDT at %p\n", gdt);
     log->info("GDT contains %u segment descriptors\n", gdt->size());
@@ -331,6 +401,7 @@ void Kernel::default_dev()
 
     // Add serial ports.
     devfs->add_serial();
+    serial = static_cast<Serial*>(devfs->get_device_driver("ttyS0"));
 }
 
 /******************************************************************************/
@@ -376,6 +447,9 @@ void Kernel::default_pit()
     pit = new Pit;
     log->info("Initialised PIT driver at %p\n", pit);
 
+    // Create the timer wheel it drives.
+    timers = new TimerWheel {};
+
     // Enable PIT interrupts.
     pic->set_mask(PicType::master,
         static_cast<PicMask>(~static_cast<uint8_t>(PicMask::master_pit)));
@@ -383,12 +457,65 @@ void Kernel::default_pit()
 
     log->info("System uptime clock begun\n", pic);
 
+    // Start the time page off at the real time.
+    init_time_page();
+
     if (log->stream())
         pit->dump(*log->stream());
 }
 
 /******************************************************************************/
 
+void Kernel::default_clock()
+{
+    // The TSC is far finer than the PIT, if the processor has one.
+    if (TscClock::supported())
+    {
+        TscClock* tsc = new TscClock {*pit};
+        if (tsc->usable())
+        {
+            clock = tsc;
+            log->info("TSC runs at %llu Hz%s\n", tsc->frequency(),
+                (TscClock::invariant() ? "" : ", but may vary"));
+
+            // User space can only rely on a counter that keeps a steady rate.
+            // Otherwise it makes do with the time of the last PIT tick.
+            if (TscClock::invariant())
+                publish_time_page_tsc(tsc->base_tsc(), tsc->base_ns(),
+                    tsc->multiplier(), TscClock::shift);
+        }
+        else
+        {
+            log->warn("TSC is too slow to use, at %llu Hz\n",
+                tsc->frequency());
+            delete tsc;
+        }
+    }
+
+    if (clock == nullptr)
+        clock = new PitClock {*pit};
+    log->info("Using the %s clock, with %u ns resolution\n", clock->name(),
+        clock->resolution_ns());
+}
+
+/******************************************************************************/
+
+void Kernel::default_smp()
+{
+    smp = new Smp {};
+    if (log->stream())
+        smp->dump(*log->stream());
+
+    // Device interrupts go through the I/O APIC, if there is one.
+    smp->route_isa_irqs();
+
+    smp->start_aps();
+    log->info("%u of %u processors online\n", smp->online_count(),
+        smp->cpu_count());
+}
+
+/******************************************************************************/
+
 void Kernel::default_idt()
 {
     idt = new Idt{};
@@ -400,6 +527,49 @@ void Kernel::default_idt()
 
 /******************************************************************************/
 
+void Kernel::default_syscalls()
+{
+    init_syscalls();
+
+    // Look for SYSENTER in the feature flags. Early Pentium Pros claim to have
+    // it but don't.
+    uint32_t regs[4];
+    cpuid(0, regs);
+    bool sep = false;
+    if (regs[0] >= 1)
+    {
+        cpuid(1, regs);
+        uint32_t family = (regs[0] >> 8) & 0xF;
+        uint32_t model = (regs[0] >> 4) & 0xF;
+        uint32_t stepping = regs[0] & 0xF;
+        sep = (regs[3] & 0x800) &&
+            !(family == 6 && model < 3 && stepping < 3);
+    }
+    sysenter = sep;
+    if (!sep)
+    {
+        log->info("SYSENTER not supported, syscalls use int 0x80\n");
+        return;
+    }
+
+    // SYSENTER and SYSEXIT work out the other segments from the kernel code
+    // segment, so the GDT must have them in the right order. User space picks
+    // SYSENTER from cpuid alone, so it has to work if it's there.
+    uint16_t kcs = gdt->kernel_mode_cs().val();
+    if (gdt->kernel_mode_ds().val() != kcs + 8 ||
+        gdt->user_mode_cs().val() != ((kcs + 16) | 3) ||
+        gdt->user_mode_ds().val() != ((kcs + 24) | 3))
+        panic("GDT segments are not in the order SYSENTER needs\n");
+    sysenter_user_cs = gdt->user_mode_cs().val();
+    sysenter_user_ss = gdt->user_mode_ds().val();
+
+    // The application processors do their own when they start.
+    load_sysenter(0);
+    log->info("SYSENTER enabled, entry at %p\n", sysenter_entry);
+}
+
+/******************************************************************************/
+
 void Kernel::default_ps2()
 {
     ps2 = new Ps2Controller {};
@@ -440,6 +610,11 @@ void Kernel::default_pci()
 
 void Kernel::default_ide()
 {
+    // Everything which reads or writes the drives goes through the cache.
+    buffers = new BufferCache {};
+    log->info("Buffer cache holds up to %u sectors\n",
+        BufferCache::default_max_buffers);
+
     log->info("Detecting IDE drives\n");
 
     ide_controllers = new klib::vector<IdeController>;
@@ -488,6 +663,9 @@ void Kernel::default_proc_table()
 
     // Create the signal manager.
     sig_man = new SignalManager {*proc_tab};
+
+    // Create the I/O ring table.
+    io_rings = new IoRingTable {};
 }
 
 /******************************************************************************/
@@ -523,6 +701,7 @@ void Kernel::default_root()
     }
 
     // If we didn't manage to mount anything, panic.
+    ReadGuard<VirtualFileSystem> rg {*vfs};
     if (vfs->lookup("/") == nullptr)
         panic("No root file system found.");
 }
@@ -531,7 +710,11 @@ void Kernel::default_root()
 
 void Kernel::default_scheduler()
 {
-    sched = new RoundRobin {};
+    for (size_t i = 0; i < smp->cpu_count(); ++i)
+        sched.push_back(new RoundRobin {i});
+
+    // The application processors have been waiting for their schedulers.
+    smp->start_scheduling();
 }
 
 /******************************************************************************/
@@ -542,13 +725,22 @@ void Kernel::default_enable()
     if (ps2 != nullptr)
         ps2->enable_interrupts();
 
-    // Enable all PIC interrupts.
-    if (pic != nullptr)
+    // Enable all PIC interrupts, or I/O APIC ones if it's taken over.
+    if (smp != nullptr && smp->apic_routing())
+    {
+        for (uint8_t irq = 0; irq < 16; ++irq)
+            smp->set_irq_masked(irq, false);
+    }
+    else if (pic != nullptr)
     {
         pic->set_mask(PicType::master, PicMask::enable);
         pic->set_mask(PicType::slave, PicMask::enable);
     }
 
+    // The serial port can send in the background now.
+    if (serial != nullptr)
+        serial->start_interrupts();
+
     // Enable all exceptions and software interrupts.
     enable_interrupts();
 
@@ -563,8 +755,17 @@ void Kernel::default_disable()
     if (ps2 != nullptr)
         ps2->disable_interrupts();
 
-    // Disable all PIC interrupts.
-    if (pic != nullptr)
+    // Get everything out of the serial port while it can still be sent.
+    if (serial != nullptr)
+        serial->stop_interrupts();
+
+    // Disable all PIC interrupts, or I/O APIC ones if it's taken over.
+    if (smp != nullptr && smp->apic_routing())
+    {
+        for (uint8_t irq = 0; irq < 16; ++irq)
+            smp->set_irq_masked(irq, true);
+    }
+    else if (pic != nullptr)
     {
         pic->set_mask(PicType::master, PicMask::disable);
         pic->set_mask(PicType::slave, PicMask::disable);
@@ -4,17 +4,17 @@
 
 #include "Kernel.h"
 #include "Logger.h"
+#include "ObjectCache.h"
 #include "PageDescriptorTable.h"
 
 /******************************************************************************
  ******************************************************************************/
 
-KernelHeap::KernelHeap(void* s, PageDescriptorTable* p) : pdt{p}
+KernelHeap::KernelHeap(void* s, PageDescriptorTable* p) :
+    pdt{p},
+    free_lists{},
+    bin_map{0}
 {
-    // Set the block data size as heap_align aligned.
-    data_size = (((sizeof(BlockData) - 1) >> heap_align_power) + 1) <<
-        heap_align_power;
-
     // Put the heap into an empty state in case we have to call malloc to
     // add a new page table.
     start = nullptr;
@@ -27,9 +27,8 @@ KernelHeap::KernelHeap(void* s, PageDescriptorTable* p) : pdt{p}
     size_t v_addr = (reinterpret_cast<size_t>(s) >> 12) << 12;
 
     // Cycle upwards in pages until we find one that is free. Make sure that one
-    // gets a virtual mapping. This allocate gets really complicated if it needs
-    // to make a new Page Table, but that's dealt with in
-    // PageDescriptorTable::new_page_table.
+    // gets a virtual mapping. Any new Page Table is made in the direct map of
+    // physical memory, so this doesn't need the heap.
     uint32_t conf = static_cast<uint32_t>(PdeSettings::present) |
         static_cast<uint32_t>(PdeSettings::writable);
     while (!(pdt->allocate(reinterpret_cast<void*>(v_addr), conf)))
@@ -41,8 +40,7 @@ KernelHeap::KernelHeap(void* s, PageDescriptorTable* p) : pdt{p}
                 "No memory available to initialise kernel heap");
     }
 
-    // Initialise a BlockData, if it wasn't already done by adding a new page
-    // table.
+    // Initialise a BlockData.
     initialise(reinterpret_cast<void*>(v_addr));
 }
 
@@ -53,7 +51,8 @@ KernelHeap::KernelHeap() :
     last{nullptr},
     next_page_addr{nullptr},
     pdt{nullptr},
-    data_size{0}
+    free_lists{},
+    bin_map{0}
 {}
     
 
@@ -83,33 +82,74 @@ void KernelHeap::dump(klib::ostream& dest)
     dest << "Dumping heap state\n";
     dest << "Start of heap at " << start << "; end of heap at " << last;
     dest << "\n";
-    dest << "Size of metadata is " << data_size << " bytes\n";
+    dest << "Size of metadata is " << data_size + footer_size << " bytes\n";
+
+    size_t used_bytes = 0;
+    size_t used_blocks = 0;
+    size_t free_bytes = 0;
+    size_t free_blocks = 0;
+    size_t largest = 0;
 
     BlockData* current = start;
-    for (size_t i = 0; current != nullptr; ++i)
+    for (size_t i = 0; current != nullptr && current != last; ++i)
     {
         dest << "Block number " << i << ": location " << current;
         dest << ", size " << current->size << " bytes";
         dest << ", free " << current->free;
-        dest << ", next " << current->next;
         if (current->magic != 0)
             dest << ", magic " << current->magic;
         dest << "\n";
 
-        if (current->next != nullptr &&
-            static_cast<size_t>((current->next - current)*sizeof(BlockData)) != 
-            current->size + data_size)
+        // The footer should match the header, and the block can't be smaller
+        // than the minimum.
+        size_t footer = *reinterpret_cast<size_t*>(
+            reinterpret_cast<size_t>(current) + current->size - footer_size);
+        if (current->size < min_block || footer != current->size)
+        {
+            dest << "HEAP CORRUPTION: size in header is " << current->size;
+            dest << " but size in footer is " << footer << "\n";
+            break;
+        }
+
+        if (current->free)
         {
-            dest << "HEAP CORRUPTION: space for block is ";
-            dest << static_cast<size_t>((current->next - current) *
-                sizeof(BlockData))  << " but size (incl metadata) is ";
-            dest << current->size + data_size << "\n";
+            free_bytes += current->size;
+            ++free_blocks;
+            if (current->size > largest)
+                largest = current->size;
+        }
+        else
+        {
+            used_bytes += current->size;
+            ++used_blocks;
         }
 
-        current = current->next;
+        current = reinterpret_cast<BlockData*>(
+            reinterpret_cast<size_t>(current) + current->size);
     }
 
-    dest.flush();
+    // Summary. Fragmentation is the percentage of free memory that isn't in
+    // the largest free block, so can't be used for the largest allocations.
+    dest << "Used " << used_bytes << " bytes in " << used_blocks;
+    dest << " blocks\n";
+    dest << "Free " << free_bytes << " bytes in " << free_blocks;
+    dest << " blocks, largest free block " << largest << " bytes\n";
+    size_t frag = (free_bytes < 100 ? 0 :
+        (free_bytes - largest) / (free_bytes / 100));
+    dest << "Fragmentation " << frag << "%\n";
+    dest << "Free blocks by size class:";
+    for (size_t i = 0; i < bins; ++i)
+    {
+        size_t n = 0;
+        for (BlockData* b = free_lists[i]; b != nullptr; b = b->next_free)
+            ++n;
+        if (n != 0)
+            dest << " " << (min_block << i) << "+: " << n;
+    }
+    dest << "\n";
+
+    // Small allocations live in the object caches.
+    ObjectCache::dump_all(dest);
 }
 
 /******************************************************************************/
@@ -119,6 +159,13 @@ void KernelHeap::free(void* addr)
     if (addr == nullptr)
         return;
 
+    // Small allocations go back to the object cache they came from.
+    if (ObjectCache::owns(addr))
+    {
+        ObjectCache::release(addr);
+        return;
+    }
+
     // If the pointer given is not to something that was malloced/calloced/
     // realloced, the static_cast will get us in trouble. Fortunately, the
     // C standard says free only has to work for previously allocated memory, so
@@ -127,17 +174,10 @@ void KernelHeap::free(void* addr)
     // actual value.
     BlockData* current = reinterpret_cast<BlockData*>(
         reinterpret_cast<size_t>(addr) - data_size);
-    current->free = true;
-    current->magic = 0;
 
-    // Let's see if we can merge with the block after. Checking the block
-    // before is prohibitively slow unless we change BlockData to be a doubly-
-    // linked list. Don't merge with the last BlockData.
-    while (current->next->free && current->next->next != nullptr)
-    {
-        current->size += data_size + current->next->size;
-        current->next = current->next->next;
-    }
+    // Merge with the blocks either side if they're free, and put the result
+    // back on a free list.
+    coalesce(current);
 }
 
 /******************************************************************************/
@@ -152,19 +192,28 @@ void KernelHeap::initialise(void* virt_addr)
     size_t v_addr = (((reinterpret_cast<size_t>(virt_addr) - 1) >> 
         heap_align_power) + 1) << heap_align_power;
 
-    // Set up start and last block.
+    // The start block is permanently allocated, so the first real block
+    // always has a previous block to look at when coalescing.
     start = reinterpret_cast<BlockData*>(v_addr);
-    start->size = 0;
-    start->next = nullptr;
-    start->free = true;
+    start->free = false;
     start->magic = 0;
-    last = start;
+    set_size(start, min_block);
+
+    // The end block has no size and is permanently allocated, so it's never
+    // merged.
+    last = reinterpret_cast<BlockData*>(v_addr + min_block);
+    last->size = 0;
+    last->free = false;
+    last->magic = 0;
 
     // Set up the next page address. Assumes that only the current page is
     // allocated.
     v_addr = (v_addr >> 12) << 12;
     next_page_addr = 
         reinterpret_cast<void*>(v_addr + PageDescriptorTable::page_size);
+
+    // Make the rest of the page into a free block.
+    extend(0);
 }
 
 /******************************************************************************/
@@ -175,18 +224,67 @@ void* KernelHeap::malloc(size_t size, size_t align, size_t magic)
     if (size <= 0)
         return nullptr;
 
-    // Align size to heap_align bytes.
-    size = (((size - 1) >> heap_align_power) + 1) << heap_align_power;
+    // Small allocations that don't need special alignment come from the
+    // object caches, which is much quicker than walking the heap. Fall back to
+    // the heap if the caches can't get any memory.
+    if (size <= ObjectCache::max_object_size && align <= ObjectCache::align)
+    {
+        void* result = ObjectCache::allocate_size(size);
+        if (result != nullptr)
+            return result;
+    }
+
+    // Work out the block size needed, including metadata, aligned to
+    // heap_align bytes.
+    size = (((size + data_size + footer_size - 1) >> heap_align_power) + 1) <<
+        heap_align_power;
+    if (size < min_block)
+        size = min_block;
+
+    // For extra alignment, look for a block big enough that we can cut off
+    // the start to get the alignment. The start has to be big enough to be a
+    // block itself.
+    if (align < heap_align)
+        align = heap_align;
+    size_t search = (align > heap_align ? size + align + min_block : size);
 
-    BlockData* result = find_free_block(size, align);
+    BlockData* result = find_free_block(search);
+    if (result == nullptr)
+    {
+        // No exisiting blocks large enough, make more space.
+        extend(search);
+        result = find_free_block(search);
+        if (result == nullptr)
+            return nullptr;
+    }
+
+    if (align > heap_align)
+    {
+        // Find the first aligned address that leaves enough space for a
+        // block before it.
+        size_t s = reinterpret_cast<size_t>(result) + data_size;
+        size_t as = (s + align - 1) & ~(align - 1);
+        if (as != s && as - s < min_block)
+            as += align;
+
+        if (as != s)
+        {
+            // Split off the start into a free block. The block before it is
+            // allocated, else we'd have coalesced with it, so no need to merge.
+            BlockData* aligned = reinterpret_cast<BlockData*>(as - data_size);
+            set_size(aligned, result->size - (as - s));
+            set_size(result, as - s);
+            result->magic = 0;
+            bin_insert(result);
+            result = aligned;
+        }
+    }
 
-    if (result == last)
-        // No exisiting blocks large enough, create a new one.
-        result = new_block(size, align);
+    // Give any spare space at the end back.
+    split(result, size);
 
-    // Set the magic number.
-    if (result != nullptr)
-        result->magic = magic;
+    result->free = false;
+    result->magic = magic;
 
     // Return a pointer to the space, not the metadata.
     return
@@ -195,207 +293,132 @@ void* KernelHeap::malloc(size_t size, size_t align, size_t magic)
 
 /******************************************************************************/
 
-KernelHeap::BlockData* KernelHeap::find_free_block(size_t size, size_t align)
+size_t KernelHeap::bin_index(size_t size)
 {
-    // Start from the beginning of the heap.
-    BlockData* current = start;
+    size_t n = 31 - __builtin_clz(size / min_block);
+    return (n < bins ? n : bins - 1);
+}
 
-    // Iterate through the heap. Simple if we don't have to worry about
-    // alignment.
-    if (align == 0)
-    {
-        while (current->next != nullptr && (size > current->size ||
-            !current->free))
-            current = current->next;
-    }
+/******************************************************************************/
+
+void KernelHeap::bin_insert(BlockData* b)
+{
+    size_t n = bin_index(b->size);
+
+    b->free = true;
+    b->prev_free = nullptr;
+    b->next_free = free_lists[n];
+    if (free_lists[n] != nullptr)
+        free_lists[n]->prev_free = b;
+    free_lists[n] = b;
+    bin_map |= (1 << n);
+}
+
+/******************************************************************************/
+
+void KernelHeap::bin_remove(BlockData* b)
+{
+    size_t n = bin_index(b->size);
+
+    if (b->prev_free != nullptr)
+        b->prev_free->next_free = b->next_free;
     else
+        free_lists[n] = b->next_free;
+    if (b->next_free != nullptr)
+        b->next_free->prev_free = b->prev_free;
+
+    if (free_lists[n] == nullptr)
+        bin_map &= ~(1 << n);
+}
+
+/******************************************************************************/
+
+void KernelHeap::coalesce(BlockData* b)
+{
+    // Merge with the next block. The end block is never free, so this stops
+    // there.
+    BlockData* next = reinterpret_cast<BlockData*>(
+        reinterpret_cast<size_t>(b) + b->size);
+    if (next->free)
     {
-        // We can only align to powers of 2. Find which power.
-        size_t power = 0;
-        while (align >>= 1)
-            ++power;
-
-        // Increase the power if the requested alignment is less than
-        // heap_align.
-        power = (heap_align_power > power ? heap_align_power : power);
-
-        // More complicated iteration as we have to check the size after
-        // alignment.
-        BlockData* prev = nullptr;
-        while (current->next != nullptr)
-        {
-            // Easy continue if not free or the total size is too small.
-            if (!current->free || size > current->size)
-            {
-                prev = current;
-                current = current->next;
-                continue;
-            }
-
-            // Round the start of the data up to the specified alignment.
-            size_t s = reinterpret_cast<size_t>(current) + data_size;
-            size_t as = (((s - 1) >> power) + 1) << power;
-            // Get the end.
-            size_t e = reinterpret_cast<size_t>(current) + data_size +
-                current->size;
-            // Check the aligned size.
-
-            if (size <= e - as)
-            {
-                // Check if there's enough space to split the start off the
-                // block.
-                if (as == s) ;
-                    // Block is already aligned, skip.
-                else if (as - s >= data_size + heap_align)
-                {
-                    // Enough space. Split off the start into a new block.
-                    prev = current;
-                    prev->size = as - s - data_size;
-                    prev->free = true;
-                    prev->magic = 0;
-                    current = reinterpret_cast<BlockData*>(as - data_size);
-                    current->next = prev->next;
-                    prev->next = current;
-                    current->size = e - as;
-                    current->magic = 0;
-                }
-                else
-                {
-                    // Not enough space. Move up the current block up.
-                    BlockData temp = *current;
-                    current = reinterpret_cast<BlockData*>(as - data_size);
-                    current->next = temp.next;
-                    current->size = temp.size - (as - s);
-                    if (prev != nullptr)
-                    {
-                        // Expand the previous block.
-                        prev->next = current;
-                        prev->size += (as - s);
-                    }
-                    else
-                        // We were at the start of the heap and we moved up. We
-                        // lose max heap_align bytes from the start of the heap.
-                        // Oh no.
-                        start = current;
-                }
-                break;
-            }
-            else
-            {
-                // Not enough space after alignment.
-                prev = current;
-                current = current->next;
-            }
-        }
+        bin_remove(next);
+        set_size(b, b->size + next->size);
     }
 
-    // Check whether there's enough space at the end of the block to split off.
-    if (current->next != nullptr &&
-        current->size >= size + data_size + heap_align)
+    // Merge with the previous block, found from its footer. The start block
+    // is never free, so this stops there.
+    BlockData* prev = previous(b);
+    if (prev->free)
     {
-        BlockData* nb = reinterpret_cast<BlockData*>(
-            reinterpret_cast<size_t>(current) + size + data_size);
-        nb->free = true;
-        nb->size = current->size - size - data_size;
-        nb->next = current->next;
-        nb->magic = 0;
-        current->size = size;
-        current->next = nb;
+        bin_remove(prev);
+        set_size(prev, prev->size + b->size);
+        b = prev;
     }
 
-    if (current->next != nullptr)
-        current->free = false;
-
-    return current;
+    b->magic = 0;
+    bin_insert(b);
 }
 
 /******************************************************************************/
 
-KernelHeap::BlockData* KernelHeap::new_block(size_t size, size_t align)
+void KernelHeap::extend(size_t size)
 {
-    // Allocate new pages if required. We could reduce this a bit if we worked
-    // out the proper alignment size, rather than using the maximum possible,
-    // but that's only an issue if we're almost out of pages, in which case we'd
-    // probably hit trouble soon anyway.
-    while((reinterpret_cast<size_t>(last) + data_size + size + align) >=
-        reinterpret_cast<size_t>(next_page_addr))
+    // If there's already a free block at the end, it'll be merged with the
+    // new space, so we only need to make up the difference.
+    BlockData* top = previous(last);
+    size_t have = (top->free ? top->size : 0);
+    size_t need = (size > have ? size - have : 0);
+    if (need < min_block)
+        need = min_block;
+
+    // Allocate new pages until there's room for the new space and a new end
+    // block.
+    while (reinterpret_cast<size_t>(next_page_addr) -
+        reinterpret_cast<size_t>(last) < need + data_size)
     {
         next_page();
     }
 
-    if (align != 0)
+    // The old end block becomes the new space, and there's a new end block
+    // at the top of the last page.
+    BlockData* b = last;
+    last = reinterpret_cast<BlockData*>(
+        reinterpret_cast<size_t>(next_page_addr) - data_size);
+    last->size = 0;
+    last->free = false;
+    last->magic = 0;
+
+    set_size(b, reinterpret_cast<size_t>(last) - reinterpret_cast<size_t>(b));
+    coalesce(b);
+}
+
+/******************************************************************************/
+
+KernelHeap::BlockData* KernelHeap::find_free_block(size_t size)
+{
+    // Blocks in the size class that fits might still be too small, so check
+    // them individually.
+    size_t n = bin_index(size);
+    for (BlockData* b = free_lists[n]; b != nullptr; b = b->next_free)
     {
-        // We need to make sure the space is aligned as specified. We can only
-        // align to powers of 2. Get the power.
-        size_t power = 0;
-        while (align >>= 1)
-            ++power;
-
-        // Increase the power if the requested alignment is less than
-        // heap_align.
-        power = (heap_align_power > power ? heap_align_power : power);
-
-        // Get where we need the space to start.
-        size_t ls = reinterpret_cast<size_t>(last) + data_size;
-        size_t as = (((ls - 1) >> power) + 1) << power;
-
-        // Check whether there's enough space for a new block.
-        if (as - data_size - ls >= data_size + heap_align)
+        if (b->size >= size)
         {
-            // There's enough space. Make a new block.
-            BlockData* nl = reinterpret_cast<BlockData*>(as - data_size);
-            last->next = nl;
-            last->free = true;
-            last->size = as - data_size - ls;
-            last = nl;
-            last->next = nullptr;
-            last->free = true;
-            last->size = 0;
-        }
-        else
-        {
-            // Not enough space. Shift up the start of the current last block.
-            BlockData* prev_last = last;
-            last = reinterpret_cast<BlockData*>(as - data_size);
-            last->free = true;
-            last->next = nullptr;
-            last->size = 0;
-
-            // We need to find the previous block to move its next pointer.
-            // Slow, but this is an edge case.
-            if (start == prev_last)
-            {
-                // There are no blocks. Shift up the start of the heap. Lose
-                // heap_align bytes maximum. Oh no.
-                start = last;
-            }
-            else
-            {
-                // Adjust the next pointer and size of the second last block.
-                BlockData* prev = start;
-                while (prev->next != prev_last)
-                    prev = prev->next;
-                prev->next = last;
-                prev->size = reinterpret_cast<size_t>(last) -
-                    reinterpret_cast<size_t>(prev) - data_size;
-            }
+            bin_remove(b);
+            b->free = false;
+            return b;
         }
     }
 
-    // Change last to reflect the new block.
-    last->size = size;
-    last->free = false;
-    BlockData* prev_last = last;
-
-    // Create a new empty last.
-    last = reinterpret_cast<BlockData*>(reinterpret_cast<size_t>(last) + size
-        + data_size);
-    last->size = 0;
-    last->free = true;
-    last->next = nullptr;
-    prev_last->next = last;
+    // Anything in a higher size class is big enough. Take the first block of
+    // the smallest one.
+    uint32_t higher = bin_map & ~((2u << n) - 1);
+    if (higher == 0)
+        return nullptr;
 
-    return prev_last;
+    BlockData* b = free_lists[__builtin_ctz(higher)];
+    bin_remove(b);
+    b->free = false;
+    return b;
 }
 
 /******************************************************************************/
@@ -424,5 +447,42 @@ void KernelHeap::next_page()
     }
 }
 
+/******************************************************************************/
+
+KernelHeap::BlockData* KernelHeap::previous(BlockData* b)
+{
+    size_t prev_size = *reinterpret_cast<size_t*>(
+        reinterpret_cast<size_t>(b) - footer_size);
+    return reinterpret_cast<BlockData*>(
+        reinterpret_cast<size_t>(b) - prev_size);
+}
+
+/******************************************************************************/
+
+void KernelHeap::set_size(BlockData* b, size_t size)
+{
+    b->size = size;
+    *reinterpret_cast<size_t*>(reinterpret_cast<size_t>(b) + size -
+        footer_size) = size;
+}
+
+/******************************************************************************/
+
+void KernelHeap::split(BlockData* b, size_t size)
+{
+    // Only split if the leftover can be a block on its own.
+    if (b->size - size < min_block)
+        return;
+
+    // The block after is allocated, else it would have been coalesced, so
+    // the leftover can go straight onto a free list.
+    BlockData* rest = reinterpret_cast<BlockData*>(
+        reinterpret_cast<size_t>(b) + size);
+    set_size(rest, b->size - size);
+    set_size(b, size);
+    rest->magic = 0;
+    bin_insert(rest);
+}
+
 /******************************************************************************
  ******************************************************************************/
@@ -0,0 +1,304 @@
+#include "Lock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupt.h"
+#include "Kernel.h"
+#include "Process.h"
+#include "ProcTable.h"
+#include "Scheduler.h"
+#include "SignalManager.h"
+#include "Smp.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+// Gets the running process, or nullptr if there isn't one, such as during
+// initialisation or in the idle task.
+static Process* current_process()
+{
+    if (switch_blocked_for_init)
+        return nullptr;
+
+    size_t pid = global_kernel->get_scheduler().get_last();
+    return (pid == 0 ?
+        nullptr : global_kernel->get_proc_table().get_process(pid));
+}
+
+// Waiter for a sleeping process.
+struct mutex_waiter : Waiter {
+    explicit mutex_waiter(void (*f)(Waiter&, PollType), Process* p) :
+        Waiter{f}, proc{p} {}
+    Process* proc;
+};
+
+/******************************************************************************
+ ******************************************************************************/
+
+void Spinlock::lock()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    while (flag.test_and_set(klib::memory_order_acquire))
+        cpu_relax();
+
+    irq_enabled = enabled;
+}
+
+/******************************************************************************/
+
+bool Spinlock::try_lock()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    if (flag.test_and_set(klib::memory_order_acquire))
+    {
+        if (enabled)
+            enable_interrupts();
+        return false;
+    }
+
+    irq_enabled = enabled;
+    return true;
+}
+
+/******************************************************************************/
+
+void Spinlock::unlock()
+{
+    bool enabled = irq_enabled;
+    flag.clear(klib::memory_order_release);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+void TicketLock::lock()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    uint32_t ticket = next.fetch_add(1, klib::memory_order_relaxed);
+    while (serving.load(klib::memory_order_acquire) != ticket)
+        cpu_relax();
+
+    irq_enabled = enabled;
+}
+
+/******************************************************************************/
+
+bool TicketLock::try_lock()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    // Only take a ticket if it would be called straight away.
+    uint32_t ticket = serving.load(klib::memory_order_acquire);
+    uint32_t expected = ticket;
+    if (!next.compare_exchange_strong(expected, ticket + 1,
+        klib::memory_order_acquire, klib::memory_order_relaxed))
+    {
+        if (enabled)
+            enable_interrupts();
+        return false;
+    }
+
+    irq_enabled = enabled;
+    return true;
+}
+
+/******************************************************************************/
+
+void TicketLock::unlock()
+{
+    bool enabled = irq_enabled;
+    serving.fetch_add(1, klib::memory_order_release);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+bool RwLock::read_lock()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    while (true)
+    {
+        uint32_t s = state.load(klib::memory_order_relaxed);
+        if (!(s & writer) && state.compare_exchange_weak(s, s + 1,
+            klib::memory_order_acquire, klib::memory_order_relaxed))
+            return enabled;
+        cpu_relax();
+    }
+}
+
+/******************************************************************************/
+
+void RwLock::read_unlock(bool enabled)
+{
+    state.fetch_sub(1, klib::memory_order_release);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void RwLock::write_lock()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    // Claim the writer bit, which stops any more readers, then wait for the
+    // ones already in to leave.
+    while (state.fetch_or(writer, klib::memory_order_acquire) & writer)
+        cpu_relax();
+    while (state.load(klib::memory_order_acquire) != writer)
+        cpu_relax();
+
+    irq_enabled = enabled;
+}
+
+/******************************************************************************/
+
+void RwLock::write_unlock()
+{
+    bool enabled = irq_enabled;
+    state.fetch_and(~writer, klib::memory_order_release);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+KernelLock kernel_lock;
+
+/******************************************************************************
+ ******************************************************************************/
+
+bool KernelLock::enter()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    // Nothing else can take it for this processor while interrupts are off, so
+    // the owner can't change under us if it's us.
+    size_t cpu = this_cpu();
+    bool taken = owner.load(klib::memory_order_relaxed) != cpu;
+    if (taken)
+    {
+        lk.lock();
+        owner.store(cpu, klib::memory_order_relaxed);
+    }
+
+    if (enabled)
+        enable_interrupts();
+    return taken;
+}
+
+/******************************************************************************/
+
+void KernelLock::leave()
+{
+    owner.store(none, klib::memory_order_relaxed);
+    lk.unlock();
+}
+
+/******************************************************************************/
+
+void leave_kernel_lock()
+{
+    kernel_lock.leave();
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+void Mutex::lock()
+{
+    Process* p = current_process();
+
+    while (true)
+    {
+        guard.lock();
+        if (!locked)
+        {
+            locked = true;
+            owner = (p == nullptr ? 0 : p->get_pid());
+            guard.unlock();
+            return;
+        }
+
+        // With no process to put to sleep, all we can do is wait.
+        if (p == nullptr)
+        {
+            guard.unlock();
+            cpu_relax();
+            continue;
+        }
+
+        // Queue up and go to sleep. The guard is held with interrupts off
+        // until the status is set, so the unlock can't slip in between and
+        // be missed.
+        mutex_waiter w {wake, p};
+        waiters.add(w);
+        p->set_status(ProcStatus::sleeping);
+        guard.unlock();
+        global_kernel->get_scheduler().yield();
+        waiters.remove(w);
+    }
+}
+
+/******************************************************************************/
+
+bool Mutex::try_lock()
+{
+    guard.lock();
+    bool taken = !locked;
+    if (taken)
+    {
+        Process* p = current_process();
+        locked = true;
+        owner = (p == nullptr ? 0 : p->get_pid());
+    }
+    guard.unlock();
+
+    return taken;
+}
+
+/******************************************************************************/
+
+void Mutex::unlock()
+{
+    // Everything waiting gets woken and tries again. Whoever the scheduler
+    // runs first gets the mutex.
+    guard.lock();
+    locked = false;
+    owner = 0;
+    waiters.wake(PollType::pollnone);
+    guard.unlock();
+}
+
+/******************************************************************************/
+
+void Mutex::wake(Waiter& w, PollType)
+{
+    mutex_waiter& mw = static_cast<mutex_waiter&>(w);
+    if (mw.proc->get_status() == ProcStatus::sleeping)
+        mw.proc->set_status(ProcStatus::runnable);
+}
+
+/******************************************************************************
+ ******************************************************************************/
@@ -6,12 +6,13 @@
 #include <ostream>
 #include <string>
 
+#include "Clock.h"
 #include "Device.h"
 #include "Kernel.h"
 #include "no_heap_util.h"
 #include "Pit.h"
 
-static constexpr const char* null_time = "[0:00:00.00]";
+static constexpr const char* null_time = "[0:00:00.000000]";
 
 /******************************************************************************
  ******************************************************************************/
@@ -165,14 +166,21 @@ void Logger::vwrite(const char* fmt, va_list arg)
 
 klib::string Logger::time()
 {
-    if (global_kernel->get_pit() == nullptr)
+    // Use the PIT until a clock has been picked.
+    uint64_t ns;
+    if (global_kernel->get_clock() != nullptr)
+        ns = global_kernel->get_clock()->now_ns();
+    else if (global_kernel->get_pit() != nullptr)
+        ns = global_kernel->get_pit()->time_ns();
+    else
         return null_time;
 
-    unsigned int ms = global_kernel->get_pit()->time();
-    unsigned int cs = (ms % 1000) / 10;
-    unsigned int sec = (ms / 1000) % 60;
-    unsigned int min = (ms / (1000 * 60)) % 60;
-    unsigned int hour = ms / (1000 * 60 * 60);
+    uint64_t us = ns / 1000;
+    unsigned int us_part = us % 1000000;
+    unsigned int secs = us / 1000000;
+    unsigned int sec = secs % 60;
+    unsigned int min = (secs / 60) % 60;
+    unsigned int hour = secs / (60 * 60);
 
     klib::string ret_val = "[";
     klib::string tmp;
@@ -189,8 +197,8 @@ klib::string Logger::time()
         tmp = '0' + tmp;
     ret_val += tmp + '.';
 
-    klib::helper::strprintf(tmp, "%u", cs);
-    if (tmp.size() == 1)
+    klib::helper::strprintf(tmp, "%u", us_part);
+    while (tmp.size() < 6)
         tmp = '0' + tmp;
     ret_val += tmp + ']';
 
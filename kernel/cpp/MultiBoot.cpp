@@ -680,18 +680,23 @@ MultiBootInfo::MultiBootInfo(const void* phys_start) : val{true}
             }
             // Open the location as a file.
             MemoryFileSystem* tmpfs;
-            try {
-                tmpfs = dynamic_cast<MemoryFileSystem*>(
-                    global_kernel->get_vfs()->lookup("/tmp"));
-            }
-            catch (klib::bad_cast&)
+            VirtualFileSystem* vfs = global_kernel->get_vfs();
+            klib::string fname {"/kernel_section_table"};
+            klib::ifstream ifs {};
             {
-                global_kernel->syslog()->warn("MultiBootInfo() Couldn't access tmpfs\n");
-                return;
+                ReadGuard<VirtualFileSystem> rg {*vfs};
+                try {
+                    tmpfs = dynamic_cast<MemoryFileSystem*>(
+                        vfs->lookup("/tmp"));
+                }
+                catch (klib::bad_cast&)
+                {
+                    global_kernel->syslog()->warn("MultiBootInfo() Couldn't access tmpfs\n");
+                    return;
+                }
+                tmpfs->create_mapping(fname, virt_addr, num * entsize);
+                ifs.open("/tmp" + fname);
             }
-            klib::string fname {"/kernel_section_table"};
-            tmpfs->create_mapping(fname, virt_addr, num * entsize);
-            klib::ifstream ifs {"/tmp" + fname};
 
             elf = ElfSectionTab {ifs, static_cast<uint16_t>(entsize),
                 static_cast<uint16_t>(num), static_cast<uint16_t>(ndx)};
@@ -0,0 +1,236 @@
+#include "ObjectCache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <ostream>
+#include <string>
+
+#include "PageDescriptorTable.h"
+#include "PageFrameAllocator.h"
+
+// General purpose caches, one for each power of two up to max_object_size.
+// These are constant initialised, so are ready before the heap exists.
+static ObjectCache size_caches[] = {
+    {"size-16", 16},
+    {"size-32", 32},
+    {"size-64", 64},
+    {"size-128", 128},
+    {"size-256", 256},
+    {"size-512", 512}
+};
+
+ObjectCache* ObjectCache::first_cache = nullptr;
+
+/******************************************************************************
+ ******************************************************************************/
+
+void* ObjectCache::allocate()
+{
+    // Prefer a partially used slab, then an empty one, then a new one.
+    Slab* s = partial;
+    if (s == nullptr)
+    {
+        s = (empty != nullptr ? empty : grow());
+        if (s == nullptr)
+            return nullptr;
+        unlink(empty, s);
+        push(partial, s);
+    }
+
+    // Take the first free object.
+    void* obj = s->free_list;
+    s->free_list = *static_cast<void**>(obj);
+    ++s->in_use;
+    if (s->in_use == per_slab)
+    {
+        unlink(partial, s);
+        push(full, s);
+    }
+
+    ++in_use;
+    ++allocs;
+
+    if (ctor != nullptr)
+        ctor(obj);
+
+    return obj;
+}
+
+/******************************************************************************/
+
+void ObjectCache::dump(klib::ostream& dest) const
+{
+    dest << cache_name << ": " << obj_size << " byte objects, " << in_use;
+    dest << " of " << objects_total() << " in use, " << slabs << " slabs, ";
+    dest << allocs << " allocations\n";
+}
+
+/******************************************************************************/
+
+void ObjectCache::free(void* obj)
+{
+    if (obj == nullptr)
+        return;
+
+    // Put the object back on its slab's free list.
+    Slab* s = slab_of(obj);
+    *static_cast<void**>(obj) = s->free_list;
+    s->free_list = obj;
+    --in_use;
+
+    // Move the slab to the right list.
+    if (s->in_use-- == per_slab)
+    {
+        unlink(full, s);
+        push(partial, s);
+    }
+    if (s->in_use == 0)
+    {
+        unlink(partial, s);
+        if (empty == nullptr)
+            push(empty, s);
+        else
+        {
+            // Already have a spare slab, so give the memory back.
+            s->magic = 0;
+            PageFrameAllocator{}.free(virt_to_phys(s));
+            --slabs;
+        }
+    }
+}
+
+/******************************************************************************/
+
+void* ObjectCache::allocate_size(size_t sz)
+{
+    for (ObjectCache& c : size_caches)
+    {
+        if (sz <= c.obj_size)
+            return c.allocate();
+    }
+
+    return nullptr;
+}
+
+/******************************************************************************/
+
+void ObjectCache::dump_all(klib::ostream& dest)
+{
+    dest << "Dumping object caches\n";
+    for (ObjectCache* c = first_cache; c != nullptr; c = c->next_cache)
+        c->dump(dest);
+    dest.flush();
+}
+
+/******************************************************************************/
+
+bool ObjectCache::owns(const void* ptr)
+{
+    // Slabs are only ever in the direct map, and every page there is mapped,
+    // so the start of the page can be read safely. Other memory from the Page
+    // Frame Allocator is in the direct map too, so check it's really a slab.
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    if (addr < PageDescriptorTable::phys_map_base ||
+        addr - PageDescriptorTable::phys_map_base >=
+        PageDescriptorTable::phys_map_size)
+        return false;
+
+    const Slab* s = slab_of(ptr);
+    if (s->magic != slab_magic)
+        return false;
+
+    // The magic number could turn up by chance, so the cache must be a real
+    // one, and the address must be one of its objects.
+    ObjectCache* c = first_cache;
+    while (c != nullptr && c != s->cache)
+        c = c->next_cache;
+    if (c == nullptr)
+        return false;
+
+    uintptr_t off = addr - reinterpret_cast<uintptr_t>(s);
+    return off >= header_size && (off - header_size) % c->obj_size == 0 &&
+        (off - header_size) / c->obj_size < c->per_slab;
+}
+
+/******************************************************************************/
+
+void ObjectCache::release(void* obj)
+{
+    if (obj == nullptr)
+        return;
+
+    slab_of(obj)->cache->free(obj);
+}
+
+/******************************************************************************/
+
+ObjectCache::Slab* ObjectCache::grow()
+{
+    // Get a page we can access through the direct map.
+    void* phys = PageFrameAllocator{}.allocate_below(
+        reinterpret_cast<void*>(PageDescriptorTable::phys_map_size));
+    if (phys == nullptr)
+        return nullptr;
+    Slab* s = new (phys_to_virt(phys)) Slab{};
+    s->cache = this;
+    s->magic = slab_magic;
+
+    // Thread all the objects onto the free list, in address order.
+    char* base = reinterpret_cast<char*>(s) + header_size;
+    for (size_t i = per_slab; i > 0; --i)
+    {
+        void* obj = base + (i - 1) * obj_size;
+        *static_cast<void**>(obj) = s->free_list;
+        s->free_list = obj;
+    }
+
+    // Add to the list of all caches the first time round.
+    if (!registered)
+    {
+        next_cache = first_cache;
+        first_cache = this;
+        registered = true;
+    }
+
+    ++slabs;
+    push(empty, s);
+    return s;
+}
+
+/******************************************************************************/
+
+ObjectCache::Slab* ObjectCache::slab_of(const void* obj)
+{
+    return reinterpret_cast<Slab*>(
+        reinterpret_cast<uintptr_t>(obj) & ~(page_size - 1));
+}
+
+/******************************************************************************/
+
+void ObjectCache::unlink(Slab*& list, Slab* s)
+{
+    if (s->prev != nullptr)
+        s->prev->next = s->next;
+    else
+        list = s->next;
+    if (s->next != nullptr)
+        s->next->prev = s->prev;
+    s->prev = nullptr;
+    s->next = nullptr;
+}
+
+/******************************************************************************/
+
+void ObjectCache::push(Slab*& list, Slab* s)
+{
+    s->prev = nullptr;
+    s->next = list;
+    if (list != nullptr)
+        list->prev = s;
+    list = s;
+}
+
+/******************************************************************************
+ ******************************************************************************/
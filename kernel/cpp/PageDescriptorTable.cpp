@@ -6,10 +6,12 @@
 #include <string>
 
 #include "Kernel.h"
-#include "KernelHeap.h"
 #include "Logger.h"
 #include "paging.h"
 
+void* PageDescriptorTable::zero_page = nullptr;
+void* PageDescriptorTable::time_page = nullptr;
+
 /******************************************************************************
  ******************************************************************************/
 
@@ -160,6 +162,10 @@ bool PageDescriptorTable::allocate(const void* virt_addr,
         return false;
 
     size_t v_addr = reinterpret_cast<size_t>(virt_addr);
+
+    // Kernel mappings are the same in every PDT, so they can be global.
+    if (v_addr >= kernel_virtual_base)
+        conf |= static_cast<uint32_t>(PdeSettings::global);
     bool success = false;
 
     if (conf & static_cast<uint32_t>(PdeSettings::large))
@@ -186,7 +192,7 @@ bool PageDescriptorTable::allocate(const void* virt_addr,
         size_t pdt_index = v_addr >> 22;
 
         // Set the entry.
-        entries[pdt_index] = reinterpret_cast<uint32_t>(p_addr) & conf;
+        entries[pdt_index] = reinterpret_cast<uint32_t>(p_addr) | conf;
 
         // Invalidate the pages in the TLB.
         v_addr = (v_addr >> 22) << 22;
@@ -219,9 +225,8 @@ bool PageDescriptorTable::allocate(const void* virt_addr,
 
         if (!(entries[pdt_index] & static_cast<uint32_t>(PdeSettings::present)))
         {
-            // We need to create a new Page Table, but the heap is not
-            // guaranteed to be available. Call a function to do some fiddling.
-            // All PTs are kernel accessible only.
+            // We need to create a new Page Table. It goes in the direct map,
+            // so this doesn't need any further allocations.
             new_page_table(virt_addr, conf);
         }
 
@@ -230,12 +235,10 @@ bool PageDescriptorTable::allocate(const void* virt_addr,
         if (pt == nullptr)
             return false;
 
-        // We can get a weird fail condition here: if we created a new Page
-        // Table that contains it's own virtual address, it may occupy the space
-        // we were asked to allocate. In that case, we need to not overwrite it
-        // with the physical memory we just got, or we'll wipe the Page Table
-        // data and get a page fault. Thus we just need to check that the page
-        // is not present first.
+        // Page Tables used to live on the kernel heap, and a new one could
+        // occupy the space we were asked to allocate. They're in the direct
+        // map now, but check the page is not present first anyway, rather than
+        // wiping whatever is there.
 
         // Calculate the Page Table index.
         size_t pt_index = (v_addr >> 12) & 0x000003FF;
@@ -248,12 +251,10 @@ bool PageDescriptorTable::allocate(const void* virt_addr,
         }
         else
         {
-            // This is a weird situation: we've set up a mapping for the virtual
-            // memory requested, but promptly filled it. This is only going to
-            // be an issue for the kernel heap (as new Page Tables only go on
-            // the kernel heap), so we'll trust the heap to sort it out. We do
-            // want to free the physical memory we just grabbed, or it will be
-            // leaked.
+            // This is a weird situation: the virtual memory requested got
+            // filled while we were setting it up. We'll trust the caller to
+            // sort it out. We do want to free the physical memory we just
+            // grabbed, or it will be leaked.
             pfa.free(p_addr);
             if (recursive != nullptr)
                 *recursive = true;
@@ -281,6 +282,79 @@ void PageDescriptorTable::clean_user_space(const void* end)
 
 /******************************************************************************/
 
+bool PageDescriptorTable::copy_on_write(const void* virt_addr)
+{
+    // Find the Page Table Entry. Anything not in a Page Table can't be copy on
+    // write.
+    size_t v_addr = reinterpret_cast<size_t>(virt_addr);
+    PageTable* pt = get(v_addr >> 22);
+    if (pt == nullptr)
+        return false;
+    size_t pt_index = (v_addr >> 12) & 0x000003FF;
+    uint32_t entry = pt->entries[pt_index];
+    if ((entry & static_cast<uint32_t>(PdeSettings::present)) == 0 ||
+        (entry & static_cast<uint32_t>(PdeSettings::copy_on_write)) == 0)
+        return false;
+
+    void* page_addr = reinterpret_cast<void*>(v_addr & ~(page_size - 1));
+    void* phys_addr = reinterpret_cast<void*>(entry & 0xFFFFF000);
+    uint32_t conf = ((entry & 0x00000FFF) &
+        ~static_cast<uint32_t>(PdeSettings::copy_on_write)) |
+        static_cast<uint32_t>(PdeSettings::writable);
+
+    // The zero page is never written to. Replace it with a new page of zeroes.
+    if (phys_addr == zero_page)
+    {
+        void* new_phys =
+            pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+        if (new_phys == nullptr)
+            return false;
+        klib::memset(phys_to_virt(new_phys), 0, page_size);
+        return pt->set(new_phys, pt_index, conf, page_addr);
+    }
+
+    // If nobody else is using the page any more, we can just take it.
+    if (pfa.shares(phys_addr) == 0)
+        return pt->set(phys_addr, pt_index, conf, page_addr);
+
+    // Otherwise we need a copy. Get a new physical page we can write to through
+    // the direct map.
+    void* new_phys = pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+    if (new_phys == nullptr)
+        return false;
+
+    // Copy the data and point the user space page at the copy.
+    klib::memcpy(phys_to_virt(new_phys), page_addr, page_size);
+    pt->set(new_phys, pt_index, conf, page_addr);
+
+    // Drop our reference to the original page.
+    pfa.free(phys_addr);
+
+    return true;
+}
+
+/******************************************************************************/
+
+bool PageDescriptorTable::write_protect(const void* virt_addr)
+{
+    size_t v_addr = reinterpret_cast<size_t>(virt_addr);
+    PageTable* pt = get(v_addr >> 22);
+    if (pt == nullptr)
+        return false;
+    size_t pt_index = (v_addr >> 12) & 0x000003FF;
+    uint32_t entry = pt->entries[pt_index];
+    if ((entry & static_cast<uint32_t>(PdeSettings::present)) == 0)
+        return false;
+
+    void* page_addr = reinterpret_cast<void*>(v_addr & ~(page_size - 1));
+    uint32_t conf = (entry & 0x00000FFF) &
+        ~static_cast<uint32_t>(PdeSettings::writable);
+    return pt->set(reinterpret_cast<void*>(entry & 0xFFFFF000), pt_index, conf,
+        page_addr);
+}
+
+/******************************************************************************/
+
 void PageDescriptorTable::dump(klib::ostream& dest) const
 {
     dest << "Entries:\n" << klib::hex;
@@ -315,79 +389,91 @@ void PageDescriptorTable::dump(klib::ostream& dest) const
 
 /******************************************************************************/
 
-void PageDescriptorTable::duplicate_user_space(const void* end)
+void PageDescriptorTable::duplicate_user_space(PageDescriptorTable& other,
+    const void* end)
 {
-    // The kernel PDT, for address translation of kernel space.
-    PageDescriptorTable& k_pdt = *global_kernel->get_pdt();
-
     // Get the end address, rounded up to a page table boundary.
     uintptr_t e = reinterpret_cast<uintptr_t>(end);
     e = (e % large_page_size == 0 ?
         e / large_page_size : e / large_page_size + 1);
 
-    // Reserve some space for the copying operation. Needs to be page aligned.
-    void* copy_space = global_kernel->get_heap()->malloc(page_size, page_size);
-    if (copy_space == nullptr)
-        global_kernel->panic(
-            "Failed to get heap space for user memory copying");
-    if ((reinterpret_cast<size_t>(copy_space) & 0x00000FFF) != 0)
-        global_kernel->panic("Memory allocated for user memory copying was not 4096 byte aligned");
-
     // Outside iteration over the page tables.
     for (size_t i = 0; i < e; ++i)
     {
-        if (k_pdt.virt_entries[i] != nullptr)
+        if (other.virt_entries[i] != nullptr)
         {
-            // We have a page table to copy. First make a new page table. This
-            // needs to be 4K aligned.
-            PageTable* new_pt = static_cast<PageTable*>(
-                global_kernel->get_heap()->malloc(sizeof(PageTable),
-                page_size));
-            if (new_pt == nullptr)
+            // We have a page table to copy. First make a new page table, in a
+            // physical page we can get at through the direct map.
+            void* pt_phys =
+                pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+            if (pt_phys == nullptr)
                 global_kernel->panic(
-                    "Failed to get heap space for new Page Table");
-            if ((reinterpret_cast<size_t>(new_pt) & 0x00000FFF) != 0)
-                global_kernel->panic("Memory allocated for new Page Table was not 4096 byte aligned");
+                    "Failed to get physical memory for new Page Table");
+            PageTable* new_pt = new (phys_to_virt(pt_phys)) PageTable{};
             // Add it's physical and virtual addresses to the PDT.
             virt_entries[i] = new_pt;
-            uint32_t conf = k_pdt.entries[i] & 0x00000FFF;
-            entries[i] =
-                reinterpret_cast<uint32_t>(k_pdt.translate(new_pt)) | conf;
+            uint32_t conf = other.entries[i] & 0x00000FFF;
+            entries[i] = reinterpret_cast<uint32_t>(pt_phys) | conf;
 
             // Inside iteration over the pages within the table.
             for (size_t j = 0; j < PageTable::sz; ++j)
             {
-                // Calculate the virtual address in user space.
-                const void* virt_addr = reinterpret_cast<const void*>(
-                    i * large_page_size + j * page_size);
+                uint32_t& entry = other.virt_entries[i]->entries[j];
 
                 // Continue if it doesn't exist.
-                if ((k_pdt.virt_entries[i]->entries[j] &
-                    static_cast<uint32_t>(PdeSettings::present)) == 0)
+                if ((entry & static_cast<uint32_t>(PdeSettings::present)) == 0)
                     continue;
 
-                // Copy the data into the temporary copy space.
-                klib::memcpy(copy_space, virt_addr, page_size);
-
-                // Now we have a copy of the data in kernel space. Get the PT to
-                // point at the data.
-                conf = k_pdt.virt_entries[i]->entries[j] & 0x00000FFF;
-                virt_entries[i]->set(k_pdt.translate(copy_space), j, conf,
-                    virt_addr);
-
-                // So now we have two virtual mappings to the same physical
-                // address. Remap the kernel space one so it's ready for the
-                // next page.
-                conf = static_cast<uint32_t>(PdeSettings::present) |
-                    static_cast<uint32_t>(PdeSettings::writable);
-                k_pdt.free(copy_space, false);
-                k_pdt.allocate(copy_space, conf);
+                // The zero and time pages are already read only and shared by
+                // everyone.
+                if (shared_page(reinterpret_cast<void*>(entry & 0xFFFFF000)))
+                {
+                    new_pt->entries[j] = entry;
+                    continue;
+                }
+
+                // Share the physical page between the two PDTs. Writable
+                // pages become read only in both, and get copied on the first
+                // write.
+                if (pfa.share(reinterpret_cast<void*>(entry & 0xFFFFF000)))
+                {
+                    if (entry & static_cast<uint32_t>(PdeSettings::writable))
+                    {
+                        entry &= ~static_cast<uint32_t>(PdeSettings::writable);
+                        entry |=
+                            static_cast<uint32_t>(PdeSettings::copy_on_write);
+                    }
+                    new_pt->entries[j] = entry;
+                    continue;
+                }
+
+                // The page has too many references already, so make a copy.
+                void* copy_phys =
+                    pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+                if (copy_phys == nullptr)
+                    global_kernel->panic(
+                        "Failed to get physical memory for user memory copying");
+
+                // Calculate the virtual address in user space.
+                const void* virt_addr = reinterpret_cast<const void*>(
+                    i * large_page_size + j * page_size);
+                klib::memcpy(phys_to_virt(copy_phys), virt_addr, page_size);
+
+                // Get the PT to point at the copy. A copy is private, so it can
+                // be writable if the original was going to be.
+                conf = entry & 0x00000FFF;
+                if (conf & static_cast<uint32_t>(PdeSettings::copy_on_write))
+                    conf = (conf &
+                        ~static_cast<uint32_t>(PdeSettings::copy_on_write)) |
+                        static_cast<uint32_t>(PdeSettings::writable);
+                new_pt->entries[j] = reinterpret_cast<uint32_t>(copy_phys) | conf;
             }
         }
     }
 
-    // Free up the copy space.
-    global_kernel->get_heap()->free(copy_space);
+    // The other PDT's writable pages are now read only. Flush the TLB so it
+    // sees that.
+    other.load();
 }
 
 /******************************************************************************/
@@ -427,7 +513,7 @@ void PageDescriptorTable::free(const void* virt_addr, bool phys_free)
     }
     else
     {
-        if (phys_free)
+        if (phys_free && !shared_page(phys_addr))
         {
             // Free the physical memory.
             pfa.free(phys_addr);
@@ -437,14 +523,15 @@ void PageDescriptorTable::free(const void* virt_addr, bool phys_free)
         PageTable* pt = get(pdt_index);
         pt->free(virt_addr);
 
-        // Check whether the Page Table is now empty.
-        if (pt->empty())
+        // Check whether the Page Table is now empty. Kernel Page Tables are
+        // shared by every PDT, so they stay.
+        if (pdt_index < (kernel_virtual_base >> 22) && pt->empty())
         {
-            // Delete the Page Table from the heap and set the PDE entry to
+            // Free the Page Table's physical page and set the PDE entry to
             // not present.
             entries[pdt_index] = static_cast<uint32_t>(PdeSettings::writable);
             virt_entries[pdt_index] = nullptr;
-            delete pt;
+            pfa.free(virt_to_phys(pt));
         }
     }
 }
@@ -458,10 +545,10 @@ void PageDescriptorTable::free_user_space(const void* end, bool phys_free)
     {
         if (virt_entries[pdt_index] != nullptr)
         {
-            for (size_t pt_index = 0; pt_index < page_size; ++pt_index)
+            for (size_t pt_index = 0; pt_index < PageTable::sz; ++pt_index)
             {
                 const void* virt_addr = reinterpret_cast<const void*>(
-                    pdt_index * page_size + pt_index * page_size);
+                    pdt_index * large_page_size + pt_index * page_size);
                 free(virt_addr, phys_free);
             }
         }
@@ -500,6 +587,29 @@ const PageTable* PageDescriptorTable::get(size_t n) const
 
 /******************************************************************************/
 
+void* PageDescriptorTable::identity_copy() const
+{
+    // The processor reads the PDT by physical address, so it must be in the
+    // direct map for us to fill it in.
+    void* phys = PageFrameAllocator{}.allocate_below(
+        reinterpret_cast<void*>(phys_map_size));
+    if (phys == nullptr)
+        return nullptr;
+
+    uint32_t* copy = static_cast<uint32_t*>(phys_to_virt(phys));
+    for (size_t i = 0; i < sz; ++i)
+        copy[i] = entries[i];
+
+    // A large page at 0 covers the identity mapping.
+    copy[0] = static_cast<uint32_t>(PdeSettings::present) |
+        static_cast<uint32_t>(PdeSettings::writable) |
+        static_cast<uint32_t>(PdeSettings::large);
+
+    return phys;
+}
+
+/******************************************************************************/
+
 void PageDescriptorTable::load() const
 {
     // Translate from virtual to physical address, using the kernel pdt.
@@ -657,106 +767,137 @@ void PageDescriptorTable::new_page_table(const void* virt_addr, uint32_t conf)
     // Fail if the configuration is not sensible.
     if (!(conf & static_cast<uint32_t>(PdeSettings::present)) ||
         conf & 0xFFFFF000)
-        global_kernel->panic("Bad configuration for temporary page table");
-
-    // Free the virtual address for the temporary page table. We don't want to
-    // free the physical space: that could be bad as it might be where the
-    // previously added page table exists.
-    size_t pdt_index = reinterpret_cast<size_t>(temp_page_table) >> 22;
-    PageTable* pt = get(pdt_index);
-    pt->free(temp_page_table);
-
-    // Allocate a new entry. This is a recursive call to allocate, but as long
-    // as the temp_page_table is within an existing Page Table, it should be
-    // fine. temp_page_table was set aside in assembly to be within a Page
-    // Table.
-    if (!allocate(static_cast<void*>(temp_page_table),
-        static_cast<uint32_t>(PdeSettings::present) |
-        static_cast<uint32_t>(PdeSettings::writable)))
-        global_kernel->panic("Unable to allocate temporary page table");
-
-    // Now we have a Page Table in an undefined state sitting somewhere in
-    // physical memory and at the temporary page table store in virtual memory.
+        global_kernel->panic("Bad configuration for new page table");
+
+    // Get a physical page for the table. It has to be in the direct map, as
+    // that's how we access it.
+    void* phys_addr =
+        pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+    if (phys_addr == nullptr)
+        global_kernel->panic("Unable to allocate new page table");
 
     // Put the Page Table into a valid state.
-    temp_page_table = new (temp_page_table) PageTable{};
+    PageTable* pt = new (phys_to_virt(phys_addr)) PageTable{};
 
     // Add the new page table to the PDT, where it will cover the requested
-    // address.
-    pdt_index = reinterpret_cast<size_t>(virt_addr) >> 22;
-    if (!set(temp_page_table, pdt_index, conf))
-        global_kernel->panic("Failed to add temporary page table to the PDT");
-
-    // Now we have new Page Table with it's physical address loaded into the PDT
-    // that covers the virtual region requested. This is a 'safe' state, but we
-    // want to be able to virtually access the new Page Table even after another
-    // new Page Table is made.
-
-    // We want to add the Page Table to the heap. This is a little complicated.
-    // Firstly, we're probably in the middle of a heap allocation that meant we
-    // had to create a new Page Table. Secondly, some idiot might have decided
-    // to initialise the heap in a new 4MB section, meaning the heap might not
-    // be fully functional yet.
-
-    if (global_kernel->get_heap() == nullptr)
+    // address. Global only means anything for the pages themselves.
+    size_t pdt_index = reinterpret_cast<size_t>(virt_addr) >> 22;
+    if (!set(pt, pdt_index, conf & ~static_cast<uint32_t>(PdeSettings::global)))
+        global_kernel->panic("Failed to add new page table to the PDT");
+}
+
+/******************************************************************************/
+
+void PageDescriptorTable::map_physical_memory()
+{
+    // Large pages, so there are no Page Tables to make. These are the same in
+    // every PDT, so they're global.
+    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) |
+        static_cast<uint32_t>(PdeSettings::writable) |
+        static_cast<uint32_t>(PdeSettings::large) |
+        static_cast<uint32_t>(PdeSettings::global);
+    const size_t start = phys_map_base / large_page_size;
+    for (size_t i = 0; i < phys_map_size / large_page_size; ++i)
     {
-        // This is the special case where the heap doesn't exist yet. This could
-        // only happen if we try to initialise the heap in a 4MB
-        // unmapped section. If we asked to initialise the heap in the middle of
-        // a 4MB section, we'll assume it's ok to put it at the start of the
-        // section instead. This avoids a horrible scenario. Putting the Page
-        // Table into the heap needs three pages (one for the meta data for the
-        // Page Table, one for the Page Table, and one for the terminating meta
-        // data). If the address given is in the last two pages, the second or
-        // third required page might be unmapped. Then when malloc asks for a
-        // new page, we'll get back here creating another new Page Table and
-        // temp_page_table will get overwritten. Ouch.
-
-        // Create a mapping for the first page of the table. Calling allocate
-        // recursively again, but we know the Page Table exists as we just made
-        // it.
-        allocate(reinterpret_cast<void*>(pdt_index << 22), conf);
-
-        // Manual heap initialisation. Yes, I know it's not pretty. Any better
-        // ideas? This should be enough to be able to call malloc.
-        global_kernel->get_heap()->initialise(
-            reinterpret_cast<void*>(pdt_index << 22)
-        );
+        entries[start + i] = (i * large_page_size) | conf;
+        virt_entries[start + i] = nullptr;
     }
+}
 
-    // Ask the heap for aligned memory. This will probably cause malloc to ask
-    // for two new pages, but that should be fine as the mapping exists (we've
-    // just created it) and the Page Table will get updated at temp_page_table.
-    // TODO: Am I sure about this? What if the new PT is for user space, but
-    // creating the PT requires a new PT for the kernel heap?
-    pt = static_cast<PageTable*>(
-        global_kernel->get_heap()->malloc(sizeof(PageTable), page_size));
-    if (pt == nullptr)
-        global_kernel->panic("Failed to get heap space for new Page Table");
-    if ((reinterpret_cast<size_t>(pt) & 0x00000FFF) != 0)
-        global_kernel->panic(
-            "Memory allocated for new Page Table was not 4096 byte aligned");
+/******************************************************************************/
 
-    // Get the indices for the new virtual address for the Page Table. Note
-    // this isn't necessarily within the new Page Table, as malloc might have
-    // found a free block somewhere else.
-    size_t pdt_index_addr = reinterpret_cast<size_t>(pt) >> 22;
-    PageTable* pt_addr = get(pdt_index_addr);
-    size_t pt_index = (reinterpret_cast<size_t>(pt) >> 12) & 0x000003FF;
-    void* phys_addr = translate(temp_page_table);
+void PageDescriptorTable::prepare_kernel_space()
+{
+    // Work out the index of the first kernel entry.
+    const size_t start = kernel_virtual_base / large_page_size;
 
-    // Update whichever Page Table.
-    pt_addr->set(phys_addr, pt_index,
-        static_cast<uint32_t>(PdeSettings::present) |
-        static_cast<uint32_t>(PdeSettings::writable), pt);
+    // Mark everything already mapped as global. The Page Tables made below
+    // are empty, so they don't need this.
+    for (size_t i = start; i < sz; ++i)
+    {
+        if (!(entries[i] & static_cast<uint32_t>(PdeSettings::present)))
+            continue;
+
+        if (entries[i] & static_cast<uint32_t>(PdeSettings::large))
+        {
+            entries[i] |= static_cast<uint32_t>(PdeSettings::global);
+            continue;
+        }
 
-    // Update the PDT virtual entries. Note the index is for where the new Page
-    // Table covers, not where it resides.
-    virt_entries[pdt_index] = pt;
+        PageTable* pt = get(i);
+        for (size_t j = 0; j < PageTable::sz; ++j)
+            if (pt->entries[j] & static_cast<uint32_t>(PdeSettings::present))
+                pt->entries[j] |= static_cast<uint32_t>(PdeSettings::global);
+    }
+
+    // Make the missing Page Tables.
+    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) |
+        static_cast<uint32_t>(PdeSettings::writable);
+    for (size_t i = start; i < sz; ++i)
+        if (!(entries[i] & static_cast<uint32_t>(PdeSettings::present)))
+            new_page_table(reinterpret_cast<void*>(i * large_page_size), conf);
 
-    // We could free the temporary address here, but let's leave it occupied to
-    // make sure no one else accidentally uses it (assembly initiation marks it
-    // as in use too).
+    // Now global pages can be turned on without any stale user mappings
+    // getting stuck in the TLB.
+    load();
+    enable_global_pages();
+
+    // Make the shared page of zeroes.
+    if (zero_page == nullptr)
+    {
+        zero_page = pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+        if (zero_page == nullptr)
+            global_kernel->panic("Failed to get physical memory for zero page");
+        klib::memset(phys_to_virt(zero_page), 0, page_size);
+    }
+
+    // And the time page, which starts off as zeroes too.
+    if (time_page == nullptr)
+    {
+        time_page = pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+        if (time_page == nullptr)
+            global_kernel->panic("Failed to get physical memory for time page");
+        klib::memset(phys_to_virt(time_page), 0, page_size);
+    }
+}
+
+/******************************************************************************/
+
+bool PageDescriptorTable::allocate_zeroed(const void* virt_addr, uint32_t conf)
+{
+    // Get a page we can clear through the direct map.
+    void* phys_addr =
+        pfa.allocate_below(reinterpret_cast<void*>(phys_map_size));
+    if (phys_addr == nullptr)
+        return false;
+    klib::memset(phys_to_virt(phys_addr), 0, page_size);
+
+    if (!allocate(virt_addr, conf, phys_addr))
+    {
+        pfa.free(phys_addr);
+        return false;
+    }
+
+    return true;
+}
+
+/******************************************************************************/
+
+bool PageDescriptorTable::map_zero_page(const void* virt_addr)
+{
+    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) |
+        static_cast<uint32_t>(PdeSettings::user_access) |
+        static_cast<uint32_t>(PdeSettings::copy_on_write);
+    return allocate(virt_addr, conf, zero_page);
+}
+
+/******************************************************************************/
+
+bool PageDescriptorTable::map_time_page(const void* virt_addr)
+{
+    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) |
+        static_cast<uint32_t>(PdeSettings::user_access);
+    return allocate(virt_addr, conf, time_page);
 }
 
 /******************************************************************************/
@@ -766,7 +907,7 @@ bool PageDescriptorTable::set(PageTable* pt, size_t n, uint32_t conf)
     if (n >= sz)
         return false;
 
-    uint32_t entry = reinterpret_cast<uint32_t>(translate(pt));
+    uint32_t entry = reinterpret_cast<uint32_t>(virt_to_phys(pt));
     if (entry & 0x00000FFF)
         return false;
 
@@ -840,32 +981,23 @@ void* PageDescriptorTable::translate(const void* virt_addr, bool print) const
     return phys_addr;
 }
 
-/******************************************************************************/
+/******************************************************************************
+ ******************************************************************************/
 
-void PageDescriptorTable::update_user_space(
-    const PageDescriptorTable& other, const void* end)
+void* virt_to_phys(const void* virt_addr)
 {
-    // Work out the index of the last user entry.
-    const uintptr_t e = reinterpret_cast<uintptr_t>(end) / large_page_size;
-
-    // Copy the physical and virtual entries.
-    for (size_t i = 0; i < e; ++i)
-    {
-        entries[i] = other.entries[i];
-        virt_entries[i] = other.virt_entries[i];
-    }
-
-    // Invalidate the TLB
-    load();
+    uintptr_t v_addr = reinterpret_cast<uintptr_t>(virt_addr);
+    if (v_addr >= PageDescriptorTable::phys_map_base &&
+        v_addr < PageDescriptorTable::phys_map_base +
+            PageDescriptorTable::phys_map_size)
+        return reinterpret_cast<void*>(
+            v_addr - PageDescriptorTable::phys_map_base);
+
+    return global_kernel->get_pdt()->translate(virt_addr);
 }
 
 /******************************************************************************/
 
-    PageTable* PageDescriptorTable::temp_page_table;
-
-/******************************************************************************
- ******************************************************************************/
-
 void trim_pdt(PageDescriptorTable* pdt, size_t end, size_t max)
 {
     // Round the end up to a 4K page boundary.
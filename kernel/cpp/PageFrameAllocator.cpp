@@ -22,38 +22,23 @@ void pfa_initialise(const void* kps, const void* kpe)
     PageFrameAllocator::kernel_physical_start = reinterpret_cast<uint32_t>(kps);
     PageFrameAllocator::kernel_physical_end = reinterpret_cast<uint32_t>(kpe);
 
-    // Clear the used array, up to the current memory size.
-    for (size_t i = 0;
-        i < PageFrameAllocator::mem_size / (PageFrameAllocator::page_size * 32);
-        ++i)
-        PageFrameAllocator::used_pages[i] = 0;
-
-    // Set everything used by the kernel to used. We'll leave the first 1MB as
-    // defintely used, as that's for various hardware stuff.
-    for (size_t i = 0; i < 8; ++i)
-        PageFrameAllocator::used_pages[i] = 0xFFFFFFFF;
-
     // Round the kernel physical start down to a page boundary and the end up to
     // a page boundary.
     size_t boundary_low = PageFrameAllocator::kernel_physical_start >> 12;
     size_t boundary_high = (PageFrameAllocator::kernel_physical_end >> 12) + 1;
 
-    // Any initial pages if the low boundary is not divisible by 32.
-    for (size_t i = boundary_low; i < (boundary_low / 32 + 1) * 32; ++i)
-        PageFrameAllocator::used_pages[i/32] |= 1 << (i%32);
-    // Simple intermediate sets of 32 used pages.
-    for (size_t i = boundary_low / 32 + 1; i < boundary_high/32; ++i)
-        PageFrameAllocator::used_pages[i] = 0xFFFFFFFF;
-    // And any trailing pages if the high boundary is not divisible by 32.
-    for (size_t i = (boundary_high / 32) * 32; i < boundary_high; ++i)
-        PageFrameAllocator::used_pages[i/32] |= 1 << (i%32);
-
     // To start with, we assume only 64MB, and hope we don't encounter a smaller
-    // computer. Set everything above this to used.
-    for (size_t i = PageFrameAllocator::mem_size /
-        (PageFrameAllocator::page_size * 32);
-        i < PageFrameAllocator::number_of_pages/32; ++i)
-        PageFrameAllocator::used_pages[i] = 0xFFFFFFFF;
+    // computer. Everything above this is left as used. We'll leave the first
+    // 1MB as defintely used, as that's for various hardware stuff, as well as
+    // everything used by the kernel.
+    PageFrameAllocator::mem_pages =
+        PageFrameAllocator::mem_size / PageFrameAllocator::page_size;
+    PageFrameAllocator::seed([boundary_low, boundary_high](size_t page)
+        {
+            return page >= 256 &&
+                (page < boundary_low || page >= boundary_high);
+        },
+        PageFrameAllocator::mem_pages);
 
     // Disable reinitialisation
     PageFrameAllocator::initialised = true;
@@ -164,15 +149,21 @@ void pfa_read_map(const klib::vector<MultiBootMap>& map)
     }
 
     // Set anything already used in the memory already available to used.
-    for (size_t i = 0;
-        i < PageFrameAllocator::mem_size / (PageFrameAllocator::page_size*32);
-        ++i)
-        temp_used[i] |= PageFrameAllocator::used_pages[i];
-
-    // Copy the data into the real array.
-    for (size_t i = 0; i < PageFrameAllocator::number_of_pages / 32; ++i)
-        PageFrameAllocator::used_pages[i] = temp_used[i];
+    for (size_t i = 0; i < PageFrameAllocator::mem_pages; ++i)
+        if (!PageFrameAllocator::page_free(i))
+            temp_used[i/32] |= 1 << (i%32);
+
+    // Rebuild the free lists from the combined map.
     PageFrameAllocator::mem_size = temp_mem_size;
+    PageFrameAllocator::mem_pages = (temp_mem_size == 0 ?
+        PageFrameAllocator::number_of_pages :
+        klib::min<size_t>(temp_mem_size / PageFrameAllocator::page_size,
+            PageFrameAllocator::number_of_pages));
+    PageFrameAllocator::seed([&temp_used](size_t page)
+        {
+            return (temp_used[page/32] & (1 << (page%32))) == 0;
+        },
+        PageFrameAllocator::mem_pages);
 
     // Disable remapping.
     PageFrameAllocator::mapped = true;
@@ -197,29 +188,36 @@ void pfa_dump_status(klib::ostream& dest)
     dest << "  Total memory is ";
     dest << format_bytes(PageFrameAllocator::mem_size) << '\n';
 
-    size_t tot_used = 0;
-    for (size_t i = 0;
-        i < PageFrameAllocator::mem_size / (PageFrameAllocator::page_size * 32);
-        ++i)
-    {
-        // Count the number of bits set at this index.
-        size_t v = PageFrameAllocator::used_pages[i];
-        for (; v; ++tot_used)
-            v &= v - 1;
-    }
-    tot_used *= PageFrameAllocator::page_size;
+    size_t tot_av =
+        PageFrameAllocator::free_count * PageFrameAllocator::page_size;
+    size_t tot_used = PageFrameAllocator::mem_size - tot_av;
     dest << "  Total used memory is " << format_bytes(tot_used) << '\n';
-    size_t tot_av = PageFrameAllocator::mem_size - tot_used;
     dest << "  Total available memory is " << format_bytes(tot_av)  << '\n';
 
+    dest << "  Free blocks by order:";
+    for (size_t i = 0; i <= PageFrameAllocator::max_order; ++i)
+        dest << ' ' << PageFrameAllocator::free_blocks[i];
+    dest << '\n';
+
     dest.flush();
 }
 
 /******************************************************************************
  ******************************************************************************/
 
-klib::array<uint32_t, PageFrameAllocator::number_of_pages / sizeof(uint32_t)>
-    PageFrameAllocator::used_pages;
+klib::array<uint32_t, PageFrameAllocator::map_words>
+    PageFrameAllocator::free_map;
+klib::array<uint32_t, PageFrameAllocator::summary_words>
+    PageFrameAllocator::free_summary;
+klib::array<uint32_t,
+    PageFrameAllocator::top_stride * (PageFrameAllocator::max_order + 1)>
+    PageFrameAllocator::free_top;
+klib::array<size_t, PageFrameAllocator::max_order + 1>
+    PageFrameAllocator::free_blocks;
+size_t PageFrameAllocator::free_count = 0;
+klib::array<uint8_t, PageFrameAllocator::number_of_pages>
+    PageFrameAllocator::extra_refs;
+size_t PageFrameAllocator::mem_pages = 0;
 uint32_t PageFrameAllocator::mem_size = (1 << 26);
 uint32_t PageFrameAllocator::kernel_physical_start = 0;
 uint32_t PageFrameAllocator::kernel_physical_end = 0;
@@ -228,138 +226,288 @@ bool PageFrameAllocator::mapped = false;
 
 /******************************************************************************/
 
-PageFrameAllocator::PageFrameAllocator()
-    : last_alloc{1024} // Start allocating pages at 4MB, ensures no clashes
-                       // with the kernel data/stack.
-{}
+void* PageFrameAllocator::allocate(bool large)
+{
+    return allocate_block(large ? max_order : 0);
+}
 
 /******************************************************************************/
 
-void* PageFrameAllocator::allocate(bool large)
+void* PageFrameAllocator::allocate_below(const void* limit)
 {
-    size_t loc = 0;
-    bool found = false;
+    return allocate_block(0, reinterpret_cast<size_t>(limit) >> 12);
+}
 
-    if (!large)
-    {
-        // Looking for a 4K page. Start looking at the last allocated one.
-        for (size_t test = last_alloc+1; test < number_of_pages; ++test)
-        {
-            found = !check(reinterpret_cast<void*>(test * page_size));
-            if (found)
-            {
-                loc = test;
-                break;
-            }
-        }
+/******************************************************************************/
 
-        // Try again from the start
-        for (size_t test = 0; test <= last_alloc && !found; ++test)
-        {
-            found = !check(reinterpret_cast<void*>(test * page_size));
-            {
-                loc = test;
-                break;
-            }
-        }
-    }
+void* PageFrameAllocator::allocate_pages(size_t pages)
+{
+    // Find the smallest order that fits.
+    size_t order = 0;
+    while (order <= max_order && (static_cast<size_t>(1) << order) < pages)
+        ++order;
+
+    if (order > max_order)
+        return nullptr;
+
+    return allocate_block(order);
+}
+
+/******************************************************************************/
+
+void PageFrameAllocator::free(const void* phys_addr, bool large)
+{
+    size_t page = reinterpret_cast<size_t>(phys_addr) >> 12;
+    if (large)
+        free_block(page >> max_order << max_order, max_order);
+    else if (page < number_of_pages && extra_refs[page] != 0)
+        // Someone else still has a reference.
+        --extra_refs[page];
     else
-    {
-        // Round last_alloc up to a 4MB page bounday.
-        size_t boundary = (last_alloc >> 10) + 1;
-        // Looking for a 4MB page. Start looking at the last allocated one.
-        for (size_t test = boundary; test < (number_of_pages >> 10); ++test)
-        {
-            found = !check(reinterpret_cast<void*>(test * large_page_size),
-                           true);
-            if (found)
-            {
-                loc = test;
-                break;
-            }
-        }
+        free_block(page, 0);
+}
 
-        // Try again from the start
-        for (size_t test = 0; test < boundary && !found; ++test)
-        {
-            found = !check(reinterpret_cast<void*>(test * large_page_size),
-                           true);
-            if (found)
-            {
-                loc = test;
-                break;
-            }
-        }
-    }
+/******************************************************************************/
 
-    if (!found)
-        // No free pages
-        return nullptr;
+void PageFrameAllocator::free_pages(const void* phys_addr, size_t pages)
+{
+    size_t order = 0;
+    while (order < max_order && (static_cast<size_t>(1) << order) < pages)
+        ++order;
+
+    size_t page = reinterpret_cast<size_t>(phys_addr) >> 12;
+    free_block(page >> order << order, order);
+}
+
+/******************************************************************************/
+
+bool PageFrameAllocator::share(const void* phys_addr)
+{
+    size_t page = reinterpret_cast<size_t>(phys_addr) >> 12;
+    if (page >= number_of_pages || extra_refs[page] == 0xFF)
+        return false;
+
+    ++extra_refs[page];
+    return true;
+}
+
+/******************************************************************************/
+
+size_t PageFrameAllocator::shares(const void* phys_addr) const
+{
+    size_t page = reinterpret_cast<size_t>(phys_addr) >> 12;
+    if (page >= number_of_pages)
+        return 0;
+
+    return extra_refs[page];
+}
+
+/******************************************************************************/
+
+bool PageFrameAllocator::check(const void* addr, bool large) const
+{
+    // Convert address to page index
+    size_t test = reinterpret_cast<size_t>(addr) >> 12;
 
-    // Convert page number to physical address and set to used.
-    last_alloc = loc;
     if (!large)
+        return !page_free(test);
+
+    // The buddy system always merges free blocks as far as possible, so a
+    // large page is completely free if and only if it's a free block of the
+    // maximum order.
+    return !test_free(max_order, test >> max_order);
+}
+
+/******************************************************************************/
+
+void* PageFrameAllocator::allocate_block(size_t order, size_t limit)
+{
+    // Find the smallest order at least as big as requested with a free block.
+    // The search gives the lowest free block of each order, so if that's not
+    // below the limit, nothing of that order is.
+    size_t o = order;
+    size_t index = 0;
+    for ( ; o <= max_order; ++o)
     {
-        used_pages[loc/32] |= (1 << (loc % 32));
-        return reinterpret_cast<void*>(loc * page_size);
+        if (free_blocks[o] == 0)
+            continue;
+        index = find_free(o);
+        if (((index + 1) << o) <= limit)
+            break;
     }
-    else
+
+    if (o > max_order)
+        // No free pages
+        return nullptr;
+
+    // Take the block.
+    clear_free(o, index);
+    --free_blocks[o];
+
+    // Split it down to the requested size. We keep the lower half each time
+    // and put the upper half on the free list of the order below.
+    while (o > order)
     {
-        for (size_t i = loc; i < loc + large_page_size/page_size; i += 32)
-            used_pages[i/32] = 0xFFFFFFFF;
-        return reinterpret_cast<void*>(loc * large_page_size);
+        --o;
+        index <<= 1;
+        set_free(o, index + 1);
+        ++free_blocks[o];
     }
+
+    free_count -= static_cast<size_t>(1) << order;
+    return reinterpret_cast<void*>((index << order) * page_size);
 }
 
 /******************************************************************************/
 
-void PageFrameAllocator::free(const void* phys_addr, bool large)
+void PageFrameAllocator::free_block(size_t page, size_t order)
 {
-    if (large)
-    {
-        // Get the large page number.
-        size_t addr = reinterpret_cast<size_t>(phys_addr) >> 22;
-        // Convert back to the 4K page number at the start of the large page.
-        addr <<= 10;
-        // Deallocate all 4K pages in the large page
-        for (size_t i = addr; i < addr + large_page_size/(32*page_size); ++i)
-            used_pages[i] = 0x0;
-    }
-    else
+    // Ignore anything outside the memory we manage, or in the reserved first
+    // 1MB. Callers are allowed to free mappings to hardware this way.
+    if (page < 256 || page >= mem_pages)
+        return;
+
+    // Freeing an already free page would corrupt the free lists, so check
+    // first. This happens when the kernel trims its initial mappings, for
+    // example.
+    if (page_free(page))
+        return;
+
+    free_count += static_cast<size_t>(1) << order;
+
+    // Merge with the buddy for as long as it's also free.
+    size_t index = page >> order;
+    while (order < max_order && test_free(order, index ^ 1))
     {
-        // Get the page number.
-        size_t addr = reinterpret_cast<size_t>(phys_addr) >> 12;
-        used_pages[addr/32] &= ~(1 << (addr % 32));
+        clear_free(order, index ^ 1);
+        --free_blocks[order];
+        index >>= 1;
+        ++order;
     }
+
+    set_free(order, index);
+    ++free_blocks[order];
 }
 
 /******************************************************************************/
 
-bool PageFrameAllocator::check(const void* addr, bool large) const
+bool PageFrameAllocator::page_free(size_t page)
 {
-    // Convert address to page index
-    size_t test = reinterpret_cast<size_t>(addr) >> 12;
-    bool used = false;
+    for (size_t order = 0; order <= max_order; ++order)
+        if (test_free(order, page >> order))
+            return true;
 
-    if (!large)
-        // Check whether the single page is allocated
-        used = (used_pages[test/32] & (1 << (test % 32)));
-    else
+    return false;
+}
+
+/******************************************************************************/
+
+template <typename T>
+void PageFrameAllocator::seed(T avail, size_t pages)
+{
+    // Start with everything used.
+    for (size_t i = 0; i < map_words; ++i)
+        free_map[i] = 0;
+    for (size_t i = 0; i < summary_words; ++i)
+        free_summary[i] = 0;
+    for (size_t i = 0; i < top_stride * (max_order + 1); ++i)
+        free_top[i] = 0;
+    for (size_t i = 0; i <= max_order; ++i)
+        free_blocks[i] = 0;
+    free_count = 0;
+
+    for (size_t page = 0; page < pages; )
     {
-        // Check all pages within this large page.
-        // Round down to the 4MB page boundary.
-        size_t boundary = (test >> 10) << 10;
-        for (size_t i = boundary; i < boundary + large_page_size/page_size; ++i)
+        if (!avail(page))
+        {
+            ++page;
+            continue;
+        }
+
+        // Grow the block for as long as it stays aligned, within memory, and
+        // the upper half of the doubled block is also available.
+        size_t order = 0;
+        while (order < max_order)
         {
-            used = (used_pages[i/32] & (1 << (i % 32)));
-            if (used)
+            size_t sz = static_cast<size_t>(1) << order;
+            if ((page & (2 * sz - 1)) != 0 || page + 2 * sz > pages)
                 break;
+            size_t i = page + sz;
+            for ( ; i < page + 2 * sz; ++i)
+                if (!avail(i))
+                    break;
+            if (i != page + 2 * sz)
+                break;
+            ++order;
         }
+
+        set_free(order, page >> order);
+        ++free_blocks[order];
+        free_count += static_cast<size_t>(1) << order;
+        page += static_cast<size_t>(1) << order;
     }
+}
+
+/******************************************************************************/
+
+void PageFrameAllocator::set_free(size_t order, size_t index)
+{
+    size_t word = index >> 5;
+    size_t sum = word >> 5;
+    free_map[map_offset(order, 0) + word] |= 1 << (index % 32);
+    free_summary[map_offset(order, 1) + sum] |= 1 << (word % 32);
+    free_top[top_stride * order + (sum >> 5)] |= 1 << (sum % 32);
+}
+
+/******************************************************************************/
+
+void PageFrameAllocator::clear_free(size_t order, size_t index)
+{
+    size_t word = index >> 5;
+    size_t sum = word >> 5;
+    uint32_t& m = free_map[map_offset(order, 0) + word];
+    m &= ~(1 << (index % 32));
+    if (m != 0)
+        return;
 
-    return used;
+    // The bitmap word is now empty, so clear it in the summaries.
+    uint32_t& s = free_summary[map_offset(order, 1) + sum];
+    s &= ~(1 << (word % 32));
+    if (s == 0)
+        free_top[top_stride * order + (sum >> 5)] &= ~(1 << (sum % 32));
+}
+
+/******************************************************************************/
+
+bool PageFrameAllocator::test_free(size_t order, size_t index)
+{
+    return free_map[map_offset(order, 0) + (index >> 5)] & (1 << (index % 32));
+}
+
+/******************************************************************************/
+
+size_t PageFrameAllocator::find_free(size_t order)
+{
+    // Work down through the summaries, taking the lowest set bit each time.
+    size_t top = top_stride * order;
+    size_t sum = 0;
+    while (free_top[top + sum] == 0)
+        ++sum;
+    sum = (sum << 5) + __builtin_ctz(free_top[top + sum]);
+    size_t word = (sum << 5) +
+        __builtin_ctz(free_summary[map_offset(order, 1) + sum]);
+    return (word << 5) + __builtin_ctz(free_map[map_offset(order, 0) + word]);
+}
+
+/******************************************************************************/
+
+size_t PageFrameAllocator::map_offset(size_t order, size_t level)
+{
+    // The words needed at each order halve as the order goes up, so the total
+    // for all the orders below this one is a geometric series.
+    size_t w = number_of_pages >> (5 * (level + 1));
+    return 2 * (w - (w >> order));
 }
 
 /******************************************************************************
  ******************************************************************************/
-
@@ -961,6 +961,16 @@ void PciDevice::dump(klib::ostream& dest) const
 
 /******************************************************************************/
 
+void PciDevice::enable_bus_master() const
+{
+    // The command register is the low half of the second register. The status
+    // half is cleared by writing 1s, so write 0s to leave it alone.
+    uint32_t reg = read_config(0x4);
+    write_config(0x4, (reg & 0xFFFF) | 0x4);
+}
+
+/******************************************************************************/
+
 uint32_t PciDevice::get_bar(size_t bar) const
 {
     if (!ex || bar > max_bar)
@@ -5,7 +5,9 @@
 #include <ostream>
 #include <string>
 
+#include "interrupt.h"
 #include "io.h"
+#include "Process.h"
 
 /******************************************************************************
  ******************************************************************************/
@@ -33,13 +35,12 @@ Pit::Pit(unsigned int freq)
     // Make sure the counters are at zero.
     timer_ms = 0;
     timer_fractions = 0;
+    skipping = 0;
 
     // Configure the hardware.
     // Strictly we need to disable interrupts here, but we'll assume that we're
     // in kernel configuration and they are already disabled.
-    outb(channel_0 | both_bytes | mode_2 | binary_mode, command_port);
-    outb(static_cast<uint8_t>(reload_value), channel_0_data);
-    outb(static_cast<uint8_t>(reload_value >> 8), channel_0_data);
+    program(mode_2, reload_value);
 }
 
 /******************************************************************************/
@@ -61,29 +62,121 @@ void Pit::dump(klib::ostream& dest) const
 
 /******************************************************************************/
 
+uint32_t Pit::ms_to_ticks(uint32_t ms) const
+{
+    uint64_t ticks = (static_cast<uint64_t>(ms) * irq_freq + 999) / 1000;
+    return (ticks > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(ticks));
+}
+
+/******************************************************************************/
+
+void Pit::resume_ticks()
+{
+    if (skipping == 0)
+        return;
+
+    // If the count has already run out, the interrupt is on its way.
+    outb(read_back_channel_0, command_port);
+    uint8_t status = inb(channel_0_data);
+    uint16_t count = inb(channel_0_data);
+    count |= static_cast<uint16_t>(inb(channel_0_data)) << 8;
+    if ((status & status_output) != 0 || count == 0)
+        return;
+
+    // Drop the whole ticks still to come and count down to the next boundary.
+    uint32_t whole = count / reload_value;
+    uint16_t part = count - whole * reload_value;
+    if (part == 0)
+    {
+        part = reload_value;
+        --whole;
+    }
+    program(mode_0, part);
+    skipping -= whole;
+}
+
+/******************************************************************************/
+
+void Pit::skip_ticks(uint32_t ticks)
+{
+    if (ticks <= 1 || skipping != 0)
+        return;
+
+    // The current tick is part way through. Add as many whole ticks to what's
+    // left of it as will fit in the counter.
+    uint16_t left = read_count();
+    uint32_t extra = (0xFFFF - left) / reload_value;
+    if (extra > ticks - 1)
+        extra = ticks - 1;
+    if (extra == 0)
+        return;
+
+    program(mode_0, left + extra * reload_value);
+    skipping = extra + 1;
+}
+
+/******************************************************************************/
+
 void Pit::sleep(unsigned int t)
 {
     uint32_t end = t + timer_ms;
     uint32_t start_fractions = timer_fractions;
 
+    // Halt until each interrupt, rather than spinning. Interrupts are off while
+    // checking, so the tick can't slip in between checking and halting. Put
+    // them back as the caller had them afterwards.
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
     while ((timer_ms == end && timer_fractions < start_fractions) ||
         timer_ms < end)
+        wait_for_interrupt();
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+uint32_t Pit::tick()
+{
+    uint32_t ticks = 1;
+
+    // Go back to periodic interrupts after skipping.
+    if (skipping != 0)
+    {
+        program(mode_2, reload_value);
+        ticks = skipping;
+        skipping = 0;
+    }
+
+    for (uint32_t i = 0; i < ticks; ++i)
     {
-        // This seems to be necessary, to stop compiler optimisations messing
-        // with the loop.
-        asm("nop");
+        timer_fractions += irq_fractions;
+        timer_ms += irq_ms;
+
+        // Check for carry from the fractions.
+        timer_ms += (timer_fractions < irq_fractions);
     }
+
+    return ticks;
 }
 
 /******************************************************************************/
 
-void Pit::tick()
+void Pit::program(operating_mode mode, uint16_t count)
 {
-    timer_fractions += irq_fractions;
-    timer_ms += irq_ms;
+    outb(channel_0 | both_bytes | mode | binary_mode, command_port);
+    outb(static_cast<uint8_t>(count), channel_0_data);
+    outb(static_cast<uint8_t>(count >> 8), channel_0_data);
+}
+
+/******************************************************************************/
 
-    // Check for carry from the fractions.
-    timer_ms += (timer_fractions < irq_fractions);
+uint16_t Pit::read_count() const
+{
+    outb(channel_0 | latch_count, command_port);
+    uint16_t count = inb(channel_0_data);
+    count |= static_cast<uint16_t>(inb(channel_0_data)) << 8;
+    return count;
 }
 
 /******************************************************************************
@@ -10,6 +10,7 @@
 #include "Kernel.h"
 #include "Logger.h"
 #include "Process.h"
+#include "Scheduler.h"
 
 /******************************************************************************
  ******************************************************************************/
@@ -17,7 +18,10 @@
 ProcTable::ProcTable(Process* p) : tab{}, last_pid{init_pid}
 {
     if (p != nullptr)
+    {
         tab[init_pid] = p;
+        p->set_pid(init_pid);
+    }
 }
 
 /******************************************************************************/
@@ -26,6 +30,8 @@ void ProcTable::erase(size_t pid)
 {
     if (tab.count(pid))
     {
+        // Make sure the scheduler doesn't hold on to it.
+        global_kernel->get_scheduler().remove(*tab[pid]);
         delete tab[pid];
         tab.erase(pid);
     }
@@ -49,11 +55,30 @@ size_t ProcTable::insert(Process* p)
     }
 
     tab[last_pid] = p;
+    p->set_pid(last_pid);
+
+    // A forked process is already runnable, but couldn't be queued until it
+    // had a PID.
+    if (p->get_status() == ProcStatus::runnable)
+        global_kernel->get_scheduler().ready(*p);
+
     return last_pid;
 }
 
 /******************************************************************************/
 
+bool ProcTable::set_process(size_t pid, Process* p)
+{
+    if (tab.count(pid) == 0)
+        return false;
+
+    tab[pid] = p;
+    p->set_pid(pid);
+    return true;
+}
+
+/******************************************************************************/
+
 bool ProcTable::swap_in(size_t pid)
 {
 //    global_kernel->syslog()->info("swap_in: pid = %X\n", pid);
@@ -128,7 +153,12 @@ FileTable::FileDescription::FileDescription(const klib::string& n,
     // the dev file system for the device, or it might be from a mounted file
     // system, in which case we first need to translate to a dev device. We can
     // find out by asking the VFS what file system the file resides on.
-    klib::string s = global_kernel->get_vfs()->lookup(n)->get_drv_name();
+    VirtualFileSystem* vfs = global_kernel->get_vfs();
+    klib::string s;
+    {
+        ReadGuard<VirtualFileSystem> rg {*vfs};
+        s = vfs->lookup(n)->get_drv_name();
+    }
 
     if (s == "")
     {
@@ -10,13 +10,23 @@
 
 #include "Elf.h"
 #include "Gdt.h"
+#include "interrupt.h"
+#include "IoRing.h"
 #include "Kernel.h"
 #include "Logger.h"
+#include "ObjectCache.h"
 #include "paging.h"
 #include "PageDescriptorTable.h"
 #include "ProcTable.h"
 #include "Scheduler.h"
 #include "SignalManager.h"
+#include "TimePage.h"
+#include "TimerWheel.h"
+
+// Cache for Process objects.
+static_assert(sizeof(Process) <= ObjectCache::max_object_size,
+    "Process is too big for an object cache");
+static ObjectCache process_cache {"Process", sizeof(Process)};
 
 /******************************************************************************
  ******************************************************************************/
@@ -56,7 +66,7 @@ Process::Process(const klib::string& name) :
 
 Process::Process() :
     entry_point{},
-    pdt{new PageDescriptorTable{}},
+    pdt{new_pdt(*global_kernel->get_pdt())},
     current_stack{0},
     kernel_stack{new uintptr_t[kernel_stack_size / sizeof(kernel_stack)]},
     break_point{nullptr},
@@ -71,10 +81,10 @@ Process::Process() :
     child_pids {}
 {
     // This constructor is specifically designed to set the process up to be
-    // duplicated in a fork call. Thus we create a new PDT but leave it blank,
-    // we create a kernel stack, leave ELF headers blank, set the registers to
-    // zero and the status to sleeping (to make sure it doesn't get time until
-    // after the duplication).
+    // duplicated in a fork call. Thus we create a new PDT but leave user space
+    // blank, we create a kernel stack, leave ELF headers blank, set the
+    // registers to zero and the status to sleeping (to make sure it doesn't get
+    // time until after the duplication).
 }
 
 /******************************************************************************/
@@ -93,7 +103,10 @@ Process::Process(Process&& other) :
     file_desc {other.file_desc},
     ret_val {other.ret_val},
     parent_pid {other.parent_pid},
-    child_pids {klib::move(other.child_pids)}
+    child_pids {klib::move(other.child_pids)},
+    pid {other.pid},
+    priority {other.priority},
+    cpu {other.cpu}
 {
     // Set the pointers in other to nullptr. Prevents the other destructor from
     // messing this up.
@@ -108,8 +121,8 @@ Process& Process::operator=(Process&& other)
 {
     // Free pointers of this process.
     // Let's just hope we're not currently using this process's kernel stack.
-    global_kernel->get_pdt()->free_user_space(
-        reinterpret_cast<void*>(kernel_virtual_base));
+    if (pdt)
+        pdt->free_user_space(reinterpret_cast<void*>(kernel_virtual_base));
     delete pdt;
     delete kernel_stack;
     delete eh_globals;
@@ -129,6 +142,9 @@ Process& Process::operator=(Process&& other)
     ret_val = other.ret_val;
     parent_pid = other.parent_pid;
     child_pids = klib::move(other.child_pids);
+    pid = other.pid;
+    priority = other.priority;
+    cpu = other.cpu;
 
     // Set the pointers in other to nullptr. Prevents the other destructor from
     // messing this up.
@@ -146,17 +162,22 @@ Process::~Process()
     // If the ELF was invalid, we won't have created at PDT.
     if (pdt)
     {
-        // Free any mappings and physical memory used in user space.
-        global_kernel->get_pdt()->free_user_space(
-            reinterpret_cast<void*>(kernel_virtual_base));
+        // Free any mappings and physical memory used in user space. This
+        // deletes the user space PTs as they empty.
+        pdt->free_user_space(reinterpret_cast<void*>(kernel_virtual_base));
 
-        // Now just delete the pdt. This doesn't delete any PTs, so the kernel
-        // should be ok.
+        // Now just delete the pdt. The kernel PTs are shared, so they stay.
         delete pdt;
     }
 
-    // Remove all pending signals.
+    // Remove all pending signals and any timer still running.
     global_kernel->get_signal_manager()->purge_process(this);
+    global_kernel->get_timers()->cancel(timer);
+
+    // Forget any I/O rings. Their memory is about to go anyway. A process that
+    // has been moved from isn't in the table and keeps nothing.
+    if (pid != 0 && global_kernel->get_proc_table().get_process(pid) == this)
+        global_kernel->get_io_rings()->purge_process(pid);
 
     // Close all file descriptors. This will only flush if it's the last
     // reference to the file.
@@ -172,6 +193,25 @@ Process::~Process()
 
 /******************************************************************************/
 
+void* Process::operator new(size_t sz)
+{
+    (void)sz;
+    void* ret_val = process_cache.allocate();
+    if (ret_val == nullptr)
+        throw klib::bad_alloc {};
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
+void Process::operator delete(void* ptr)
+{
+    process_cache.free(ptr);
+}
+
+/******************************************************************************/
+
 void Process::exec_duplicate(const Process& other)
 {
     // Copy the open file descriptors. This should just increment the file
@@ -198,16 +238,21 @@ void Process::fork_duplicate(const Process& other)
     is = other.is;
     ir = other.ir;
 
+    // Copy the ELF, which is needed for the break point and for loading pages
+    // of the binary that haven't been touched yet.
+    elf = other.elf;
+
     // Copy the size of the user space stack.
     current_stack = other.current_stack;
 
     // The entry point is irrelevant for now, but we might as copy it.
     entry_point = other.entry_point;
 
-    // The memory is complicated, as we want to copy all the pages. Delegate to
-    // the PDT. This copies from the currently loaded PDT, so it only works if
-    // the other process is active.
-    pdt->duplicate_user_space(reinterpret_cast<void*>(kernel_virtual_base));
+    // The memory is complicated, as we want to share all the pages copy on
+    // write. Delegate to the PDT. This only works if the other process is
+    // active, as its PDT must be the one loaded.
+    pdt->duplicate_user_space(*other.pdt,
+        reinterpret_cast<void*>(kernel_virtual_base));
     break_point = other.break_point;
 
     // Duplicate the file description table. We need to increment the counts of
@@ -235,6 +280,53 @@ void Process::fork_duplicate(const Process& other)
 
 /******************************************************************************/
 
+void Process::set_status(ProcStatus st)
+{
+    stat = st;
+
+    // Processes not yet in the process table can't be scheduled.
+    if (pid == 0)
+        return;
+
+    // Only runnable processes wait on a run queue. The active process comes
+    // off when it gets time and goes back on when it's swapped out.
+    if (st == ProcStatus::runnable)
+        global_kernel->get_scheduler().ready(*this);
+    else
+        global_kernel->get_scheduler().remove(*this);
+}
+
+/******************************************************************************/
+
+void Process::set_priority(unsigned pri)
+{
+    if (pri >= Scheduler::priorities)
+        pri = Scheduler::priorities - 1;
+
+    // Requeue at the new priority if waiting. The status says whether it's
+    // queued, as queued itself changes under the run queue lock when another
+    // processor steals the process.
+    if (pid != 0 && stat == ProcStatus::runnable)
+    {
+        global_kernel->get_scheduler().remove(*this);
+        priority = pri;
+        global_kernel->get_scheduler().ready(*this);
+    }
+    else
+        priority = pri;
+}
+
+/******************************************************************************/
+
+void Process::wake(void* p)
+{
+    Process* proc = static_cast<Process*>(p);
+    if (proc->stat == ProcStatus::sleeping)
+        proc->set_status(ProcStatus::runnable);
+}
+
+/******************************************************************************/
+
 void Process::swap_stack(Process& other)
 {
     klib::swap(other.kernel_stack, kernel_stack);
@@ -242,6 +334,24 @@ void Process::swap_stack(Process& other)
 
 /******************************************************************************/
 
+PageDescriptorTable* Process::new_pdt(const PageDescriptorTable& k_pdt)
+{
+    // We need to make sure the PDT is 4K aligned.
+    void* space = global_kernel->get_heap()->malloc(sizeof(PageDescriptorTable),
+        PageDescriptorTable::page_size);
+    if (space == nullptr)
+        global_kernel->panic("Failed to get heap space for a process PDT");
+
+    // Copy from the existing kernel PDT, then remove anything the kernel PDT
+    // had in user space.
+    PageDescriptorTable* ret_val = new (space) PageDescriptorTable{k_pdt};
+    ret_val->clean_user_space(reinterpret_cast<void*>(kernel_virtual_base));
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
 void Process::launch(PageDescriptorTable& k_pdt)
 {
     // Return if the ELF is not valid.
@@ -251,47 +361,24 @@ void Process::launch(PageDescriptorTable& k_pdt)
         return;
     }
 
-    // Create some space for the binary. We don't care where it is physically
-    // and we'll read the virtual addresses from the program header. We really
-    // want to create these in the new PDT, but creating them makes new PTs
-    // that need to go on the kernel heap. We'll allocate them all in the kernel
-    // PDT, copy to new one, then clean the kernel PDT.
-    elf.allocate(k_pdt);
+    // The binary isn't allocated or loaded here. Its pages are filled in by
+    // load_page() from the page fault handler as they're first touched.
 
-    // The page configuration must be set to present and user mode. It does need
-    // to be writable to copy the data to it. We might consider setting .text
-    // and .rodata to unwritable later.
-    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) | 
-        static_cast<uint32_t>(PdeSettings::writable) |
-        static_cast<uint32_t>(PdeSettings::user_access);
+    // Make the PDT for this process, sharing the kernel Page Tables.
+    if (pdt == nullptr)
+        pdt = new_pdt(k_pdt);
 
-    // Allocate pages for the stack.
-    for (uintptr_t i = kernel_virtual_base - current_stack;
-        i < kernel_virtual_base;
-        i += PageDescriptorTable::page_size)
-    {
-        if (!k_pdt.allocate(reinterpret_cast<void*>(i), conf))
-        {
-            global_kernel->panic(
-                "Failed to allocate virtual memory for new process.\n");
-            return;
-        }
-    }
+    // Give it the time page, so it can read the time without a syscall.
+    if (!pdt->map_time_page(reinterpret_cast<void*>(time_page_addr)))
+        global_kernel->syslog()->warn("Failed to map the time page.\n");
+
+    // The stack isn't allocated here either. Its pages are mapped by
+    // anonymous_page() from the page fault handler as they're first touched.
 
     // Allocate kernel stack space.
     if (kernel_stack == nullptr)
         kernel_stack = new uintptr_t[kernel_stack_size / sizeof(kernel_stack)];
 
-    // We need to make sure the PDT is 4K aligned.
-    pdt = static_cast<PageDescriptorTable*>(
-        global_kernel->get_heap()->malloc(sizeof(PageDescriptorTable),
-        PageDescriptorTable::page_size));
-    // Copy from the existing kernel PDT.
-    pdt = new (pdt) PageDescriptorTable{k_pdt};
-
-    // Now clean all the user space mappings from the kernel PDT.
-//    k_pdt.clean_user_space(reinterpret_cast<void*>(kernel_virtual_base));
-
     // Set up the interrupt stack state. The values of parity etc. in eflags
     // doesn't really matter. We'll get sensible values for the reserved ones by
     // using the current values.
@@ -303,13 +390,8 @@ void Process::launch(PageDescriptorTable& k_pdt)
         global_kernel->get_gdt().user_mode_ds().val()
         };
 
-    // Merge user space mappings for this process into the kernel page
-    // descriptor table.
-//    global_kernel->get_pdt()->update_user_space(*pdt,
-//        reinterpret_cast<void*>(kernel_virtual_base));
-
-    // Copy the binary from the ELF to the virtual mapping we created for it.
-    elf.load();
+    // Switch to the PDT for this process.
+    pdt->load();
 
     // Set the state to active so we don't reload the PDT in resume().
     stat = ProcStatus::active;
@@ -331,23 +413,29 @@ void Process::launch(PageDescriptorTable& k_pdt)
 
 void Process::resume()
 {
-    // Reload the PDT for this process.
-    // This is fairly expensive. We'll skip it if this is already the active
-    // process.
+    // Load the PDT for this process. The kernel mappings are global, so only
+    // the user space ones get flushed from the TLB. We'll skip it if this is
+    // already the active process.
     if (stat != ProcStatus::active)
-        global_kernel->get_pdt()->update_user_space(*pdt,
-            reinterpret_cast<void*>(kernel_virtual_base));
+        pdt->load();
+
+    // Interrupts stay off until the launch, so the switch in progress can be
+    // unblocked now.
+    disable_interrupts();
+    switch_blocked_for_switch = false;
 
+    uintptr_t* kstack = kernel_stack +
+        kernel_stack_size / sizeof(kernel_stack) - sizeof(uintptr_t);
     if (is.eip() >= kernel_virtual_base)
     {
         // Set the TSS. This isn't actually necessary yet, but it needs to be
         // ready for when whatever syscall the process was executing irets back
         // to user mode.
-        global_kernel->get_tss().set_esp(kernel_stack +
-        kernel_stack_size / sizeof(kernel_stack) - sizeof(uintptr_t));
+        global_kernel->get_tss().set_esp(kstack);
         // Update the status.
         stat = ProcStatus::active;
-        // Transfer to assembly to iret.
+        // Transfer to assembly to iret. The process carries on in the kernel,
+        // so keeps the kernel lock.
         launch_kernel_process(ir.edi(),
                               ir.esi(),
                               ir.ebp(),
@@ -364,11 +452,10 @@ void Process::resume()
     else
     {
         // Set the TSS.
-        global_kernel->get_tss().set_esp(kernel_stack +
-        kernel_stack_size / sizeof(kernel_stack) - sizeof(uintptr_t));
+        global_kernel->get_tss().set_esp(kstack);
         // Update the status.
         stat = ProcStatus::active;
-        // Transfer to assembly to iret.
+        // Transfer to assembly to iret, which gives up the kernel lock.
         launch_process(ir.edi(),
                        ir.esi(),
                        ir.ebp(),
@@ -381,7 +468,8 @@ void Process::resume()
                        is.cs(),
                        is.eflags(),
                        is.esp(),
-                       is.ss());
+                       is.ss(),
+                       reinterpret_cast<uintptr_t>(kstack));
     }
 }
 
@@ -472,30 +560,44 @@ int Process::set_user_stack(size_t sz)
     if (kernel_virtual_base - sz < reinterpret_cast<uintptr_t>(break_point))
         return -1;
 
-    // The page configuration must be set to present, user mode and
-    // writable.
+    // Just record the new size. Pages are mapped by anonymous_page() when
+    // they're first touched.
+    current_stack = sz;
+
+    return 0;
+}
+
+/******************************************************************************/
+
+int Process::anonymous_page(const void* virt_addr, bool write)
+{
+    uintptr_t v_addr = reinterpret_cast<uintptr_t>(virt_addr);
+
+    // Check the address is in the heap or the stack.
+    bool heap = virt_addr >= elf.get_break_point() && virt_addr < break_point;
+    bool stack = v_addr >= kernel_virtual_base - current_stack &&
+        v_addr < kernel_virtual_base;
+    if (!heap && !stack)
+        return -1;
+
+    // Reads can share the zero page until something is written. This PDT is
+    // the one loaded, so the mapping is live straight away.
+    if (!write)
+        return (pdt->map_zero_page(virt_addr) ? 0 : -1);
+
     uint32_t conf = static_cast<uint32_t>(PdeSettings::present) | 
         static_cast<uint32_t>(PdeSettings::writable) |
         static_cast<uint32_t>(PdeSettings::user_access);
+    return (pdt->allocate_zeroed(virt_addr, conf) ? 0 : -1);
+}
 
-    // Increase the current stack size to match the new size.
-    bool pdt_changed;
-    while (current_stack < sz)
-    {
-        void* new_stack = reinterpret_cast<void*>(kernel_virtual_base -
-            current_stack - PageDescriptorTable::page_size);
-        if (!pdt->allocate(new_stack, conf))
-            return -1;
-        pdt_changed = true;
-        current_stack += PageDescriptorTable::page_size;
-    }
-
-    // Update the kernel PDT.
-    if (pdt_changed)
-        global_kernel->get_pdt()->update_user_space(*pdt,
-            reinterpret_cast<void*>(kernel_virtual_base));
+/******************************************************************************/
 
-    return 0;
+int Process::load_page(const void* virt_addr)
+{
+    // Allocate in this process's PDT, which is the one loaded, so the page can
+    // be filled through its user space address.
+    return (elf.allocate(*pdt, virt_addr) ? 0 : -1);
 }
 
 /******************************************************************************/
@@ -512,51 +614,24 @@ int Process::brk(void* addr)
     if (addr < elf.get_break_point())
         return -1;
 
-    // Round the requested address up to a page boundary.
-    uintptr_t addr_top = v_addr - v_addr % PageDescriptorTable::page_size +
-        PageDescriptorTable::page_size;
+    // The heap covers pages up to the first page boundary at or above the
+    // break point.
+    uintptr_t addr_top = (v_addr + PageDescriptorTable::page_size - 1) &
+        ~(PageDescriptorTable::page_size - 1);
+    uintptr_t bp_top = (v_bp + PageDescriptorTable::page_size - 1) &
+        ~(PageDescriptorTable::page_size - 1);
     if (addr_top >= kernel_virtual_base - current_stack)
         return -1;
 
-    // Round the current address down to the highest allocated page start.
-    uintptr_t break_bot;
-    if (v_bp % PageDescriptorTable::page_size == 0)
-        break_bot = v_bp - PageDescriptorTable::page_size;
-    else
-        break_bot = v_bp - v_bp % PageDescriptorTable::page_size;
-
-    // The page configuration must be set to present, user mode and
-    // writable.
-    uint32_t conf = static_cast<uint32_t>(PdeSettings::present) | 
-        static_cast<uint32_t>(PdeSettings::writable) |
-        static_cast<uint32_t>(PdeSettings::user_access);
-
-    // Test whether we need to allocate more pages.
-    bool pdt_changed;
-    while (v_addr > break_bot + PageDescriptorTable::page_size)
-    {
-        if (!pdt->allocate(
-            reinterpret_cast<void*>(break_bot + PageDescriptorTable::page_size),
-            conf))
-            return -1;
-        break_bot += PageDescriptorTable::page_size;
-        pdt_changed = true;
-    }
-    // Test whether we need to deallocate pages.
-    while (addr_top <= v_bp)
-    {
-        pdt->free(reinterpret_cast<void*>(v_bp));
-        v_bp -= PageDescriptorTable::page_size;
-        pdt_changed = true;
-    }
+    // Growing just moves the break point, pages are mapped by anonymous_page()
+    // when they're first touched. When shrinking, free any pages that have
+    // been touched.
+    for (uintptr_t page = addr_top; page < bp_top;
+        page += PageDescriptorTable::page_size)
+        pdt->free(reinterpret_cast<void*>(page));
 
     break_point = static_cast<uintptr_t*>(addr);
 
-    // Update the kernel PDT.
-    if (pdt_changed)
-        global_kernel->get_pdt()->update_user_space(*pdt,
-            reinterpret_cast<void*>(kernel_virtual_base));
-
     return 0;
 }
 
@@ -0,0 +1,57 @@
+#include "Rcu.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupt.h"
+#include "Kernel.h"
+#include "Scheduler.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+unsigned Rcu::read_lock()
+{
+    while (true)
+    {
+        // If a grace period started between reading the epoch and joining it,
+        // the writer may already have stopped looking at it, so join the new
+        // one instead.
+        unsigned e = epoch.load();
+        readers(e).fetch_add(1);
+        if (epoch.load() == e)
+            return e;
+        readers(e).fetch_sub(1);
+    }
+}
+
+/******************************************************************************/
+
+void Rcu::read_unlock(unsigned token)
+{
+    readers(token).fetch_sub(1, klib::memory_order_release);
+}
+
+/******************************************************************************/
+
+void Rcu::synchronize()
+{
+    LockGuard<Mutex> lk {writer};
+
+    // Send new readers to the other epoch, then wait for the old one to
+    // empty. Readers that slept or were preempted need the processor to get
+    // out, so give it up while waiting if there's a process to do it.
+    unsigned old = epoch.load();
+    epoch.store(old ^ 1);
+    while (readers(old).load(klib::memory_order_acquire) != 0)
+    {
+        if (!switch_blocked_for_init &&
+            global_kernel->get_scheduler().get_last() != 0)
+            global_kernel->get_scheduler().yield();
+        else
+            cpu_relax();
+    }
+}
+
+/******************************************************************************
+ ******************************************************************************/
@@ -19,7 +19,7 @@ void rtti_test()
     dest << "RTTI tests\n";
     dest << "Type of Kernel is " << typeid(k).name() << '\n';
     dest << "Type of kernel Scheduler is " << typeid(k.get_scheduler()).name() << '\n';
-    RoundRobin s {};
+    RoundRobin s {0};
     dest << "Type of RoundRobin is " << typeid(s).name() << '\n';
     if (typeid(s) == typeid(k.get_scheduler()))
         dest << "Scheduler types match.\n";
@@ -1,11 +1,18 @@
 #include "Scheduler.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include "Gdt.h"
+#include "interrupt.h"
 #include "Kernel.h"
 #include "Logger.h"
+#include "PageDescriptorTable.h"
+#include "Pit.h"
 #include "Process.h"
 #include "ProcTable.h"
+#include "Smp.h"
+#include "TimerWheel.h"
 
 /******************************************************************************
  ******************************************************************************/
@@ -22,8 +29,6 @@ void RoundRobin::next_proc(const InterruptRegisters& ir,
         const InterruptStack& is)
 {
 //    global_kernel->syslog()->info("RoundRobin: beginning next_proc\n");
-    // TODO Timed sleeping processes will have their clocks decremented here.
-
     // Reference to the process table, for convenience.
     ProcTable& tab = global_kernel->get_proc_table();
 
@@ -32,42 +37,84 @@ void RoundRobin::next_proc(const InterruptRegisters& ir,
         // to shutdown.
         global_kernel->shutdown();
 
-    // This loop means that if we don't find a runnable process in the table,
-    // we'll just keep looping here.
-    auto it = tab.find(current_proc);
-    for (++it; true; ++it)
+    // The current process keeps running if nothing of at least its priority
+    // is waiting. If it can't keep running, because it's gone to sleep, and
+    // nothing else is runnable, we switch to the idle task. A current_proc of
+    // 0 means the idle task is running. The next process comes off the queue
+    // straight away, so no other processor can steal it.
+    Process* cur = tab.get_process(current_proc);
+    bool cur_active = cur != nullptr && cur->get_status() == ProcStatus::active;
+    guard.lock();
+    Process* next = peek();
+    if (next != nullptr && cur_active && next->priority > cur->priority)
+        next = nullptr;
+    if (next != nullptr)
+        unlink(*next);
+    guard.unlock();
+
+    if (next == nullptr)
     {
-        if (it == tab.end())
-            it = tab.begin();
-
-        // Select the first runnable process. Active means we've looped back to
-        // the previously running process, which is also fine.
-        if (it->second->get_status() == ProcStatus::runnable ||
-            it->second->get_status() == ProcStatus::active)
-            break;
+        // If we aren't changing process, we don't need to swap anything. The
+        // interrupt can just unwind and iret to the active process, or to the
+        // idle task.
+        if (cur_active || current_proc == 0)
+            return;
+        tab.swap_out(current_proc, ir, is);
+        current_proc = 0;
+        launch_idle();
     }
 
-    // If we're changing process, swap out the old one and swap in the new
-    // one.
-    if (it->second->get_status() != ProcStatus::active)
+    // Leaving the idle task, which stopped the timer.
+    if (in_idle)
     {
-        tab.swap_out(current_proc, ir, is);
-        current_proc = it->first;
-        if(!tab.swap_in(current_proc))
-            // Swapping the process in failed for some reason. Panic for
-            // now.
-            global_kernel->panic("Failed to swap in process with PID %d",
-                current_proc);
+        Smp* smp = global_kernel->get_smp();
+        if (smp != nullptr)
+            smp->start_timer();
+        in_idle = false;
     }
 
-    // If we aren't changing process, we don't need to swap anything. The
-    // interrupt can just unwind and iret to the active process.
+    // Swap out the old process, which puts it on the back of its queue if it's
+    // still runnable, and swap in the new one. The new one might be the old
+    // one, if it was asleep and the only thing to wake up. The idle task has
+    // nothing to save.
+    if (current_proc != 0)
+        tab.swap_out(current_proc, ir, is);
+    current_proc = next->get_pid();
+    if(!tab.swap_in(current_proc))
+        // Swapping the process in failed for some reason. Panic for
+        // now.
+        global_kernel->panic("Failed to swap in process with PID %d",
+            current_proc);
 
 //    global_kernel->syslog()->info("RoundRobin: ending next_proc\n");
 }
 
 /******************************************************************************/
 
+void RoundRobin::ready(Process& p)
+{
+    RoundRobin& rq = lock_home(p);
+    bool added = !p.queued;
+    if (added)
+        rq.push(p);
+    rq.guard.unlock();
+
+    if (added)
+        kick(rq);
+}
+
+/******************************************************************************/
+
+void RoundRobin::remove(Process& p)
+{
+    RoundRobin& rq = lock_home(p);
+    if (p.queued)
+        rq.unlink(p);
+    rq.guard.unlock();
+}
+
+/******************************************************************************/
+
 void RoundRobin::start(size_t init)
 {
     // Reference to the process table, for convenience.
@@ -104,5 +151,241 @@ void RoundRobin::yield()
     asm_yield();
 }
 
+/******************************************************************************/
+
+RoundRobin& RoundRobin::of(size_t n)
+{
+    return static_cast<RoundRobin&>(global_kernel->get_scheduler(n));
+}
+
+/******************************************************************************/
+
+RoundRobin& RoundRobin::lock_home(Process& p)
+{
+    // Stealing changes the processor with both queues locked, so once the
+    // queue is locked, the process stays put if it's still the right one.
+    while (true)
+    {
+        RoundRobin& rq = of(p.cpu);
+        rq.guard.lock();
+        if (p.cpu == rq.cpu)
+            return rq;
+        rq.guard.unlock();
+    }
+}
+
+/******************************************************************************/
+
+void RoundRobin::push(Process& p)
+{
+    // Add to the tail.
+    unsigned pri = p.priority;
+    p.run_prev = tails[pri];
+    p.run_next = nullptr;
+    if (tails[pri] != nullptr)
+        tails[pri]->run_next = &p;
+    else
+        heads[pri] = &p;
+    tails[pri] = &p;
+    p.queued = true;
+    ready_map |= 1u << pri;
+    ++length;
+}
+
+/******************************************************************************/
+
+void RoundRobin::unlink(Process& p)
+{
+    unsigned pri = p.priority;
+    if (p.run_prev != nullptr)
+        p.run_prev->run_next = p.run_next;
+    else
+        heads[pri] = p.run_next;
+    if (p.run_next != nullptr)
+        p.run_next->run_prev = p.run_prev;
+    else
+        tails[pri] = p.run_prev;
+    p.run_prev = nullptr;
+    p.run_next = nullptr;
+    p.queued = false;
+    --length;
+
+    if (heads[pri] == nullptr)
+        ready_map &= ~(1u << pri);
+}
+
+/******************************************************************************/
+
+Process* RoundRobin::peek() const
+{
+    if (ready_map == 0)
+        return nullptr;
+
+    // The lowest set bit is the highest priority.
+    return heads[__builtin_ctz(ready_map)];
+}
+
+/******************************************************************************/
+
+bool RoundRobin::steal()
+{
+    Smp* smp = global_kernel->get_smp();
+    if (smp == nullptr)
+        return false;
+
+    // Pick the longest queue without locking. It's only a guess, so it's
+    // checked again once locked.
+    RoundRobin* victim = nullptr;
+    for (size_t i = 0; i < smp->cpu_count(); ++i)
+    {
+        if (i == cpu || !smp->get_cpu(i).online)
+            continue;
+        RoundRobin& rq = of(i);
+        if (rq.length > 0 && (victim == nullptr || rq.length > victim->length))
+            victim = &rq;
+    }
+    if (victim == nullptr)
+        return false;
+
+    // Queues are locked in processor order, so two processors stealing from
+    // each other can't deadlock.
+    RoundRobin& first = (cpu < victim->cpu ? *this : *victim);
+    RoundRobin& second = (cpu < victim->cpu ? *victim : *this);
+    first.guard.lock();
+    second.guard.lock();
+    Process* p = victim->peek();
+    if (p != nullptr)
+    {
+        victim->unlink(*p);
+        p->cpu = cpu;
+        push(*p);
+    }
+    second.guard.unlock();
+    first.guard.unlock();
+
+    return p != nullptr;
+}
+
+/******************************************************************************/
+
+void RoundRobin::kick(RoundRobin& rq)
+{
+    Smp* smp = global_kernel->get_smp();
+    if (smp == nullptr)
+        return;
+
+    // A processor running the idle task is halted, or about to look at its
+    // queue, so its own is best. Failing that, any idle processor will steal
+    // it.
+    size_t self = this_cpu();
+    if (rq.in_idle)
+    {
+        if (rq.cpu != self)
+            smp->reschedule(rq.cpu);
+        return;
+    }
+    for (size_t i = 0; i < smp->cpu_count(); ++i)
+    {
+        if (i != self && smp->get_cpu(i).online && of(i).in_idle)
+        {
+            smp->reschedule(i);
+            return;
+        }
+    }
+}
+
+/******************************************************************************/
+
+void RoundRobin::idle()
+{
+    Pit* pit = global_kernel->get_pit();
+    TimerWheel* timers = global_kernel->get_timers();
+    Smp* smp = global_kernel->get_smp();
+
+    // Other processors can add timers while this one is halted, so the PIT
+    // can only skip ticks if there's just the one.
+    bool solo = smp == nullptr || smp->online_count() <= 1;
+
+    // Interrupts are only enabled while halted, so nothing can become runnable
+    // between checking and halting. The queues have their own lock, so the
+    // kernel lock is given up while idle, letting the other processors into
+    // the kernel.
+    disable_interrupts();
+    kernel_lock.leave();
+    while (true)
+    {
+        guard.lock();
+        bool work = peek() != nullptr;
+        guard.unlock();
+
+        if (work || steal())
+        {
+            // Get the PIT back to normal ticks before giving the process the
+            // processor. Another processor may steal it back before the kernel
+            // lock is free, in which case the yield finds nothing to run and
+            // returns.
+            kernel_lock.enter();
+            if (solo)
+                pit->resume_ticks();
+            yield();
+            disable_interrupts();
+            kernel_lock.leave();
+            continue;
+        }
+
+        // There's no point waking up for ticks where no timer expires. If an
+        // interrupt wakes something, the scheduler switches straight to it
+        // from the interrupt.
+        if (smp != nullptr)
+            smp->stop_timer();
+        if (solo)
+            pit->skip_ticks(timers->ticks_to_next());
+        wait_for_interrupt();
+    }
+}
+
+/******************************************************************************/
+
+void RoundRobin::start_idle()
+{
+    launch_idle();
+}
+
+/******************************************************************************/
+
+void RoundRobin::launch_idle()
+{
+    // Interrupt handlers nest on the idle stack, so it's as big as the kernel
+    // stack of a process.
+    constexpr size_t idle_stack_size = Process::kernel_stack_size;
+    if (idle_stack == nullptr)
+        idle_stack = new uintptr_t[idle_stack_size / sizeof(uintptr_t)];
+
+    // The process that was running might be deleted while we're idle, so stop
+    // using its PDT. Resuming a process loads its own again.
+    global_kernel->get_pdt()->load();
+
+    // Nothing can switch away from the idle task until it's running, as
+    // interrupts stay off until the launch.
+    in_idle = true;
+    disable_interrupts();
+    switch_blocked_for_switch = false;
+
+    // Start the idle task at the top of its stack, with interrupts enabled.
+    launch_kernel_process(0, 0, 0, 0, 0, 0, 0, 0,
+        reinterpret_cast<uintptr_t>(idle_entry),
+        global_kernel->get_gdt().kernel_mode_cs().val(),
+        get_eflags() | 0x200,
+        reinterpret_cast<uintptr_t>(idle_stack +
+            idle_stack_size / sizeof(uintptr_t)) - sizeof(uintptr_t));
+}
+
+/******************************************************************************/
+
+void RoundRobin::idle_entry()
+{
+    global_kernel->get_scheduler().idle();
+}
+
 /******************************************************************************
  ******************************************************************************/
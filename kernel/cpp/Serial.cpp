@@ -2,10 +2,20 @@
 
 #include <stddef.h>
 
+#include <string>
+
 #include "Device.h"
+#include "interrupt.h"
 #include "io.h"
+#include "Kernel.h"
 #include "SignalManager.h"
 
+/******************************************************************************
+ ******************************************************************************/
+
+// Times stop_interrupts() tries for the lock before going on without it.
+static constexpr size_t stop_lock_attempts = 1000000;
+
 /******************************************************************************
  ******************************************************************************/
 
@@ -28,17 +38,132 @@ Serial::Serial(SerialAddress port,
         static_cast<uint16_t>(PortOffset::modem))},
     line_status_port{static_cast<uint16_t>(static_cast<uint16_t>(data_port) +
         static_cast<uint16_t>(PortOffset::line_status))},
+    modem_status_port{static_cast<uint16_t>(static_cast<uint16_t>(data_port) +
+        static_cast<uint16_t>(PortOffset::modem_status))},
     divisor{d},
     interrupt_conf{ic},
     line_conf{lc},
     buffer_conf{bc},
-    modem_conf{mc}
+    modem_conf{mc},
+    fifo_size{1},
+    irq_driven{false},
+    tx_busy{false},
+    tx_head{0},
+    tx_tail{0},
+    rx_head{0},
+    rx_tail{0},
+    lock{}
 {
     set_divisor(d);
     set_interrupt_conf(ic),
     set_line_conf(lc);
     set_buffer_conf(bc);
     set_modem_conf(mc);
+
+    // Only a 16550A with working FIFOs says so when they're turned on.
+    if ((inb(fifo_command_port) & iir_fifo_enabled) == iir_fifo_enabled)
+        fifo_size = fifo_depth;
+}
+
+/******************************************************************************/
+
+void Serial::start_interrupts()
+{
+    LockGuard<Spinlock> lg {lock};
+    if (irq_driven)
+        return;
+
+    // Let anything written by polling finish, so the transmit interrupt means
+    // the FIFO is empty.
+    while (!transmit_buffer_empty()) ;
+    tx_busy = false;
+    irq_driven = true;
+
+    set_modem_conf(modem_conf | mcr_out2);
+    set_interrupt_conf(static_cast<uint8_t>(SerialInterrupt::rx_data) |
+        static_cast<uint8_t>(SerialInterrupt::tx_empty) |
+        static_cast<uint8_t>(SerialInterrupt::line_status));
+}
+
+/******************************************************************************/
+
+void Serial::stop_interrupts()
+{
+    // On a panic the lock may be held by whatever was interrupted, even on
+    // this processor, and never let go. Stop waiting for it after a while and
+    // carry on regardless, rather than hang and lose the message.
+    bool locked = false;
+    for (size_t i = 0; i < stop_lock_attempts && !locked; ++i)
+    {
+        locked = lock.try_lock();
+        if (!locked)
+            cpu_relax();
+    }
+
+    if (irq_driven)
+    {
+        set_interrupt_conf(0);
+        set_modem_conf(modem_conf & ~mcr_out2);
+        drain();
+        tx_busy = false;
+        irq_driven = false;
+    }
+    while (!transmit_buffer_empty()) ;
+
+    if (locked)
+        lock.unlock();
+}
+
+/******************************************************************************/
+
+void Serial::handle_interrupt()
+{
+    bool received = false;
+    bool space = false;
+
+    lock.lock();
+    uint8_t iir;
+    while (!((iir = inb(fifo_command_port)) & iir_none))
+    {
+        switch (iir & iir_id_mask)
+        {
+        case iir_rx_data: case iir_rx_timeout:
+            // Take everything in the FIFO. Characters are dropped if the ring
+            // is full.
+            while (receive_buffer_full())
+            {
+                char c = static_cast<char>(inb(data_port));
+                if (rx_tail - rx_head < rx_size)
+                    rx_buf[rx_tail++ & (rx_size - 1)] = c;
+                received = true;
+            }
+            break;
+        case iir_tx_empty:
+        {
+            bool full = (tx_tail - tx_head == tx_size);
+            if (send_from_ring() == 0)
+                tx_busy = false;
+            else if (full)
+                space = true;
+            break;
+        }
+        case iir_line_status:
+            // Reading the status clears the error.
+            inb(line_status_port);
+            break;
+        case iir_modem_status:
+            inb(modem_status_port);
+            break;
+        }
+    }
+    lock.unlock();
+
+    // Let pollers know, now the lock is released.
+    SignalManager* sig = global_kernel->get_signal_manager();
+    if (sig != nullptr && received)
+        sig->notify_file(this, PollType::pollin);
+    if (sig != nullptr && space)
+        sig->notify_file(this, PollType::pollout);
 }
 
 /******************************************************************************/
@@ -94,16 +219,45 @@ void Serial::set_modem_conf(uint8_t mc)
 
 void Serial::write_char(char c)
 {
-    // Wait until the buffer is empty.
-    flush();
-    // Send data.
-    outb(static_cast<uint8_t>(c), data_port);
+    if (!irq_driven)
+    {
+        // Wait until the buffer is empty.
+        flush();
+        // Send data.
+        outb(static_cast<uint8_t>(c), data_port);
+        return;
+    }
+
+    LockGuard<Spinlock> lg {lock};
+
+    // If the ring is full, make room by feeding the port directly. This only
+    // happens if characters are written faster than the line can take them
+    // for a long time.
+    while (tx_tail - tx_head == tx_size)
+    {
+        while (!transmit_buffer_empty()) ;
+        send_from_ring();
+    }
+
+    tx_buf[tx_tail++ & (tx_size - 1)] = c;
+
+    // Start the port off if it's idle. Otherwise the transmit interrupt picks
+    // the character up.
+    if (!tx_busy)
+    {
+        send_from_ring();
+        tx_busy = true;
+    }
 }
 
 /******************************************************************************/
 
 int Serial::flush()
 {
+    // The interrupt handler sends what's on the ring.
+    if (irq_driven)
+        return 0;
+
     // Wait until the buffer is empty.
     while (!transmit_buffer_empty()) ;
     return 0;
@@ -113,8 +267,9 @@ int Serial::flush()
 
 int Serial::close()
 {
-    // Wait until the buffer is empty.
-    return flush();
+    LockGuard<Spinlock> lg {lock};
+    drain();
+    return 0;
 }
 
 /******************************************************************************/
@@ -123,6 +278,19 @@ PollType Serial::poll_check(PollType cond) const
 {
     PollType ret_val = PollType::pollnone;
 
+    // When interrupt driven, look at the rings rather than the port.
+    if (irq_driven)
+    {
+        LockGuard<Spinlock> lg {lock};
+        if ((cond & PollType::pollout) != PollType::pollnone &&
+            tx_tail - tx_head < tx_size)
+            ret_val |= PollType::pollout;
+        if ((cond & PollType::pollin) != PollType::pollnone &&
+            rx_tail != rx_head)
+            ret_val |= PollType::pollin;
+        return ret_val;
+    }
+
     // Check if we're ready to write by looking at the transmit buffer.
     if ((cond & PollType::pollout) != PollType::pollnone &&
         transmit_buffer_empty())
@@ -137,6 +305,38 @@ PollType Serial::poll_check(PollType cond) const
 
 /******************************************************************************/
 
+klib::string Serial::read_chars(size_t count)
+{
+    klib::string ret_val;
+
+    // Without interrupts, take whatever the port has.
+    if (!irq_driven)
+    {
+        while ((count == 0 || ret_val.size() < count) &&
+            receive_buffer_full())
+            ret_val += static_cast<char>(inb(data_port));
+        return ret_val;
+    }
+
+    // Make room first, so nothing is allocated with the lock held. More may
+    // arrive in the meantime, but it can wait for next time.
+    lock.lock();
+    size_t avail = rx_tail - rx_head;
+    lock.unlock();
+    if (count == 0 || count > avail)
+        count = avail;
+    ret_val.reserve(count);
+
+    lock.lock();
+    while (ret_val.size() < count && rx_head != rx_tail)
+        ret_val += rx_buf[rx_head++ & (rx_size - 1)];
+    lock.unlock();
+
+    return ret_val;
+}
+
+/******************************************************************************/
+
 bool Serial::transmit_buffer_empty() const
 {
     // The buffer is empty if bit 5 of the line status register is set.
@@ -153,5 +353,28 @@ bool Serial::receive_buffer_full() const
     return (data & 0x1);
 }
 
+/******************************************************************************/
+
+uint32_t Serial::send_from_ring()
+{
+    uint32_t n = 0;
+    for (; n < fifo_size && tx_head != tx_tail; ++n)
+        outb(static_cast<uint8_t>(tx_buf[tx_head++ & (tx_size - 1)]),
+            data_port);
+    return n;
+}
+
+/******************************************************************************/
+
+void Serial::drain()
+{
+    while (tx_head != tx_tail)
+    {
+        while (!transmit_buffer_empty()) ;
+        send_from_ring();
+    }
+    while (!transmit_buffer_empty()) ;
+}
+
 /******************************************************************************
  ******************************************************************************/
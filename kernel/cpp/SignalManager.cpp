@@ -1,13 +1,18 @@
 #include "SignalManager.h"
 
+#include <limits>
+#include <map>
 #include <vector>
 
 #include "Device.h"
+#include "interrupt.h"
 #include "Kernel.h"
 #include "Logger.h"
 #include "Process.h"
 #include "ProcTable.h"
+#include "Pit.h"
 #include "Scheduler.h"
+#include "TimerWheel.h"
 
 /******************************************************************************
  ******************************************************************************/
@@ -20,9 +25,6 @@ int SignalManager::poll(pollfd* fds, size_t nfds, int timeout)
     if (timeout == 0)
         return 0;
 
-    // Block task switching.
-    switch_blocked_for_notify = true;
-
 //    global_kernel->syslog()->info("SignalManager::poll fds at %p, nfds = %u, timeout = %d\n", fds, nfds, timeout);
 //    for (size_t i = 0; i < nfds; ++i)
 //        global_kernel->syslog()->info("fds[%u]: fd = %d, events = %u, revents = %u\n", i, fds[i].fd, fds[i].events, fds[i].revents);
@@ -33,11 +35,14 @@ int SignalManager::poll(pollfd* fds, size_t nfds, int timeout)
     if (active == nullptr)
         return -1;
 
+    // The waiters are linked into the device queues by address, so make them
+    // all up front. used counts how many are on a queue.
+    poll_waiter* waiters = new poll_waiter[nfds];
+    size_t used = 0;
+
     // Cycle over events.
     // ret_count records the number of events that are immediately true.
-    // found_count records the number of valid events added to the list.
     int ret_count = 0;
-    size_t found_count = 0;
     for (size_t i = 0; i < nfds; ++i)
     {
         // Get the global file table key (return 0 if it doesn't exist).
@@ -63,9 +68,17 @@ int SignalManager::poll(pollfd* fds, size_t nfds, int timeout)
 
         PollType ret_mask {PollType::pollnone};
         if (dev != nullptr)
+        {
+            // Wait on the device before checking it, so an event between the
+            // check and going to sleep isn't missed.
+            poll_waiter& w = waiters[used++];
+            w.req = fds + i;
+            w.proc = active;
+            dev->get_wait_queue().add(w);
             // Check the current state of the device.
             ret_mask =
                 dev->poll_check(fds[i].events & PollType::pollrequestable);
+        }
         else
             // There may not be a physical device for the file, in which case
             // dev is currently a nullptr. In this case, the file exists in
@@ -76,108 +89,71 @@ int SignalManager::poll(pollfd* fds, size_t nfds, int timeout)
         {
             ++ret_count;
             fds[i].revents |= ret_mask;
-        }
-        else
-        {
-            // Add event to the list.
-            pending_polls.emplace_back(fds + i, timeout, pid);
-            ++found_count;
+            // Already counted, so no need to wait on the device.
+            if (dev != nullptr)
+            {
+                dev->get_wait_queue().remove(waiters[--used]);
+            }
         }
     }
 
     // See whether we found any valid events.
-    if (found_count == 0 && ret_count == 0)
+    if (used == 0 && ret_count == 0)
     {
-        switch_blocked_for_notify = false;
+        delete[] waiters;
         return -1;
     }
 
-    // Interrupts might have already triggered events. See how many are left.
-    size_t pid_count = 0;
-    for (const auto& p : pending_polls)
-        if (p.pid == pid && p.req->revents == PollType::pollnone)
-            ++pid_count;
-
-    // If conditions are already true, remove events from the list and return
-    // immediately.
-    if (ret_count != 0 || found_count != pid_count)
+    // If nothing is true yet, go to sleep. Set the status first, so an event
+    // firing after the last check wakes us up again straight away. Start the
+    // timeout if there is one. The timer wakes the process if nothing else has
+    // by then.
+    if (ret_count == 0)
     {
-        // Remove all pending events for this pid.
-        for (auto it = pending_polls.begin(); it != pending_polls.end(); )
+        active->set_status(ProcStatus::sleeping);
+        bool fired = false;
+        for (size_t i = 0; i < used; ++i)
+            fired = fired || waiters[i].req->revents != PollType::pollnone;
+
+        if (fired)
+            active->set_status(ProcStatus::active);
+        else
         {
-            if (it->pid == pid)
-                it = pending_polls.erase(it);
-            else
-                ++it;
+            if (timeout > 0)
+                global_kernel->get_timers()->add(active->get_timer(),
+                    global_kernel->get_pit()->ms_to_ticks(timeout));
+            global_kernel->get_scheduler().yield();
+
+            // Stop the timeout, in case an event woke us first.
+            global_kernel->get_timers()->cancel(active->get_timer());
         }
-        // Release task switching.
-        switch_blocked_for_notify = false;
-        return ret_count + found_count - pid_count;
     }
 
-    // Found events. Put the process to sleep and yield remaining time.
-    active->set_status(ProcStatus::sleeping);
-    global_kernel->get_scheduler().yield();
-
-    // Block again for the count, or we may find ourselves swapped out,
-    // allowing more events. We could still interrupt and trigger more events,
-    // but we'll deem that unlikely and not very serious.
-    switch_blocked_for_notify = true;
-
-    // We get back here after an event has fired and the process has been woken
-    // up. See how many events have fired. Wipe any pending ones for the pid. It
-    // is also possible to get here on timeout. In that case there will be no
-    // fired events and we return 0 as required.
-    pid_count = 0;
-    for (auto it = pending_polls.begin(); it != pending_polls.end(); )
+    // Take the waiters off the device queues and count the events that fired
+    // while they were there. It is also possible to get here on timeout. In
+    // that case there will be no fired events and we return 0 as required.
+    // Events which were already true have been counted.
+    for (size_t i = 0; i < used; ++i)
     {
-        if (it->pid == pid)
-        {
-            if (it->req->revents != PollType::pollnone)
-                ++pid_count;
-            it = pending_polls.erase(it);
-        }
-        else
-            ++it;
+        poll_waiter& w = waiters[i];
+        w.get_queue()->remove(w);
+        if (w.req->revents != PollType::pollnone)
+            ++ret_count;
     }
 
-    // The poll has successfully concluded after the event. Go back to whatever
-    // we were doing before.
-    switch_blocked_for_notify = false;
-    return pid_count;
+    delete[] waiters;
+    return ret_count;
 }
 
 /******************************************************************************/
 
-void SignalManager::notify_file(const Device* dev, PollType ev)
+void SignalManager::notify_file(Device* dev, PollType ev)
 {
-    // Disable block switching to make sure we scan the whole list before going
-    // elsewhere. Otherwise new polls made after this call could be concluded. 
+    // Disable block switching, so the woken processes don't run until we've
+    // been through the whole queue.
     switch_blocked_for_notify = true;
 
-    // Search through the pending events and see if any match the device and
-    // event.
-    for (auto it = pending_polls.begin(); it != pending_polls.end(); )
-    {
-        // Get the process.
-        Process* proc = pt.get_process(it->pid);
-        // If the process doesn't exist any more, remove the event.
-        if (proc == nullptr)
-            it = pending_polls.erase(it);
-        else {
-            // Get the process device.
-            Device* d = global_kernel->get_file_table()->get_dev(
-                proc->get_fd_key(it->req->fd));
-            if (d == dev && (it->req->events & ev) != PollType::pollnone)
-            {
-                // We have a match. Set the revent and wake up the process.
-                it->req->revents |= (it->req->events & ev);
-                if (proc->get_status() == ProcStatus::sleeping)
-                    proc->set_status(ProcStatus::runnable);
-            }
-            ++it;
-        }
-    }
+    dev->get_wait_queue().wake(ev);
 
     switch_blocked_for_notify = false;
 }
@@ -214,28 +190,29 @@ int SignalManager::waitpid(int pid, int* wstatus, int options)
     // without, butit would be more fiddly.
     switch_blocked_for_notify = true;
 
-    // Create the wait request and add it to the list. Get a reference to the
-    // event.
-    pending_waits.emplace_back(active_pid, child_pids, wstatus, 0, options);
-    const wait_request& wr = pending_waits.back();
-
-    // Look through the list of happened events to see if there's a match.
-    for (auto it = happened_waits.begin(); it != happened_waits.end(); ++it)
+    // Look through the events that have happened to our children to see if
+    // there's a match.
+    auto hw = happened_waits.find(active_pid);
+    if (hw != happened_waits.end())
     {
-        // TODO check the nature of the event too.
-        auto it2 =
-            klib::find(wr.wait_pids.begin(), wr.wait_pids.end(), it->pid);
-        if (it2 != wr.wait_pids.end())
+        klib::vector<wait_event>& events = hw->second;
+        for (auto it = events.begin(); it != events.end(); ++it)
         {
+            // TODO check the nature of the event too.
+            if (klib::find(child_pids.begin(), child_pids.end(), it->pid) ==
+                child_pids.end())
+                continue;
+
             // We have a match. Set the return properties.
-            const Process* child = pt.get_process(*it2);
-            if (wr.wstatus != nullptr)
-                *wr.wstatus = child->get_ret_status();
-            int ret_val = static_cast<int>(*it2);
+            const Process* child = pt.get_process(it->pid);
+            if (wstatus != nullptr)
+                *wstatus = child->get_ret_status();
+            int ret_val = static_cast<int>(it->pid);
 
-            // Remove the happened event and the request.
-            happened_waits.erase(it);
-            pending_waits.pop_back();
+            // Remove the happened event.
+            events.erase(it);
+            if (events.empty())
+                happened_waits.erase(hw);
 
             switch_blocked_for_notify = false;
             return ret_val;
@@ -243,35 +220,29 @@ int SignalManager::waitpid(int pid, int* wstatus, int options)
     }
 
     // If we've reached here, we're waiting for an event that hasn't happened
-    // yet, so put the process to sleep.
+    // yet, so make the request and put the process to sleep.
+    pending_waits[active_pid] = wait_request {child_pids, wstatus, 0, options};
     active->set_status(ProcStatus::sleeping);
     global_kernel->get_scheduler().yield();
 
     // If we've reached here, we've been woken up and the event has happened.
     // The notify event will have set the local status of the request, but not
     // user space value. It will have removed all wait PIDs from the list
-    // except the one that caused the event. The wr reference may not be valid
-    // any more, as the vector might have been reallocated, and it doesn't have
-    // to be at the back any more, but I think each process can only have one
-    // wait at a time.
-    for (auto it = pending_waits.begin(); it != pending_waits.end(); ++it)
-    {
-        if (it->pid == active_pid)
-        {
-            // Set the return values.
-            if (it->wstatus != nullptr)
-                *(it->wstatus) = it->local_wstatus;
-            int ret_val = static_cast<int>(it->wait_pids.front());
+    // except the one that caused the event.
+    auto it = pending_waits.find(active_pid);
+    if (it == pending_waits.end())
+        // We shouldn't be able to get here. Return an error.
+        return -1;
 
-            // Remove the request from the list.
-            pending_waits.erase(it);
+    // Set the return values.
+    if (it->second.wstatus != nullptr)
+        *(it->second.wstatus) = it->second.local_wstatus;
+    int ret_val = static_cast<int>(it->second.wait_pids.front());
 
-            return ret_val;
-        }
-    }
+    // Remove the request.
+    pending_waits.erase(it);
 
-    // We shouldn't be able to get here. Return an error.
-    return -1;
+    return ret_val;
 }
 
 /******************************************************************************/
@@ -281,19 +252,22 @@ void SignalManager::notify_wait(int ev)
     // Get the active process.
     size_t active_pid = global_kernel->get_scheduler().get_last();
     const Process* active = pt.get_process(active_pid);
+    if (active == nullptr)
+        return;
+    size_t parent = active->get_ppid();
 
     // Block switching. We don't want requests being added and deleted
     // underneath us.
     switch_blocked_for_notify = true;
 
-    // Search through each pending wait request.
-    for (wait_request& wr : pending_waits)
+    // Only the parent can be waiting for us.
+    auto it = pending_waits.find(parent);
+    if (it != pending_waits.end())
     {
         // TODO check the nature of the event matches.
-        // Search through the wait PIDs of the request.
-        auto it2 =
-            klib::find(wr.wait_pids.begin(), wr.wait_pids.end(), active_pid);
-        if (it2 != wr.wait_pids.end())
+        wait_request& wr = it->second;
+        if (klib::find(wr.wait_pids.begin(), wr.wait_pids.end(), active_pid) !=
+            wr.wait_pids.end())
         {
             // We have a match. Update the local status of the request. We can't
             // change the user space value as it won't be in virtual memory.
@@ -304,8 +278,8 @@ void SignalManager::notify_wait(int ev)
             wr.wait_pids = klib::vector<size_t> {active_pid};
 
             // Wake up the process.
-            Process* proc = pt.get_process(wr.pid);
-            if (proc->get_status() == ProcStatus::sleeping)
+            Process* proc = pt.get_process(parent);
+            if (proc != nullptr && proc->get_status() == ProcStatus::sleeping)
                 proc->set_status(ProcStatus::runnable);
 
             switch_blocked_for_notify = false;
@@ -313,42 +287,224 @@ void SignalManager::notify_wait(int ev)
         }
     }
 
-    // If we got here, no process is waiting for this event. Add it to the list
-    // of events that have happened.
-    happened_waits.emplace_back(active_pid, ev);
+    // If we got here, the parent isn't waiting for this event. Add it to the
+    // parent's list of events that have happened.
+    happened_waits[parent].push_back(wait_event {active_pid, ev});
     switch_blocked_for_notify = false;
 }
 
 /******************************************************************************/
 
-void SignalManager::purge_process(size_t pid)
+int SignalManager::create_interest_set()
+{
+    size_t pid = global_kernel->get_scheduler().get_last();
+    if (pt.get_process(pid) == nullptr)
+        return -1;
+
+    // Find an unused identifier, wrapping round if we run out.
+    int id = last_set;
+    do {
+        id = (id == klib::numeric_limits<int>::max() ? 1 : id + 1);
+        if (id == last_set)
+            return -1;
+    } while (interest_sets.find(id) != interest_sets.end());
+    last_set = id;
+
+    interest_sets[id] = new interest_set {pid, {}, nullptr, nullptr};
+    return id;
+}
+
+/******************************************************************************/
+
+int SignalManager::interest_ctl(int set, interest_op op, int fd,
+    PollType events)
 {
-    // Search pending polls and remove matches.
-    for (auto it = pending_polls.begin(); it != pending_polls.end(); )
+    interest_set* s = get_interest_set(set);
+    if (s == nullptr)
+        return -1;
+
+    auto it = s->fds.find(fd);
+    switch (op)
     {
-        if (it->pid == pid)
-            it = pending_polls.erase(it);
-        else
-            ++it;
+    case interest_op::add:
+    {
+        if (it != s->fds.end())
+            return -1;
+        if ((events & PollType::pollrequestable) == PollType::pollnone)
+            return -1;
+
+        // Find the device the file is on.
+        Process* active = pt.get_process(s->pid);
+        int key = active->get_fd_key(fd);
+        if (key == 0)
+            return -1;
+        Device* dev = global_kernel->get_file_table()->get_dev(key);
+
+        interest* in = new interest {s, fd, dev,
+            events & PollType::pollrequestable};
+        s->fds[fd] = in;
+
+        // Wait on the device first, then see whether it's already ready. Files
+        // without a device are always ready, so just go on the ready list.
+        if (dev != nullptr)
+            dev->get_wait_queue().add(*in);
+        if (dev == nullptr || dev->poll_check(in->events) != PollType::pollnone)
+        {
+            bool enabled = get_eflags() & 0x200;
+            disable_interrupts();
+            make_ready(*in);
+            if (enabled)
+                enable_interrupts();
+        }
+        return 0;
     }
 
-    // Search the list of wait events that have happened.
-    for (auto it = happened_waits.begin(); it != happened_waits.end(); )
+    case interest_op::mod:
     {
-        if (it->pid == pid)
-            it = happened_waits.erase(it);
-        else
-            ++it;
+        if (it == s->fds.end())
+            return -1;
+        if ((events & PollType::pollrequestable) == PollType::pollnone)
+            return -1;
+
+        interest& in = *it->second;
+        in.events = events & PollType::pollrequestable;
+        if (in.dev == nullptr ||
+            in.dev->poll_check(in.events) != PollType::pollnone)
+        {
+            bool enabled = get_eflags() & 0x200;
+            disable_interrupts();
+            make_ready(in);
+            if (enabled)
+                enable_interrupts();
+        }
+        return 0;
+    }
+
+    case interest_op::del:
+    {
+        if (it == s->fds.end())
+            return -1;
+
+        interest* in = it->second;
+        if (in->dev != nullptr)
+            in->dev->get_wait_queue().remove(*in);
+
+        // Take the entry off the ready list.
+        bool enabled = get_eflags() & 0x200;
+        disable_interrupts();
+        if (in->ready)
+        {
+            interest* prev = nullptr;
+            for (interest* r = s->ready_head; r != in; r = r->ready_next)
+                prev = r;
+            (prev == nullptr ? s->ready_head : prev->ready_next) =
+                in->ready_next;
+            if (s->ready_tail == in)
+                s->ready_tail = prev;
+        }
+        if (enabled)
+            enable_interrupts();
+
+        s->fds.erase(it);
+        delete in;
+        return 0;
+    }
+
+    default:
+        return -1;
     }
+}
+
+/******************************************************************************/
+
+int SignalManager::wait_interest(int set, pollfd* events, size_t max,
+    int timeout)
+{
+    interest_set* s = get_interest_set(set);
+    if (s == nullptr || events == nullptr || max == 0)
+        return -1;
+
+    size_t count = collect_ready(*s, events, max);
+    if (count != 0 || timeout == 0)
+        return count;
 
-    // Search the list of wait requests.
-    for (auto it = pending_waits.begin(); it != pending_waits.end(); )
+    // Nothing ready, so sleep. Set the status before looking at the ready list
+    // again, so an entry becoming ready after the check wakes us straight
+    // away.
+    Process* active = pt.get_process(s->pid);
+    active->set_status(ProcStatus::sleeping);
+    if (s->ready_head != nullptr)
     {
-        if (it->pid == pid)
-            it = pending_waits.erase(it);
+        active->set_status(ProcStatus::active);
+        return collect_ready(*s, events, max);
+    }
+
+    if (timeout > 0)
+        global_kernel->get_timers()->add(active->get_timer(),
+            global_kernel->get_pit()->ms_to_ticks(timeout));
+    global_kernel->get_scheduler().yield();
+    global_kernel->get_timers()->cancel(active->get_timer());
+
+    // Woken by an entry becoming ready or the timeout. Either way, whatever is
+    // ready now is the answer.
+    return collect_ready(*s, events, max);
+}
+
+/******************************************************************************/
+
+int SignalManager::close_interest_set(int set)
+{
+    interest_set* s = get_interest_set(set);
+    if (s == nullptr)
+        return -1;
+
+    interest_sets.erase(set);
+    destroy_interest_set(s);
+    return 0;
+}
+
+/******************************************************************************/
+
+void SignalManager::purge_process(size_t pid)
+{
+    // Wait requests from the process and events for it to collect.
+    pending_waits.erase(pid);
+    happened_waits.erase(pid);
+
+    // Events the process has caused, on its parent's list.
+    const Process* proc = pt.get_process(pid);
+    if (proc != nullptr)
+    {
+        auto hw = happened_waits.find(proc->get_ppid());
+        if (hw != happened_waits.end())
+        {
+            klib::vector<wait_event>& events = hw->second;
+            for (auto it = events.begin(); it != events.end(); )
+            {
+                if (it->pid == pid)
+                    it = events.erase(it);
+                else
+                    ++it;
+            }
+            if (events.empty())
+                happened_waits.erase(hw);
+        }
+    }
+
+    // Interest sets owned by the process.
+    for (auto it = interest_sets.begin(); it != interest_sets.end(); )
+    {
+        if (it->second->pid == pid)
+        {
+            destroy_interest_set(it->second);
+            it = interest_sets.erase(it);
+        }
         else
             ++it;
     }
+
+    // Poll waiters belong to the poll() call that made them and are gone once
+    // it returns.
 }
 
 /******************************************************************************/
@@ -365,43 +521,139 @@ void SignalManager::purge_process(const Process* proc)
         }
     }
 
-    // We didn't find the process. Guess there's nothing much to do. Orphaned
-    // events will eventually get removed by their timeouts.
+    // We didn't find the process. Guess there's nothing much to do.
 }
 
 /******************************************************************************/
 
-void SignalManager::tick_down(int tick_size)
+void SignalManager::wake_poll(Waiter& w, PollType ev)
 {
-    // Block switiching to make sure we decrease all time outs.
-    switch_blocked_for_notify = true;
+    poll_waiter& pw = static_cast<poll_waiter&>(w);
+    PollType match = pw.req->events & ev;
+    if (match == PollType::pollnone)
+        return;
+
+    // Set the revent and wake up the process.
+    pw.req->revents |= match;
+    if (pw.proc->get_status() == ProcStatus::sleeping)
+        pw.proc->set_status(ProcStatus::runnable);
+}
+
+/******************************************************************************/
+
+void SignalManager::wake_interest(Waiter& w, PollType ev)
+{
+    interest& in = static_cast<interest&>(w);
+    if ((in.events & ev) == PollType::pollnone || in.ready)
+        return;
+
+    make_ready(in);
+
+    // Wake the owner if it's waiting on the set.
+    Process* proc = global_kernel->get_proc_table().get_process(in.set->pid);
+    if (proc != nullptr && proc->get_status() == ProcStatus::sleeping)
+        proc->set_status(ProcStatus::runnable);
+}
+
+/******************************************************************************/
 
-    // Search through the pending events and decrease their timeouts.
-    for (auto it = pending_polls.begin(); it != pending_polls.end(); )
+void SignalManager::make_ready(interest& in)
+{
+    if (in.ready)
+        return;
+
+    interest_set& s = *in.set;
+    in.ready = true;
+    in.ready_next = nullptr;
+    if (s.ready_tail != nullptr)
+        s.ready_tail->ready_next = &in;
+    else
+        s.ready_head = &in;
+    s.ready_tail = &in;
+}
+
+/******************************************************************************/
+
+SignalManager::interest_set* SignalManager::get_interest_set(int set)
+{
+    auto it = interest_sets.find(set);
+    if (it == interest_sets.end())
+        return nullptr;
+    if (it->second->pid != global_kernel->get_scheduler().get_last())
+        return nullptr;
+
+    return it->second;
+}
+
+/******************************************************************************/
+
+void SignalManager::destroy_interest_set(interest_set* s)
+{
+    for (auto& p : s->fds)
+    {
+        if (p.second->dev != nullptr)
+            p.second->dev->get_wait_queue().remove(*p.second);
+        delete p.second;
+    }
+
+    delete s;
+}
+
+/******************************************************************************/
+
+size_t SignalManager::collect_ready(interest_set& s, pollfd* events, size_t max)
+{
+    // Take the ready list, leaving a new one for entries that become ready
+    // while we're looking. The entries taken stay marked as ready until
+    // they're looked at, so an interrupt can't put one on the new list and
+    // cut the old one short. Any change to them is picked up by the check.
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+    interest* list = s.ready_head;
+    s.ready_head = nullptr;
+    s.ready_tail = nullptr;
+    if (enabled)
+        enable_interrupts();
+
+    // Ask the device whether each entry is still ready. Entries that are go
+    // back on the list, so they're reported next time too until the condition
+    // goes away.
+    size_t count = 0;
+    while (list != nullptr)
     {
-        // Only consider positive values, negative disables timeout.
-        if (it->time_left >= 0)
+        disable_interrupts();
+        interest* in = list;
+        list = in->ready_next;
+        in->ready = false;
+
+        if (count == max)
         {
-            it->time_left -= tick_size;
-            if (it->time_left <= 0)
-            {
-                // Get the process.
-                Process* proc = pt.get_process(it->pid);
-                // If the process doesn't exist any more, remove the event.
-                if (proc == nullptr)
-                {
-                    it = pending_polls.erase(it);
-                    continue;
-                }
-                // Wake up timed out processes.
-                if (proc->get_status() == ProcStatus::sleeping)
-                    proc->set_status(ProcStatus::runnable);
-            }
+            // No room, but it still needs looking at next time.
+            make_ready(*in);
+            if (enabled)
+                enable_interrupts();
+            continue;
         }
-        ++it;
+        if (enabled)
+            enable_interrupts();
+
+        PollType revents = (in->dev == nullptr ? in->events :
+            in->dev->poll_check(in->events));
+        if (revents == PollType::pollnone)
+            continue;
+
+        events[count].fd = in->fd;
+        events[count].events = in->events;
+        events[count].revents = revents;
+        ++count;
+
+        disable_interrupts();
+        make_ready(*in);
+        if (enabled)
+            enable_interrupts();
     }
 
-    switch_blocked_for_notify = false;
+    return count;
 }
 
 /******************************************************************************
@@ -0,0 +1,575 @@
+#include "Smp.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <ostream>
+
+#include "Apic.h"
+#include "Gdt.h"
+#include "Idt.h"
+#include "interrupt.h"
+#include "InterruptHandler.h"
+#include "io.h"
+#include "Kernel.h"
+#include "Lock.h"
+#include "Logger.h"
+#include "PageDescriptorTable.h"
+#include "PageFrameAllocator.h"
+#include "Pic.h"
+#include "Pit.h"
+#include "Process.h"
+#include "Scheduler.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+// Firmware tables are packed, so fields may not be aligned. These read little
+// endian values a byte at a time.
+static uint16_t read16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) |
+        (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Where the application processors enter the kernel, from the trampoline.
+static void ap_start(size_t n)
+{
+    global_kernel->get_smp()->ap_main(n);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+Smp::Smp() :
+    ncpus{0},
+    lapic_phys{0},
+    lapic{nullptr},
+    ioapics{},
+    imcr{false},
+    io_routing{false},
+    timer_count{0},
+    scheduling{false}
+{
+    for (size_t i = 0; i < cpu_of_apic.size(); ++i)
+        cpu_of_apic[i] = 0xFF;
+    // Without overrides, ISA interrupts are edge triggered, active high, on the
+    // GSI of the same number.
+    for (size_t i = 0; i < isa_irqs; ++i)
+        isa[i] = IsaRoute{i, false, false};
+
+    if (!read_madt() && !read_mp_table())
+        global_kernel->syslog()->info("No ACPI MADT or MP tables found\n");
+
+    if (lapic_phys == 0 || ncpus == 0)
+    {
+        // Just the bootstrap processor, through the PIC.
+        for (IoApic* io : ioapics)
+            delete io;
+        ioapics.clear();
+        ncpus = 1;
+        cpus[0] = Cpu{0, true, nullptr};
+        return;
+    }
+
+    lapic = new LocalApic {lapic_phys};
+
+    // Make sure the bootstrap processor is number 0.
+    uint8_t bsp = lapic->id();
+    if (cpu_of_apic[bsp] == 0xFF)
+    {
+        if (ncpus == max_cpus)
+            --ncpus;
+        add_cpu(bsp);
+    }
+    size_t n = cpu_of_apic[bsp];
+    if (n != 0)
+    {
+        Cpu tmp = cpus[0];
+        cpus[0] = cpus[n];
+        cpus[n] = tmp;
+        cpu_of_apic[cpus[0].apic_id] = 0;
+        cpu_of_apic[cpus[n].apic_id] = n;
+    }
+    cpus[0].online = true;
+
+    lapic->enable(spurious_vector);
+}
+
+/******************************************************************************/
+
+void Smp::dump(klib::ostream& dest) const
+{
+    dest << "SMP configuration:\n";
+    dest << "  Local APIC physical address: "
+         << reinterpret_cast<void*>(lapic_phys) << '\n';
+    dest << "  Processors: " << ncpus << '\n';
+    for (size_t i = 0; i < ncpus; ++i)
+        dest << "    " << i << ": APIC ID "
+             << static_cast<unsigned>(cpus[i].apic_id)
+             << (cpus[i].online ? ", online\n" : "\n");
+    dest << "  I/O APICs: " << ioapics.size() << '\n';
+    dest << "  ISA interrupt overrides:\n";
+    for (size_t i = 0; i < isa_irqs; ++i)
+    {
+        if (isa[i].gsi == i && !isa[i].active_low && !isa[i].level)
+            continue;
+        dest << "    IRQ " << i << " -> GSI " << isa[i].gsi
+             << (isa[i].active_low ? ", active low" : ", active high")
+             << (isa[i].level ? ", level\n" : ", edge\n");
+    }
+    dest << "  IMCR present: " << (imcr ? "yes" : "no") << '\n';
+
+    dest.flush();
+}
+
+/******************************************************************************/
+
+size_t Smp::online_count() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < ncpus; ++i)
+        if (cpus[i].online)
+            ++count;
+    return count;
+}
+
+/******************************************************************************/
+
+size_t Smp::this_cpu() const
+{
+    if (lapic == nullptr)
+        return 0;
+
+    uint8_t n = cpu_of_apic[lapic->id()];
+    return (n == 0xFF ? 0 : n);
+}
+
+/******************************************************************************/
+
+void Smp::route_isa_irqs()
+{
+    if (ioapics.empty() || lapic == nullptr)
+        return;
+
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    // Some systems that use the MP tables start with the PIC wired straight
+    // to the processor, with the IMCR in the way of the APIC.
+    if (imcr)
+    {
+        outb(0x70, 0x22);
+        outb(0x01, 0x23);
+    }
+
+    // Same vectors as the PIC, so the handlers don't care where interrupts
+    // came from. IRQ 2 is the PIC cascade, which doesn't exist here.
+    for (uint8_t irq = 0; irq < isa_irqs; ++irq)
+    {
+        if (irq == 2)
+            continue;
+        IoApic* io = ioapic_for(isa[irq].gsi);
+        if (io == nullptr)
+            continue;
+        io->route(isa[irq].gsi,
+            static_cast<uint8_t>(InterruptNumber::pic1_start) + irq,
+            cpus[0].apic_id, isa[irq].active_low, isa[irq].level);
+    }
+
+    // The PIC stays initialised with its vectors out of the way, but silent.
+    global_kernel->get_pic()->set_mask(PicType::master, PicMask::disable);
+    global_kernel->get_pic()->set_mask(PicType::slave, PicMask::disable);
+    io_routing = true;
+
+    // Keep the clock going.
+    set_irq_masked(0, false);
+
+    if (enabled)
+        enable_interrupts();
+
+    global_kernel->syslog()->info("Routing ISA interrupts through I/O APIC\n");
+}
+
+/******************************************************************************/
+
+void Smp::set_irq_masked(uint8_t irq, bool masked)
+{
+    if (!io_routing || irq >= isa_irqs || irq == 2)
+        return;
+
+    IoApic* io = ioapic_for(isa[irq].gsi);
+    if (io != nullptr)
+        io->set_masked(isa[irq].gsi, masked);
+}
+
+/******************************************************************************/
+
+void Smp::start_aps()
+{
+    if (ncpus < 2 || lapic == nullptr)
+        return;
+
+    Pit* pit = global_kernel->get_pit();
+
+    // All the local APIC timers run off the same clock, so measure once here.
+    uint32_t per_ms = lapic->calibrate_timer(*pit);
+    timer_count = per_ms * (pit->period() == 0 ? 1 : pit->period());
+    global_kernel->syslog()->info("Local APIC timer counts %u per ms\n",
+        per_ms);
+
+    // The trampoline needs the first 4MB identity mapped to turn on paging.
+    void* pdt_copy = global_kernel->get_pdt()->identity_copy();
+    if (pdt_copy == nullptr)
+    {
+        global_kernel->syslog()->warn(
+            "No memory for application processor page table\n");
+        return;
+    }
+
+    // Copy the trampoline to low memory and fill in the fields. The first MB
+    // is never handed out by the page frame allocator, so it's free.
+    char* tramp = static_cast<char*>(
+        phys_to_virt(reinterpret_cast<void*>(trampoline_page)));
+    klib::memcpy(tramp, ap_trampoline_start,
+        ap_trampoline_end - ap_trampoline_start);
+    uint32_t* cr3_field = reinterpret_cast<uint32_t*>(
+        tramp + (ap_cr3 - ap_trampoline_start));
+    uint32_t* stack_field = reinterpret_cast<uint32_t*>(
+        tramp + (ap_stack - ap_trampoline_start));
+    uint32_t* entry_field = reinterpret_cast<uint32_t*>(
+        tramp + (ap_entry - ap_trampoline_start));
+    uint32_t* index_field = reinterpret_cast<uint32_t*>(
+        tramp + (ap_index - ap_trampoline_start));
+    *cr3_field = reinterpret_cast<uint32_t>(pdt_copy);
+    *entry_field = reinterpret_cast<uint32_t>(&ap_start);
+
+    // One at a time, since they share the trampoline.
+    for (size_t n = 1; n < ncpus; ++n)
+    {
+        Cpu& c = cpus[n];
+        constexpr size_t words = stack_size / sizeof(uintptr_t);
+        c.stack = new uintptr_t[words];
+        *stack_field = reinterpret_cast<uint32_t>(c.stack + words);
+        *index_field = n;
+
+        // INIT, then up to two startups, as the MP specification says.
+        lapic->send_init(c.apic_id);
+        pit->sleep(10);
+        for (int i = 0; i < 2 && !c.online; ++i)
+        {
+            lapic->send_startup(c.apic_id, trampoline_page);
+            pit->sleep(1);
+        }
+
+        // Give it a while to get going.
+        for (int i = 0; i < 10 && !c.online; ++i)
+            pit->sleep(10);
+
+        if (!c.online)
+            global_kernel->syslog()->warn(
+                "Processor with APIC ID %u did not start\n", c.apic_id);
+    }
+
+    // Any processor that hasn't arrived by now isn't coming, so the identity
+    // map can go.
+    PageFrameAllocator{}.free(pdt_copy);
+}
+
+/******************************************************************************/
+
+void Smp::start_scheduling()
+{
+    start_timer();
+    scheduling = true;
+}
+
+/******************************************************************************/
+
+void Smp::ap_main(size_t n)
+{
+    // Off the trampoline page table and onto the kernel's, then the kernel
+    // segments, this processor's TSS and interrupts.
+    global_kernel->get_pdt()->load();
+    global_kernel->get_gdt().load_secondary(n);
+    global_kernel->get_idt().load();
+    global_kernel->load_sysenter(n);
+
+    lapic->enable(spurious_vector);
+    cpus[n].online = true;
+
+    // Interrupts stay off until there's a scheduler for this processor. Then
+    // it idles until there's something to run, which it can only switch to
+    // holding the kernel lock. The idle task starts its timer when it does.
+    while (!scheduling)
+        cpu_relax();
+    kernel_lock.enter();
+    global_kernel->get_scheduler().start_idle();
+
+    global_kernel->panic("Processor %u returned from its idle task", n);
+}
+
+/******************************************************************************/
+
+void Smp::start_timer()
+{
+    if (timer_count != 0)
+        lapic->start_timer(timer_count, timer_vector);
+}
+
+/******************************************************************************/
+
+void Smp::stop_timer()
+{
+    if (timer_count != 0)
+        lapic->stop_timer();
+}
+
+/******************************************************************************/
+
+void Smp::reschedule(size_t n)
+{
+    if (lapic != nullptr && n < ncpus && cpus[n].online)
+        lapic->send_interrupt(cpus[n].apic_id, reschedule_vector);
+}
+
+/******************************************************************************/
+
+bool Smp::read_madt()
+{
+    // The RSDP is in the first KB of the EBDA, or in the BIOS area.
+    uint32_t ebda = static_cast<uint32_t>(read16(phys_ptr(0x40E, 2))) << 4;
+    uint32_t rsdp = 0;
+    if (ebda != 0)
+        rsdp = find_signature(ebda, ebda + 0x400, "RSD PTR ", 20);
+    if (rsdp == 0)
+        rsdp = find_signature(0xE0000, 0x100000, "RSD PTR ", 20);
+    if (rsdp == 0)
+        return false;
+
+    uint32_t rsdt_phys = read32(phys_ptr(rsdp, 20) + 16);
+    uint32_t rsdt_len = read32(phys_ptr(rsdt_phys, 36) + 4);
+    const uint8_t* rsdt = phys_ptr(rsdt_phys, rsdt_len);
+    if (klib::memcmp(rsdt, "RSDT", 4) != 0 || !checksum(rsdt, rsdt_len))
+        return false;
+
+    // The RSDT is a list of pointers to the other tables.
+    for (size_t i = 36; i + 4 <= rsdt_len; i += 4)
+    {
+        uint32_t table = read32(rsdt + i);
+        if (klib::memcmp(phys_ptr(table, 36), "APIC", 4) != 0)
+            continue;
+        uint32_t len = read32(phys_ptr(table, 36) + 4);
+        const uint8_t* madt = phys_ptr(table, len);
+        if (!checksum(madt, len))
+            continue;
+
+        lapic_phys = read32(madt + 36);
+
+        // Variable length entries, each starting with type and length.
+        for (size_t off = 44; off + 2 <= len && madt[off + 1] >= 2;
+            off += madt[off + 1])
+        {
+            const uint8_t* e = madt + off;
+            switch (e[0])
+            {
+            case 0:
+                // Processor, if enabled.
+                if (read32(e + 4) & 0x1)
+                    add_cpu(e[3]);
+                break;
+            case 1:
+                ioapics.push_back(new IoApic {read32(e + 4), read32(e + 8)});
+                break;
+            case 2:
+            {
+                // Interrupt source override, for the ISA bus.
+                uint16_t flags = read16(e + 8);
+                if (e[2] == 0 && e[3] < isa_irqs)
+                    isa[e[3]] = IsaRoute{read32(e + 4), (flags & 0x3) == 0x3,
+                        ((flags >> 2) & 0x3) == 0x3};
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+/******************************************************************************/
+
+bool Smp::read_mp_table()
+{
+    // The floating pointer is in the first KB of the EBDA, the last KB of base
+    // memory or the BIOS ROM.
+    uint32_t ebda = static_cast<uint32_t>(read16(phys_ptr(0x40E, 2))) << 4;
+    uint32_t fp_phys = 0;
+    if (ebda != 0)
+        fp_phys = find_signature(ebda, ebda + 0x400, "_MP_", 16);
+    if (fp_phys == 0)
+        fp_phys = find_signature(0x9FC00, 0xA0000, "_MP_", 16);
+    if (fp_phys == 0)
+        fp_phys = find_signature(0xF0000, 0x100000, "_MP_", 16);
+    if (fp_phys == 0)
+        return false;
+
+    const uint8_t* fp = phys_ptr(fp_phys, 16);
+    imcr = fp[12] & 0x80;
+
+    // Default configurations without a table aren't supported.
+    uint32_t cfg_phys = read32(fp + 4);
+    if (cfg_phys == 0)
+        return false;
+    uint16_t len = read16(phys_ptr(cfg_phys, 44) + 4);
+    const uint8_t* cfg = phys_ptr(cfg_phys, len);
+    if (klib::memcmp(cfg, "PCMP", 4) != 0 || !checksum(cfg, len))
+        return false;
+
+    lapic_phys = read32(cfg + 36);
+
+    // Entries come in type order, so the buses and I/O APICs are known by the
+    // time the interrupt entries need them. I/O APICs get consecutive GSIs.
+    klib::array<bool, 256> isa_bus;
+    for (size_t i = 0; i < isa_bus.size(); ++i)
+        isa_bus[i] = false;
+    klib::vector<uint8_t> ioapic_ids;
+    uint16_t count = read16(cfg + 34);
+    size_t off = 44;
+    for (uint16_t i = 0; i < count && off < len; ++i)
+    {
+        const uint8_t* e = cfg + off;
+        switch (e[0])
+        {
+        case 0:
+            // Processor, if enabled.
+            if (e[3] & 0x1)
+                add_cpu(e[1]);
+            off += 20;
+            break;
+        case 1:
+            if (klib::memcmp(e + 2, "ISA", 3) == 0)
+                isa_bus[e[1]] = true;
+            off += 8;
+            break;
+        case 2:
+            // I/O APIC, if usable.
+            if (e[3] & 0x1)
+            {
+                uint32_t gsi =
+                    (ioapics.empty() ? 0 : ioapics.back()->gsi_end());
+                ioapics.push_back(new IoApic {read32(e + 4), gsi});
+                ioapic_ids.push_back(e[1]);
+            }
+            off += 8;
+            break;
+        case 3:
+        {
+            // Vectored interrupt from an ISA bus.
+            uint16_t flags = read16(e + 2);
+            if (e[1] == 0 && isa_bus[e[4]] && e[5] < isa_irqs)
+            {
+                for (size_t j = 0; j < ioapic_ids.size(); ++j)
+                {
+                    if (ioapic_ids[j] != e[6])
+                        continue;
+                    isa[e[5]] = IsaRoute{ioapics[j]->gsi_start() + e[7],
+                        (flags & 0x3) == 0x3, ((flags >> 2) & 0x3) == 0x3};
+                    break;
+                }
+            }
+            off += 8;
+            break;
+        }
+        default:
+            off += 8;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/******************************************************************************/
+
+void Smp::add_cpu(uint8_t apic_id)
+{
+    if (ncpus == max_cpus || cpu_of_apic[apic_id] != 0xFF)
+        return;
+
+    cpus[ncpus] = Cpu{apic_id, false, nullptr};
+    cpu_of_apic[apic_id] = ncpus;
+    ++ncpus;
+}
+
+/******************************************************************************/
+
+const uint8_t* Smp::phys_ptr(uint32_t phys, size_t size)
+{
+    void* p = reinterpret_cast<void*>(phys);
+    void* virt = phys_to_virt(p);
+    if (virt == nullptr)
+        virt = global_kernel->get_pdt()->map(p, size);
+    if (virt == nullptr)
+        global_kernel->panic("No virtual memory for firmware table at %p", p);
+    return static_cast<const uint8_t*>(virt);
+}
+
+/******************************************************************************/
+
+uint32_t Smp::find_signature(uint32_t start, uint32_t end, const char* sig,
+    size_t len)
+{
+    size_t sig_len = klib::strlen(sig);
+    const uint8_t* mem = phys_ptr(start, end - start);
+    for (uint32_t off = 0; off + len <= end - start; off += 16)
+    {
+        if (klib::memcmp(mem + off, sig, sig_len) == 0 &&
+            checksum(mem + off, len))
+            return start + off;
+    }
+
+    return 0;
+}
+
+/******************************************************************************/
+
+bool Smp::checksum(const uint8_t* data, size_t len)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; ++i)
+        sum += data[i];
+    return sum == 0;
+}
+
+/******************************************************************************/
+
+IoApic* Smp::ioapic_for(uint32_t gsi)
+{
+    for (IoApic* io : ioapics)
+        if (io->handles(gsi))
+            return io;
+    return nullptr;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+size_t this_cpu()
+{
+    Smp* smp = (global_kernel == nullptr ? nullptr : global_kernel->get_smp());
+    return (smp == nullptr ? 0 : smp->this_cpu());
+}
+
+/******************************************************************************
+ ******************************************************************************/
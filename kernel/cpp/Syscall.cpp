@@ -10,128 +10,233 @@
 #include <utility>
 
 #include "FileSystem.h"
+#include "IoRing.h"
 #include "Kernel.h"
 #include "Logger.h"
 #include "PageDescriptorTable.h"
 #include "paging.h"
+#include "Pit.h"
 #include "Process.h"
 #include "ProcTable.h"
 #include "Scheduler.h"
 #include "SignalManager.h"
+#include "TimerWheel.h"
 
 /******************************************************************************
  ******************************************************************************/
 
+// Each entry of the table takes the saved registers and interrupt stack and
+// unpacks the arguments for the syscall function.
+using syscall_function = int32_t (*)(InterruptRegisters&,
+    const InterruptStack&);
+
+// Syscall functions, indexed by syscall_ind. Empty entries are unknown.
+static syscall_function syscall_table[syscall_table_size] {};
+
+/******************************************************************************/
+
+static int32_t call_fork(InterruptRegisters& ir, const InterruptStack& is)
+{
+    // Create a copy of the current process.
+    return syscalls::fork(ir, is);
+}
+
+static int32_t call_read(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Read from a file.
+    return syscalls::read(ir.ebx(), reinterpret_cast<char*>(ir.ecx()),
+        ir.edx());
+}
+
+static int32_t call_write(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Print to a file.
+    return syscalls::write(ir.ebx(), reinterpret_cast<const char*>(ir.ecx()),
+        ir.edx());
+}
+
+static int32_t call_open(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Open a file descriptor.
+    return syscalls::open(reinterpret_cast<const char*>(ir.ebx()),
+        static_cast<open_flags>(ir.ecx()), ir.edx());
+}
+
+static int32_t call_close(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Close a file descriptor.
+    return syscalls::close(ir.ebx());
+}
+
+static int32_t call_wait(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Wait for a child process.
+    return syscalls::wait(ir.ebx(), reinterpret_cast<int*>(ir.ecx()),
+        ir.edx());
+}
+
+static int32_t call_unlink(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Unlink (delete) a file.
+    return syscalls::unlink(reinterpret_cast<const char*>(ir.ebx()));
+}
+
+static int32_t call_execve(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Exec a new executable.
+    return syscalls::execve(reinterpret_cast<const char*>(ir.ebx()),
+        reinterpret_cast<char**>(ir.ecx()),
+        reinterpret_cast<char**>(ir.edx()));
+}
+
+static int32_t call_getpid(InterruptRegisters&, const InterruptStack&)
+{
+    // Get the curent process PID.
+    return syscalls::getpid();
+}
+
+static int32_t call_mkdir(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Create a new directory.
+    return syscalls::mkdir(reinterpret_cast<const char*>(ir.ebx()), ir.ecx());
+}
+
+static int32_t call_rmdir(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Remove (unlink) a directory.
+    return syscalls::rmdir(reinterpret_cast<const char*>(ir.ebx()));
+}
+
+static int32_t call_brk(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Change the programme break point.
+    return syscalls::brk(reinterpret_cast<void*>(ir.ebx()));
+}
+
+static int32_t call_llseek(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Change the offset position in a file.
+    return syscalls::llseek(static_cast<int32_t>(ir.ebx()),
+        static_cast<int32_t>(ir.ecx()),
+        static_cast<int32_t>(ir.edx()),
+        reinterpret_cast<klib::fpos_t*>(ir.esi()),
+        ir.edi());
+}
+
+static int32_t call_yield(InterruptRegisters& ir, const InterruptStack& is)
+{
+    // Move onto the next process.
+    return syscalls::yield(ir, is);
+}
+
+static int32_t call_nanosleep(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Sleep for a while.
+    return syscalls::nanosleep(reinterpret_cast<const timespec*>(ir.ebx()),
+        reinterpret_cast<timespec*>(ir.ecx()));
+}
+
+static int32_t call_epoll_create(InterruptRegisters& ir,
+    const InterruptStack&)
+{
+    // Make an interest set.
+    return syscalls::epoll_create(ir.ebx());
+}
+
+static int32_t call_epoll_ctl(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Change an interest set.
+    return syscalls::epoll_ctl(ir.ebx(), ir.ecx(), ir.edx(),
+        reinterpret_cast<const epoll_event*>(ir.esi()));
+}
+
+static int32_t call_epoll_wait(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Wait on an interest set.
+    return syscalls::epoll_wait(ir.ebx(),
+        reinterpret_cast<epoll_event*>(ir.ecx()), ir.edx(), ir.esi());
+}
+
+static int32_t call_epoll_close(InterruptRegisters& ir, const InterruptStack&)
+{
+    // Get rid of an interest set.
+    return syscalls::epoll_close(ir.ebx());
+}
+
+static int32_t call_io_ring_setup(InterruptRegisters& ir,
+    const InterruptStack&)
+{
+    // Make an I/O ring.
+    return syscalls::io_ring_setup(reinterpret_cast<io_ring*>(ir.ebx()),
+        ir.ecx());
+}
+
+static int32_t call_io_ring_enter(InterruptRegisters& ir,
+    const InterruptStack&)
+{
+    // Carry out entries from an I/O ring.
+    return syscalls::io_ring_enter(ir.ebx(), ir.ecx());
+}
+
+static int32_t call_io_ring_close(InterruptRegisters& ir,
+    const InterruptStack&)
+{
+    // Get rid of an I/O ring.
+    return syscalls::io_ring_close(ir.ebx());
+}
+
+/******************************************************************************/
+
+// Adds a function to the syscall table.
+static void set_syscall(syscall_ind ind, syscall_function f)
+{
+    syscall_table[static_cast<size_t>(ind)] = f;
+}
+
+/******************************************************************************/
+
+void init_syscalls()
+{
+    set_syscall(syscall_ind::fork, call_fork);
+    set_syscall(syscall_ind::read, call_read);
+    set_syscall(syscall_ind::write, call_write);
+    set_syscall(syscall_ind::open, call_open);
+    set_syscall(syscall_ind::close, call_close);
+    set_syscall(syscall_ind::wait, call_wait);
+    set_syscall(syscall_ind::unlink, call_unlink);
+    set_syscall(syscall_ind::execve, call_execve);
+    set_syscall(syscall_ind::getpid, call_getpid);
+    set_syscall(syscall_ind::mkdir, call_mkdir);
+    set_syscall(syscall_ind::rmdir, call_rmdir);
+    set_syscall(syscall_ind::brk, call_brk);
+    set_syscall(syscall_ind::llseek, call_llseek);
+    set_syscall(syscall_ind::yield, call_yield);
+    set_syscall(syscall_ind::nanosleep, call_nanosleep);
+    set_syscall(syscall_ind::epoll_create, call_epoll_create);
+    set_syscall(syscall_ind::epoll_ctl, call_epoll_ctl);
+    set_syscall(syscall_ind::epoll_wait, call_epoll_wait);
+    set_syscall(syscall_ind::epoll_close, call_epoll_close);
+    set_syscall(syscall_ind::io_ring_setup, call_io_ring_setup);
+    set_syscall(syscall_ind::io_ring_enter, call_io_ring_enter);
+    set_syscall(syscall_ind::io_ring_close, call_io_ring_close);
+}
+
+/******************************************************************************/
+
 void syscall(InterruptRegisters& ir, const InterruptStack& is)
 {
-    // Do a big switch on the function index. The index is stored in %eax before
-    // the call.
-    int32_t ret_val = 0;
-    syscall_ind ind = static_cast<syscall_ind>(ir.eax());
-
-    // Mapping from syscall indices to name.
-    static const klib::map<syscall_ind, klib::string> function_names = {
-        klib::pair<syscall_ind, klib::string> {syscall_ind::fork, "fork"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::read, "read"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::write, "write"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::open, "open"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::close, "close"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::wait, "wait"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::unlink, "unlink"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::execve, "execve"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::getpid, "getpid"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::mkdir, "mkdir"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::rmdir, "rmdir"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::brk, "brk"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::llseek, "llseek"},
-        klib::pair<syscall_ind, klib::string> {syscall_ind::yield, "yield"}
-    };
-
-
-    auto it = function_names.find(ind);
-    if (it == function_names.end())
+    // Look up the function index in the table. The index is stored in %eax
+    // before the call.
+    int32_t ret_val = -1;
+    uint32_t ind = ir.eax();
+
+    if (ind < syscall_table_size && syscall_table[ind] != nullptr)
+        ret_val = syscall_table[ind](ir, is);
+    else
         global_kernel->syslog()->warn(
-            "Syscall function index is %X: unknown function\n", ir.eax());
-//    else
-//        global_kernel->syslog()->info(
-//            "Syscall function index is %X: %s\n", ir.eax(), it->second.c_str());
-
-    switch (ind)
-    {
-        case syscall_ind::fork:
-            // Create a copy of the current process.
-            ret_val = syscalls::fork(ir, is);
-            break;
-        case syscall_ind::read:
-            // Read from a file.
-            ret_val = syscalls::read(ir.ebx(),
-                reinterpret_cast<char*>(ir.ecx()), ir.edx());
-            break;
-        case syscall_ind::write:
-            // Print to a file.
-            ret_val = syscalls::write(ir.ebx(),
-                reinterpret_cast<const char*>(ir.ecx()), ir.edx());
-            break;
-        case syscall_ind::open:
-            // Open a file descriptor.
-            ret_val = syscalls::open(reinterpret_cast<const char*>(ir.ebx()),
-                static_cast<open_flags>(ir.ecx()), ir.edx());
-            break;
-        case syscall_ind::close:
-            // Close a file descriptor.
-            ret_val = syscalls::close(ir.ebx());
-            break;
-        case syscall_ind::wait:
-            // Wait for a child process.
-            ret_val = syscalls::wait(ir.ebx(), reinterpret_cast<int*>(ir.ecx()),
-                ir.edx());
-            break;
-        case syscall_ind::unlink:
-            // Unlink (delete) a file.
-            ret_val = syscalls::unlink(reinterpret_cast<const char*>(ir.ebx()));
-            break;
-        case syscall_ind::execve:
-            // Exec a new executable.
-            ret_val = syscalls::execve(reinterpret_cast<const char*>(ir.ebx()),
-                reinterpret_cast<char**>(ir.ecx()),
-                reinterpret_cast<char**>(ir.edx()));
-            break;
-        case syscall_ind::getpid:
-            // Get the curent process PID.
-            ret_val = syscalls::getpid();
-            break;
-        case syscall_ind::mkdir:
-            // Create a new directory.
-            ret_val = syscalls::mkdir(reinterpret_cast<const char*>(ir.ebx()),
-                ir.ecx());
-            break;
-        case syscall_ind::rmdir:
-            // Remove (unlink) a directory.
-            ret_val = syscalls::rmdir(reinterpret_cast<const char*>(ir.ebx()));
-            break;
-        case syscall_ind::brk:
-            // Change the programme break point.
-            ret_val = syscalls::brk(reinterpret_cast<void*>(ir.ebx()));
-            break;
-        case syscall_ind::llseek:
-            // Change the offset position in a file.
-            ret_val = syscalls::llseek(static_cast<int32_t>(ir.ebx()),
-                static_cast<int32_t>(ir.ecx()),
-                static_cast<int32_t>(ir.edx()),
-                reinterpret_cast<klib::fpos_t*>(ir.esi()),
-                ir.edi());
-            break;
-        case syscall_ind::yield:
-            // Move onto the next process.
-            ret_val = syscalls::yield(ir, is);
-            break;
-        default:
-            global_kernel->syslog()->warn(
-                "Unknown syscall function index %X\n", ir.eax());
-    }
+            "Unknown syscall function index %X\n", ind);
 
     // Put the return value in %eax.
-//    global_kernel->syslog()->info("syscall retval = %u\n", ret_val);
     ir.set_eax(ret_val);
 }
 
@@ -442,19 +547,14 @@ int32_t execve(const char* filename, char* const argv[], char* const envp[])
     // memory problems.
     switch_blocked_for_exec = true;
 
-    // Now free up virtual memory so it's available for the new process.
-    global_kernel->get_pdt()->clean_user_space(
-        reinterpret_cast<void*>(kernel_virtual_base));
-
-    // Create the process.
+    // Create the process. It gets its own PDT when launched, so the old one
+    // stays loaded for now.
     new_p = new Process {tmp_filename};
     if (new_p->get_status() == ProcStatus::invalid)
     {
-        // Something went wrong with creating the new process. We need to
-        // restore the old one and bail.
+        // Something went wrong with creating the new process. Just bail.
         delete new_p;
-        global_kernel->get_pdt()->update_user_space(old_p->get_pdt(),
-            reinterpret_cast<void*>(kernel_virtual_base));
+        switch_blocked_for_exec = false;
         return -1;
     }
 
@@ -470,7 +570,14 @@ int32_t execve(const char* filename, char* const argv[], char* const envp[])
     // file descriptors, PPID and child PIDs.
     new_p->exec_duplicate(*old_p);
 
-    // Clean up the old process. We're done with it now.
+    // The I/O rings of the old program point into its address space, which is
+    // about to go. Its destructor leaves them alone, as the PID now belongs to
+    // the new program, so forget them here.
+    global_kernel->get_io_rings()->purge_process(pid);
+
+    // Clean up the old process. We're done with it now. Switch to the kernel
+    // PDT first, as the old PDT is about to be deleted.
+    global_kernel->get_pdt()->load();
     delete old_p;
 
     // End block for destructors.
@@ -660,6 +767,156 @@ int32_t yield(const InterruptRegisters& ir, const InterruptStack& is)
     return 0;
 }
 
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t nanosleep(const timespec* req, timespec* rem)
+{
+    // We require both structures to be in user space.
+    if (req == nullptr ||
+        reinterpret_cast<size_t>(req + 1) > kernel_virtual_base ||
+        (rem != nullptr &&
+        reinterpret_cast<size_t>(rem + 1) > kernel_virtual_base))
+    {
+        global_kernel->syslog()->warn(
+            "nanosleep syscall was given an address in kernel space.\n");
+        return -1;
+    }
+
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec > 999999999)
+        return -1;
+
+    // Work out how many ticks to sleep for, rounding up to whole milliseconds.
+    uint32_t ms = static_cast<uint32_t>(req->tv_sec) * 1000 +
+        (static_cast<uint32_t>(req->tv_nsec) + 999999) / 1000000;
+    if (req->tv_sec > static_cast<int32_t>(TimerWheel::max_delay / 1000))
+        ms = TimerWheel::max_delay;
+    uint32_t ticks = global_kernel->get_pit()->ms_to_ticks(ms);
+
+    // Get the active process.
+    Process* p = global_kernel->get_proc_table().get_process(
+        global_kernel->get_scheduler().get_last());
+
+    // Sleep until the timer wakes us up. If the timer expires between going to
+    // sleep and checking it, the process has already been made runnable, so
+    // just carry on.
+    Timer& t = p->get_timer();
+    if (ticks != 0)
+        global_kernel->get_timers()->add(t, ticks);
+    while (t.pending())
+    {
+        p->set_status(ProcStatus::sleeping);
+        if (!t.pending())
+        {
+            p->set_status(ProcStatus::active);
+            break;
+        }
+        global_kernel->get_scheduler().yield();
+    }
+
+    if (rem != nullptr)
+        *rem = timespec {0, 0};
+
+    return 0;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t epoll_create(int size)
+{
+    if (size <= 0)
+        return -1;
+
+    return global_kernel->get_signal_manager()->create_interest_set();
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t epoll_ctl(int epfd, int op, int fd, const epoll_event* event)
+{
+    interest_op iop = static_cast<interest_op>(op);
+
+    // The event is only needed for adding and changing, but must be in user
+    // space if it's given.
+    if ((event == nullptr && iop != interest_op::del) ||
+        (event != nullptr &&
+        reinterpret_cast<size_t>(event + 1) > kernel_virtual_base))
+    {
+        global_kernel->syslog()->warn(
+            "epoll_ctl syscall was given an invalid event.\n");
+        return -1;
+    }
+
+    PollType events = (event == nullptr ? PollType::pollnone :
+        static_cast<PollType>(event->events));
+    return global_kernel->get_signal_manager()->interest_ctl(epfd, iop, fd,
+        events);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout)
+{
+    // We require the whole array to be in user space.
+    if (events == nullptr || maxevents <= 0 ||
+        reinterpret_cast<size_t>(events) >= kernel_virtual_base ||
+        static_cast<size_t>(maxevents) > (kernel_virtual_base -
+        reinterpret_cast<size_t>(events)) / sizeof(epoll_event))
+    {
+        global_kernel->syslog()->warn(
+            "epoll_wait syscall was given an invalid event array.\n");
+        return -1;
+    }
+
+    // Collect the results in the kernel, then copy them out. There's no point
+    // in a huge buffer, as the rest will be reported next time.
+    size_t max = (maxevents > 256 ? 256 : maxevents);
+    SignalManager::pollfd* ready = new SignalManager::pollfd[max];
+    int32_t ret_val = global_kernel->get_signal_manager()->wait_interest(epfd,
+        ready, max, timeout);
+    for (int32_t i = 0; i < ret_val; ++i)
+        events[i] = epoll_event {static_cast<uint32_t>(ready[i].revents),
+            ready[i].fd};
+    delete[] ready;
+
+    return ret_val;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t epoll_close(int epfd)
+{
+    return global_kernel->get_signal_manager()->close_interest_set(epfd);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t io_ring_setup(io_ring* ring, uint32_t entries)
+{
+    return global_kernel->get_io_rings()->create(ring, entries);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t io_ring_enter(int id, uint32_t to_submit)
+{
+    return global_kernel->get_io_rings()->enter(id, to_submit);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+int32_t io_ring_close(int id)
+{
+    return global_kernel->get_io_rings()->close(id);
+}
+
 /******************************************************************************
  ******************************************************************************/
 
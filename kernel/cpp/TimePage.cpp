@@ -0,0 +1,189 @@
+#include "TimePage.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "interrupt.h"
+#include "io.h"
+#include "Kernel.h"
+#include "Logger.h"
+#include "PageDescriptorTable.h"
+#include "Process.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+// CMOS I/O ports.
+static constexpr uint16_t cmos_index = 0x70;
+static constexpr uint16_t cmos_data = 0x71;
+
+// CMOS real time clock registers.
+enum rtc_reg : uint8_t {
+    rtc_seconds = 0x00,
+    rtc_minutes = 0x02,
+    rtc_hours = 0x04,
+    rtc_day = 0x07,
+    rtc_month = 0x08,
+    rtc_year = 0x09,
+    rtc_status_a = 0x0A,
+    rtc_status_b = 0x0B
+};
+
+// Status A bit set while the clock is updating.
+static constexpr uint8_t rtc_updating = 0x80;
+// Status B bits for 24 hour time and binary rather than BCD values.
+static constexpr uint8_t rtc_24_hour = 0x02;
+static constexpr uint8_t rtc_binary = 0x04;
+// Hours bit for PM in 12 hour time.
+static constexpr uint8_t rtc_pm = 0x80;
+
+// Time as read from the real time clock.
+struct rtc_time {
+    uint8_t sec;
+    uint8_t min;
+    uint8_t hour;
+    uint8_t day;
+    uint8_t month;
+    uint8_t year;
+};
+
+/******************************************************************************/
+
+// Reads a CMOS register.
+static uint8_t cmos_read(uint8_t reg)
+{
+    outb(reg, cmos_index);
+    return inb(cmos_data);
+}
+
+/******************************************************************************/
+
+// Reads the clock registers, once no update is in progress.
+static rtc_time read_rtc_once()
+{
+    while (cmos_read(rtc_status_a) & rtc_updating);
+
+    return rtc_time {cmos_read(rtc_seconds), cmos_read(rtc_minutes),
+        cmos_read(rtc_hours), cmos_read(rtc_day), cmos_read(rtc_month),
+        cmos_read(rtc_year)};
+}
+
+/******************************************************************************/
+
+// Converts a BCD value to binary.
+static uint8_t from_bcd(uint8_t v)
+{
+    return (v >> 4) * 10 + (v & 0x0F);
+}
+
+/******************************************************************************/
+
+// Gets the number of days from the Unix epoch to a date in the proleptic
+// Gregorian calendar.
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    // Count years from March, so the leap day is at the end.
+    y -= (m <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = static_cast<unsigned>(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+/******************************************************************************/
+
+// Gets the time page through the direct map.
+static volatile time_page* get_page()
+{
+    return static_cast<volatile time_page*>(
+        phys_to_virt(PageDescriptorTable::get_time_page()));
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+void init_time_page()
+{
+    // Read until we get the same values twice, in case an update happened
+    // part way through.
+    rtc_time t = read_rtc_once();
+    rtc_time last;
+    do {
+        last = t;
+        t = read_rtc_once();
+    } while (t.sec != last.sec || t.min != last.min || t.hour != last.hour ||
+        t.day != last.day || t.month != last.month || t.year != last.year);
+
+    uint8_t status = cmos_read(rtc_status_b);
+    bool pm = (t.hour & rtc_pm);
+    t.hour &= ~rtc_pm;
+    if (!(status & rtc_binary))
+    {
+        t.sec = from_bcd(t.sec);
+        t.min = from_bcd(t.min);
+        t.hour = from_bcd(t.hour);
+        t.day = from_bcd(t.day);
+        t.month = from_bcd(t.month);
+        t.year = from_bcd(t.year);
+    }
+    if (!(status & rtc_24_hour))
+        t.hour = (t.hour % 12) + (pm ? 12 : 0);
+
+    int64_t secs = days_from_civil(2000 + t.year, t.month, t.day) * 86400 +
+        t.hour * 3600 + t.min * 60 + t.sec;
+
+    // Nothing reads the page yet, so no need for the sequence count.
+    volatile time_page* tp = get_page();
+    tp->boot_sec = secs;
+
+    global_kernel->syslog()->info(
+        "Real time clock reads %u-%u-%u %u:%u:%u\n", 2000 + t.year, t.month,
+        t.day, t.hour, t.min, t.sec);
+}
+
+/******************************************************************************/
+
+void update_time_page(uint64_t ns)
+{
+    volatile time_page* tp = get_page();
+    if (tp->tsc_mult != 0)
+        return;
+
+    uint32_t seq = tp->seq;
+    tp->seq = seq + 1;
+    klib::atomic_thread_fence(klib::memory_order_release);
+    tp->mono_ns = ns;
+    klib::atomic_thread_fence(klib::memory_order_release);
+    tp->seq = seq + 2;
+}
+
+/******************************************************************************/
+
+void publish_time_page_tsc(uint64_t tsc, uint64_t ns, uint32_t mult,
+    uint32_t shift)
+{
+    volatile time_page* tp = get_page();
+
+    // The timer interrupt writes the page too, so keep it out until done.
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    uint32_t seq = tp->seq;
+    tp->seq = seq + 1;
+    klib::atomic_thread_fence(klib::memory_order_release);
+    tp->mono_ns = ns;
+    tp->tsc_base = tsc;
+    tp->tsc_shift = shift;
+    tp->tsc_mult = mult;
+    klib::atomic_thread_fence(klib::memory_order_release);
+    tp->seq = seq + 2;
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************
+ ******************************************************************************/
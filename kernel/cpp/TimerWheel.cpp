@@ -0,0 +1,140 @@
+#include "TimerWheel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupt.h"
+#include "Process.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+void TimerWheel::add(Timer& t, uint32_t ticks)
+{
+    if (ticks == 0)
+        ticks = 1;
+    else if (ticks > max_delay)
+        ticks = max_delay;
+
+    // The PIT interrupt mustn't advance the wheel while we're changing it.
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    if (t.pending())
+        unlink(t);
+    t.expires = jiffies + ticks;
+    insert(t);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void TimerWheel::cancel(Timer& t)
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    if (t.pending())
+        unlink(t);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void TimerWheel::tick()
+{
+    ++jiffies;
+
+    // Each time a level wraps round, bring the timers in the next slot of the
+    // level above down.
+    size_t index = jiffies & (slots - 1);
+    for (size_t l = 1; index == 0 && l < levels; ++l)
+        index = cascade(l);
+
+    // Run everything in the current slot of the first level. The callback may
+    // add the timer again, so take it out first.
+    Timer*& head = wheel[0][jiffies & (slots - 1)];
+    while (head != nullptr)
+    {
+        Timer* t = head;
+        unlink(*t);
+        t->callback(t->data);
+    }
+}
+
+/******************************************************************************/
+
+uint32_t TimerWheel::ticks_to_next() const
+{
+    // Look through the first level up to where it wraps.
+    size_t index = jiffies & (slots - 1);
+    uint32_t ticks = 1;
+    for (; index + ticks < slots; ++ticks)
+    {
+        if (wheel[0][index + ticks] != nullptr)
+            break;
+    }
+
+    return ticks;
+}
+
+/******************************************************************************/
+
+void TimerWheel::insert(Timer& t)
+{
+    // Find the lowest level that reaches the expiry.
+    uint32_t delta = t.expires - jiffies;
+    size_t l = 0;
+    while (l < levels - 1 && delta >= (1u << ((l + 1) * level_bits)))
+        ++l;
+    Timer*& head = wheel[l][(t.expires >> (l * level_bits)) & (slots - 1)];
+
+    // Add to the front of the slot.
+    t.prev = nullptr;
+    t.next = head;
+    if (head != nullptr)
+        head->prev = &t;
+    head = &t;
+    t.slot = &head;
+}
+
+/******************************************************************************/
+
+void TimerWheel::unlink(Timer& t)
+{
+    if (t.prev != nullptr)
+        t.prev->next = t.next;
+    else
+        *t.slot = t.next;
+    if (t.next != nullptr)
+        t.next->prev = t.prev;
+    t.prev = nullptr;
+    t.next = nullptr;
+    t.slot = nullptr;
+}
+
+/******************************************************************************/
+
+size_t TimerWheel::cascade(size_t level)
+{
+    size_t index = (jiffies >> (level * level_bits)) & (slots - 1);
+
+    // Everything in the slot now expires within reach of a lower level.
+    Timer* t = wheel[level][index];
+    wheel[level][index] = nullptr;
+    while (t != nullptr)
+    {
+        Timer* next = t->next;
+        insert(*t);
+        t = next;
+    }
+
+    return index;
+}
+
+/******************************************************************************
+ ******************************************************************************/
@@ -41,10 +41,11 @@ VgaController::VgaController(void* addr, size_t w, size_t h, size_t b,
     else
     {
         size_t sz = width * height * bpp;
-        // Let's put it near the end, so we don't clash with any process stuff
-        // or the kernel_heap.
+        // Let's put it near the end of kernel space, so we don't clash with
+        // the kernel heap or other mappings. It needs to be in kernel space to
+        // be visible to every process.
         void* v_addr = pdt.map(addr, sz,
-            reinterpret_cast<void*>((1 << 31) - sz));
+            reinterpret_cast<void*>(0xFFC00000 - sz));
         if (v_addr == nullptr)
             global_kernel->panic(
                 "Failed to get virtual memory for framebuffer mapping.\n");
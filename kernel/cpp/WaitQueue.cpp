@@ -0,0 +1,103 @@
+#include "WaitQueue.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupt.h"
+#include "Process.h"
+#include "SignalManager.h"
+
+/******************************************************************************
+ ******************************************************************************/
+
+WaitQueue::~WaitQueue()
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    while (head != nullptr)
+        unlink(*head);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void WaitQueue::add(Waiter& w)
+{
+    // The queue may be woken from an interrupt, which mustn't see the list
+    // half changed.
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    if (w.queue != nullptr)
+        w.queue->unlink(w);
+
+    w.prev = tail;
+    w.next = nullptr;
+    if (tail != nullptr)
+        tail->next = &w;
+    else
+        head = &w;
+    tail = &w;
+    w.queue = this;
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void WaitQueue::remove(Waiter& w)
+{
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    if (w.queue == this)
+        unlink(w);
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void WaitQueue::wake(PollType ev)
+{
+    // This is usually called from an interrupt handler already, but it might
+    // not be, and the wake functions mustn't be interrupted by another wake.
+    bool enabled = get_eflags() & 0x200;
+    disable_interrupts();
+
+    // Get the next link first, in case the function takes the waiter off.
+    for (Waiter* w = head; w != nullptr; )
+    {
+        Waiter* next = w->next;
+        w->wake_func(*w, ev);
+        w = next;
+    }
+
+    if (enabled)
+        enable_interrupts();
+}
+
+/******************************************************************************/
+
+void WaitQueue::unlink(Waiter& w)
+{
+    if (w.prev != nullptr)
+        w.prev->next = w.next;
+    else
+        head = w.next;
+    if (w.next != nullptr)
+        w.next->prev = w.prev;
+    else
+        tail = w.prev;
+    w.prev = nullptr;
+    w.next = nullptr;
+    w.queue = nullptr;
+}
+
+/******************************************************************************
+ ******************************************************************************/
@@ -90,7 +90,6 @@ void seppuku()
     @param kps Physical memory address of the end of the kernel.
     @param kpe Physical memory address of the end of the kernel.
     @param pdt The basic Page Descriptor Table set up in the loader.
-    @param tpt Location reserved for a temporary page table.
     @param mbp Start of Multiboot information, generated by GRUB.
  */
 extern "C"
@@ -99,11 +98,10 @@ void kernel_main (void* kvs,
                   void* kps,
                   void* kpe,
                   void* pdt,
-                  void* tpt,
                   void* mbp)
 {
     // Make new kernel.
-    Kernel k {kvs, kve, kps, kpe, pdt, tpt, mbp};
+    Kernel k {kvs, kve, kps, kpe, pdt, mbp};
 
     // Try setting up the first multiboot modules as a user mode process and
     // running it.
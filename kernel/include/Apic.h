@@ -0,0 +1,215 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Forward declarations
+class Pit;
+
+/**
+    Driver for a processor's local APIC. Every processor has one at the same
+    physical address, which only that processor sees, so the same driver
+    object works for all of them. Used for acknowledging interrupts, sending
+    inter-processor interrupts and the per-processor timer.
+ */
+class LocalApic {
+public:
+    /**
+        Constructor. Maps the registers into kernel space.
+
+        @param phys Physical address of the local APIC registers.
+     */
+    explicit LocalApic(uint32_t phys);
+
+    /**
+        Turns on the local APIC of the calling processor, with spurious
+        interrupts going to the given vector. Interrupts from the 8259 PIC
+        still come through LINT0, as the firmware left it.
+
+        @param spurious Vector for spurious interrupts.
+     */
+    void enable(uint8_t spurious);
+
+    /**
+        Gets the APIC ID of the calling processor.
+
+        @return Local APIC ID.
+     */
+    uint8_t id() const;
+
+    /**
+        Signals the end of an interrupt delivered through the APIC.
+     */
+    void eoi() { write(reg_eoi, 0); }
+
+    /**
+        Sends an INIT inter-processor interrupt, which resets the target and
+        leaves it waiting for a startup interrupt.
+
+        @param apic_id Target processor.
+     */
+    void send_init(uint8_t apic_id);
+
+    /**
+        Sends a startup inter-processor interrupt, which starts the target in
+        real mode at the start of the given page.
+
+        @param apic_id Target processor.
+        @param page Physical address to start at. Must be page aligned and
+               below 1MB.
+     */
+    void send_startup(uint8_t apic_id, uint32_t page);
+
+    /**
+        Sends an interrupt to another processor, which takes it like any other.
+
+        @param apic_id Target processor.
+        @param vector Interrupt vector to deliver.
+     */
+    void send_interrupt(uint8_t apic_id, uint8_t vector);
+
+    /**
+        Measures how fast the timer of the calling processor counts, against
+        the PIT. Interrupts must be enabled, as it waits on PIT interrupts.
+
+        @param pit PIT to measure against.
+        @return Timer counts per millisecond.
+     */
+    uint32_t calibrate_timer(Pit& pit);
+
+    /**
+        Starts the timer of the calling processor interrupting periodically.
+
+        @param count Timer counts between interrupts, from calibrate_timer().
+        @param vector Interrupt vector to use.
+     */
+    void start_timer(uint32_t count, uint8_t vector);
+
+    /**
+        Stops the timer of the calling processor.
+     */
+    void stop_timer() { write(reg_timer_initial, 0); }
+
+private:
+    // Register offsets.
+    static constexpr size_t reg_id = 0x20;
+    static constexpr size_t reg_tpr = 0x80;
+    static constexpr size_t reg_eoi = 0xB0;
+    static constexpr size_t reg_svr = 0xF0;
+    static constexpr size_t reg_esr = 0x280;
+    static constexpr size_t reg_icr_low = 0x300;
+    static constexpr size_t reg_icr_high = 0x310;
+    static constexpr size_t reg_lvt_timer = 0x320;
+    static constexpr size_t reg_lvt_error = 0x370;
+    static constexpr size_t reg_timer_initial = 0x380;
+    static constexpr size_t reg_timer_current = 0x390;
+    static constexpr size_t reg_timer_divide = 0x3E0;
+
+    // Bits in the registers.
+    static constexpr uint32_t svr_enable = 0x100;
+    static constexpr uint32_t icr_pending = 0x1000;
+    static constexpr uint32_t icr_init = 0x500;
+    static constexpr uint32_t icr_startup = 0x600;
+    static constexpr uint32_t icr_assert = 0x4000;
+    static constexpr uint32_t lvt_masked = 0x10000;
+    static constexpr uint32_t lvt_periodic = 0x20000;
+    // Divide the timer clock by 16.
+    static constexpr uint32_t timer_divide_16 = 0x3;
+
+    // Registers, mapped into kernel space.
+    volatile uint32_t* base;
+
+    // Register access. Offsets are in bytes.
+    uint32_t read(size_t reg) const { return base[reg / 4]; }
+    void write(size_t reg, uint32_t val) { base[reg / 4] = val; }
+
+    // Sends an inter-processor interrupt and waits for it to be accepted.
+    void send_ipi(uint8_t apic_id, uint32_t command);
+};
+
+/**
+    Driver for an I/O APIC, which routes device interrupts to processors. Each
+    input pin is a Global System Interrupt (GSI), starting from the I/O APIC's
+    GSI base.
+ */
+class IoApic {
+public:
+    /**
+        Constructor. Maps the registers into kernel space and masks every
+        input.
+
+        @param phys Physical address of the registers.
+        @param gsi First GSI handled by this I/O APIC.
+     */
+    IoApic(uint32_t phys, uint32_t gsi);
+
+    /**
+        Tests whether a GSI is one of this I/O APIC's inputs.
+
+        @param gsi GSI to test.
+        @return Whether this I/O APIC handles the GSI.
+     */
+    bool handles(uint32_t gsi) const
+    {
+        return gsi >= gsi_base && gsi < gsi_base + inputs;
+    }
+
+    /**
+        Gets the first GSI handled by this I/O APIC.
+
+        @return First GSI.
+     */
+    uint32_t gsi_start() const { return gsi_base; }
+
+    /**
+        Gets the GSI after the last one handled by this I/O APIC.
+
+        @return One past the last GSI.
+     */
+    uint32_t gsi_end() const { return gsi_base + inputs; }
+
+    /**
+        Routes an input to a vector on a processor. The input starts masked.
+
+        @param gsi GSI to route.
+        @param vector Interrupt vector to deliver.
+        @param apic_id Local APIC ID of the processor to deliver to.
+        @param active_low Whether the input is active low.
+        @param level Whether the input is level triggered.
+     */
+    void route(uint32_t gsi, uint8_t vector, uint8_t apic_id, bool active_low,
+        bool level);
+
+    /**
+        Masks or unmasks an input.
+
+        @param gsi GSI to change.
+        @param masked True to stop the input interrupting.
+     */
+    void set_masked(uint32_t gsi, bool masked);
+
+private:
+    // Register select and data window offsets, in 32 bit words.
+    static constexpr size_t reg_select = 0;
+    static constexpr size_t reg_window = 4;
+    // Indirect register numbers.
+    static constexpr uint8_t reg_version = 0x1;
+    static constexpr uint8_t reg_redirect = 0x10;
+    // Bits in the low half of a redirection entry.
+    static constexpr uint32_t redirect_active_low = 0x2000;
+    static constexpr uint32_t redirect_level = 0x8000;
+    static constexpr uint32_t redirect_masked = 0x10000;
+
+    // Registers, mapped into kernel space.
+    volatile uint32_t* base;
+    // First GSI and number of inputs.
+    uint32_t gsi_base;
+    uint32_t inputs;
+
+    // Indirect register access.
+    uint32_t read(uint8_t reg) const;
+    void write(uint8_t reg, uint32_t val);
+};
+
+#endif /* APIC_H */
@@ -0,0 +1,189 @@
+#ifndef BLOCK_QUEUE_H
+#define BLOCK_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Lock.h"
+#include "WaitQueue.h"
+
+// Forward declarations
+class BlockDevice;
+
+/**
+    A request to read or write a run of sectors. Like timers, requests don't
+    own any memory and are meant to be embedded in whatever is waiting for
+    them. A request must not be destroyed until it's done.
+ */
+class BlockRequest {
+public:
+    /**
+        Constructor.
+
+        @param w True to write to the device, false to read.
+        @param o Offset on the device. Must be sector aligned.
+        @param a Memory to read into or write from.
+        @param c Number of sectors.
+        @param f Function to call when the request is done, or nullptr. Called
+               by whichever process is running the queue, not necessarily the
+               one that made the request.
+        @param d Data to pass to the function.
+     */
+    BlockRequest(bool w, uint64_t o, void* a, size_t c,
+        void (*f)(void*) = nullptr, void* d = nullptr) :
+        write{w},
+        off{o},
+        addr{static_cast<char*>(a)},
+        count{c},
+        callback{f},
+        data{d},
+        result{0},
+        finished{false},
+        deadline{0},
+        next{nullptr}
+    {}
+
+    /**
+        Requests are linked into queues by address, so can't be copied.
+     */
+    BlockRequest(const BlockRequest&) = delete;
+    BlockRequest& operator=(const BlockRequest&) = delete;
+
+    /**
+        Tests whether the request has been carried out.
+
+        @return True once the transfer has finished, successfully or not.
+     */
+    bool done() const { return finished; }
+
+    /**
+        Gets how much was transferred.
+
+        @return Number of bytes read or written. Only meaningful once done.
+     */
+    size_t bytes() const { return result; }
+
+private:
+    friend class BlockQueue;
+    friend class BlockDevice;
+
+    // Direction, position and memory of the transfer.
+    bool write;
+    uint64_t off;
+    char* addr;
+    size_t count;
+    // Function to call when done, and its argument.
+    void (*callback)(void*);
+    void* data;
+    // Bytes transferred, and whether the transfer has finished.
+    size_t result;
+    bool finished;
+    // Time by which the request should be started, in nanoseconds.
+    uint64_t deadline;
+    // Next request on the queue, in offset order.
+    BlockRequest* next;
+
+    // Records the result and calls the function.
+    void complete(size_t res);
+};
+
+/**
+    Queue of requests for a block device, so a driver can do them in the order
+    that suits the disk rather than the order they were made.
+
+    Requests are kept sorted by offset, and the queue is served like a lift,
+    going up through the disk and starting again from the bottom. Requests
+    which follow on from each other in the same direction are merged into one
+    transfer. So that nothing waits forever while another part of the disk is
+    busy, each request has a deadline, shorter for reads than writes, and the
+    oldest request past its deadline is served next.
+
+    There's no thread behind the queue. Whoever waits on a request runs the
+    queue until it's empty, doing the requests made by everyone else in the
+    meantime. Anyone else waiting sleeps until their request is done.
+
+    Requests in the queue may be done in any order, so callers must finish one
+    request before making another that depends on it, such as reading back
+    sectors that are being written.
+ */
+class BlockQueue {
+public:
+    /**
+        Constructor. The queue starts empty.
+
+        @param d Device to carry out requests. Must outlive the queue.
+        @param max Most sectors to merge into one transfer.
+     */
+    BlockQueue(BlockDevice& d, size_t max);
+
+    /**
+        Requests refer to the queue, so it can't be copied.
+     */
+    BlockQueue(const BlockQueue&) = delete;
+    BlockQueue& operator=(const BlockQueue&) = delete;
+
+    /**
+        Adds a request to the queue. It isn't started until the queue is run.
+
+        @param r Request to add. Must not be on a queue already.
+     */
+    void submit(BlockRequest& r);
+
+    /**
+        Carries out requests until the queue is empty. Returns straight away if
+        something else is already running the queue.
+     */
+    void run();
+
+    /**
+        Waits until a request is done, running the queue if nothing else is.
+        If something else is running the queue and the caller can't sleep, a
+        request which hasn't been started is taken off the queue and finished
+        with nothing transferred.
+
+        @param r Request to wait for, which must have been submitted.
+        @return Number of bytes transferred.
+     */
+    size_t wait(BlockRequest& r);
+
+    /**
+        Tests whether there are requests waiting to be started.
+
+        @return True if there are none.
+     */
+    bool empty() const { return head == nullptr; }
+
+private:
+    // How long a request may wait before it jumps the queue, in nanoseconds.
+    static constexpr uint64_t read_expiry = 500000000ULL;
+    static constexpr uint64_t write_expiry = 5000000000ULL;
+
+    // Takes the next requests to do off the queue, as a list of requests that
+    // follow on from each other. Must hold the guard.
+    BlockRequest* next_batch();
+
+    // Takes a request off the queue if it hasn't been started. Must hold the
+    // guard.
+    bool remove(BlockRequest& r);
+
+    // Carries out a list of requests as one transfer.
+    void transfer(BlockRequest* batch);
+
+    // Device which carries out the requests.
+    BlockDevice& dev;
+    // Most sectors in one transfer.
+    size_t max_sectors;
+    // Requests not yet started, in offset order.
+    BlockRequest* head;
+    // Offset just after the last transfer, where the next one starts looking.
+    uint64_t position;
+    // Whether something is running the queue.
+    bool running;
+    // Protects the queue. Interrupts are off while it's held, so a sleeper
+    // can't miss its wake up.
+    Spinlock guard;
+    // Processes waiting for requests to finish.
+    WaitQueue waiters;
+};
+
+#endif /* BLOCK_QUEUE_H */
@@ -0,0 +1,350 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "Lock.h"
+#include "WaitQueue.h"
+
+// Forward declarations
+class BlockDevice;
+
+/**
+    Cache of disk sectors, shared by everything that reads or writes block
+    devices. Each buffer holds one sector, keyed by the physical device and its
+    offset on that device, so a partition and the whole disk see the same
+    buffers.
+
+    Buffers are handed out as reference counted handles. A buffer with a handle
+    outstanding is pinned and won't be reused. Writes only change the buffer
+    and mark it dirty. Dirty buffers are written to the device when it's
+    flushed or when too many have built up.
+
+    Buffers are reused in least recently used order once the cache is at its
+    limit, or sooner if free physical memory is running low. Only clean buffers
+    are reused, so finding one never waits for the disk.
+
+    The lock isn't held while the disk is read or written. A buffer being read
+    in or written back is marked as busy, and anyone else who needs it sleeps
+    until it's done, so other processes can use the cache and queue their own
+    requests in the meantime.
+ */
+class BufferCache {
+private:
+    // A cached sector.
+    struct buffer;
+
+public:
+    /**
+        Default limit on the number of buffers.
+     */
+    static constexpr size_t default_max_buffers = 4096;
+
+    /**
+        Reference to a buffer in the cache. The buffer is pinned until the
+        handle is released or destroyed. Handles can be moved but not copied.
+     */
+    class Handle {
+    public:
+        /**
+            Default constructor. Makes a handle to nothing.
+         */
+        Handle() : cache{nullptr}, buf{nullptr} {}
+
+        /**
+            Move constructor. Takes over the buffer of the other handle.
+
+            @param other Handle to move from. Left refering to nothing.
+         */
+        Handle(Handle&& other) : cache{other.cache}, buf{other.buf}
+        {
+            other.buf = nullptr;
+        }
+
+        /**
+            Move assignment. Releases the current buffer and takes over the
+            buffer of the other handle.
+
+            @param other Handle to move from. Left refering to nothing.
+            @return This handle.
+         */
+        Handle& operator=(Handle&& other);
+
+        /**
+            Handles are counted, so can't be copied.
+         */
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+
+        /**
+            Destructor. Releases the buffer.
+         */
+        ~Handle() { release(); }
+
+        /**
+            Checks whether the handle refers to a buffer. It doesn't if the
+            sector couldn't be read.
+
+            @return True if there's a buffer.
+         */
+        bool valid() const { return buf != nullptr; }
+
+        /**
+            Gets the contents of the buffer, one sector long.
+
+            @return Start of the buffer.
+         */
+        char* data() const;
+
+        /**
+            Marks the buffer as changed, so it gets written back to the device.
+            Call after changing the contents.
+         */
+        void mark_dirty();
+
+        /**
+            Unpins the buffer, leaving the handle refering to nothing.
+         */
+        void release();
+
+    private:
+        friend class BufferCache;
+
+        // Makes a handle for a buffer which has already been counted.
+        Handle(BufferCache* c, buffer* b) : cache{c}, buf{b} {}
+
+        // Cache the buffer belongs to.
+        BufferCache* cache;
+        // The buffer, or nullptr.
+        buffer* buf;
+    };
+
+    /**
+        Constructor. The cache starts empty.
+
+        @param max Most buffers to keep.
+     */
+    explicit BufferCache(size_t max = default_max_buffers);
+
+    /**
+        Destructor. Writes back any dirty buffers, then frees them all. There
+        must be no handles outstanding.
+     */
+    ~BufferCache();
+
+    /**
+        The cache owns its buffers, so can't be copied.
+     */
+    BufferCache(const BufferCache&) = delete;
+    BufferCache& operator=(const BufferCache&) = delete;
+
+    /**
+        Gets a sector from the cache, reading it from the device if it's not
+        there already.
+
+        @param dev Device to read. May be a partition.
+        @param off Offset on the device. Must be sector aligned.
+        @param fill False if the caller is about to overwrite the whole sector,
+               so there's no need to read it.
+        @return Handle to the buffer, which isn't valid if reading failed.
+     */
+    Handle get(BlockDevice& dev, uint64_t off, bool fill = true);
+
+    /**
+        Copies a sector out of the cache.
+
+        @param dev Device to read. May be a partition.
+        @param off Offset on the device. Must be sector aligned.
+        @param addr Where to copy the sector to.
+        @return Number of bytes read, the sector size on success.
+     */
+    size_t read(BlockDevice& dev, uint64_t off, void* addr);
+
+    /**
+        Copies a sector into the cache. It's written to the device later.
+
+        @param dev Device to write. May be a partition.
+        @param off Offset on the device. Must be sector aligned.
+        @param addr Where to copy the sector from.
+        @return Number of bytes written, the sector size on success.
+     */
+    size_t write(BlockDevice& dev, uint64_t off, const void* addr);
+
+    /**
+        Reads a run of sectors straight from the device in as few commands as
+        possible, for large transfers. Sectors which are already cached are
+        copied from the cache instead, since they may be newer. The sectors
+        read aren't added to the cache.
+
+        @param dev Device to read. May be a partition.
+        @param off Offset on the device. Must be sector aligned.
+        @param addr Where to copy the sectors to.
+        @param count Number of sectors.
+        @return Number of bytes read.
+     */
+    size_t read_blocks(BlockDevice& dev, uint64_t off, void* addr,
+        size_t count);
+
+    /**
+        Writes a run of sectors straight to the device in as few commands as
+        possible, for large transfers. Any of the sectors which are cached are
+        updated to match. They're left dirty, since a write back started
+        earlier may reach the disk after this.
+
+        @param dev Device to write. May be a partition.
+        @param off Offset on the device. Must be sector aligned.
+        @param addr Where to copy the sectors from.
+        @param count Number of sectors.
+        @return Number of bytes written.
+     */
+    size_t write_blocks(BlockDevice& dev, uint64_t off, const void* addr,
+        size_t count);
+
+    /**
+        Brings a run of sectors into the cache ahead of them being needed. The
+        sectors which aren't cached already are queued on the device together,
+        so they can be read in as few commands as possible. Sectors past the
+        end of the device are ignored.
+
+        @param dev Device to read. May be a partition.
+        @param off Offset on the device. Must be sector aligned.
+        @param n Number of sectors.
+        @return Number of sectors read into the cache.
+     */
+    size_t prefetch(BlockDevice& dev, uint64_t off, size_t n);
+
+    /**
+        Writes back all the dirty buffers of a physical device. A partition
+        flushes the whole disk it's on.
+
+        @param dev Device to write back.
+        @return 0 on success, -1 if any write failed.
+     */
+    int flush(BlockDevice& dev);
+
+    /**
+        Writes back all the dirty buffers of every device.
+
+        @return 0 on success, -1 if any write failed.
+     */
+    int sync();
+
+    /**
+        Prints the size and hit rate of the cache.
+
+        @param dest Stream to print to.
+     */
+    void dump(klib::ostream& dest) const;
+
+private:
+    // Buffers are looked up by physical device and offset on that device.
+    using key = klib::pair<BlockDevice*, uint64_t>;
+
+    struct buffer {
+        // Physical device and offset of the sector.
+        BlockDevice* dev;
+        uint64_t off;
+        // Contents, one sector.
+        char* data;
+        // Number of handles outstanding.
+        uint32_t refs;
+        // Whether the contents have been changed since they were read or
+        // written back.
+        bool dirty;
+        // Whether the contents have been read in. Only meaningful once
+        // loading is over.
+        bool valid;
+        // Whether the sector is being read in, or the contents written back.
+        // Set with the lock held, and cleared under io_guard as well.
+        bool loading;
+        bool writing;
+        // Whether the sector was written while being read in, so what's read
+        // may be out of date and must be read again.
+        bool stale;
+        // Neighbours on the LRU list. The head is the most recently used.
+        buffer* prev;
+        buffer* next;
+    };
+
+    // Free physical pages below which buffers are reused rather than
+    // allocated.
+    static constexpr size_t low_free_pages = 1024;
+    // Fraction of the cache one prefetch may fill, so guesses can't push out
+    // everything else.
+    static constexpr size_t prefetch_share = 4;
+
+    // Reads in the sector of a pinned buffer, letting go of the lock
+    // meanwhile. Must hold the lock.
+    bool load(buffer& b);
+
+    // Writes back several dirty buffers, queueing them all first so the
+    // device can merge and order the writes. Lets go of the lock while
+    // waiting for them. Must hold the lock.
+    bool write_back(const klib::vector<buffer*>& bufs);
+
+    // Sleeps until a pinned buffer isn't being read or written. Must hold the
+    // lock, which is let go of meanwhile. Returns false if the caller can't
+    // sleep.
+    bool wait_io(buffer& b);
+
+    // Waits until none of the buffers of a device between two offsets is
+    // being read or written, or none at all if the device is nullptr. Must
+    // hold the lock. Returns false if the caller can't sleep.
+    bool wait_busy(BlockDevice* dev, uint64_t start, uint64_t end);
+
+    // Marks a buffer as no longer being read or written, and wakes anyone
+    // waiting for it.
+    void end_io(buffer& b);
+
+    // Finds a buffer to hold a new sector, allocating or reusing one. Must hold
+    // the lock.
+    buffer* new_buffer(BlockDevice& dev, uint64_t off);
+
+    // Takes an unpinned, clean buffer off the end of the LRU list and out of
+    // the index. Must hold the lock.
+    buffer* evict();
+
+    // Removes a buffer from the LRU list.
+    void unlink(buffer& b);
+
+    // Puts a buffer at the head of the LRU list.
+    void push_front(buffer& b);
+
+    // Drops a reference to a buffer, for Handle::release().
+    void put(buffer& b);
+
+    // Marks a buffer dirty, for Handle::mark_dirty(). Writes back the oldest
+    // dirty buffers if there are too many.
+    void set_dirty(buffer& b);
+
+    // Most buffers to keep, and most of those which may be dirty.
+    size_t max_buffers;
+    size_t max_dirty;
+    // Current buffer counts.
+    size_t count;
+    size_t dirty_count;
+    // Buffers by device and offset.
+    klib::map<key, buffer*> index;
+    // Ends of the LRU list.
+    buffer* head;
+    buffer* tail;
+    // Statistics.
+    size_t hits;
+    size_t misses;
+    // Protects everything.
+    Mutex lock;
+    // Protects clearing the busy flags of the buffers, for those sleeping
+    // without the lock. Interrupts are off while it's
+    // held, so a sleeper can't miss its wake up.
+    Spinlock io_guard;
+    // Processes waiting for buffers to stop being busy.
+    WaitQueue io_waiters;
+};
+
+#endif /* BUFFER_CACHE_H */
@@ -0,0 +1,200 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Forward declarations
+class Pit;
+
+/**
+    A source of the time since boot. The kernel picks the best one available
+    at boot and uses it anywhere that needs to measure how long something
+    took. Reads are cheap and may be made from interrupt handlers.
+ */
+class Clock {
+public:
+    /**
+        Destructor.
+     */
+    virtual ~Clock() {}
+
+    /**
+        Gets a short name for the clock, for the log.
+
+        @return Name of the clock.
+     */
+    virtual const char* name() const = 0;
+
+    /**
+        Gets the current time. Never goes backwards.
+
+        @return Time since boot, in nanoseconds.
+     */
+    virtual uint64_t now_ns() const = 0;
+
+    /**
+        Gets the smallest step the time can advance by.
+
+        @return Resolution, in nanoseconds.
+     */
+    virtual uint32_t resolution_ns() const = 0;
+};
+
+/**
+    Clock based on the PIT tick count. Always available, but only advances once
+    per PIT interrupt.
+ */
+class PitClock : public Clock {
+public:
+    /**
+        Constructor.
+
+        @param p PIT to read. Must outlive the clock.
+     */
+    explicit PitClock(const Pit& p) : pit{p} {}
+
+    /**
+        Gets a short name for the clock, for the log.
+
+        @return "PIT".
+     */
+    virtual const char* name() const override { return "PIT"; }
+
+    /**
+        Gets the time of the last PIT tick.
+
+        @return Time since boot, in nanoseconds.
+     */
+    virtual uint64_t now_ns() const override;
+
+    /**
+        Gets the time between PIT ticks.
+
+        @return Resolution, in nanoseconds.
+     */
+    virtual uint32_t resolution_ns() const override;
+
+private:
+    // PIT whose ticks are counted.
+    const Pit& pit;
+};
+
+/**
+    Clock based on the processor's time stamp counter, which counts cycles. The
+    rate is measured against the PIT when the clock is created, and the clock
+    carries on from the PIT time at that point.
+
+    The counter only ticks at a constant rate if the processor says it's
+    invariant. Otherwise it may change speed with power saving, and the clock
+    is only good for short measurements. The counters of different processors
+    aren't guaranteed to agree, so the clock should be read on the boot
+    processor when comparing times.
+ */
+class TscClock : public Clock {
+public:
+    /**
+        Counts are converted to nanoseconds by multiplying by the multiplier
+        and shifting right by this. The shift keeps the multiplier within 32
+        bits for any usable frequency.
+     */
+    static constexpr uint32_t shift = 24;
+
+    /**
+        Checks whether the processor has a time stamp counter.
+
+        @return True if the counter can be read.
+     */
+    static bool supported();
+
+    /**
+        Checks whether the time stamp counter runs at a constant rate, even
+        through frequency changes and sleep states.
+
+        @return True if the counter is invariant.
+     */
+    static bool invariant();
+
+    /**
+        Constructor. Measures the counter against the PIT, which takes about
+        100ms. Interrupts must be enabled, as it waits on PIT interrupts.
+
+        @param pit PIT to measure against.
+     */
+    explicit TscClock(Pit& pit);
+
+    /**
+        Checks that the counter runs fast enough to be better than the PIT.
+
+        @return True if the clock should be used.
+     */
+    bool usable() const { return freq >= min_freq; }
+
+    /**
+        Gets the measured counter frequency.
+
+        @return Counts per second.
+     */
+    uint64_t frequency() const { return freq; }
+
+    /**
+        Gets the counter value the clock starts from. The time is base_ns()
+        plus the counts since this, scaled by multiplier() and shift.
+
+        @return Counter value at the end of calibration.
+     */
+    uint64_t base_tsc() const { return start_tsc; }
+
+    /**
+        Gets the time the clock starts from.
+
+        @return Time since boot at base_tsc(), in nanoseconds.
+     */
+    uint64_t base_ns() const { return start_ns; }
+
+    /**
+        Gets the multiplier for converting counts to nanoseconds, before
+        shifting right by shift.
+
+        @return Multiplier, or 0 if the clock isn't usable.
+     */
+    uint32_t multiplier() const { return mult; }
+
+    /**
+        Gets a short name for the clock, for the log.
+
+        @return "TSC".
+     */
+    virtual const char* name() const override { return "TSC"; }
+
+    /**
+        Gets the current time, from the counter.
+
+        @return Time since boot, in nanoseconds.
+     */
+    virtual uint64_t now_ns() const override;
+
+    /**
+        Gets the time between counts, rounded up.
+
+        @return Resolution, in nanoseconds.
+     */
+    virtual uint32_t resolution_ns() const override;
+
+private:
+    // Slowest frequency whose multiplier fits in 32 bits.
+    static constexpr uint64_t min_freq =
+        (1000000000ULL << shift) / 0xFFFFFFFFULL + 1;
+    // Time to measure the counter for, in milliseconds.
+    static constexpr unsigned int calibrate_ms = 100;
+
+    // Counter value and time at the end of calibration.
+    uint64_t start_tsc;
+    uint64_t start_ns;
+    // Counts per second.
+    uint64_t freq;
+    // Multiplier for converting counts to nanoseconds.
+    uint32_t mult;
+};
+
+#endif /* CLOCK_H */
@@ -3,7 +3,10 @@
 
 #include <string>
 
+#include "WaitQueue.h"
+
 // Forward declarations
+class BlockRequest;
 enum class FileSystemType;
 enum class PollType;
 
@@ -24,7 +27,8 @@ enum class DeviceType {
 };
 
 /**
-    Abstract class for any device. Only stores the type.
+    Abstract class for any device. Stores the type and the queue of anything
+    waiting for events on the device.
  */
 class Device {
 public:
@@ -33,7 +37,7 @@ public:
 
         @param t Type of device.
      */
-    Device(DeviceType t) : type {t} {}
+    Device(DeviceType t) : type {t}, waiters {} {}
 
     /**
         Virtual destructor. Does nothing.
@@ -55,8 +59,19 @@ public:
      */
     DeviceType get_type() const { return type; }
 
+    /**
+        Gets the queue of waiters for events on the device. Drivers should pass
+        the device to SignalManager::notify_file() rather than waking the queue
+        themselves.
+
+        @return Wait queue for the device.
+     */
+    WaitQueue& get_wait_queue() { return waiters; }
+
 protected:
     DeviceType type;
+    // Polls and interest sets waiting for events on the device.
+    WaitQueue waiters;
 };
 
 /**
@@ -150,6 +165,50 @@ public:
      */
     virtual size_t write_block(uint64_t off, const void* addr) = 0;
 
+    /**
+        Read a run of consecutive sectors from an offset on the disk into a
+        memory location. The default reads one sector at a time, but drivers
+        which can transfer several sectors in one command should override it.
+        The offset must be aligned.
+
+        @param off Offset from the start of the disk to read from.
+        @param addr Address in memory to put the data.
+        @param count Number of sectors to read.
+        @return Number of bytes read.
+     */
+    virtual size_t read_blocks(uint64_t off, void* addr, size_t count);
+
+    /**
+        Write a run of consecutive sectors from a memory location onto the
+        disk. The default writes one sector at a time, but drivers which can
+        transfer several sectors in one command should override it. The offset
+        must be aligned.
+
+        @param off Offset from the start of the disk to write to.
+        @param addr Address in memory to get the data from.
+        @param count Number of sectors to write.
+        @return Number of bytes written.
+     */
+    virtual size_t write_blocks(uint64_t off, const void* addr, size_t count);
+
+    /**
+        Starts a request to read or write a run of sectors. Drivers with a
+        request queue add it to the queue, where it may be merged with others
+        and done in a different order. The default carries out the request
+        straight away.
+
+        @param r Request to start. Must stay alive until it's done.
+     */
+    virtual void submit(BlockRequest& r);
+
+    /**
+        Waits until a request made with submit() is done.
+
+        @param r Request to wait for.
+        @return Number of bytes read or written.
+     */
+    virtual size_t wait(BlockRequest& r);
+
     /**
         Waits until the pending write is complete.
 
@@ -221,7 +280,38 @@ public:
      */
     virtual size_t sector_size() const { return s_sz; }
 
+    /**
+        Gives the physical device this device's data is on. The buffer cache
+        keys sectors by physical device, so every view of a disk shares them.
+
+        @return The physical device, which is this one unless overridden.
+     */
+    virtual BlockDevice& base_device() { return *this; }
+
+    /**
+        Gives the offset of this device's data on the physical device.
+
+        @return Offset in bytes, 0 unless overridden.
+     */
+    virtual uint64_t base_offset() const { return 0; }
+
 protected:
+    friend class BlockQueue;
+
+    /**
+        Carries out a run of sectors taken from a request queue. The default
+        uses read_blocks() and write_blocks(), so drivers with a queue must
+        override it.
+
+        @param write True to write to the disk, false to read.
+        @param off Offset from the start of the disk.
+        @param addr Address in memory of the data.
+        @param count Number of sectors.
+        @return Number of bytes transferred.
+     */
+    virtual size_t transfer(bool write, uint64_t off, void* addr,
+        size_t count);
+
     // String with a description of the device.
     klib::string desc;
     // Size of a sector.
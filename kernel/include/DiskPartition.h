@@ -54,8 +54,26 @@ public:
     virtual uint64_t get_offset() const { return offset; }
 
     /**
-        Read bytes from an offset on the disk into a memory location. An error
-        may be returned if not a convenient size or offset.
+        Gives the physical device the partition is on.
+
+        @return The physical device under the partition.
+     */
+    virtual BlockDevice& base_device() override { return drv->base_device(); }
+
+    /**
+        Gives the offset of the partition on the physical device.
+
+        @return Offset in bytes.
+     */
+    virtual uint64_t base_offset() const override
+    {
+        return offset + drv->base_offset();
+    }
+
+    /**
+        Read bytes from an offset on the disk into a memory location, through
+        the buffer cache. An error may be returned if not a convenient size or
+        offset.
 
         @param off Offset from the start of the disk to read from.
         @param addr Address in memory to put the data.
@@ -64,8 +82,9 @@ public:
     virtual size_t read_block(uint64_t off, void* addr) override;
 
     /**
-        Write bytes from a memory location onto the disk. An error may be
-        returned if not a convenient size or offset.
+        Write bytes from a memory location onto the disk, through the buffer
+        cache. The data reaches the disk when the cache writes it back. An
+        error may be returned if not a convenient size or offset.
 
         @param off Offset from the start of the disk to write to.
         @param addr Address in memory to get the data from.
@@ -74,19 +93,46 @@ public:
     virtual size_t write_block(uint64_t off, const void* addr) override;
 
     /**
-        Waits until the pending write is complete. Calls the underlying device
-        flush.
+        Read a run of sectors from an offset on the disk into a memory
+        location. Passed through to the underlying device as one transfer,
+        with anything newer taken from the buffer cache.
+
+        @param off Offset from the start of the disk to read from.
+        @param addr Address in memory to put the data.
+        @param count Number of sectors to read.
+        @return Number of bytes read.
+     */
+    virtual size_t read_blocks(uint64_t off, void* addr, size_t count)
+        override;
+
+    /**
+        Write a run of sectors from a memory location onto the disk. Passed
+        through to the underlying device as one transfer, updating any copies
+        in the buffer cache.
+
+        @param off Offset from the start of the disk to write to.
+        @param addr Address in memory to get the data from.
+        @param count Number of sectors to write.
+        @return Number of bytes written.
+     */
+    virtual size_t write_blocks(uint64_t off, const void* addr, size_t count)
+        override;
+
+    /**
+        Writes back the cached sectors of the whole disk, by flushing the
+        underlying device.
 
         @return 0 on success, otherwise EoF.
      */
     virtual int flush() override { return drv->flush(); }
 
     /**
-        Performs any clean up operations required. Just calls flush() for now.
+        Performs any clean up operations required. Cached sectors stay cached,
+        so nothing to do.
 
         @return 0 on success, otherwise EoF.
      */
-    virtual int close() override { return flush(); }
+    virtual int close() override { return 0; }
 
     /**
         Determines whether a poll condition is currently satisfied. Forwards the
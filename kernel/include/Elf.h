@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include <array>
+#include <fstream>
 #include <istream>
 #include <iterator>
 #include <ostream>
@@ -1271,7 +1272,8 @@ public:
         file_name {""},
         file_hdr {nullptr},
         section_hdrs {nullptr},
-        program_hdrs {nullptr}
+        program_hdrs {nullptr},
+        file {nullptr}
     {}
 
     /**
@@ -1313,17 +1315,25 @@ public:
 
     /**
         Desctructor. Frees the file header, section headers table and program
-        headers table.
+        headers table, and closes the binary if it was opened for loading.
      */
     ~Elf();
 
     /**
-        Allocates all the pages required to cover the segments listed in the
-        program header table.
+        Allocates and loads the page containing the given virtual address, if
+        it's covered by one of the segments listed in the program header table.
+        Segments are not allocated up front, but one page at a time as they are
+        first accessed. Pages are only writable if a segment covering them is.
+        Writable pages with no data from the file share the zero page until
+        they're written.
 
-        @param pdt Page Descriptor Table for the allocations.
+        @param pdt Page Descriptor Table for the allocation. Must be the active
+               one.
+        @param virt_addr Virtual address to allocate the page for.
+        @return True if a page was allocated, false if the address is not in a
+                segment or the allocation failed.
      */
-    void allocate(PageDescriptorTable& pdt) const;
+    bool allocate(PageDescriptorTable& pdt, const void* virt_addr) const;
 
     /**
         Deallocates all the pages required to cover the segments listed in the
@@ -1371,11 +1381,6 @@ public:
      */
     const ElfProgramTab& get_program_table() const { return *program_hdrs; }
 
-    /**
-        Load the program segments into memory at their specified locations.
-     */
-    void load() const;
-
     /**
         Whether this seems to be a valid ELF file that the kernel can load.
 
@@ -1394,5 +1399,12 @@ private:
     ElfSectionTab* section_hdrs;
     // Program header table.
     ElfProgramTab* program_hdrs;
+    // The binary, kept open for loading pages on demand. Opened on first use.
+    mutable klib::ifstream* file;
+
+    // Loads the program segment data for a single page into memory. Parts of
+    // the page not backed by the file are cleared. The page must already have
+    // been allocated, writable, and be mapped in the active PDT.
+    void load(const void* virt_addr) const;
 };
 #endif /* ELF_H */
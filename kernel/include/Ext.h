@@ -13,6 +13,7 @@
 
 #include "File.h"
 #include "FileSystem.h"
+#include "ObjectCache.h"
 
 // Forward declarations.
 class Ext2FileSystem;
@@ -1473,6 +1474,31 @@ protected:
     size_t inode_index;
 
 private:
+    // Blocks read ahead once sequential reading is spotted, and the most the
+    // amount read ahead may grow to.
+    static constexpr size_t min_readahead = 4;
+    static constexpr size_t max_readahead = 128;
+
+    // Block of the file where the last read finished. A read starting there
+    // carries on a sequential run.
+    size_t ra_next;
+    // Number of blocks to read ahead of the reader, or 0 if reading isn't
+    // sequential.
+    size_t ra_window;
+    // First block of the file not yet read ahead.
+    size_t ra_end;
+
+    /**
+        Called by read. Spots sequential reading and brings the following
+        blocks into the buffer cache before they're asked for. The amount read
+        ahead doubles each time the reader catches up with it, and starts again
+        from nothing when the reader jumps elsewhere.
+
+        @param first First block of the file the read covers.
+        @param last Last block of the file the read covers.
+     */
+    void readahead(size_t first, size_t last);
+
     /**
         Called by truncate. Reads the block pointed top as a list of blocks,
         either to deallocate, or read as another list of blocks, according to
@@ -1644,8 +1670,10 @@ protected:
     // Keep a cache of inodes for files undergoing changes. Keep them centrally
     // for the file system so that files open multiple times can be kept in sync
     // without repeated disk writes and reads. The boolean is used to keep track
-    // of whether the inode has been modified.
-    klib::map<size_t, klib::pair<Ext2Inode, bool>> inodes;
+    // of whether the inode has been modified. The nodes are in an object cache.
+    klib::map<size_t, klib::pair<Ext2Inode, bool>, klib::less<size_t>,
+        CacheAllocator<klib::pair<const size_t, klib::pair<Ext2Inode, bool>>>>
+        inodes;
 
     // The contents of the superblock, along with a flag for whether it's
     // been modified.
@@ -218,6 +218,10 @@ public:
     virtual int truncate() override { return 0; }
 
 protected:
+    // Runs of at least this many whole sectors are transferred in one go,
+    // rather than a sector at a time through the buffer cache.
+    static constexpr size_t bulk_sectors = 16;
+
     // Block device that handles the reads and writes.
     BlockDevice& dev;
     // Whether data has been read into the buffer. The buffer must be up to date
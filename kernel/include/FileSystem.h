@@ -3,10 +3,14 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <cstdio>
 #include <map>
 #include <string>
 
+#include "Lock.h"
+#include "Rcu.h"
+
 // Forward declarations.
 class BlockDevice;
 class DevFileSystem;
@@ -44,7 +48,7 @@ public:
         @param ro Whether the file system is read only.
      */
     FileSystem(const klib::string& n, bool ro = false) :
-        drv_name{n}, read_only{ro}
+        drv_name{n}, read_only{ro}, dev_drv{nullptr}
     {}
 
     /**
@@ -86,7 +90,8 @@ public:
     virtual int mkdir(const klib::string& name, int mode) = 0;
 
     /**
-        Reads some characters from the underlying device into the buffer.
+        Reads some characters from the underlying device into the buffer,
+        through the buffer cache.
 
         @param offset Position on the disk to start reading from.
         @param buf Character buffer to read into.
@@ -95,6 +100,15 @@ public:
      */
     virtual size_t read(uint64_t offset, char* buf, size_t n);
 
+    /**
+        Brings part of the underlying device into the buffer cache, so later
+        reads of it don't have to wait for the disk.
+
+        @param offset Position on the disk to start from.
+        @param n Number of characters wanted.
+     */
+    virtual void prefetch(uint64_t offset, size_t n);
+
     /**
         Rename the given file to the new given name.
 
@@ -125,7 +139,8 @@ public:
     virtual int unlink(const klib::string& name) = 0;
 
     /**
-        Write some characters from the buffer into the file.
+        Write some characters from the buffer onto the underlying device. They
+        go into the buffer cache, and reach the disk when it's flushed.
 
         @param offset Position on the disk to start writing to.
         @param buf Character buffer to get the data from.
@@ -148,6 +163,13 @@ public:
      */
     virtual bool ro() const { return read_only; }
 
+    /**
+        Gets the driver of the underlying device, looking it up the first time.
+
+        @return Block device driver, or nullptr for a virtual file system.
+     */
+    BlockDevice* device();
+
     /**
         Get the block size of the file system.
 
@@ -160,6 +182,8 @@ protected:
     klib::string drv_name;
     // Whether the file system is read only.
     bool read_only;
+    // Driver for the device, once looked up.
+    BlockDevice* dev_drv;
 };
 
 /**
@@ -183,9 +207,14 @@ public:
     /**
         Default constructor. Creates an empty set of mappings.
      */
-    VirtualFileSystem() : FileSystem{""}, mtab {}
+    VirtualFileSystem() : FileSystem{""}, mtab {new mount_table {}}
     {}
 
+    /**
+        Destructor. Frees the mount table, but not the file systems in it.
+     */
+    virtual ~VirtualFileSystem() { delete mtab.load(); }
+
     /**
         Opens a directory, returning a pointer to the directory handle. nullptr
         is returned on errors, such as the directory not existing, or the name
@@ -258,10 +287,27 @@ public:
      */
     virtual size_t block_size() const { return 1; }
 
+    /**
+        Starts a read section of the mount table. File systems found with
+        lookup() can't be unmounted and freed until the section ends. Read
+        sections may sleep and may be nested. ReadGuard holds one for a scope.
+
+        @return Token to pass to read_unlock().
+     */
+    unsigned read_lock() const { return mtab_rcu.read_lock(); }
+
+    /**
+        Ends a read section of the mount table.
+
+        @param token Value returned by the matching read_lock().
+     */
+    void read_unlock(unsigned token) const { mtab_rcu.read_unlock(token); }
+
     /**
         Given a file name, searches for the deepest matching mapping and then
         returns the file system the file exists on. The original file name is
-        adjusted to be relative to the root of the device.
+        adjusted to be relative to the root of the device. Must be called in a
+        read section, and the file system may only be used until it ends.
 
         @param f Absolute path name to look up. Gets modified to the file name
                relative to the root of the device in the non-const version.
@@ -311,9 +357,22 @@ public:
     void umount(const klib::string& n);
 
 private:
+    // Mappings between mount points and file systems.
+    using mount_table = klib::map<klib::string, FileSystem*>;
+
     // List of mappings between mount points and file systems. Device drivers
-    // are accessed through the /dev/ file system.
-    klib::map<klib::string, FileSystem*> mtab;
+    // are accessed through the /dev/ file system. Every path lookup reads it
+    // and it hardly ever changes, so readers just hold an RCU read section
+    // while changes copy it and swap the pointer.
+    klib::atomic<mount_table*> mtab;
+    // Grace periods for readers of mtab.
+    mutable Rcu mtab_rcu;
+    // Serialises changes to mtab.
+    Mutex mtab_lock;
+
+    // Publishes a new mount table and frees the old one once no reader can
+    // see it. Must hold mtab_lock.
+    void replace_mtab(mount_table* tab);
 };
 
 #endif /* FILE_SYSTEM_H */
@@ -241,7 +241,9 @@ public:
     bool set_user_mode_ds(size_t n);
 
     /**
-        Returns the GDT register corresponding to the task state segment.
+        Returns the GDT register corresponding to the task state segment of
+        the bootstrap processor. The other processors' TSS descriptors follow
+        on from it, in processor order.
 
         @return GDT register value for the task state segment.
      */
@@ -266,6 +268,15 @@ public:
      */
     bool load() const; 
 
+    /**
+        Loads the table on an application processor, with the processor's own
+        TSS, as a TSS descriptor can only be in use on one processor at a time.
+
+        @param n Processor index, from 1.
+        @return Whether the operation succeeded.
+     */
+    bool load_secondary(size_t n) const;
+
 private:
     // Space for table entries. We're very much relying on vector having
     // contiguous storage. The standard does guarantee that, so we just have to
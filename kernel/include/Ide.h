@@ -8,10 +8,16 @@
 #include <ostream>
 #include <string>
 
+#include "BlockQueue.h"
 #include "Device.h"
 #include "FileSystem.h"
 #include "InterruptHandler.h"
+#include "Lock.h"
 #include "Pci.h"
+#include "WaitQueue.h"
+
+// Forward declarations
+class Process;
 
 // Channels on the IDE bus.
 enum class channel : uint8_t {
@@ -31,6 +37,11 @@ enum class rank : uint8_t {
  */
 class IdeController : public PciDevice {
 public:
+    /**
+        Most sectors that can be read or written by one command.
+     */
+    static constexpr size_t max_sectors = 256;
+
     /**
         Constructor. Inherited PCI constructor sets the bus, device and function
         numbers, then checks for existence.
@@ -57,7 +68,10 @@ public:
     void dump(klib::ostream& dest) const;
 
     /**
-        Read sectors from the specified disk.
+        Read sectors from the specified disk. Uses bus master DMA if the
+        controller and disk support it, otherwise PIO. The calling process
+        sleeps until a DMA transfer completes, if there is one and interrupts
+        are on.
 
         @param cha Channel of the device.
         @param ra Master or slave device.
@@ -70,7 +84,10 @@ public:
         size_t sz);
 
     /**
-        Write sectors to the specified disk.
+        Write sectors to the specified disk. Uses bus master DMA if the
+        controller and disk support it, otherwise PIO. The calling process
+        sleeps until a DMA transfer completes, if there is one and interrupts
+        are on.
 
         @param cha Channel of the device.
         @param ra Master or slave device.
@@ -92,6 +109,14 @@ public:
      */
     void add_drivers(klib::map<klib::string, Device*>& drvs);
 
+    /**
+        Handles an interrupt, finishing the DMA transfer on the channel or
+        channels which use it.
+
+        @param inum Interrupt raised.
+     */
+    void handle_interrupt(InterruptNumber inum);
+
 private:
     // Default values of the addresses. These are used by older parallel IDE
     // controllers. If the PCI BAR is 0x0 or 0x1, these values are used instead.
@@ -241,6 +266,9 @@ private:
         altstatus = 0xC,
         devaddress = 0xD,
         // bmide start at 0xE and offset from the bmide start (subtract 0xE).
+        bmide_command = 0xE,
+        bmide_status = 0x10,
+        bmide_prdt = 0x12,
         bmide_top = 0x15
     };
     // Adjustments for the above values when converting to actual port numbers.
@@ -249,6 +277,66 @@ private:
     static constexpr uint16_t control_adjust = 0xA;
     static constexpr uint16_t bmide_adjust = 0xE;
 
+    // Bits of the bus master command register.
+    enum class bmide_command_bits : uint8_t {
+        // Set to run the transfer.
+        start = 0x01,
+        // Set when the transfer writes to memory.
+        read = 0x08
+    };
+
+    // Bits of the bus master status register.
+    enum class bmide_status_bits : uint8_t {
+        // The transfer is in progress.
+        active = 0x01,
+        // The transfer failed. Write 1 to clear.
+        error = 0x02,
+        // The device raised an interrupt. Write 1 to clear.
+        irq = 0x04,
+        // The BIOS set up DMA for the master and slave devices.
+        master_dma = 0x20,
+        slave_dma = 0x40
+    };
+
+    // Physical Region Descriptor, one entry in the list of memory areas a DMA
+    // transfer uses.
+    struct prd {
+        // Physical address of the area. Must be even.
+        uint32_t addr;
+        // Length in bytes, with 0 meaning 64KB. Must be even.
+        uint16_t count;
+        // Top bit is set on the last entry.
+        uint16_t flags;
+    };
+    // Flag for the last PRD entry.
+    static constexpr uint16_t prd_end = 0x8000;
+    // Areas may not cross a 64KB boundary.
+    static constexpr uint32_t prd_boundary = 0x10000;
+    // PRD entries in the page which holds the table.
+    static constexpr size_t max_prds = 512;
+    // How long to wait for a DMA interrupt before giving up, in milliseconds.
+    static constexpr uint32_t dma_timeout_ms = 5000;
+
+    // State shared by the devices on a channel. Kept on the heap, so copies
+    // of the controller refer to the same one.
+    struct ChannelState {
+        // Held for a whole command, so only one runs on the channel.
+        Mutex lock;
+        // Protects the fields below, which the interrupt handler changes.
+        Spinlock guard;
+        // Whether a DMA transfer is waiting for its interrupt.
+        bool waiting;
+        // Bus master and ATA status when the transfer finished.
+        uint8_t bm_status;
+        uint8_t ata_status;
+        // Processes waiting for the transfer.
+        WaitQueue waiters;
+        // PRD table, or nullptr if the channel can't do DMA, and its physical
+        // address.
+        prd* prdt;
+        uint32_t prdt_phys;
+    };
+
     // Responses to polling.
     enum class polling_response : uint8_t {
         no_error = 0,
@@ -281,6 +369,8 @@ private:
         bool nien;
         // Which device is currently active.
         rank dev;
+        // Lock and DMA state.
+        ChannelState* state;
     };
 
     // Class to store information on the devices.
@@ -328,8 +418,6 @@ private:
     // secondary master, secondary slave.
     static constexpr size_t max_drives = 4;
     klib::array<IdeDevice, max_drives> devs;
-    // Maximum number of sectors to read in one go.
-    static constexpr size_t max_sectors = 256;
     // Assume heads per cylinder is 16, only necessary for LBA to CHS
     // translation.
     static constexpr size_t heads_per_cylinder = 16;
@@ -366,6 +454,19 @@ private:
     void print_error(size_t drive, polling_response err) const;
     // Switches the active device on the bus, if necessary.
     polling_response switch_device(channel cha, rank ra);
+    // Sets up the PRD table for a DMA transfer. Returns false if the memory
+    // can't be used for DMA.
+    bool build_prd(channel cha, const void* addr, size_t sz);
+    // Transfers sectors by DMA. Returns false, without doing anything, if DMA
+    // can't be used, otherwise sets err to the result.
+    bool ata_dma(channel cha, rank ra, uint64_t off, const void* addr,
+        size_t sz, bool write, DiskIoError& err);
+    // Waits for the DMA transfer on a channel to finish, putting p to sleep
+    // or polling if it's nullptr. Returns false on a timeout.
+    bool dma_wait(channel cha, Process* p);
+    // Stops the DMA transfer on a channel and records how it finished. The
+    // guard must be held.
+    void dma_finish(channel cha);
 };
 
 /**
@@ -390,7 +491,8 @@ public:
         cont {c},
         cha {ch},
         ra {r},
-        busy {false}
+        busy {false},
+        queue {*this, IdeController::max_sectors}
     {}
 
     /**
@@ -414,19 +516,62 @@ public:
     virtual size_t write_block(uint64_t off, const void* addr) override;
 
     /**
-        Waits until the pending write is complete. Write doesn't return until
-        the write is complete, so no action is required.
+        Read consecutive sectors from an offset on the disk into a memory
+        location, using as few commands as the controller allows. The offset
+        must be aligned.
+
+        @param off Offset from the start of the disk to read from.
+        @param addr Address in memory to put the data.
+        @param count Number of sectors to read.
+        @return Number of bytes read.
+     */
+    virtual size_t read_blocks(uint64_t off, void* addr, size_t count)
+        override;
+
+    /**
+        Write consecutive sectors from a memory location onto the disk, using
+        as few commands as the controller allows. The offset must be aligned.
+
+        @param off Offset from the start of the disk to write to.
+        @param addr Address in memory to get the data from.
+        @param count Number of sectors to write.
+        @return Number of bytes written.
+     */
+    virtual size_t write_blocks(uint64_t off, const void* addr, size_t count)
+        override;
+
+    /**
+        Adds a request to the queue of the disk. Nothing is transferred until
+        something waits on the queue.
+
+        @param r Request to start. Must stay alive until it's done.
+     */
+    virtual void submit(BlockRequest& r) override;
+
+    /**
+        Waits until a request is done, carrying out everything else on the
+        queue of the disk too.
+
+        @param r Request to wait for.
+        @return Number of bytes read or written.
+     */
+    virtual size_t wait(BlockRequest& r) override;
+
+    /**
+        Writes back any sectors of the disk which have been changed in the
+        buffer cache.
 
         @return 0 on success, otherwise EoF.
      */
-    virtual int flush() override { return 0; }
+    virtual int flush() override;
 
     /**
-        Performs any clean up operations required. Just calls flush() for now.
+        Performs any clean up operations required. Cached sectors stay cached,
+        so nothing to do.
 
         @return 0 on success, otherwise EoF.
      */
-    virtual int close() override { return flush(); }
+    virtual int close() override { return 0; }
 
     /**
         Determines whether a poll condition is currently satisfied.
@@ -436,6 +581,20 @@ public:
      */
     virtual PollType poll_check(PollType cond) const override;
 
+protected:
+    /**
+        Carries out a run of sectors taken from the queue, in transfers as
+        large as the controller allows.
+
+        @param write True to write to the disk, false to read.
+        @param off Offset from the start of the disk.
+        @param addr Address in memory of the data.
+        @param count Number of sectors.
+        @return Number of bytes transferred.
+     */
+    virtual size_t transfer(bool write, uint64_t off, void* addr,
+        size_t count) override;
+
 private:
     // IDE driver for read and write operations.
     IdeController& cont;
@@ -443,8 +602,16 @@ private:
     channel cha;
     // Device on the bus.
     rank ra;
-    // For DMA, indicates whether the device is currently busy with a rea/write.
+    // Indicates whether the device is currently busy with a read or write.
     bool busy;
+    // Reads and writes waiting to be carried out.
+    BlockQueue queue;
+
+    // Notifies pollers once a transfer has finished.
+    void done();
+
+    // Puts a request on the queue and waits for it.
+    size_t queue_io(bool write, uint64_t off, void* addr, size_t count);
 };
 
 #endif /* IDE_H */
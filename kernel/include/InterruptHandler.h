@@ -41,6 +41,45 @@ uint32_t interrupt_handler(uint32_t edi,
                        uint32_t esp_int,
                        uint16_t ss);
 
+/**
+    Transfer to here from the fast syscall entry in assembly. The arguments are
+    the same as for interrupt_handler, with irr always 0x80.
+
+    @param edi General purpose register value.
+    @param esi General purpose register value.
+    @param ebp General purpose register value.
+    @param esp General purpose register value.
+    @param ebx General purpose register value.
+    @param edx General purpose register value.
+    @param ecx General purpose register value.
+    @param eax General purpose register value.
+    @param irr Interrupt number.
+    @param err Error code.
+    @param eip Instruction address at the time of the interrupt.
+    @param cs Code segment at the time of the interrupt.
+    @param eflags eflags register value at the time of the interrupt.
+    @param esp_int Stack pointer at the time of the interrupt.
+    @param ss Stack segment at the time of the interrupt.
+
+    @return Return value of the syscall, for eax.
+ */
+extern "C"
+uint32_t sysenter_handler(uint32_t edi,
+                       uint32_t esi,
+                       uint32_t ebp,
+                       uint32_t esp,
+                       uint32_t ebx,
+                       uint32_t edx,
+                       uint32_t ecx,
+                       uint32_t eax,
+                       uint32_t irr,
+                       uint32_t err,
+                       uint32_t eip,
+                       uint16_t cs,
+                       uint32_t eflags,
+                       uint32_t esp_int,
+                       uint16_t ss);
+
 /**
     Information on the identites of various interrupts.
  */
@@ -89,8 +128,14 @@ enum class InterruptNumber : uint8_t {
     ata1 = 0x2E,
     // Secondary ATA or spurious
     ata2 = 0x2F,
+    // Local APIC timer
+    apic_timer = 0x30,
+    // Another processor asking this one to look for something to run
+    reschedule = 0x31,
     // System call interrupt number
-    syscall = 0x80
+    syscall = 0x80,
+    // Local APIC spurious interrupt
+    apic_spurious = 0xFF
 };
 
 /**
@@ -469,7 +514,8 @@ public:
 
     /**
         Handler routine. Sends a PIC acknowledgement if necessary. Checks for
-        a spurious PIC interrupt.
+        a spurious PIC interrupt. If the I/O APIC has taken over from the PIC,
+        acknowledges at the local APIC instead.
      */
     virtual void handle() override;
 };
@@ -488,6 +534,23 @@ public:
     virtual void handle() override;
 };
 
+/**
+    Interrupt handler for the local APIC timer and rescheduling requests from
+    other processors, which both call the scheduler of the processor they
+    arrive on.
+ */
+class ScheduleHandler : public InterruptHandler {
+public:
+    // Inherit base constructor
+    using InterruptHandler::InterruptHandler;
+
+    /**
+        Handler routine. Acknowledges at the local APIC and switches to the
+        next process, if switching isn't blocked.
+     */
+    virtual void handle() override;
+};
+
 /**
     Interrupt handler for the PS/2 keyboard.
  */
@@ -502,6 +565,34 @@ public:
     virtual void handle() override;
 };
 
+/**
+    Interrupt handler for the first serial port.
+ */
+class SerialHandler : public DefaultHandler {
+public:
+    // Inherit base constructor
+    using DefaultHandler::DefaultHandler;
+
+    /**
+        Handler routine. Moves characters between the port and its rings.
+     */
+    virtual void handle() override;
+};
+
+/**
+    Interrupt handler for the IDE channels.
+ */
+class IdeHandler : public DefaultHandler {
+public:
+    // Inherit base constructor
+    using DefaultHandler::DefaultHandler;
+
+    /**
+        Handler routine. Finishes any DMA transfer the interrupt is for.
+     */
+    virtual void handle() override;
+};
+
 /**
     Interrupt handler for the syscall interface.
  */
@@ -545,8 +636,9 @@ public:
 };
 
 /**
-    Interrupt handler for a page fault. Prints out the details and causes a
-    kernel panic.
+    Interrupt handler for a page fault. Resolves copy on write pages, loading
+    pages of the binary, first touches of heap and stack pages and user stack
+    growth, otherwise prints out the details and causes a kernel panic.
  */
 class PageFaultHandler : public InterruptHandler {
 public:
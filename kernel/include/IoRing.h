@@ -0,0 +1,136 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+
+#include "Lock.h"
+#include "Syscall.h"
+
+/**
+    Keeps track of the I/O rings processes have set up. An I/O ring lets a
+    process queue up many file operations in its own memory and have the
+    kernel carry them all out in one io_ring_enter syscall, rather than making
+    a syscall for each.
+
+    The ring lives in memory provided by the process: an io_ring header, then
+    the submission entries, then the completion entries. The process fills in
+    submission entries and moves sq_tail on. The kernel takes entries from
+    sq_head, carries them out and puts the results on the completion ring at
+    cq_tail. The process takes completions from cq_head. The kernel only
+    touches the ring during io_ring_enter, so user space doesn't need atomics.
+
+    The ring saves syscalls rather than waiting. There are no kernel threads to
+    finish an operation on the process's behalf, and the file classes all
+    block until they're done, so operations complete synchronously. Every
+    entry taken is carried out before the enter call returns, so its result is
+    on the completion ring by then and there's never anything left in flight.
+    Entries are never taken from the submission ring unless there's room for
+    their results, so nothing is lost if the process is slow to collect them.
+ */
+class IoRingTable {
+public:
+    /**
+        Largest number of entries a ring can have.
+     */
+    static constexpr uint32_t max_entries = 4096;
+
+    /**
+        Constructor. There are no rings to start with.
+     */
+    IoRingTable() : rings{}, last_id{0}, table_lock{} {}
+
+    /**
+        Destructor. Forgets all the rings. The memory belongs to the processes.
+     */
+    ~IoRingTable();
+
+    /**
+        The table is the only record of the rings, so can't be copied.
+     */
+    IoRingTable(const IoRingTable&) = delete;
+    IoRingTable& operator=(const IoRingTable&) = delete;
+
+    /**
+        Gets the amount of memory a ring needs.
+
+        @param entries Number of entries in the ring.
+        @return Size of the header and both arrays, in bytes.
+     */
+    static size_t ring_size(uint32_t entries)
+    {
+        return sizeof(io_ring) + entries * (sizeof(io_sqe) + sizeof(io_cqe));
+    }
+
+    /**
+        Sets up a ring for the active process. The memory is cleared, which also
+        makes sure it's mapped, and the number of entries filled in.
+
+        @param mem Start of the ring, in user space.
+        @param entries Number of entries, a power of 2 no more than
+               max_entries.
+        @return Identifier for the ring, or -1 on failure.
+     */
+    int create(io_ring* mem, uint32_t entries);
+
+    /**
+        Takes entries from the submission ring and carries them out, putting
+        their results on the completion ring. Stops taking entries when the
+        submission ring is empty or there's no more room for results.
+
+        @param id Identifier of the ring. Must belong to the active process.
+        @param to_submit Most entries to take.
+        @return Number of entries taken, or -1 on failure.
+     */
+    int enter(int id, uint32_t to_submit);
+
+    /**
+        Destroys a ring. Entries still on the submission ring are ignored.
+
+        @param id Identifier of the ring. Must belong to the active process.
+        @return 0 on success, -1 on failure.
+     */
+    int close(int id);
+
+    /**
+        Destroys all the rings belonging to a process. Used when the process
+        ends.
+
+        @param pid PID of the process.
+     */
+    void purge_process(size_t pid);
+
+private:
+    // A ring and the kernel's view of it.
+    struct ring {
+        // Owning process.
+        size_t pid;
+        // Header and arrays, in the owner's memory.
+        io_ring* shared;
+        io_sqe* sqes;
+        io_cqe* cqes;
+        // Number of entries, and the mask for indexing the arrays.
+        uint32_t entries;
+        uint32_t mask;
+    };
+
+    // Looks up a ring belonging to the active process.
+    ring* get_ring(int id);
+
+    // Carries out a submission entry.
+    int32_t submit(const io_sqe& sqe);
+
+    // Number of completions on the ring which the process hasn't taken.
+    static uint32_t cq_ready(const ring& r);
+
+    // Rings, keyed by identifier.
+    klib::map<int, ring*> rings;
+    // Last identifier handed out.
+    int last_id;
+    // Protects the map.
+    Spinlock table_lock;
+};
+
+#endif /* IO_RING_H */
@@ -8,11 +8,14 @@
 
 // Forward declarations.
 namespace __cxxabiv1 { class __cxa_eh_globals; }
+class BufferCache;
+class Clock;
 class DevFileSystem;
 class FileTable;
 class Gdt;
 class IdeController;
 class Idt;
+class IoRingTable;
 class Kernel;
 class KernelHeap;
 class Logger;
@@ -26,7 +29,9 @@ class Ps2Controller;
 class Ps2Keyboard;
 class Scheduler;
 class Serial;
+class Smp;
 class SignalManager;
+class TimerWheel;
 class Tss;
 class VgaController;
 class VirtualFileSystem;
@@ -55,11 +60,9 @@ public:
         @param kps Physical memory address of the end of the kernel.
         @param kpe Physical memory address of the end of the kernel.
         @param pdt The basic Page Descriptor Table set up in the loader.
-        @param tpt Location reserved for a temporary page table.
         @param mbp Start of Multiboot information, generated by GRUB.
      */
-    Kernel (void* kvs, void* kve, void* kps, void* kpe, void* pdt, void* tpt,
-        void* mbp);
+    Kernel (void* kvs, void* kve, void* kps, void* kpe, void* pdt, void* mbp);
 
     /**
         Destructor. This should never be called, so it generates a panic.
@@ -162,6 +165,13 @@ public:
      */
     virtual const Gdt& get_gdt() const { return *gdt; }
 
+    /**
+        Gets the IDT information structure.
+
+        @return Reference to the IDT information.
+     */
+    virtual const Idt& get_idt() const { return *idt; }
+
     /**
         Gets a reference to the list of IDE devices.
 
@@ -206,6 +216,22 @@ public:
      */
     virtual Pit* get_pit() { return pit; }
 
+    /**
+        Gets the clock to use for measuring time.
+
+        @return The best clock available, or nullptr if there isn't one yet.
+     */
+    virtual Clock* get_clock() const { return clock; }
+
+    /**
+        Gets the cache of disk sectors, which all block device I/O goes
+        through.
+
+        @return Pointer to the buffer cache, or nullptr before the disks have
+                been set up.
+     */
+    virtual BufferCache* get_buffer_cache() const { return buffers; }
+
     /**
         Gets a pointer to the process table.
 
@@ -214,11 +240,27 @@ public:
     virtual ProcTable& get_proc_table() { return *proc_tab; }
 
     /**
-        Gets the scheduler.
+        Gets the scheduler of the calling processor.
 
         @return Reference to the scheduler.
      */
-    virtual Scheduler& get_scheduler() const { return *sched; }
+    virtual Scheduler& get_scheduler() const;
+
+    /**
+        Gets the scheduler of a processor.
+
+        @param n Processor index.
+        @return Reference to the scheduler.
+     */
+    virtual Scheduler& get_scheduler(size_t n) const { return *sched[n]; }
+
+    /**
+        Gets the driver for the first serial port, which the system log uses.
+
+        @return Pointer to the serial port driver, or nullptr if it hasn't been
+                created yet.
+     */
+    virtual Serial* get_serial() const { return serial; }
 
     /**
         Gets the signal manager.
@@ -228,12 +270,34 @@ public:
     virtual SignalManager* get_signal_manager() const { return sig_man; }
 
     /**
-        Gets the Task State Segment structure. Useful for setting the esp
-        interrupt value.
+        Gets the table of I/O rings.
+
+        @return Pointer to the I/O ring table.
+     */
+    virtual IoRingTable* get_io_rings() const { return io_rings; }
+
+    /**
+        Gets the processors and APICs.
+
+        @return Pointer to the SMP information, or nullptr before the
+                processors have been found.
+     */
+    virtual Smp* get_smp() const { return smp; }
+
+    /**
+        Gets the timer wheel, which runs timeouts off the PIT.
+
+        @return Pointer to the timer wheel.
+     */
+    virtual TimerWheel* get_timers() const { return timers; }
+
+    /**
+        Gets the Task State Segment structure of the calling processor. Useful
+        for setting the esp interrupt value.
 
         @return Reference to the TSS.
      */
-    virtual Tss& get_tss() const { return *tss; }
+    virtual Tss& get_tss() const;
 
     /**
         Gets a pointer to the Virtual File System. All file system operations
@@ -243,6 +307,15 @@ public:
      */
     virtual VirtualFileSystem* get_vfs() { return vfs; }
 
+    /**
+        Points the SYSENTER entry of the calling processor at the kernel, with
+        the stack taken from a processor's TSS. Does nothing if the processor
+        doesn't support SYSENTER.
+
+        @param n Index of the calling processor.
+     */
+    virtual void load_sysenter(size_t n);
+
     /**
         Display an error message, if provided, then abort the kernel.
 
@@ -273,12 +346,24 @@ protected:
     // PIT driver.
     Pit* pit;
 
+    // Clock for measuring time, which may be the PIT or something better.
+    Clock* clock;
+
+    // Timers driven by the PIT.
+    TimerWheel* timers;
+
+    // Processors and APICs.
+    Smp* smp;
+
     // PS/2 Controller driver.
     Ps2Controller* ps2;
 
     // Keyboard driver.
     Ps2Keyboard* keyboard;
 
+    // First serial port driver, owned by the dev file system.
+    Serial* serial;
+
     // File descriptions table.
     FileTable* file_tab;
 
@@ -306,8 +391,14 @@ protected:
     // List of the IDE controllers.
     klib::vector<IdeController>* ide_controllers;
 
-    // TSS location.
-    Tss* tss;
+    // Cache of disk sectors.
+    BufferCache* buffers;
+
+    // TSS for each processor.
+    klib::vector<Tss*> tss;
+
+    // Whether the processors support SYSENTER.
+    bool sysenter;
 
     // Virtual file system, which stores mappings between mount points and
     // file systems.
@@ -316,12 +407,15 @@ protected:
     // Process table, storing pointers to all the processes.
     ProcTable* proc_tab;
 
-    // Scheduler, decides which process to pass CPU control to.
-    Scheduler* sched;
+    // Scheduler for each processor, deciding which process it runs.
+    klib::vector<Scheduler*> sched;
 
     // Signal manager, which handles asynchronous events.
     SignalManager* sig_man;
 
+    // I/O rings set up by processes.
+    IoRingTable* io_rings;
+
     // Thread global exception information. This on is used in initialisation,
     // after that it'll be the active process's one.
     __cxxabiv1::__cxa_eh_globals* eh_globals;
@@ -330,9 +424,8 @@ protected:
     virtual void dump_address();
 
     // Set up PDTs and paging in the standard way.
-    // pdt is the address of the boot page table, tpt is the space for a
-    // temporary page table.
-    virtual void default_paging(void* pdt, void* tpt);
+    // pdt is the address of the boot page table.
+    virtual void default_paging(void* pdt);
 
     // Sets up a heap to start after the kernel.
     virtual void default_heap();
@@ -355,9 +448,20 @@ protected:
     // Sets up the programmable interval timer.
     virtual void default_pit();
 
+    // Picks a clock, measuring the TSC against the PIT if there is one.
+    virtual void default_clock();
+
+    // Finds the other processors and starts them, and routes interrupts
+    // through the I/O APIC if there is one.
+    virtual void default_smp();
+
     // Creates and populates an interrupt descriptor table.
     virtual void default_idt();
 
+    // Fills the syscall table and sets up the SYSENTER entry if the processor
+    // supports it.
+    virtual void default_syscalls();
+
     // Sets up the PS/2 controller.
     virtual void default_ps2();
 
@@ -378,7 +482,8 @@ protected:
     // mount.
     virtual void default_root();
 
-    // Creates a new scheduler. The default is round robin.
+    // Creates a new scheduler for each processor, then lets them start
+    // scheduling. The default is round robin.
     virtual void default_scheduler();
 
     // Enables interrupts of all descriptions.
@@ -2,14 +2,23 @@
 #define KERNEL_HEAP_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <array>
 #include <ostream>
 
 // Forward declarations
 class PageDescriptorTable;
 
 /**
-    Class to manage kernel dynamic memory allocation.
+    Class to manage kernel dynamic memory allocation. Small allocations are
+    passed on to the general purpose object caches, the heap itself is only
+    used for large or specially aligned memory.
+
+    Each heap block has a header and a footer holding its size (boundary
+    tags), so a freed block can be merged with the free blocks either side
+    straight away. Free blocks are kept on doubly linked lists segregated by
+    size, so finding a block doesn't mean walking the whole heap.
  */
 class KernelHeap {
 public:
@@ -41,7 +50,9 @@ public:
     void* calloc(size_t nitems, size_t size);
 
     /**
-        Write the current status of the heap, for debugging purposes.
+        Write the current status of the heap, for debugging purposes. Finishes
+        with totals for used and free memory and how fragmented the free
+        memory is.
 
         @param dest Location to send the information.
      */
@@ -79,8 +90,10 @@ public:
 
         @param size Memory size (in bytes) to allocate.
         @param align Specify that the start of the data must be aligned to a
-                     the given number of bytes. Most useful for Page Tables,
-                     which must be aligned to 4096 bytes.
+                     the given number of bytes, which must be a power of two.
+                     Most useful for Page Descriptor Tables, which must be
+                     aligned to 4096 bytes. Space skipped over to get the
+                     alignment is returned to the heap.
         @param magic A number that will be recorded in the heap metadata for
                the allocated block, allowing tracing of where memory was
                allocated from.
@@ -103,53 +116,91 @@ public:
     void* realloc(void* ptr, size_t size);
 
 private:
-    // Stores meta information about each block.
+    // Stores meta information about each block. Every block also ends with a
+    // footer that repeats the size, so the previous block can be found when
+    // coalescing.
     struct BlockData {
-        // Size of the block, in bytes.
+        // Size of the whole block, including metadata, in bytes.
         size_t size = 0;
-        // Pointer to the next block.
-        BlockData* next = nullptr;
         // Whether the block is currently available.
         bool free = true;
         // A magic number for allocation tracing.
         size_t magic = 0;
+        // Links in the free list for the block's size class. Only valid while
+        // the block is free, as they overlap the start of the data.
+        BlockData* prev_free = nullptr;
+        BlockData* next_free = nullptr;
     };
 
-    // Memory address of the start of the heap.
+    // Number of size classes for free blocks. Class n holds blocks of at least
+    // min_block << n bytes and less than twice that; the last class holds
+    // everything bigger.
+    static constexpr size_t bins = 24;
+
+    // Memory address of the start of the heap. This is a permanently allocated
+    // block of minimum size, so the first real block always has a previous
+    // block.
     BlockData* start;
     // Memory address of the end of the heap. This will be a valid BlockData,
-    // with it's size as 0 and it's next as nullptr.
+    // with its size as 0 and marked as allocated.
     BlockData* last;
     // Memory address of the start of the page above the current highest
     // allocated page.
     void* next_page_addr;
     // Page Descriptor Table for memory allocation.
     PageDescriptorTable* pdt;
-
-    // Size of the BlockData. Even though we expect this to be 16 bytes, we'll
-    // set it up in the constructor to be aligned to heap_align.
-    size_t data_size;
+    // Heads of the free lists for each size class.
+    klib::array<BlockData*, bins> free_lists;
+    // Bit n is set when free list n is not empty.
+    uint32_t bin_map;
 
     // This is the value to align the heap to. Having the power is convenient
     // for bitwise operations.
     static constexpr size_t heap_align = 16;
     static constexpr size_t heap_align_power = 4;
 
-    // Starting from the beginning of the heap, return the first free block
-    // of sufficient size, or last if none is found. Splits the block if there
-    // is enough trailing space.
-    // If the optional alignment is given, only return a free block if there's
-    // space to fit in the aligned data. Splits the start off, if there's enough
-    // leading space.
-    BlockData* find_free_block(size_t size, size_t align = 0);
+    // Size of the BlockData header, aligned to heap_align. The free list links
+    // are allowed to spill over into the data.
+    static constexpr size_t data_size = heap_align;
+    // Size of the footer at the end of each block.
+    static constexpr size_t footer_size = sizeof(size_t);
+    // Smallest possible block, with room for the free list links and footer.
+    static constexpr size_t min_block = 2 * heap_align;
+
+    // Gets the size class a block size belongs in.
+    static size_t bin_index(size_t size);
+
+    // Adds a block to the free list for its size and marks it free.
+    void bin_insert(BlockData* b);
+
+    // Takes a block off its free list.
+    void bin_remove(BlockData* b);
 
-    // Creates a new block of the specified size at the end of the heap. If
-    // align is not zero, the space created will be aligned as specified. This
-    // may mean creating two new blocks.
-    BlockData* new_block(size_t size, size_t align = 0);
+    // Merges a free block with any free neighbours, then puts the result on a
+    // free list.
+    void coalesce(BlockData* b);
+
+    // Adds enough pages to the end of the heap for a free block of at least
+    // the given size, merged with any free block already at the end.
+    void extend(size_t size);
+
+    // Finds a free block of at least the given size and takes it off its free
+    // list, or returns nullptr if there isn't one. Checks the size class that
+    // fits first, then takes the first block from the next non-empty class.
+    BlockData* find_free_block(size_t size);
+
+    // Gets the block immediately before the given one in memory.
+    static BlockData* previous(BlockData* b);
+
+    // Sets the size of a block and writes its footer.
+    static void set_size(BlockData* b, size_t size);
 
     // Allocates the next page of virtual memory. If it fails (ie the page is
     // already in use) cause a panic.
     void next_page();
+
+    // Cuts a block down to the given size, returning any leftover space to
+    // the free lists.
+    void split(BlockData* b, size_t size);
 };
 #endif
@@ -0,0 +1,348 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <utility>
+
+#include "WaitQueue.h"
+
+/**
+    Busy waiting lock, for short critical sections that may be entered from
+    interrupt handlers. Interrupts on the locking processor are disabled while
+    the lock is held, and put back as they were when it's released, so the
+    holder can't be interrupted by something wanting the same lock. Nothing
+    that sleeps may be done while holding one.
+ */
+class Spinlock {
+public:
+    /**
+        Constructor. The lock starts unlocked.
+     */
+    constexpr Spinlock() : flag{}, irq_enabled{false} {}
+
+    /**
+        Locks are identified by address, so can't be copied.
+     */
+    Spinlock(const Spinlock&) = delete;
+    Spinlock& operator=(const Spinlock&) = delete;
+
+    /**
+        Takes the lock, spinning until it's free.
+     */
+    void lock();
+
+    /**
+        Takes the lock if it's free, without waiting.
+
+        @return Whether the lock was taken.
+     */
+    bool try_lock();
+
+    /**
+        Releases the lock.
+     */
+    void unlock();
+
+private:
+    // Set while locked.
+    klib::atomic_flag flag;
+    // Whether interrupts were enabled before locking. Only the holder touches
+    // this.
+    bool irq_enabled;
+};
+
+/**
+    Busy waiting lock which is handed out in the order it was asked for, so
+    no processor can be starved by others getting in first. Otherwise the same
+    as Spinlock, including disabling interrupts while held.
+ */
+class TicketLock {
+public:
+    /**
+        Constructor. The lock starts unlocked.
+     */
+    constexpr TicketLock() : next{0}, serving{0}, irq_enabled{false} {}
+
+    /**
+        Locks are identified by address, so can't be copied.
+     */
+    TicketLock(const TicketLock&) = delete;
+    TicketLock& operator=(const TicketLock&) = delete;
+
+    /**
+        Takes a ticket and spins until it's called.
+     */
+    void lock();
+
+    /**
+        Takes the lock if nobody holds it or is waiting, without waiting.
+
+        @return Whether the lock was taken.
+     */
+    bool try_lock();
+
+    /**
+        Releases the lock to the next ticket.
+     */
+    void unlock();
+
+private:
+    // Next ticket to hand out, and the ticket that holds the lock.
+    klib::atomic<uint32_t> next;
+    klib::atomic<uint32_t> serving;
+    // Whether interrupts were enabled before locking. Only the holder touches
+    // this.
+    bool irq_enabled;
+};
+
+/**
+    Busy waiting lock which any number of readers can hold at once, or one
+    writer. A waiting writer stops new readers getting in, so writers can't be
+    starved. Interrupts are disabled while held. Since there can be many
+    readers, each one keeps its own interrupt state, returned by read_lock()
+    and passed back to read_unlock().
+ */
+class RwLock {
+public:
+    /**
+        Constructor. The lock starts unlocked.
+     */
+    constexpr RwLock() : state{0}, irq_enabled{false} {}
+
+    /**
+        Locks are identified by address, so can't be copied.
+     */
+    RwLock(const RwLock&) = delete;
+    RwLock& operator=(const RwLock&) = delete;
+
+    /**
+        Takes the lock for reading, spinning while a writer holds it or is
+        waiting for it.
+
+        @return Whether interrupts were enabled, to pass to read_unlock().
+     */
+    bool read_lock();
+
+    /**
+        Releases the lock for reading.
+
+        @param enabled Value returned by read_lock().
+     */
+    void read_unlock(bool enabled);
+
+    /**
+        Takes the lock for writing, spinning until the readers have left.
+     */
+    void write_lock();
+
+    /**
+        Releases the lock for writing.
+     */
+    void write_unlock();
+
+private:
+    // Set in state while a writer holds or wants the lock. The rest of the
+    // bits count the readers.
+    static constexpr uint32_t writer = 0x80000000;
+
+    // Writer bit and reader count.
+    klib::atomic<uint32_t> state;
+    // Whether interrupts were enabled before write locking. Only the writer
+    // touches this.
+    bool irq_enabled;
+};
+
+/**
+    The big kernel lock, which lets only one processor at a time run in the
+    kernel. Processors take it on the way into the kernel and give it up on
+    the way back out to user space, or when they go idle, so user space runs
+    on every processor at once while the kernel sees one at a time, as it
+    always has. Held by processors rather than processes: whoever switches
+    process in the kernel passes the lock on to the process switched to.
+
+    Unlike the other locks, interrupts are left as they were while it's held,
+    as processes sleep in the kernel. It's a TicketLock underneath, so
+    processors get into the kernel in the order they asked.
+ */
+class KernelLock {
+public:
+    /**
+        Constructor. The lock starts unlocked.
+     */
+    constexpr KernelLock() : lk{}, owner{none} {}
+
+    /**
+        Locks are identified by address, so can't be copied.
+     */
+    KernelLock(const KernelLock&) = delete;
+    KernelLock& operator=(const KernelLock&) = delete;
+
+    /**
+        Takes the lock for the calling processor, spinning until it's free,
+        unless the processor holds it already. Interrupts are disabled while
+        spinning and put back as they were afterwards.
+
+        @return Whether the lock was taken. Only then should the caller give it
+                back with leave().
+     */
+    bool enter();
+
+    /**
+        Gives up the lock. Interrupts must be disabled, and stay that way until
+        the processor has left the kernel or halted, or whatever interrupts it
+        would run in the kernel without the lock.
+     */
+    void leave();
+
+private:
+    // Owner when no processor holds the lock.
+    static constexpr size_t none = ~static_cast<size_t>(0);
+
+    // Lock itself, only ever taken and released with interrupts disabled, so
+    // it never changes them.
+    TicketLock lk;
+    // Index of the processor holding the lock, or none.
+    klib::atomic<size_t> owner;
+};
+
+/**
+    The big kernel lock.
+ */
+extern KernelLock kernel_lock;
+
+/**
+    Gives up the big kernel lock, for assembly, which does it when launching a
+    user mode process once it's off the old kernel stack.
+ */
+extern "C" void leave_kernel_lock();
+
+/**
+    Lock which puts processes to sleep while they wait, for longer critical
+    sections, which may themselves sleep. Waiters are woken by the scheduler
+    when the lock is released. Must not be used from interrupt handlers. Before
+    the scheduler starts, when there's no process to put to sleep, it spins
+    instead.
+ */
+class Mutex {
+public:
+    /**
+        Constructor. The mutex starts unlocked.
+     */
+    constexpr Mutex() : guard{}, locked{false}, owner{0}, waiters{} {}
+
+    /**
+        Locks are identified by address, so can't be copied.
+     */
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+
+    /**
+        Takes the mutex, sleeping until it's free.
+     */
+    void lock();
+
+    /**
+        Takes the mutex if it's free, without waiting.
+
+        @return Whether the mutex was taken.
+     */
+    bool try_lock();
+
+    /**
+        Releases the mutex and wakes anything waiting for it.
+     */
+    void unlock();
+
+    /**
+        Gets the PID of the process holding the mutex.
+
+        @return PID of the holder, or 0 if it's free or held outside any
+                process.
+     */
+    size_t get_owner() const { return owner; }
+
+private:
+    // Protects the rest of the state.
+    Spinlock guard;
+    // Whether the mutex is held, and by which process.
+    bool locked;
+    size_t owner;
+    // Processes waiting for the mutex.
+    WaitQueue waiters;
+
+    // Wakes a waiting process.
+    static void wake(Waiter& w, PollType ev);
+};
+
+/**
+    Holds a lock for as long as it exists, for scoped critical sections that
+    release the lock however they're left, including by exceptions.
+
+    @param L Type of the lock, which needs lock() and unlock().
+ */
+template <typename L>
+class LockGuard {
+public:
+    /**
+        Constructor. Takes the lock.
+
+        @param l Lock to take.
+     */
+    explicit LockGuard(L& l) : lk(l) { lk.lock(); }
+
+    /**
+        Destructor. Releases the lock.
+     */
+    ~LockGuard() { lk.unlock(); }
+
+    /**
+        Guards own the lock while they exist, so can't be copied.
+     */
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+
+private:
+    // Lock being held.
+    L& lk;
+};
+
+/**
+    Holds a read section for as long as it exists, the read side counterpart
+    of LockGuard. The token from read_lock() is kept and handed back to
+    read_unlock() however the scope is left, including by exceptions.
+
+    @param L Type of the lock, which needs read_lock() returning a token and
+           read_unlock() taking it back, such as RwLock or Rcu.
+ */
+template <typename L>
+class ReadGuard {
+public:
+    /**
+        Constructor. Starts the read section.
+
+        @param l Lock to read.
+     */
+    explicit ReadGuard(L& l) : lk(l), token(l.read_lock()) {}
+
+    /**
+        Destructor. Ends the read section.
+     */
+    ~ReadGuard() { lk.read_unlock(token); }
+
+    /**
+        Guards own the read section while they exist, so can't be copied.
+     */
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+
+private:
+    // Lock being read.
+    L& lk;
+    // Value returned by read_lock().
+    decltype(klib::declval<L&>().read_lock()) token;
+};
+
+#endif /* LOCK_H */
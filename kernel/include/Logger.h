@@ -122,7 +122,7 @@ public:
     void vwrite(const char* fmt, va_list arg);
 
     /**
-        Get the time since the PIT was activated.
+        Get the time since the PIT was activated, to the microsecond.
 
         @return Formatted time since the PIT was activated, or 0 time if it
                 hasn't been activated.
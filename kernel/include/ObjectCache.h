@@ -0,0 +1,301 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <new>
+#include <ostream>
+
+/**
+    A cache of fixed size objects. Objects are carved out of slabs, each of
+    which is a single page of physical memory accessed through the direct map.
+    The start of each page holds the slab metadata, including a free list of
+    the objects in that slab, so allocating and freeing are both constant time.
+    Slabs are kept on three lists, depending on whether they are partially
+    used, full or empty. One empty slab is kept around to avoid thrashing, any
+    others are returned to the Page Frame Allocator.
+
+    Instances have a constexpr constructor so they can be declared statically,
+    which is the intended use; the kernel has no global constructors. A cache
+    adds itself to a list of all the caches when it first gets a slab, which is
+    used for printing statistics.
+
+    There is also a set of general purpose caches for power of two sizes, which
+    the kernel heap uses for small allocations.
+ */
+class ObjectCache {
+public:
+    /**
+        Constructor. Doesn't allocate any memory, the first slab is made on the
+        first allocation.
+
+        @param n Name of the cache, for statistics. Must have static storage.
+        @param sz Size of each object in bytes. Will be rounded up to the
+               alignment. Must be no more than max_object_size.
+        @param c Optional function to call on each object as it's allocated.
+     */
+    constexpr ObjectCache(const char* n, size_t sz, void (*c)(void*) = nullptr) :
+        cache_name{n},
+        obj_size{round_size(sz)},
+        per_slab{(page_size - header_size) / round_size(sz)},
+        ctor{c},
+        partial{nullptr},
+        full{nullptr},
+        empty{nullptr},
+        next_cache{nullptr},
+        registered{false},
+        slabs{0},
+        in_use{0},
+        allocs{0}
+    {}
+
+    /**
+        Caches are linked into a global list by address, so can't be copied.
+     */
+    ObjectCache(const ObjectCache&) = delete;
+    ObjectCache& operator=(const ObjectCache&) = delete;
+
+    /**
+        Gets an object from the cache, creating a new slab if necessary. Calls
+        the constructor function, if there is one.
+
+        @return Pointer to the object, or nullptr if no memory is available.
+     */
+    void* allocate();
+
+    /**
+        Writes the usage of this cache to the provided stream.
+
+        @param dest Stream to write to.
+     */
+    void dump(klib::ostream& dest) const;
+
+    /**
+        Returns an object to the cache. The object must have come from this
+        cache.
+
+        @param obj Object to free. Nothing happens if it's nullptr.
+     */
+    void free(void* obj);
+
+    /**
+        Gives the name of the cache.
+
+        @return Name of the cache.
+     */
+    const char* name() const { return cache_name; }
+
+    /**
+        Gives the size of the objects in the cache, after alignment.
+
+        @return Object size in bytes.
+     */
+    size_t object_size() const { return obj_size; }
+
+    /**
+        Gives the number of objects currently allocated.
+
+        @return Number of objects in use.
+     */
+    size_t objects_in_use() const { return in_use; }
+
+    /**
+        Gives the number of objects the current slabs can hold.
+
+        @return Number of objects in use or available.
+     */
+    size_t objects_total() const { return slabs * per_slab; }
+
+    /**
+        Gives the number of slabs (pages) owned by the cache.
+
+        @return Number of slabs.
+     */
+    size_t slab_count() const { return slabs; }
+
+    /**
+        Gives the total number of allocations ever made from the cache.
+
+        @return Number of allocations.
+     */
+    size_t allocations() const { return allocs; }
+
+    /**
+        Allocates from the general purpose cache for the given size.
+
+        @param sz Size of memory required.
+        @return Pointer to the memory, or nullptr if there is no cache big
+                enough or no memory available.
+     */
+    static void* allocate_size(size_t sz);
+
+    /**
+        Writes the usage of all caches that have any slabs to the provided
+        stream.
+
+        @param dest Stream to write to.
+     */
+    static void dump_all(klib::ostream& dest);
+
+    /**
+        Tests whether an address is an object in one of the caches. The page it
+        is in must be a live slab, recognised from its metadata, and the
+        address must be the start of one of the objects in it.
+
+        @param ptr Address to test.
+        @return True if the address is a cached object.
+     */
+    static bool owns(const void* ptr);
+
+    /**
+        Returns an object to whichever cache it came from, which is found from
+        the slab metadata.
+
+        @param obj Object to free.
+     */
+    static void release(void* obj);
+
+    /**
+        Alignment of every object.
+     */
+    static constexpr size_t align = 16;
+
+    /**
+        Largest size of object that can be cached, and the size of the largest
+        general purpose cache.
+     */
+    static constexpr size_t max_object_size = 512;
+
+private:
+    // Slab metadata, at the start of each slab page.
+    struct Slab {
+        // Links for whichever list the slab is on.
+        Slab* prev;
+        Slab* next;
+        // First free object, each free object holds a pointer to the next.
+        void* free_list;
+        // Number of objects allocated from this slab.
+        size_t in_use;
+        // Cache the slab belongs to.
+        ObjectCache* cache;
+        // Set to slab_magic while the page is a slab.
+        uint32_t magic;
+    };
+
+    // Marks a page as a slab, so slabs can be told apart from other pages in
+    // the direct map.
+    static constexpr uint32_t slab_magic = 0x51AB0BEC;
+
+    // Size of a slab.
+    static constexpr size_t page_size = 4096;
+    // Space taken by the metadata at the start of a slab.
+    static constexpr size_t header_size =
+        ((sizeof(Slab) + align - 1) / align) * align;
+
+    // Name, for statistics.
+    const char* cache_name;
+    // Size of each object, including alignment.
+    size_t obj_size;
+    // Number of objects in each slab.
+    size_t per_slab;
+    // Called on each object when allocated.
+    void (*ctor)(void*);
+    // Slab lists.
+    Slab* partial;
+    Slab* full;
+    Slab* empty;
+    // Next in the list of all caches.
+    ObjectCache* next_cache;
+    // Whether this is in the list of all caches.
+    bool registered;
+    // Statistics.
+    size_t slabs;
+    size_t in_use;
+    size_t allocs;
+
+    // List of all caches that have ever had a slab.
+    static ObjectCache* first_cache;
+
+    // Rounds a size up to the alignment.
+    static constexpr size_t round_size(size_t sz)
+    {
+        return ((sz == 0 ? 1 : sz) + align - 1) / align * align;
+    }
+
+    // Gets a new slab from the Page Frame Allocator and puts it on the empty
+    // list. Returns nullptr if no memory is available.
+    Slab* grow();
+
+    // Gets the slab an object belongs to.
+    static Slab* slab_of(const void* obj);
+
+    // Removes a slab from a list.
+    static void unlink(Slab*& list, Slab* s);
+
+    // Adds a slab to the front of a list.
+    static void push(Slab*& list, Slab* s);
+};
+
+/**
+    An allocator for klib containers that puts single objects into the general
+    purpose object caches. Requests for more than one object, or objects too
+    large to cache, go to the kernel heap as usual. Otherwise identical to the
+    default allocator.
+ */
+template <typename T>
+struct CacheAllocator : public klib::allocator<T> {
+    /**
+        Provides a way to get an allocator for a different type.
+     */
+    template <typename U>
+    struct rebind {
+        using other = CacheAllocator<U>;
+    };
+
+    /**
+        The allocator is stateless, so construction does nothing.
+     */
+    CacheAllocator() noexcept {}
+    CacheAllocator(const CacheAllocator&) = default;
+    template <typename U>
+    CacheAllocator(const CacheAllocator<U>&) noexcept {}
+
+    /**
+        Allocate unitialised memory for n objects of type T.
+
+        @param n Number of objects to allocate space for.
+        @param hint A hint for where to allocate the memory. Ignored.
+        @return Pointer to the allocated memory.
+     */
+    T* allocate(size_t n, const void* hint = nullptr)
+    {
+        (void)hint;
+        if (n != 1)
+            return static_cast<T*>(operator new[](n * sizeof(T)));
+
+        void* ret_val = ObjectCache::allocate_size(sizeof(T));
+        if (ret_val == nullptr)
+            ret_val = operator new(sizeof(T));
+        return static_cast<T*>(ret_val);
+    }
+
+    /**
+        Deallocate memory previously obtained from allocate.
+
+        @param p Address for deallocation.
+        @param n Number of objects, which must match the call to allocate.
+     */
+    void deallocate(T* p, size_t n)
+    {
+        if (n != 1)
+            operator delete[](p);
+        else if (ObjectCache::owns(p))
+            ObjectCache::release(p);
+        else
+            operator delete(p);
+    }
+};
+
+#endif /* OBJECT_CACHE_H */
@@ -31,7 +31,13 @@ enum class PdeSettings : uint32_t {
     // Set for dirty bit (PTE only)
     dirty = 0x040,
     // Set for 4MB pages (PDE only)
-    large = 0x080
+    large = 0x080,
+    // Set for a mapping that's the same in every PDT, so it isn't flushed from
+    // the TLB when the PDT is changed (needs global pages enabled)
+    global = 0x100,
+    // Set for a read only page that should be copied on the first write (PTE
+    // only, uses one of the bits available to software)
+    copy_on_write = 0x200
 };
 
 /**
@@ -152,17 +158,49 @@ public:
         const void* phys_addr = nullptr,
         bool* already_existed = nullptr);
 
+    /**
+        Maps a new page of zeroes at the virtual address provided. The page is
+        cleared through the direct map before it's mapped.
+
+        @param virt_addr Virtual memory address. Will be rounded down to a page
+               boundary.
+        @param conf Configuration.
+        @return Whether the operation succeeded.
+     */
+    bool allocate_zeroed(const void* virt_addr, uint32_t conf);
+
     /**
         Clears any entries below the indicated index (in 4MB blocks). Does not
         free any physical memory or delete any page tables. Therefore this
         should not be used unless there exists another PDT with pointers to the
-        user space PTs.
+        user space PTs, or the entries were copied from one, as when a new
+        process PDT is made from the kernel PDT.
 
         @param end Virtual address to wipe up to, rounded down to a page table
                boundary.
      */
     void clean_user_space(const void* end);
 
+    /**
+        Resolves a write to a copy on write page in user space. If other address
+        spaces still reference the physical page, the data is copied to a new
+        page first. Either way, the page is left writable.
+
+        @param virt_addr Virtual address that was written to.
+        @return True if the address was a copy on write page and has been made
+                writable, false otherwise.
+     */
+    bool copy_on_write(const void* virt_addr);
+
+    /**
+        Makes a page in user space read only, without changing anything else
+        about the mapping.
+
+        @param virt_addr Virtual address in the page.
+        @return True if the page was mapped, false otherwise.
+     */
+    bool write_protect(const void* virt_addr);
+
     /**
         Dump the entries and virt_entries for debugging purposes to the provided
         Stream.
@@ -172,14 +210,17 @@ public:
     void dump(klib::ostream& dest) const;
 
     /**
-        Duplicate the user space memory of the currently loaded PDT into this
-        one. New page tables are put on the kernel heap managed by the currently
-        loaded PDT. The pointer end is taken as the end of user space.
+        Duplicate the user space memory of another PDT into this one. New page
+        tables are put on the kernel heap. The pointer end is taken as the end
+        of user space. Pages are shared rather than copied, with writable pages
+        marked copy on write in both PDTs. The other PDT must be the one
+        currently loaded.
 
+        @param other PDT to duplicate the user space of.
         @param end Only copy up to this address. The address is rounded up to a
                page table boundary.
      */
-    void duplicate_user_space(const void* end);
+    void duplicate_user_space(PageDescriptorTable& other, const void* end);
 
     /**
         Removes the entry for the given virtual page. Will also deallocate the
@@ -201,6 +242,17 @@ public:
      */
     void free_user_space(const void* virt_addr, bool phys_free = true);
 
+    /**
+        Makes a copy of the hardware entries in a new physical page, with the
+        first 4MB identity mapped as well. This is for starting other
+        processors, which turn on paging while running from low memory. The
+        copy is only good until the kernel entries change.
+
+        @return Physical address of the copy, or nullptr if out of memory. Free
+                it with the Page Frame Allocator.
+     */
+    void* identity_copy() const;
+
     /**
         Set this table as the current PDT. Will not enable paging if not already
         enabled.
@@ -219,7 +271,7 @@ public:
      */ 
     void* map(const void* phys,
         size_t size,
-        const void* hint = reinterpret_cast<void*>(0x10000000));
+        const void* hint = reinterpret_cast<void*>(0xF0000000));
 
     /**
         Frees the virtual address provided, up to the size given. This had
@@ -232,11 +284,55 @@ public:
      */
     void unmap(const void* virt_addr, size_t size);
 
+    /**
+        Maps the shared zero page at the given user space address. It's read
+        only and marked copy on write, so the first write to it gets a private
+        page of zeroes instead. The zero page is never freed.
+
+        @param virt_addr Virtual address to map at.
+        @return Whether the operation succeeded.
+     */
+    bool map_zero_page(const void* virt_addr);
+
+    /**
+        Maps the shared time page at the given user space address, read only.
+        The time page is never freed.
+
+        @param virt_addr Virtual address to map at.
+        @return Whether the operation succeeded.
+     */
+    bool map_time_page(const void* virt_addr);
+
+    /**
+        Gets the shared time page, which the kernel writes the time to for user
+        space to read.
+
+        @return Physical address of the time page, or nullptr before
+                prepare_kernel_space() has made it.
+     */
+    static void* get_time_page() { return time_page; }
+
+    /**
+        Maps physical memory from address zero up to phys_map_size into kernel
+        space at phys_map_base, using large pages. Must be called before any
+        new Page Tables are needed, as they're accessed through this mapping.
+     */
+    void map_physical_memory();
+
+    /**
+        Creates a Page Table for every entry in kernel space that doesn't
+        already have one, and marks the existing kernel pages as global. After
+        this the kernel entries never change, so every process PDT can take a
+        copy of them and share the kernel Page Tables. Also makes the shared
+        zero and time pages. Must be called before any process PDTs are made.
+     */
+    void prepare_kernel_space();
+
     /**
         Sets the Page Frame Allocator.
 
-        @param Allocator to set. Will be copied. The only non-static data it
-               contains is the last allocation, anyway.
+        @param Allocator to set. Will be copied. It contains no non-static
+               data, anyway.
      */
     void set_allocator(const PageFrameAllocator& p) { pfa = p; }
 
@@ -250,24 +346,19 @@ public:
     void* translate(const void* virt_addr, bool print = false) const;
 
     /**
-        Updates the user space mappings from the given other PDT. Useful for
-        swapping a processes mappings into the active PDT.
-
-        @param other Other PDT to copy the kernel space mappings from.
-        @param end Virtual address to wipe up to.
+        Number of bytes in a page (4KB).
      */
-    void update_user_space(const PageDescriptorTable& other, const void* end);
+    static constexpr size_t page_size = 4096;
 
     /**
-        Location for creating a temporary page table. Guaranteed to be available
-        for this purpose and shouldn't be used for anything else.
+        Virtual address where physical memory is mapped into kernel space.
      */
-    static PageTable* temp_page_table;
+    static constexpr uintptr_t phys_map_base = 0xD0000000;
 
     /**
-        Number of bytes in a page (4KB).
+        Amount of physical memory mapped into kernel space (512MB).
      */
-    static constexpr size_t page_size = 4096;
+    static constexpr size_t phys_map_size = 0x20000000;
 
     // Give the initialisation routine access to the private static members.
     friend void trim_pdt(PageDescriptorTable* pdt, size_t end, size_t max);
@@ -284,6 +375,19 @@ private:
     klib::array<PageTable*, sz> virt_entries;
     // Allocator for getting physical memory.
     PageFrameAllocator pfa;
+    // Physical address of a page of zeroes, shared by all lazily allocated
+    // memory that has been read but not written.
+    static void* zero_page;
+    // Physical address of the page the kernel publishes the time on, mapped
+    // read only into every process.
+    static void* time_page;
+
+    // Tests for the pages shared by every process, which are never copied or
+    // freed.
+    static bool shared_page(const void* phys_addr)
+    {
+        return phys_addr == zero_page || phys_addr == time_page;
+    }
 
     /**
         Gets the Page Table for the given virtual address. Can be used to modify
@@ -297,10 +401,9 @@ private:
     const PageTable* get(size_t n) const;
 
     /**
-        Creates a new Page Table in the temporary reserved space, making sure to
-        include the provided virtual address. Adds it's physical address to the
-        Page Descriptor Table and sets up a mapping to itself in a free slot
-        within it's own Page Table. Frees the virtual temporary space.
+        Creates a new Page Table covering the provided virtual address, and adds
+        it to the Page Descriptor Table. The Page Table goes in a physical page
+        within the direct map, which is where it's accessed from.
         @param virt_addr Virtual address to be included in this Page Table. Will
                          be rounded down to a 4MB page boundary.
         @param conf Configuration to use for the new Page Table.
@@ -328,6 +431,32 @@ private:
     bool set(void* page, size_t n, uint32_t conf);
 };
 
+/**
+    Gives the virtual address of some physical memory in the direct map.
+
+    @param phys_addr Physical address.
+    @return Virtual address in the direct map, or nullptr if the physical
+            address is beyond the direct map.
+ */
+inline void* phys_to_virt(const void* phys_addr)
+{
+    uintptr_t p_addr = reinterpret_cast<uintptr_t>(phys_addr);
+    if (p_addr >= PageDescriptorTable::phys_map_size)
+        return nullptr;
+
+    return reinterpret_cast<void*>(p_addr + PageDescriptorTable::phys_map_base);
+}
+
+/**
+    Gives the physical address of some kernel virtual memory. Addresses in the
+    direct map are converted directly, anything else is looked up in the kernel
+    PDT.
+
+    @param virt_addr Virtual address.
+    @return Physical address, or nullptr if there is no mapping.
+ */
+void* virt_to_phys(const void* virt_addr);
+
 /**
     The assembly loader allocates a full 4MB for the kernel (excluding the
     heap), but this is unlikley to be full, so free everything from the end of
@@ -13,15 +13,20 @@ class MultiBootMap;
 class PageDescriptorTable;
 
 /**
-    Manages the used pages and supplies new ones when requested.
+    Manages the used pages and supplies new ones when requested. Physical memory
+    is handed out by a binary buddy system, with blocks of between one 4KB page
+    (order 0) and one 4MB page (max_order). For each order there is a bitmap of
+    free blocks, with two levels of summary bitmaps above it, so that finding a
+    free block or merging a freed block with its buddy only takes a handful of
+    word operations, however much memory there is.
  */
 class PageFrameAllocator {
 public:
     /**
-        Used to intialise the used_pages array. Will set everything below 1MB
-        and everything used by the kernel as used.
+        Constructor. All the allocation data is static, so there is nothing to
+        do. Initialisation is done by pfa_initialise() and pfa_read_map().
      */
-    PageFrameAllocator();
+    PageFrameAllocator() {}
 
     /**
         Find a free page and allocate it.
@@ -31,10 +36,38 @@ public:
      */
     void* allocate(bool large = false);
 
+    /**
+        Allocates a page below a given physical address. Used for memory the
+        kernel needs to access through the direct map of physical memory.
+
+        @param limit Physical address the page must be entirely below.
+        @return Physical address of the page found, or nullptr for a fail.
+     */
+    void* allocate_below(const void* limit);
+
+    /**
+        Allocates physically contiguous memory. The number of pages is rounded
+        up to the next power of two and the returned address is aligned to that
+        size.
+
+        @param pages Number of 4KB pages required. Must be no more than the
+               number in a large page.
+        @return Physical address of the first page, or nullptr for a fail.
+     */
+    void* allocate_pages(size_t pages);
+
+    /**
+        Gets the amount of free physical memory.
+
+        @return Number of free 4KB pages.
+     */
+    size_t free_pages() const { return free_count; }
+
     /**
         Free a given page. It's the caller's fault if there's still virtual
         memory mapping to this physical page (eg if multiple virtual address
         map to the same physical address) and those address become invalid.
+        If the page was shared with share(), this just drops one reference.
 
         @param phys_addr Physical address to unmap. Will be rounded down to a
                          page boundary.
@@ -42,11 +75,47 @@ public:
      */
     void free(const void* phys_addr, bool large = false);
 
+    /**
+        Frees physically contiguous memory previously allocated with
+        allocate_pages(). Pages within the block may also be freed individually
+        with free(), in which case they are merged back together as their
+        buddies are freed.
+
+        @param phys_addr Physical address of the first page.
+        @param pages Number of pages, as passed to allocate_pages().
+     */
+    void free_pages(const void* phys_addr, size_t pages);
+
+    /**
+        Adds a reference to an allocated page, for when it is mapped into more
+        than one address space. Each reference must be released with free(),
+        and the page only becomes available again when the last one is.
+
+        @param phys_addr Physical address of the page.
+        @return False if no more references can be counted, in which case the
+                caller should make a copy instead.
+     */
+    bool share(const void* phys_addr);
+
+    /**
+        Gets the number of references to a page, beyond the first.
+
+        @param phys_addr Physical address of the page.
+        @return Number of additional references.
+     */
+    size_t shares(const void* phys_addr) const;
+
     /**
         Number of pages, asuuming 4KB pages and 4GB of memory.
      */
     static constexpr size_t number_of_pages = 1048576;
 
+    /**
+        Highest order of block managed by the allocator. A block of order n
+        contains 2^n pages, so this is one 4MB page.
+     */
+    static constexpr size_t max_order = 10;
+
     // These functions need access to the private static members.
     friend void pfa_dump_status(klib::ostream& dest);
     friend void pfa_initialise(const void*, const void*);
@@ -58,18 +127,38 @@ private:
     // Size of large pages (4MB)
     static const size_t large_page_size = 4194304;
 
-    // The bit map for which physical pages are used. Since there are 4GB of 
-    // memory and each page is 4KB, there are 1 million ish pages. With a bit
-    // for each one, we need 128KB to store the bit map. This is static data as
-    // we're assuming there's only one set of physical 4GB RAM available.
-    static klib::array<uint32_t, number_of_pages / sizeof(uint32_t)> used_pages;
+    // The free block bitmaps for each order, stored one after another. The map
+    // for order n has a bit for each of the number_of_pages / 2^n blocks, which
+    // is set if that block is free and not part of a larger free block. Since
+    // there are 1 million ish pages, in total this needs 256KB. This is static
+    // data as we're assuming there's only one set of physical 4GB RAM
+    // available.
+    static constexpr size_t map_words =
+        2 * (number_of_pages >> 5) - (number_of_pages >> (5 + max_order));
+    static klib::array<uint32_t, map_words> free_map;
+    // First summary level. Each bit is set if the corresponding word of
+    // free_map is not zero.
+    static constexpr size_t summary_words =
+        2 * (number_of_pages >> 10) - (number_of_pages >> (10 + max_order));
+    static klib::array<uint32_t, summary_words> free_summary;
+    // Second summary level. Each bit is set if the corresponding word of
+    // free_summary is not zero. Each order gets a fixed 32 words, which is
+    // enough for order 0.
+    static constexpr size_t top_stride = 32;
+    static klib::array<uint32_t, top_stride * (max_order + 1)> free_top;
+    // Number of free blocks of each order.
+    static klib::array<size_t, max_order + 1> free_blocks;
+    // Total number of free pages.
+    static size_t free_count;
+    // Number of references to each page beyond the first, for pages shared
+    // between address spaces.
+    static klib::array<uint8_t, number_of_pages> extra_refs;
+    // Number of pages covered by the allocator, as indicated by mem_size.
+    static size_t mem_pages;
     // Total available memory, as indicated by the highest address in the
     // MultiBoot memory map. Assumed to be 64MB to start with.
     static uint32_t mem_size;
 
-    // Index of the last allocated free page.
-    size_t last_alloc;
-
     // Physical memory address of the start and end of the kernel.
     static uint32_t kernel_physical_start;
     static uint32_t kernel_physical_end;
@@ -87,6 +176,58 @@ private:
         @return True if the page is already allocated.
      */
     bool check(const void* addr, bool large = false) const;
+
+    /**
+        Allocates a block of the given order, splitting a larger one if
+        necessary.
+
+        @param order Order of the block to allocate.
+        @param limit Page number the block must end at or below.
+        @return Physical address of the block, or nullptr if none is free.
+     */
+    static void* allocate_block(size_t order,
+        size_t limit = number_of_pages);
+
+    /**
+        Frees a block of the given order, merging it with its buddy as far up
+        as possible.
+
+        @param page Page number of the start of the block.
+        @param order Order of the block.
+     */
+    static void free_block(size_t page, size_t order);
+
+    /**
+        Tests whether a page is free, that is whether it lies in any free block.
+
+        @param page Page number to test.
+        @return True if the page is free.
+     */
+    static bool page_free(size_t page);
+
+    /**
+        Rebuilds all the free lists from scratch. Every page for which avail
+        returns true is made free, in the largest blocks possible. Everything
+        else is used.
+
+        @param avail Callable taking a page number and returning whether the
+               page is available.
+        @param pages Number of pages to consider.
+     */
+    template <typename T>
+    static void seed(T avail, size_t pages);
+
+    // Bitmap manipulation. The block index is the page number divided by
+    // 2^order.
+    static void set_free(size_t order, size_t index);
+    static void clear_free(size_t order, size_t index);
+    static bool test_free(size_t order, size_t index);
+    // Finds the lowest free block of the given order. Returns the index of the
+    // block, which must exist.
+    static size_t find_free(size_t order);
+    // Offset to the start of the bitmap for the given order. Level 0 is
+    // free_map and level 1 is free_summary.
+    static size_t map_offset(size_t order, size_t level);
 };
 
 /**
@@ -474,6 +474,12 @@ public:
      */
     uint32_t get_function() const { return func_no; }
 
+    /**
+        Lets the device start its own transfers to and from memory, by setting
+        the bus master bit of the command register.
+     */
+    void enable_bus_master() const;
+
     /**
         Get a Base Address Register (BAR). There are six BARs for a PCI device.
         Their use depends on the device.
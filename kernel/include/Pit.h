@@ -113,6 +113,15 @@ public:
      */
     uint32_t period() const { return irq_ms; }
 
+    /**
+        Converts a time to a number of ticks, rounding up so that waiting for
+        that many ticks takes at least the requested time.
+
+        @param ms Time in milliseconds.
+        @return Number of PIT interrupts covering the time.
+     */
+    uint32_t ms_to_ticks(uint32_t ms) const;
+
     /**
         Sleeps for at least the number of milliseconds specified. This is a
         busy kernel sleep, not for user processes.
@@ -122,9 +131,28 @@ public:
     void sleep(unsigned int t);
 
     /**
-        Advances the systme clock by one count.
+        Lets the PIT skip interrupts while idle. The next interrupt is put off
+        by up to the given number of ticks, as far as the counter allows, by
+        switching to a one shot count. tick() then accounts for all the ticks
+        together and switches back to periodic interrupts.
+
+        @param ticks Number of ticks until something needs to happen.
+     */
+    void skip_ticks(uint32_t ticks);
+
+    /**
+        Cuts short skipping interrupts, if skip_ticks() was called, so the next
+        interrupt comes at the next tick boundary.
+     */
+    void resume_ticks();
+
+    /**
+        Advances the system clock on a PIT interrupt. That's normally one tick,
+        but may be more if ticks were being skipped.
+
+        @return Number of ticks the clock advanced by.
      */
-    void tick();
+    uint32_t tick();
 
     /**
         Gets the current system clock.
@@ -133,6 +161,18 @@ public:
      */
     uint32_t time() const { return timer_ms; }
 
+    /**
+        Gets the current system clock, including the fractions of a
+        millisecond.
+
+        @return Time, in nanoseconds, since the PIT was initialised.
+     */
+    uint64_t time_ns() const
+    {
+        return static_cast<uint64_t>(timer_ms) * 1000000 +
+            ((static_cast<uint64_t>(timer_fractions) * 1000000) >> 32);
+    }
+
 private:
     // Whole number of milliseconds in the time.
     unsigned int timer_ms;
@@ -146,11 +186,24 @@ private:
     unsigned int irq_freq;
     // Frequency divisor stored by the PIT.
     uint16_t reload_value;
+    // Number of ticks covered by the pending one shot interrupt when skipping
+    // ticks, or 0 when interrupting periodically.
+    uint32_t skipping;
+
+    // Reads the current count of channel 0.
+    uint16_t read_count() const;
+
+    // Programs channel 0 with a mode and count.
+    void program(operating_mode mode, uint16_t count);
 
     // Inherent frequency of the PIT, in Hz.
     static constexpr unsigned int base_freq = 1193181;
     // Lowest possible frequency (base_freq / 65536)
     static constexpr unsigned int slow_freq = 18;
+    // Read back command for the status and count of channel 0.
+    static constexpr uint8_t read_back_channel_0 = read_back | 0x2;
+    // Bit in the read back status for the channel output.
+    static constexpr uint8_t status_output = 0x80;
 };
 
 #endif /* PIT_H */
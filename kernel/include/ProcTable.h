@@ -8,6 +8,8 @@
 #include <map>
 #include <string>
 
+#include "ObjectCache.h"
+
 // Forward declarations
 class Device;
 class InterruptRegisters;
@@ -25,11 +27,15 @@ class Process;
     The process table. Stores pointers to all the current processes, keyed by
     their PIDs. Basically a wrapper around klib::map. */
 class ProcTable {
+    // Map type, with the nodes in an object cache.
+    using table_type = klib::map<size_t, Process*, klib::less<size_t>,
+        CacheAllocator<klib::pair<const size_t, Process*>>>;
+
 public:
     /** Iterator type for this container. */
-    using iterator = klib::map<size_t, Process*>::iterator;
+    using iterator = table_type::iterator;
     /** Contstant iterator type for this container. */
-    using const_iterator = klib::map<size_t, Process*>::const_iterator;
+    using const_iterator = table_type::const_iterator;
 
     /**
         Constructor. Must be initialised with the init process, which gets a
@@ -94,17 +100,11 @@ public:
         @param p New process to swap in.
         @return True for success, false for failure.
      */
-    bool set_process(size_t pid, Process* p)
-    {
-        if (tab.count(pid) == 0)
-            return false;
-
-        tab[pid] = p;
-        return true;
-    }
+    bool set_process(size_t pid, Process* p);
 
     /**
-        Adds a new process to the table. The PID is autmatically determined.
+        Adds a new process to the table. The PID is autmatically determined. If
+        the process is runnable, it's given to the scheduler.
 
         @param p Pointer to the new process.
         @return PID of the new process. 0 indicates failure.
@@ -152,7 +152,7 @@ public:
 
 private:
     // Contains the list of processes. Key is the PID.
-    klib::map<size_t, Process*> tab;
+    table_type tab;
     // Last PID allocated. Useful for finding an available one quickly.
     size_t last_pid;
     // Maximum allowed PID.
@@ -267,8 +267,10 @@ protected:
         klib::fstream fs;
     };
 
-    // Map of the currently opened file descriptors.
-    klib::map<int, FileDescription> file_list;
+    // Map of the currently opened file descriptors. The nodes are in an object
+    // cache.
+    klib::map<int, FileDescription, klib::less<int>,
+        CacheAllocator<klib::pair<const int, FileDescription>>> file_list;
 };
 
 #endif /* PROC_TABLE_H */
@@ -11,6 +11,8 @@
 #include "Elf.h"
 #include "InterruptHandler.h"
 #include "PageDescriptorTable.h"
+#include "Scheduler.h"
+#include "TimerWheel.h"
 
 // Forward declarations
 namespace __cxxabiv1 { class __cxa_eh_globals; }
@@ -85,6 +87,22 @@ public:
      */
     ~Process();
 
+    /**
+        Processes are allocated from their own object cache, so their memory
+        use shows up separately in the cache statistics.
+
+        @param sz Size of the allocation, which must be sizeof(Process).
+        @return Pointer to memory for the Process.
+     */
+    static void* operator new(size_t sz);
+
+    /**
+        Returns memory for a Process to the object cache.
+
+        @param ptr Memory previously allocated by operator new.
+     */
+    static void operator delete(void* ptr);
+
     /**
         Used for exec. Copies the parent and child PIDs and the open file
         descriptors.
@@ -129,6 +147,7 @@ public:
         @return Reference to the process's PDT.
      &*/
     const PageDescriptorTable& get_pdt() const { return *pdt; }
+    PageDescriptorTable& get_pdt() { return *pdt; }
 
     /**
         Gets the current values of the interrupt stack, containing values for
@@ -175,11 +194,51 @@ public:
     ProcStatus get_status() const { return stat; }
 
     /**
-        Sets the current state of the process.
+        Sets the current state of the process. Once the process is in the
+        process table, this also puts it on or takes it off the scheduler's run
+        queue as appropriate.
 
         @param st State to set this process to.
      */
-    void set_status(ProcStatus st) { stat = st; }
+    void set_status(ProcStatus st);
+
+    /**
+        Gets the PID of the process. This is 0 until the process has been put
+        in the process table.
+
+        @return PID of the process.
+     */
+    size_t get_pid() const { return pid; }
+
+    /**
+        Sets the PID of the process. Used by the process table.
+
+        @param p PID of the process.
+     */
+    void set_pid(size_t p) { pid = p; }
+
+    /**
+        Gets the scheduling priority of the process. 0 is the highest.
+
+        @return Scheduling priority.
+     */
+    unsigned get_priority() const { return priority; }
+
+    /**
+        Sets the scheduling priority of the process, moving it to the right run
+        queue if it's waiting on one.
+
+        @param pri New priority, which must be less than Scheduler::priorities.
+     */
+    void set_priority(unsigned pri);
+
+    /**
+        Gets the timer used for timed sleeps. When it expires, the process is
+        woken up if it's sleeping.
+
+        @return Reference to the process's timer.
+     */
+    Timer& get_timer() { return timer; }
  
     /**
         Swaps the stack pointers of this process and another. Useful for exec.
@@ -189,9 +248,9 @@ public:
     void swap_stack(Process& other);
 
     /**
-        Transfer to this process. Allocates and loads the process PDT, copies
-        the binary to code/data address, works out the necessary data values,
-        then transfers to assembly to carry out an iret.
+        Transfer to this process. Allocates and loads the process PDT, sets up
+        the stack, works out the necessary data values, then transfers to
+        assembly to carry out an iret. The binary is loaded as it's accessed.
 
         @param PDT with kernel information.
      */
@@ -264,19 +323,46 @@ public:
         Sets the current user space stack size. The set will do nothing
         successfully if the specified value is less than the current stack size,
         and will fail if the requested size is greater than the current maximum
-        stack size. It will allocate new memory to the stack below the current
-        base and move the base downwards.
+        stack size. It moves the base of the stack downwards, but doesn't
+        allocate any memory; that's done by anonymous_page() when the new pages
+        are first touched.
 
         @param sz New size for the user space stack.
         @return 0 on success, -1 on failure.
      */
     int set_user_stack(size_t sz);
 
+    /**
+        Maps a page of the heap or stack the first time it's touched. Reads get
+        the shared zero page, and writes (including the first write to a page
+        that was read) get a new page of zeroes. Used by the page fault
+        handler, so heap and stack only use physical memory for the pages that
+        are actually used.
+
+        @param virt_addr Virtual address that was accessed.
+        @param write Whether the access was a write.
+        @return 0 on success, -1 if the address is not in the heap or stack or
+                the allocation failed.
+     */
+    int anonymous_page(const void* virt_addr, bool write);
+
+    /**
+        Allocates and loads the page of the binary containing the given
+        address. Used by the page fault handler, as pages of the binary are only
+        loaded when they're first accessed.
+
+        @param virt_addr Virtual address that was accessed.
+        @return 0 on success, -1 if the address is not part of the binary or
+                the allocation failed.
+     */
+    int load_page(const void* virt_addr);
+
     /**
         Sets the break point, ie changes the size of the heap. Will fail if the
         new address is into stack memory, or before the start of the heap. As a
         special case, if the value 0 is passed, instead returns the current
-        break point.
+        break point. New heap memory isn't allocated until it's touched, see
+        anonymous_page().
 
         @param addr New address for the break point.
         @return 0 on success, -1 on error, or current break point if addr was 0.
@@ -313,6 +399,9 @@ public:
     const klib::vector<size_t>& get_children() const { return child_pids; }
 
 private:
+    // The scheduler threads its run queues through the processes.
+    friend class RoundRobin;
+
     // Initial size of the user stack, currently one page.
     static constexpr size_t start_stack = PageDescriptorTable::page_size;
     // Size of the kernel stack for this process. This is only used for
@@ -322,10 +411,27 @@ private:
     // dynamically expanded (by catching page faults) until it is this size.
     static constexpr size_t default_max_stack = 1 << 23;
 
+    /**
+        Timer callback that wakes the process up.
+
+        @param p The Process to wake.
+     */
+    static void wake(void* p);
+
+    /**
+        Makes a new PDT for a process. It shares the kernel Page Tables with
+        the given kernel PDT and has nothing in user space.
+
+        @param k_pdt PDT with kernel information.
+        @return The new PDT, 4K aligned on the heap.
+     */
+    static PageDescriptorTable* new_pdt(const PageDescriptorTable& k_pdt);
+
     // Entry point for the process, as read from the ELF header.
     uintptr_t entry_point;
-    // Page Descriptor Table for this process. PDTs own their associated Page
-    // Tables, so we don't need a list of PTs here.
+    // Page Descriptor Table for this process. PDTs own their associated user
+    // space Page Tables, so we don't need a list of PTs here. The kernel space
+    // Page Tables are shared by all processes.
     PageDescriptorTable* pdt;
     // Current size of the user stack and maximum size.
     size_t current_stack;
@@ -357,11 +463,26 @@ private:
     size_t parent_pid;
     // List of the pids of children.
     klib::vector<size_t> child_pids;
+    // PID, once the process is in the process table.
+    size_t pid = 0;
+    // Scheduling priority.
+    unsigned priority = Scheduler::default_priority;
+    // Links for the scheduler run queue, only meaningful when queued.
+    Process* run_prev = nullptr;
+    Process* run_next = nullptr;
+    bool queued = false;
+    // Processor whose run queue the process goes on, the one it last ran on.
+    size_t cpu = 0;
+    // Timer for timed sleeps.
+    Timer timer {wake, this};
 };
 
 /**
     Assembly instruction to carry out the iret to transfer to a user mode
-    process. This will disable interrupts for the moment.
+    process. This will disable interrupts for the moment. The frame is moved
+    onto the process's kernel stack first, then the kernel lock is given up,
+    as the stack it was called on may belong to a process that another
+    processor can resume as soon as the lock is free.
 
     @param edi Register value.
     @param esi Register value.
@@ -376,6 +497,7 @@ private:
     @param eflags Processor flags value.
     @param esp Stack pointer.
     @param ss Stack segment selector.
+    @param kstack Top of the process's kernel stack.
  */
 extern "C"
 void launch_process(uint32_t edi,
@@ -390,7 +512,8 @@ void launch_process(uint32_t edi,
                     uint16_t cs,
                     uint32_t eflags,
                     uint32_t esp,
-                    uint16_t ss);
+                    uint16_t ss,
+                    uintptr_t kstack);
 
 /**
     Assembly instruction to carry out the iret to transfer to a kernel mode
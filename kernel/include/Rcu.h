@@ -0,0 +1,75 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "Lock.h"
+
+/**
+    Read-copy-update for read-mostly data. Readers take no locks, they just
+    mark the start and end of their read sections. A writer makes a new copy of
+    the data, publishes it with an atomic pointer store, then waits for a grace
+    period with synchronize(), after which no reader can still see the old
+    copy, so it can be freed.
+
+    Readers are counted in two epochs. Starting a grace period moves new
+    readers to the other epoch, and it ends once the old epoch has emptied.
+    Unlike classic RCU, read sections may sleep or be preempted, since they're
+    counted rather than inferred from context switches.
+ */
+class Rcu {
+public:
+    /**
+        Constructor.
+     */
+    constexpr Rcu() : epoch{0}, readers0{0}, readers1{0}, writer{} {}
+
+    /**
+        Grace periods are tied to the readers, so can't be copied.
+     */
+    Rcu(const Rcu&) = delete;
+    Rcu& operator=(const Rcu&) = delete;
+
+    /**
+        Starts a read section. Pointers to the protected data loaded after
+        this stay valid until the matching read_unlock().
+
+        @return Token to pass to read_unlock().
+     */
+    unsigned read_lock();
+
+    /**
+        Ends a read section.
+
+        @param token Value returned by the matching read_lock().
+     */
+    void read_unlock(unsigned token);
+
+    /**
+        Waits until every read section that started before the call has
+        ended. Anything unpublished before the call can then be freed. May
+        sleep, so not for interrupt handlers. Writers must still exclude each
+        other while making their updates.
+     */
+    void synchronize();
+
+private:
+    // Epoch new readers join, 0 or 1.
+    klib::atomic<unsigned> epoch;
+    // Number of readers in each epoch.
+    klib::atomic<uint32_t> readers0;
+    klib::atomic<uint32_t> readers1;
+    // Stops grace periods overlapping.
+    Mutex writer;
+
+    // Gets the reader count for an epoch.
+    klib::atomic<uint32_t>& readers(unsigned e)
+    {
+        return (e == 0 ? readers0 : readers1);
+    }
+};
+
+#endif /* RCU_H */
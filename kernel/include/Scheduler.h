@@ -2,8 +2,16 @@
 #define SCHEDULER_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
 
 #include "InterruptHandler.h"
+#include "Lock.h"
+
+// Forward declarations
+class Process;
 
 // We have a set of flags for blocking a swtich for various reasons. These are
 // global and have C linkage, so we can switch them from assembly.
@@ -40,6 +48,22 @@ public:
      */
     virtual size_t get_last() const { return current_proc; }
 
+    /**
+        Adds a runnable process to the run queue for its priority. Does nothing
+        if it's already queued. Processes that are sleeping, or the one that's
+        currently active, are not kept on a run queue.
+
+        @param p Process to queue.
+     */
+    virtual void ready(Process& p) = 0;
+
+    /**
+        Takes a process off the run queue. Does nothing if it isn't queued.
+
+        @param p Process to remove.
+     */
+    virtual void remove(Process& p) = 0;
+
     /**
         Switch to the next scheduled process. We need the state of the old
         process so we can save it if we swap out.
@@ -62,16 +86,82 @@ public:
      */
     virtual void yield() = 0;
 
+    /**
+        Body of the idle task, which runs when no process can. Halts the
+        processor until there's something to run. Never returns.
+     */
+    virtual void idle() = 0;
+
+    /**
+        Starts the idle task on a processor with nothing to run yet, such as
+        an application processor once it's set up. The kernel lock must be
+        held, and is given up by the idle task. Never returns.
+     */
+    virtual void start_idle() = 0;
+
+    /**
+        Tests whether the idle task is running, rather than a process.
+
+        @return Whether the processor is idle.
+     */
+    virtual bool idling() const = 0;
+
+    /**
+        Number of priority levels. 0 is the highest priority.
+     */
+    static constexpr unsigned priorities = 8;
+
+    /**
+        Priority new processes start with.
+     */
+    static constexpr unsigned default_priority = priorities / 2;
+
 protected:
     // Last process PID given time by the scheduler.
     size_t current_proc = 0;
 };
 
 /**
-    Simple round robin scheduler with equal priorities.
+    Round robin scheduler with strict priorities, one per processor. Each
+    priority level has a run queue, which is an intrusive list threaded
+    through the Processes, and a bitmap records which queues are non-empty, so
+    finding the next process takes constant time however many processes there
+    are. Only runnable processes are queued; processes go on the tail when
+    they become runnable or are swapped out, and come off the head when they
+    get time.
+
+    A process is queued on the processor it last ran on. The queues have
+    their own lock, so idle processors can look for work without the kernel
+    lock: a processor with nothing to run steals from the processor with the
+    longest queue, and one that queues a process wakes an idle processor to
+    run it.
  */
 class RoundRobin : public Scheduler {
 public:
+    /**
+        Constructor. All the run queues start empty.
+
+        @param n Index of the processor to schedule.
+     */
+    explicit RoundRobin(size_t n) : cpu{n}, guard{}, heads{}, tails{},
+        ready_map{0}, length{0}, idle_stack{nullptr}, in_idle{false} {}
+
+    /**
+        Adds a runnable process to the tail of the run queue for its priority,
+        on the processor it last ran on, and wakes an idle processor to run
+        it. Does nothing if it's already queued.
+
+        @param p Process to queue.
+     */
+    virtual void ready(Process& p) override;
+
+    /**
+        Takes a process off whichever run queue it's on. Does nothing if it
+        isn't queued.
+
+        @param p Process to remove.
+     */
+    virtual void remove(Process& p) override;
     /**
         Switch to the next scheduled process. We need the state of the old
         process so we can save it if we swap out.
@@ -93,6 +183,79 @@ public:
         Give up remaining time and start the next process.
      */
     virtual void yield() override;
+
+    /**
+        Body of the idle task. Gives up the kernel lock and halts until
+        something is runnable here, or can be stolen from another processor,
+        then yields to it. The timer is stopped while halted; with only one
+        processor, the PIT skips the ticks in which no timer expires too.
+        Never returns.
+     */
+    virtual void idle() override;
+
+    /**
+        Starts the idle task on a processor with nothing to run yet. The kernel
+        lock must be held, and is given up by the idle task. Never returns.
+     */
+    virtual void start_idle() override;
+
+    /**
+        Tests whether the idle task is running, rather than a process.
+
+        @return Whether the processor is idle.
+     */
+    virtual bool idling() const override { return in_idle; }
+
+private:
+    // Processor this schedules.
+    size_t cpu;
+    // Protects the run queues, which other processors look at and steal from
+    // without the kernel lock.
+    Spinlock guard;
+    // First and last processes in each run queue.
+    klib::array<Process*, priorities> heads;
+    klib::array<Process*, priorities> tails;
+    // Bit n is set if the queue for priority n is non-empty.
+    uint32_t ready_map;
+    // Number of processes queued, for picking which processor to steal from.
+    size_t length;
+    // Stack for the idle task. Nothing on it needs saving, so the idle task
+    // always starts again from the top.
+    uintptr_t* idle_stack;
+    // Whether the idle task is running. Other processors read it to find one
+    // to wake.
+    klib::atomic<bool> in_idle;
+
+    // Gets the scheduler of processor n.
+    static RoundRobin& of(size_t n);
+
+    // Locks the run queues of the processor a process is queued on, which
+    // may change until they're locked. Returns that scheduler.
+    static RoundRobin& lock_home(Process& p);
+
+    // Adds a process to the tail of its queue, and takes it off. The guard
+    // must be held.
+    void push(Process& p);
+    void unlink(Process& p);
+
+    // Gets the first process of the highest priority non-empty queue, or
+    // nullptr if nothing is runnable. Doesn't remove it. The guard must be
+    // held.
+    Process* peek() const;
+
+    // Moves the first process of the longest run queue of another processor
+    // onto this one. Returns whether there was one to move.
+    bool steal();
+
+    // Wakes an idle processor to run something just added to rq: its own if
+    // that's idle, otherwise any other.
+    static void kick(RoundRobin& rq);
+
+    // Switches to the idle task. Doesn't return.
+    void launch_idle();
+
+    // Entry point of the idle task.
+    static void idle_entry();
 };
 
 /**
@@ -7,6 +7,7 @@
 #include <string>
 
 #include "Device.h"
+#include "Lock.h"
 
 // Forward declarations
 enum class PollType;
@@ -41,7 +42,26 @@ enum class PortOffset : uint16_t {
 };
 
 /**
-    Manages a serial port.
+    Bits of the interrupt enable register.
+ */
+enum class SerialInterrupt : uint8_t {
+    /** Received data available */
+    rx_data = 0x01,
+    /** Transmit holding register empty */
+    tx_empty = 0x02,
+    /** Receiver line status */
+    line_status = 0x04,
+    /** Modem status */
+    modem_status = 0x08
+};
+
+/**
+    Manages a serial port. Starts out writing each character by waiting for
+    the port, which works anywhere, even before interrupts are set up. Once
+    start_interrupts() is called, characters written go on a transmit ring and
+    are sent from the interrupt handler, as many at a time as the FIFO holds,
+    so writers don't wait for the line. Received characters are collected on a
+    receive ring by the interrupt handler and handed out by read_chars().
  */
 class Serial : public CharacterDevice {
 public:
@@ -66,9 +86,28 @@ public:
                     uint8_t mc = 0x03);
 
     /**
-        Destructor. Calls close().
+        Destructor. Stops interrupts and sends anything left.
+     */
+    virtual ~Serial() { stop_interrupts(); }
+
+    /**
+        Switches to sending and receiving by interrupts. The IRQ for the port
+        must be unmasked and handled by calling handle_interrupt().
+     */
+    void start_interrupts();
+
+    /**
+        Switches back to waiting for the port on each character, sending
+        anything still on the transmit ring first. Used when interrupts are
+        about to go away, such as on a panic.
+     */
+    void stop_interrupts();
+
+    /**
+        Deals with an interrupt from the port. Sends the next characters from
+        the transmit ring and puts received characters on the receive ring.
      */
-    virtual ~Serial() { close(); }
+    void handle_interrupt();
 
     /**
         Sets the baud rate.
@@ -145,7 +184,8 @@ public:
     uint8_t get_modem_conf() const { return modem_conf; }
 
     /**
-        Send a character down the serial port.
+        Send a character down the serial port. When interrupt driven, it's put
+        on the transmit ring, and only waits for the port if the ring is full.
 
         @param c Character to send.
      */
@@ -153,10 +193,10 @@ public:
 
     /**
         Waits until the pending write is complete, by polling the transmission
-        buffer.
+        buffer. When interrupt driven, characters are on their way once they're
+        on the transmit ring, so returns straight away.
 
-        @return Always returns 0, since all characters will have been written by
-                the time it returns.
+        @return Always returns 0.
      */
     virtual int flush() override;
 
@@ -180,19 +220,35 @@ public:
 
     /**
         Reads characters. Stops at the requested number of characters or when
-        no more characters are availble. TODO not yet implemented. Always
-        returns an empty string.
+        no more characters are availble. Doesn't wait for any to arrive.
 
         @param count Number of characters to read. 0 (the default) means read
                all availble characters.
         @return String containing all the characters read.
      */
-    virtual klib::string read_chars(size_t = 0) override
-    {
-        return klib::string {""};
-    }
+    virtual klib::string read_chars(size_t count = 0) override;
 
 private:
+    // Sizes of the transmit and receive rings. Must be powers of 2.
+    static constexpr uint32_t tx_size = 4096;
+    static constexpr uint32_t rx_size = 1024;
+
+    // Interrupt identification register bits, read from the FIFO port.
+    static constexpr uint8_t iir_none = 0x01;
+    static constexpr uint8_t iir_id_mask = 0x0E;
+    static constexpr uint8_t iir_modem_status = 0x00;
+    static constexpr uint8_t iir_tx_empty = 0x02;
+    static constexpr uint8_t iir_rx_data = 0x04;
+    static constexpr uint8_t iir_line_status = 0x06;
+    static constexpr uint8_t iir_rx_timeout = 0x0C;
+    // Set in the interrupt identification register when the FIFOs work.
+    static constexpr uint8_t iir_fifo_enabled = 0xC0;
+    // Modem control bit which connects the port to its IRQ.
+    static constexpr uint8_t mcr_out2 = 0x08;
+    // Depth of the 16550 transmit FIFO.
+    static constexpr uint32_t fifo_depth = 16;
+
+
     // Address of data port.
     uint16_t data_port;
     // Address of interrupt enable port.
@@ -205,6 +261,8 @@ private:
     uint16_t modem_command_port;
     // Address of line status port.
     uint16_t line_status_port;
+    // Address of modem status port.
+    uint16_t modem_status_port;
     // Divisor to set baud rate.
     uint16_t divisor;
     // interrupt configuration byte/
@@ -215,6 +273,32 @@ private:
     uint8_t buffer_conf;
     // Modem configuartion byte.
     uint8_t modem_conf;
+    // Number of characters the port takes at once, 1 without a FIFO.
+    uint32_t fifo_size;
+    // Whether characters are sent and received by interrupts.
+    bool irq_driven;
+    // Whether the port is sending from the ring, so a transmit interrupt is
+    // coming.
+    bool tx_busy;
+    // Transmit ring. The counters run freely and are masked to index it.
+    char tx_buf[tx_size];
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    // Receive ring, the same way.
+    char rx_buf[rx_size];
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    // Protects the rings and the state, as the interrupt handler uses them.
+    mutable Spinlock lock;
+
+    // Fills the transmit FIFO from the ring. The FIFO must be empty. Must be
+    // called with the lock held.
+    // Returns the number of characters sent.
+    uint32_t send_from_ring();
+
+    // Sends everything on the transmit ring by polling. Must be called with
+    // the lock held.
+    void drain();
 
     /**
         Checks whether the transmission buffer is empty. This must be true
@@ -4,9 +4,12 @@
 #include <stddef.h>
 
 #include <ios>
+#include <map>
 #include <string>
 #include <vector>
 
+#include "WaitQueue.h"
+
 // Forward declarations
 class Device;
 class Process;
@@ -54,12 +57,30 @@ using klib::operator|=;
 using klib::operator&=;
 using klib::operator^=;
 
+/**
+    Operations for SignalManager::interest_ctl().
+ */
+enum class interest_op {
+    /** Register a file descriptor with the set. */
+    add = 1,
+    /** Remove a file descriptor from the set. */
+    del = 2,
+    /** Change the events registered for a file descriptor. */
+    mod = 3
+};
+
 /**
     The purpose of this class is to manage signals to processes and events such
     as waited for by poll(). A process can notify the event manager that it is
     waiting for an event, and the manager will put it to sleep. When events
     occur, the signal manager should be notified so that it can wake up waiting
     processes.
+
+    File events are delivered through the wait queue of the device they happen
+    on, so a notification only visits the polls and interest sets waiting on
+    that device. Wait requests and events that have happened are kept per
+    process, so a notification only looks at the parent of the process sending
+    it.
  */
 class SignalManager {
 public:
@@ -70,9 +91,10 @@ public:
      */
     explicit SignalManager(ProcTable& p) :
         pt {p},
-        pending_polls {},
         pending_waits {},
-        happened_waits{}
+        happened_waits {},
+        interest_sets {},
+        last_set {0}
     {}
 
     /**
@@ -90,39 +112,78 @@ public:
     /**
         Puts a process to sleep until the requested file events have occured.
         For example, wait for the user to provide keyboard input to the tty.
-        Multiple file descriptors and multiple events may be specified. Task
-        switching is disabled while the events list is scanned to prevent events
-        firing while the process is switched out being missed.
+        Multiple file descriptors and multiple events may be specified. A waiter
+        for each file descriptor goes on the wait queue of its device for the
+        duration of the call, so the cost is in the number of descriptors, not
+        the number of other processes polling.
 
         @param fds List of the file descriptors and events. Must be a pointer to
                a heap variable, as the active process stack may change.
         @param nfds Number of objects in the list.
         @param timeout Time after which to return if no event occured,
-               in milliseconds. A negative value means infinite.
+               in milliseconds. A negative value means infinite. The timeout
+               is run by the process's timer in the timer wheel.
         @return Number of fds with successful events, 0 if the timeout was
                 reached or -1 on error.
      */
     int poll(pollfd* fds, size_t nfds, int timeout);
 
     /**
-        Notify the manager that a file descriptor event has occured. If matching
-        events are found in the poll events list, the associated processes will
-        be woken up. Task switching is disabled while the events list is scanned
-        to make sure we process all matches immediately.
+        Notify the manager that a file descriptor event has occured. Wakes the
+        wait queue of the device, so only polls and interest sets waiting on
+        that device are looked at. Matching polls have their processes woken,
+        matching interest set entries are marked ready.
 
         @param dev Device that has caused the event.
         @param ev Bitmask specifying the event or events that have occured.
      */
-    void notify_file(const Device* dev, PollType ev);
+    void notify_file(Device* dev, PollType ev);
 
     /**
-        Decreases the timeout counters for all pending events. Processes with
-        events reaching their timeouts will be woken up. Switching is blocked
-        to ensure we wake everything up immedately.
+        Creates an interest set for the active process. File descriptors
+        registered with the set stay registered between waits, so waiting
+        doesn't need to check every descriptor again, only the ones that have
+        become ready.
 
-        @param tick_size Number of milliseconds to decrease each timer by.
+        @return Identifier of the set, or -1 on failure.
      */
-    void tick_down(int tick_size);
+    int create_interest_set();
+
+    /**
+        Changes the file descriptors registered with an interest set. The set
+        refers to the file descriptor's device, so a descriptor should be
+        removed from the set before it's closed.
+
+        @param set Identifier of the set, belonging to the active process.
+        @param op Whether to add, remove or change the registration.
+        @param fd File descriptor of the active process.
+        @param events Events to wait for. Ignored when removing.
+        @return 0 on success, -1 on failure.
+     */
+    int interest_ctl(int set, interest_op op, int fd, PollType events);
+
+    /**
+        Waits for file descriptors in an interest set to become ready. Entries
+        stay ready for as long as their device says the events are true, so
+        descriptors that aren't read stay reported.
+
+        @param set Identifier of the set, belonging to the active process.
+        @param events Array to fill in with the fd and the events that are true
+               in revents. Must be in kernel memory.
+        @param max Size of the array.
+        @param timeout Time after which to return if nothing is ready, in
+               milliseconds. A negative value means infinite.
+        @return Number of entries filled in, 0 on timeout or -1 on error.
+     */
+    int wait_interest(int set, pollfd* events, size_t max, int timeout);
+
+    /**
+        Destroys an interest set.
+
+        @param set Identifier of the set, belonging to the active process.
+        @return 0 on success, -1 on failure.
+     */
+    int close_interest_set(int set);
 
     /**
         Registers a process to wait for an event, going to sleep until the
@@ -153,10 +214,10 @@ public:
 
     /**
         Purge all the pending events for a specific PID. Useful for ending
-        processes. Deletes poll events where the process is waiting for a poll,
-        wait events that have happened for this process and wait requests for
-        the process. Does not delete wait requests where other processes are
-        waiting for this one.
+        processes. Deletes wait events that have happened for this process or
+        its children, wait requests for the process and the process's interest
+        sets. Does not delete wait requests where other processes are waiting
+        for this one.
 
         @param pid PID of process to purge.
         @param proc Process to purge.
@@ -168,22 +229,53 @@ protected:
     // The process table.
     ProcTable& pt;
 
-    // This class is used to store polling events. As well as the address of the
-    // polling request, it contains the remaining time till timeout and the PID.
-    struct poll_event {
+    // Waiter for one file descriptor in a poll. These only exist for the
+    // length of the poll() call that makes them.
+    struct poll_waiter : public Waiter {
+        poll_waiter() : Waiter{wake_poll}, req{nullptr}, proc{nullptr} {}
+
+        // Request to fill in, and the process to wake.
         pollfd* req;
-        int time_left;
+        Process* proc;
+    };
+
+    struct interest_set;
+
+    // Waiter for a file descriptor registered with an interest set. These stay
+    // on the device's queue until the descriptor is removed from the set.
+    struct interest : public Waiter {
+        interest(interest_set* s, int f, Device* d, PollType e) :
+            Waiter{wake_interest}, set{s}, fd{f}, dev{d}, events{e},
+            ready_next{nullptr}, ready{false} {}
+
+        // Set the entry belongs to.
+        interest_set* set;
+        // File descriptor and its device. Files without a device are always
+        // ready.
+        int fd;
+        Device* dev;
+        // Events registered for.
+        PollType events;
+        // Link for the set's ready list and whether the entry is on it.
+        interest* ready_next;
+        bool ready;
+    };
+
+    // An interest set. Has the PID of the owning process, the registered
+    // entries and a list of entries that may be ready.
+    struct interest_set {
         size_t pid;
+        klib::map<int, interest*> fds;
+        interest* ready_head;
+        interest* ready_tail;
     };
 
-    // This class is used to store waiting requests. It has the PID of the
-    // waiting process, a list of PIDs of processes it is waiting for, the
-    // address of a user space integer used to return information, a field to
-    // store the data to put into that address (since the relevant user space
-    // process may not be in virtual memory when events are notified) and an
-    // options field.
+    // This class is used to store waiting requests. It has a list of PIDs of
+    // processes it is waiting for, the address of a user space integer used
+    // to return information, a field to store the data to put into that
+    // address (since the relevant user space process may not be in virtual
+    // memory when events are notified) and an options field.
     struct wait_request {
-        size_t pid;
         klib::vector<size_t> wait_pids;
         int* wstatus;
         int local_wstatus;
@@ -198,15 +290,38 @@ protected:
         int ev;
     };
 
-    // List of polling events. This class will not free any memory associated
-    // with polling requests (pollfd).
-    klib::vector<poll_event> pending_polls;
+    // Wait requests, keyed by the PID of the waiting process. Each process can
+    // only have one wait at a time.
+    klib::map<size_t, wait_request> pending_waits;
+
+    // Events that have been notified that no process has asked for yet, keyed
+    // by the PID of the parent that can ask for them.
+    klib::map<size_t, klib::vector<wait_event>> happened_waits;
+
+    // Interest sets, by identifier.
+    klib::map<int, interest_set*> interest_sets;
+    // Last identifier handed out.
+    int last_set;
+
+    // Wake functions for the waiters. Called with interrupts off.
+    static void wake_poll(Waiter& w, PollType ev);
+    static void wake_interest(Waiter& w, PollType ev);
+
+    // Adds an interest set entry to the ready list if it isn't already there.
+    // Interrupts must be off.
+    static void make_ready(interest& in);
+
+    // Looks up an interest set belonging to the active process. Returns
+    // nullptr if there isn't one.
+    interest_set* get_interest_set(int set);
 
-    // List of processes waiting for events.
-    klib::vector<wait_request> pending_waits;
+    // Takes all the entries of an interest set off their queues and frees the
+    // set.
+    static void destroy_interest_set(interest_set* s);
 
-    // List of events that have been notified that no process has asked for yet.
-    klib::vector<wait_event> happened_waits;
+    // Moves entries from an interest set's ready list that are still ready into
+    // an array. Returns the number found.
+    static size_t collect_ready(interest_set& s, pollfd* events, size_t max);
 };
 
 #endif /* SIGNAL_MANAGER_H */
@@ -0,0 +1,275 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <ostream>
+#include <vector>
+
+// Forward declarations
+class IoApic;
+class LocalApic;
+
+/**
+    Most processors the kernel will use. Any more are left halted.
+ */
+constexpr size_t max_cpus = 16;
+
+/**
+    State kept for each processor.
+ */
+struct Cpu {
+    /** Local APIC ID. */
+    uint8_t apic_id;
+    /** Whether the processor has started and is running the kernel. */
+    volatile bool online;
+    /** Stack the processor starts on. nullptr for the bootstrap processor,
+        which has its own. */
+    uintptr_t* stack;
+};
+
+/**
+    Finds the processors and interrupt controllers in the machine, from the
+    ACPI MADT or failing that the MP tables, and starts the application
+    processors. Processor 0 is always the bootstrap processor.
+
+    When an I/O APIC is found, ISA interrupts are routed through it to the
+    bootstrap processor instead of through the 8259 PIC, and acknowledged at
+    the local APIC.
+
+    Every processor runs processes. Each has its own scheduler and run queue,
+    and TSS. With more than one processor, each has its local APIC timer
+    preempting processes too, and the PIT just keeps time on the bootstrap
+    processor. The rest of the kernel is still written for one processor, so
+    it runs under the big kernel lock, which each processor holds while it's
+    in the kernel.
+ */
+class Smp {
+public:
+    /**
+        Constructor. Reads the firmware tables. If nothing useful is found,
+        there's just the bootstrap processor and the PIC stays in charge.
+     */
+    Smp();
+
+    /**
+        Prints the processors and interrupt controllers found.
+
+        @param dest Stream to print to.
+     */
+    void dump(klib::ostream& dest) const;
+
+    /**
+        Gets the number of processors found.
+
+        @return Number of processors, at least 1.
+     */
+    size_t cpu_count() const { return ncpus; }
+
+    /**
+        Gets the number of processors running the kernel.
+
+        @return Number of processors online.
+     */
+    size_t online_count() const;
+
+    /**
+        Gets the index of the calling processor.
+
+        @return Processor index, 0 for the bootstrap processor.
+     */
+    size_t this_cpu() const;
+
+    /**
+        Gets a processor's state.
+
+        @param n Processor index, less than cpu_count().
+        @return State for the processor.
+     */
+    Cpu& get_cpu(size_t n) { return cpus[n]; }
+
+    /**
+        Gets the local APIC driver.
+
+        @return Local APIC driver, or nullptr if there's no local APIC.
+     */
+    LocalApic* local_apic() { return lapic; }
+
+    /**
+        Tests whether device interrupts come through the I/O APIC rather than
+        the PIC.
+
+        @return True if routing through the I/O APIC.
+     */
+    bool apic_routing() const { return io_routing; }
+
+    /**
+        Routes the ISA interrupts through the I/O APIC to the bootstrap
+        processor, on the same vectors the PIC used, and masks the PIC. The
+        interrupts start masked apart from the PIT. Does nothing if there's no
+        I/O APIC.
+     */
+    void route_isa_irqs();
+
+    /**
+        Masks or unmasks an ISA interrupt at the I/O APIC.
+
+        @param irq ISA interrupt number.
+        @param masked True to stop the interrupt.
+     */
+    void set_irq_masked(uint8_t irq, bool masked);
+
+    /**
+        Measures the local APIC timers, then starts all the application
+        processors and waits for them to come online. Interrupts must be
+        enabled, as the delays use the PIT.
+     */
+    void start_aps();
+
+    /**
+        Lets every processor start scheduling processes, once there's a
+        scheduler for each, and starts the local APIC timer of the calling
+        processor, which must be the bootstrap processor.
+     */
+    void start_scheduling();
+
+    /**
+        Finishes setting up an application processor, on that processor. Once
+        scheduling starts, it holds the kernel lock and starts its idle task.
+        Never returns.
+
+        @param n Processor index.
+     */
+    void ap_main(size_t n);
+
+    /**
+        Tests whether the local APIC timers preempt processes, rather than the
+        PIT.
+
+        @return Whether there are local APIC timers to use.
+     */
+    bool cpu_timers() const { return timer_count != 0; }
+
+    /**
+        Starts the local APIC timer of the calling processor. Does nothing if
+        the local APIC timers aren't in use.
+     */
+    void start_timer();
+
+    /**
+        Stops the local APIC timer of the calling processor, such as while it
+        has nothing to run. Does nothing if the local APIC timers aren't in
+        use.
+     */
+    void stop_timer();
+
+    /**
+        Interrupts another processor so that it looks for something to run.
+
+        @param n Processor index.
+     */
+    void reschedule(size_t n);
+
+    /**
+        Vector for the local APIC timer.
+     */
+    static constexpr uint8_t timer_vector = 0x30;
+
+    /**
+        Vector for interrupts asking a processor to look for something to run.
+     */
+    static constexpr uint8_t reschedule_vector = 0x31;
+
+    /**
+        Vector for local APIC spurious interrupts. These don't need
+        acknowledging.
+     */
+    static constexpr uint8_t spurious_vector = 0xFF;
+
+private:
+    // How an ISA interrupt is connected to the I/O APIC.
+    struct IsaRoute {
+        uint32_t gsi;
+        bool active_low;
+        bool level;
+    };
+
+    // Physical address the trampoline is copied to. Must match smp.s.
+    static constexpr uint32_t trampoline_page = 0x8000;
+    // Size of each application processor's stack.
+    static constexpr size_t stack_size = 4096;
+    // Number of ISA interrupts.
+    static constexpr size_t isa_irqs = 16;
+
+    // Processors found and how many.
+    klib::array<Cpu, max_cpus> cpus;
+    size_t ncpus;
+    // Processor index for each APIC ID, or 0xFF if unknown.
+    klib::array<uint8_t, 256> cpu_of_apic;
+    // Physical address of the local APICs.
+    uint32_t lapic_phys;
+    // Local APIC driver, shared by all processors.
+    LocalApic* lapic;
+    // I/O APICs.
+    klib::vector<IoApic*> ioapics;
+    // Where each ISA interrupt comes in.
+    klib::array<IsaRoute, isa_irqs> isa;
+    // Whether the MP tables say the IMCR needs switching to use the APIC.
+    bool imcr;
+    // Whether ISA interrupts are routed through the I/O APIC.
+    bool io_routing;
+    // Local APIC timer counts between interrupts, or 0 if they aren't used.
+    uint32_t timer_count;
+    // Set once the application processors can start scheduling.
+    volatile bool scheduling;
+
+    // Reads the ACPI MADT. Returns whether it was found.
+    bool read_madt();
+
+    // Reads the MP configuration table. Returns whether it was found.
+    bool read_mp_table();
+
+    // Records a processor.
+    void add_cpu(uint8_t apic_id);
+
+    // Gets a virtual address for some physical memory, mapping it if it isn't
+    // in the direct map.
+    static const uint8_t* phys_ptr(uint32_t phys, size_t size);
+
+    // Searches physical memory for a signature on a 16 byte boundary, with a
+    // valid checksum over len bytes. Returns the physical address or 0.
+    static uint32_t find_signature(uint32_t start, uint32_t end,
+        const char* sig, size_t len);
+
+    // Tests whether the bytes sum to 0.
+    static bool checksum(const uint8_t* data, size_t len);
+
+    // Finds the I/O APIC for a GSI, or nullptr if none handles it.
+    IoApic* ioapic_for(uint32_t gsi);
+};
+
+/**
+    Gets the index of the calling processor. Works before the processors have
+    been found, when it's always 0.
+
+    @return Processor index, 0 for the bootstrap processor.
+ */
+size_t this_cpu();
+
+/**
+    Start and end of the application processor startup code, and the fields in
+    it filled in by the kernel, defined in smp.s in assembly. Only the copy in
+    low memory is used.
+ */
+extern "C" {
+extern char ap_trampoline_start[];
+extern char ap_trampoline_end[];
+extern char ap_cr3[];
+extern char ap_stack[];
+extern char ap_entry[];
+extern char ap_index[];
+}
+
+#endif /* SMP_H */
@@ -20,6 +20,27 @@
  */
 void syscall(InterruptRegisters& ir, const InterruptStack& is);
 
+/**
+    Fills the table syscall() uses to find the function for each index. Must be
+    called before any syscalls are made.
+ */
+void init_syscalls();
+
+/**
+    Fast syscall entry point, defined in sysenter.s in assembly. The SYSENTER
+    MSRs point here.
+ */
+extern "C"
+void sysenter_entry();
+
+/**
+    User mode code and stack segment selectors the fast syscall entry puts in
+    the stack frame. SYSEXIT always returns to the selectors 16 and 24 above the
+    kernel code segment, so these must be the same.
+ */
+extern "C" uint32_t sysenter_user_cs;
+extern "C" uint32_t sysenter_user_ss;
+
 /**
     List of the system call function indices. See the equivalent functions for
     descriptions.
@@ -38,9 +59,23 @@ enum class syscall_ind {
     rmdir = 0x28,
     brk = 0x2d,
     llseek = 0x8c,
-    yield = 0x9e
+    yield = 0x9e,
+    nanosleep = 0xa2,
+    epoll_create = 0xfe,
+    epoll_ctl = 0xff,
+    epoll_wait = 0x100,
+    epoll_close = 0x101,
+    io_ring_setup = 0x1a9,
+    io_ring_enter = 0x1aa,
+    io_ring_close = 0x1ab
 };
 
+/**
+    Size of the syscall table, one past the highest syscall index.
+ */
+constexpr size_t syscall_table_size =
+    static_cast<size_t>(syscall_ind::io_ring_close) + 1;
+
 /**
     List of flags for open.
  */
@@ -59,6 +94,99 @@ enum class open_flags {
     trunc = 0x8
 };
 
+/**
+    Time interval for nanosleep. Matches struct timespec in user space.
+ */
+struct timespec {
+    /** Whole seconds. */
+    int32_t tv_sec;
+    /** Nanoseconds, from 0 to 999999999. */
+    int32_t tv_nsec;
+};
+
+/**
+    Event reported by epoll_wait. Matches struct epoll_event in user space.
+ */
+struct epoll_event {
+    /** Events registered for, or the events that are true when returned. Uses
+        the same bits as PollType. */
+    uint32_t events;
+    /** File descriptor. */
+    int32_t fd;
+};
+
+/**
+    Operations that can be submitted to an I/O ring. Match the IORING_OP_*
+    values in user space.
+ */
+enum class io_op : uint32_t {
+    /** Does nothing, completing with 0. */
+    nop = 0,
+    /** read(fd, addr, len). */
+    read = 1,
+    /** write(fd, addr, len). */
+    write = 2,
+    /** open(addr, flags, mode). */
+    open = 3,
+    /** close(fd). */
+    close = 4,
+    /** llseek(fd, off, addr, flags), with flags as whence. */
+    llseek = 5,
+    /** unlink(addr). */
+    unlink = 6
+};
+
+/**
+    Start of an I/O ring, in user memory. Followed by the submission entries
+    and then the completion entries, one of each per ring entry. The counters
+    run freely and are masked with entries - 1 to index the arrays. Matches
+    struct io_ring in user space.
+ */
+struct io_ring {
+    /** Next submission for the kernel to take. Written by the kernel. */
+    uint32_t sq_head;
+    /** One past the last submission. Written by user space. */
+    uint32_t sq_tail;
+    /** Next completion for user space to take. Written by user space. */
+    uint32_t cq_head;
+    /** One past the last completion. Written by the kernel. */
+    uint32_t cq_tail;
+    /** Number of entries in each ring, a power of 2. Written by the kernel. */
+    uint32_t entries;
+};
+
+/**
+    Submission ring entry. Matches struct io_sqe in user space.
+ */
+struct io_sqe {
+    /** Operation, one of io_op. */
+    uint32_t opcode;
+    /** File descriptor for operations that take one. */
+    int32_t fd;
+    /** Buffer, file name or result address. */
+    uint32_t addr;
+    /** Byte count for read and write. */
+    uint32_t len;
+    /** Offset for llseek. */
+    int64_t off;
+    /** Flags for open, or whence for llseek. */
+    uint32_t flags;
+    /** Mode for open. */
+    uint32_t mode;
+    /** Copied to the completion, to identify it. */
+    uint32_t user_data;
+};
+
+/**
+    Completion ring entry. Matches struct io_cqe in user space.
+ */
+struct io_cqe {
+    /** user_data of the submission. */
+    uint32_t user_data;
+    /** Return value of the operation, as from the equivalent syscall. */
+    int32_t res;
+};
+
 /**
     Template overloads to allow open_flags enum to be used as Bitfields. We need
     to use the klib bitwise operators, since open_flags is not a member of klib
@@ -248,6 +376,88 @@ int32_t llseek(int fd, int32_t offset_high, int32_t offset_low,
  */
 int32_t yield(const InterruptRegisters& ir, const InterruptStack& is);
 
+/**
+    Puts the process to sleep for at least the requested time. The time is
+    rounded up to a whole number of PIT ticks. Other processes get the CPU in
+    the meantime.
+
+    @param req Time to sleep for, from %ebx.
+    @param rem If not nullptr, set to the time remaining, which is always zero
+           as nothing can interrupt the sleep, from %ecx.
+    @return 0 on success, -1 if the request is invalid.
+ */
+int32_t nanosleep(const timespec* req, timespec* rem);
+
+/**
+    Creates an interest set, to which file descriptors can be added and which
+    can then be waited on.
+
+    @param size Ignored, but must be positive, from %ebx.
+    @return Identifier of the new set, -1 on failure.
+ */
+int32_t epoll_create(int size);
+
+/**
+    Adds, removes or changes a file descriptor in an interest set.
+
+    @param epfd Identifier of the interest set, from %ebx.
+    @param op 1 to add, 2 to remove or 3 to change, from %ecx.
+    @param fd File descriptor, from %edx.
+    @param event Events to register for. May be nullptr when removing, from
+           %esi.
+    @return 0 on success, -1 on failure.
+ */
+int32_t epoll_ctl(int epfd, int op, int fd, const epoll_event* event);
+
+/**
+    Waits for file descriptors in an interest set to be ready.
+
+    @param epfd Identifier of the interest set, from %ebx.
+    @param events Array to fill in with the ready file descriptors, from %ecx.
+    @param maxevents Size of the array, from %edx.
+    @param timeout Time to wait for in milliseconds. Negative means forever,
+           from %esi.
+    @return Number of entries filled in, 0 on timeout, -1 on failure.
+ */
+int32_t epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout);
+
+/**
+    Destroys an interest set. The identifier doesn't refer to a file
+    descriptor, so this replaces close().
+
+    @param epfd Identifier of the interest set, from %ebx.
+    @return 0 on success, -1 on failure.
+ */
+int32_t epoll_close(int epfd);
+
+/**
+    Sets up an I/O ring in memory provided by the process. See IoRingTable.
+
+    @param ring Memory for the ring, IoRingTable::ring_size(entries) bytes in
+           user space, from %ebx.
+    @param entries Number of entries, a power of 2 up to 4096, from %ecx.
+    @return Identifier of the ring, -1 on failure.
+ */
+int32_t io_ring_setup(io_ring* ring, uint32_t entries);
+
+/**
+    Carries out entries from an I/O ring, putting their results on its
+    completion ring before returning.
+
+    @param id Identifier of the ring, from %ebx.
+    @param to_submit Most submissions to take, from %ecx.
+    @return Number of submissions taken, -1 on failure.
+ */
+int32_t io_ring_enter(int id, uint32_t to_submit);
+
+/**
+    Destroys an I/O ring. The memory goes back to the process.
+
+    @param id Identifier of the ring, from %ebx.
+    @return 0 on success, -1 on failure.
+ */
+int32_t io_ring_close(int id);
+
 }
 
 #endif /* SYSCALL_H */
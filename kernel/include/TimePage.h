@@ -0,0 +1,72 @@
+#ifndef TIME_PAGE_H
+#define TIME_PAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+    User space address of the time page in every process. Just above the null
+    page, well below where programs are linked. Matches TIME_PAGE_ADDR in user
+    space.
+ */
+constexpr uintptr_t time_page_addr = 0x1000;
+
+/**
+    Contents of the time page, which user space reads without a syscall.
+
+    With an invariant TSC, the kernel publishes its TSC clock once and user
+    space works the time out from the counter, as mono_ns plus the counts since
+    tsc_base, multiplied by tsc_mult and shifted right by tsc_shift. Otherwise
+    tsc_mult is 0 and the kernel writes mono_ns on every timer tick.
+
+    Writes are bracketed by incrementing seq, so it's odd while a write is in
+    progress. Readers take seq, read the rest, and try again if seq was odd or
+    has changed. Matches struct time_page in user space.
+ */
+struct time_page {
+    /** Sequence count, odd while the page is being written. */
+    uint32_t seq;
+    /** Padding, to keep the times aligned. */
+    uint32_t pad;
+    /** Nanoseconds since boot, at the last update or at tsc_base. */
+    uint64_t mono_ns;
+    /** Seconds since the Unix epoch at boot, from the real time clock. */
+    int64_t boot_sec;
+    /** TSC value at mono_ns. Only meaningful if tsc_mult isn't 0. */
+    uint64_t tsc_base;
+    /** Multiplier for converting counts to nanoseconds, or 0 if the TSC
+        isn't used. */
+    uint32_t tsc_mult;
+    /** Right shift after multiplying by tsc_mult. */
+    uint32_t tsc_shift;
+};
+
+/**
+    Reads the CMOS real time clock and puts the boot time on the time page. The
+    clock is assumed to be in UTC, in the 21st century.
+ */
+void init_time_page();
+
+/**
+    Publishes the time since boot on the time page. Called by the timer
+    interrupt. Does nothing once the TSC has been published, as user space
+    works the time out from that instead.
+
+    @param ns Nanoseconds since boot.
+ */
+void update_time_page(uint64_t ns);
+
+/**
+    Publishes a TSC clock on the time page, so user space can read the time to
+    the resolution of the counter. Counts after tsc are converted to
+    nanoseconds by multiplying by mult and shifting right by shift.
+
+    @param tsc Counter value at ns.
+    @param ns Nanoseconds since boot.
+    @param mult Multiplier for converting counts.
+    @param shift Right shift after multiplying.
+ */
+void publish_time_page_tsc(uint64_t tsc, uint64_t ns, uint32_t mult,
+    uint32_t shift);
+
+#endif /* TIME_PAGE_H */
@@ -0,0 +1,142 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+
+/**
+    A timer that calls a function when it expires. Timers don't own any memory
+    and are meant to be embedded in the object they belong to. A timer must not
+    be destroyed while it's pending; cancel it first.
+ */
+class Timer {
+public:
+    /**
+        Constructor. The timer starts off not pending.
+
+        @param f Function to call on expiry. Called from the PIT interrupt.
+        @param d Data to pass to the function.
+     */
+    constexpr Timer(void (*f)(void*), void* d) :
+        callback{f},
+        data{d},
+        prev{nullptr},
+        next{nullptr},
+        slot{nullptr},
+        expires{0}
+    {}
+
+    /**
+        Timers are linked into the wheel by address, so can't be copied.
+     */
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    /**
+        Tests whether the timer is waiting to expire.
+
+        @return True if the timer is in the wheel.
+     */
+    bool pending() const { return slot != nullptr; }
+
+private:
+    friend class TimerWheel;
+
+    // Function to call on expiry and its argument.
+    void (*callback)(void*);
+    void* data;
+    // Links for the wheel slot the timer is in.
+    Timer* prev;
+    Timer* next;
+    // Head of the slot list the timer is in, or nullptr if it isn't pending.
+    Timer** slot;
+    // Tick on which the timer expires.
+    uint32_t expires;
+};
+
+/**
+    Hierarchical timer wheel, advanced by the PIT interrupt. The first level
+    has a slot for each of the next 64 ticks, each level after that has slots
+    64 times as wide. A timer goes in the lowest level that reaches its expiry
+    and is moved down a level when the wheel comes round to its slot, so adding,
+    cancelling and each tick all take constant time however many timers are
+    pending, apart from running the timers that expire.
+ */
+class TimerWheel {
+public:
+    /**
+        Constructor. The wheel starts at tick 0 with no timers.
+     */
+    TimerWheel() : wheel{}, jiffies{0} {}
+
+    /**
+        Adds a timer to the wheel, replacing its previous expiry if it was
+        already pending.
+
+        @param t Timer to add.
+        @param ticks Number of ticks from now to expire. 0 is treated as 1, and
+               anything more than max_delay is reduced to max_delay.
+     */
+    void add(Timer& t, uint32_t ticks);
+
+    /**
+        Removes a timer from the wheel. Does nothing if it isn't pending.
+
+        @param t Timer to remove.
+     */
+    void cancel(Timer& t);
+
+    /**
+        Advances the wheel by one tick and runs the timers that expire.
+     */
+    void tick();
+
+    /**
+        Gets the number of ticks so far.
+
+        @return Current tick.
+     */
+    uint32_t now() const { return jiffies; }
+
+    /**
+        Gets a number of ticks that can pass without any timer expiring. This
+        is exact if a timer expires before the first level next wraps round,
+        otherwise it's the number of ticks until the wrap, when timers from the
+        higher levels may need to come down.
+
+        @return Ticks until something needs doing, at least 1.
+     */
+    uint32_t ticks_to_next() const;
+
+    /**
+        Longest delay a timer can be set for, in ticks.
+     */
+    static constexpr uint32_t max_delay = (1u << 30) - 1;
+
+private:
+    // Bits of the expiry handled by each level.
+    static constexpr unsigned level_bits = 6;
+    // Slots in each level.
+    static constexpr size_t slots = 1 << level_bits;
+    // Number of levels.
+    static constexpr size_t levels = 5;
+
+    // Heads of the timer lists in each slot.
+    klib::array<klib::array<Timer*, slots>, levels> wheel;
+    // Ticks processed so far.
+    uint32_t jiffies;
+
+    // Puts a timer in the right slot for its expiry. Interrupts must be off.
+    void insert(Timer& t);
+
+    // Takes a timer out of its slot. Interrupts must be off.
+    void unlink(Timer& t);
+
+    // Reinserts all the timers in the current slot of a level, which moves
+    // them down a level. Returns the index of the slot.
+    size_t cascade(size_t level);
+};
+
+#endif /* TIMER_WHEEL_H */
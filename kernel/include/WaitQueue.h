@@ -0,0 +1,126 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+
+#include <stddef.h>
+
+// Forward declarations
+enum class PollType;
+class WaitQueue;
+
+/**
+    An entry on a wait queue. Like timers, waiters don't own any memory and are
+    meant to be embedded in whatever is doing the waiting, which decides what
+    waking up means through the function it provides. A waiter must not be
+    destroyed while it's on a queue; remove it first.
+ */
+class Waiter {
+public:
+    /**
+        Constructor. The waiter starts off not on any queue.
+
+        @param f Function to call when the queue is woken. May be called from
+               an interrupt handler.
+     */
+    constexpr explicit Waiter(void (*f)(Waiter&, PollType)) :
+        wake_func{f},
+        prev{nullptr},
+        next{nullptr},
+        queue{nullptr}
+    {}
+
+    /**
+        Waiters are linked into queues by address, so can't be copied.
+     */
+    Waiter(const Waiter&) = delete;
+    Waiter& operator=(const Waiter&) = delete;
+
+    /**
+        Tests whether the waiter is on a queue.
+
+        @return True if the waiter is on a queue.
+     */
+    bool queued() const { return queue != nullptr; }
+
+    /**
+        Gets the queue the waiter is on.
+
+        @return Queue the waiter is on, or nullptr if there isn't one.
+     */
+    WaitQueue* get_queue() const { return queue; }
+
+private:
+    friend class WaitQueue;
+
+    // Function to call on waking.
+    void (*wake_func)(Waiter&, PollType);
+    // Links for the queue.
+    Waiter* prev;
+    Waiter* next;
+    // Queue the waiter is on, or nullptr if it isn't on one.
+    WaitQueue* queue;
+};
+
+/**
+    A list of waiters interested in something, such as a device becoming
+    readable. Whoever owns the queue wakes it when the thing happens, which
+    only visits the waiters on that queue. Adding and removing are safe against
+    the queue being woken from an interrupt handler.
+ */
+class WaitQueue {
+public:
+    /**
+        Constructor. The queue starts empty.
+     */
+    constexpr WaitQueue() : head{nullptr}, tail{nullptr} {}
+
+    /**
+        Nothing can be left waiting on a queue that's going away.
+     */
+    ~WaitQueue();
+
+    /**
+        Queues are referred to by their waiters, so can't be copied.
+     */
+    WaitQueue(const WaitQueue&) = delete;
+    WaitQueue& operator=(const WaitQueue&) = delete;
+
+    /**
+        Adds a waiter to the back of the queue. A waiter already on a queue is
+        moved.
+
+        @param w Waiter to add.
+     */
+    void add(Waiter& w);
+
+    /**
+        Takes a waiter off the queue. Does nothing if it isn't on this queue.
+
+        @param w Waiter to remove.
+     */
+    void remove(Waiter& w);
+
+    /**
+        Calls the wake function of every waiter on the queue, in the order they
+        were added. Waiters stay on the queue.
+
+        @param ev Events that have happened.
+     */
+    void wake(PollType ev);
+
+    /**
+        Tests whether anything is waiting.
+
+        @return True if there are no waiters.
+     */
+    bool empty() const { return head == nullptr; }
+
+private:
+    // Ends of the list of waiters.
+    Waiter* head;
+    Waiter* tail;
+
+    // Takes a waiter out of the list. Interrupts must be off.
+    void unlink(Waiter& w);
+};
+
+#endif /* WAIT_QUEUE_H */
@@ -0,0 +1,42 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+/**
+    Runs the cpuid instruction, with a sub-leaf of 0.
+
+    @param leaf Value for eax, saying what to query.
+    @param regs Filled with the resulting eax, ebx, ecx and edx, in that order.
+ */
+extern "C"
+void cpuid(uint32_t leaf, uint32_t* regs);
+
+/**
+    Reads a model specific register.
+
+    @param msr Number of the register.
+    @return Value of the register.
+ */
+extern "C"
+uint64_t read_msr(uint32_t msr);
+
+/**
+    Writes a model specific register.
+
+    @param msr Number of the register.
+    @param low Bottom 32 bits of the value.
+    @param high Top 32 bits of the value.
+ */
+extern "C"
+void write_msr(uint32_t msr, uint32_t low, uint32_t high);
+
+/**
+    Reads the time stamp counter, which counts processor cycles since reset.
+
+    @return Value of the counter.
+ */
+extern "C"
+uint64_t rdtsc();
+
+#endif /* CPU_H */
@@ -13,6 +13,19 @@ void disable_interrupts();
 extern "C"
 void enable_interrupts();
 
+/**
+    Enable interrupts, halt until the next one has been handled, then disable
+    interrupts again.
+ */
+extern "C"
+void wait_for_interrupt();
+
+/**
+    Pause briefly, for use in spin wait loops.
+ */
+extern "C"
+void cpu_relax();
+
 /**
     Assembly code to load the Interrupt Descriptor Table.
 
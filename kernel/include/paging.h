@@ -35,6 +35,12 @@ void enable_paging();
  */
 void enable_pse();
 
+/**
+    Enables global pages, which are not flushed from the TLB when a new PDT is
+    loaded.
+ */
+void enable_global_pages();
+
 /**
     Invladiates the Translation Lookahead Buffer (TLB) for the given virtual
     memory address, which must be at a 4KB page boundary.
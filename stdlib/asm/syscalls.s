@@ -1,20 +1,89 @@
+.section .data
+
+# Where the system call stubs below go to enter the kernel. Starts as the
+# int $0x80 entry, which always works, and is switched to SYSENTER at startup
+# if the processor has it.
+.global syscall_entry
+syscall_entry: .long int80_syscall
+
 .section .text
 
 # Here we provide the assembly definitions of the system calls. This must be
-# done in assembly to use the int instruction. Each function must put parameters
-# from the stack into appropriate registers. Callee-saved registers are
-# preserved by the system call, so we only need to save registers if we're
-# putting values into them. %eax, %ecx and %edx are caller-saved, so we never
-# need to worry about saving them. After the interrupt, it must restore any
-# saved registers and clear the stack. The interrupt will put the return value
+# done in assembly to use the int or sysenter instructions. Each function must
+# put parameters from the stack into appropriate registers. Callee-saved
+# registers are preserved by the system call, so we only need to save registers
+# if we're putting values into them. %eax, %ecx and %edx are caller-saved, so we
+# never need to worry about saving them. After the call, it must restore any
+# saved registers and clear the stack. The kernel will put the return value
 # in %eax, so no adjustment is required for that.
 
+# Enters the kernel with an interrupt. Registers are already set up.
+int80_syscall:
+    int $0x80
+    ret
+
+# Enters the kernel with SYSENTER. Registers are already set up, apart from
+# %ebp. The kernel needs to be told where to come back to, so we push the return
+# address and point %ebp at it. SYSEXIT puts the stack back to just above it,
+# clobbering %ecx and %edx.
+sysenter_syscall:
+    push %ebp
+    push $sysenter_return
+    mov %esp, %ebp
+    sysenter
+sysenter_return:
+    pop %ebp
+    ret
+
+# Picks SYSENTER for system calls if cpuid says the processor has it. Early
+# Pentium Pros (family 6, model and stepping below 3) say they do but don't.
+# No parameters.
+.global init_syscall_entry
+init_syscall_entry:
+    push %ebx
+    # cpuid itself is there if the ID flag in eflags can be changed.
+    pushfl
+    pop %eax
+    mov %eax, %ecx
+    xor $0x200000, %eax
+    push %eax
+    popfl
+    pushfl
+    pop %eax
+    cmp %eax, %ecx
+    je 0f
+    # Check leaf 1 is there, then look at the SEP flag.
+    xor %eax, %eax
+    cpuid
+    cmp $1, %eax
+    jb 0f
+    mov $1, %eax
+    cpuid
+    test $0x800, %edx
+    jz 0f
+    mov %eax, %ecx
+    and $0xF00, %ecx
+    cmp $0x600, %ecx
+    jne 1f
+    mov %eax, %ecx
+    and $0xF0, %ecx
+    cmp $0x30, %ecx
+    jae 1f
+    and $0xF, %eax
+    cmp $3, %eax
+    jb 0f
+    1:
+    movl $sysenter_syscall, syscall_entry
+    0:
+    pop %ebx
+    ret
+
 # Forks the process.
 # No parameters.
 .global fork
 fork:
     mov $0x2, %eax
-    int $0x80
+    call *syscall_entry
     ret
 
 # Reads characters.
@@ -28,7 +97,7 @@ read:
     mov 8(%esp), %ebx
     mov 12(%esp), %ecx
     mov 16(%esp), %edx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -43,7 +112,7 @@ write:
     mov 8(%esp), %ebx
     mov 12(%esp), %ecx
     mov 16(%esp), %edx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -58,7 +127,7 @@ open:
     mov 8(%esp), %ebx
     mov 12(%esp), %ecx
     mov 16(%esp), %edx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -69,7 +138,7 @@ close:
     push %ebx
     mov $0x6, %eax
     mov 8(%esp), %ebx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -84,7 +153,7 @@ wait:
     mov 8(%esp), %ebx
     mov 12(%esp), %ecx
     mov 16(%esp), %edx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -95,7 +164,7 @@ unlink:
     push %ebx
     mov $0xa, %eax
     mov 8(%esp), %ebx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -110,7 +179,7 @@ execve:
     mov 8(%esp), %ebx
     mov 12(%esp), %ecx
     mov 16(%esp), %edx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -119,7 +188,7 @@ execve:
 .global getpid
 getpid:
     mov $0x14, %eax
-    int $0x80
+    call *syscall_entry
     ret
 
 # Creates a directory.
@@ -131,7 +200,7 @@ mkdir:
     mov $0x27, %eax
     mov 8(%esp), %ebx
     mov 12(%esp), %ecx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -142,7 +211,7 @@ rmdir:
     push %ebx
     mov $0x28, %eax
     mov 8(%esp), %ebx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -153,7 +222,7 @@ brk:
     push %ebx
     mov $0x2d, %eax
     mov 8(%esp), %ebx
-    int $0x80
+    call *syscall_entry
     pop %ebx
     ret
 
@@ -174,7 +243,7 @@ llseek:
     mov 24(%esp), %edx
     mov 28(%esp), %esi
     mov 32(%esp), %edi
-    int $0x80
+    call *syscall_entry
     pop %edi
     pop %esi
     pop %ebx
@@ -185,5 +254,115 @@ llseek:
 .global yield
 yield:
     mov $0x9e, %eax
-    int $0x80
+    call *syscall_entry
+    ret
+
+# Sleeps for a given time.
+# Requested time at %esp + 4 goes into %ebx
+# Remaining time at %esp + 8 goes into %ecx
+.global nanosleep
+nanosleep:
+    push %ebx
+    mov $0xa2, %eax
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
+    call *syscall_entry
+    pop %ebx
+    ret
+
+# Creates an interest set.
+# Size hint at %esp + 4 goes into %ebx
+.global epoll_create
+epoll_create:
+    push %ebx
+    mov $0xfe, %eax
+    mov 8(%esp), %ebx
+    call *syscall_entry
+    pop %ebx
+    ret
+
+# Changes an interest set.
+# Set identifier at %esp + 4 goes into %ebx
+# Operation at %esp + 8 goes into %ecx
+# File descriptor at %esp + 12 goes into %edx
+# Pointer to the event at %esp + 16 goes into %esi
+.global epoll_ctl
+epoll_ctl:
+    push %ebx
+    push %esi
+    mov $0xff, %eax
+    mov 12(%esp), %ebx
+    mov 16(%esp), %ecx
+    mov 20(%esp), %edx
+    mov 24(%esp), %esi
+    call *syscall_entry
+    pop %esi
+    pop %ebx
+    ret
+
+# Waits on an interest set.
+# Set identifier at %esp + 4 goes into %ebx
+# Pointer to the event array at %esp + 8 goes into %ecx
+# Size of the array at %esp + 12 goes into %edx
+# Timeout at %esp + 16 goes into %esi
+.global epoll_wait
+epoll_wait:
+    push %ebx
+    push %esi
+    mov $0x100, %eax
+    mov 12(%esp), %ebx
+    mov 16(%esp), %ecx
+    mov 20(%esp), %edx
+    mov 24(%esp), %esi
+    call *syscall_entry
+    pop %esi
+    pop %ebx
+    ret
+
+# Destroys an interest set.
+# Set identifier at %esp + 4 goes into %ebx
+.global epoll_close
+epoll_close:
+    push %ebx
+    mov $0x101, %eax
+    mov 8(%esp), %ebx
+    call *syscall_entry
+    pop %ebx
+    ret
+
+# Sets up an I/O ring.
+# Ring memory at %esp + 4 goes into %ebx
+# Number of entries at %esp + 8 goes into %ecx
+.global io_ring_setup
+io_ring_setup:
+    push %ebx
+    mov $0x1a9, %eax
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
+    call *syscall_entry
+    pop %ebx
+    ret
+
+# Carries out the entries on an I/O ring.
+# Ring identifier at %esp + 4 goes into %ebx
+# Most entries to submit at %esp + 8 goes into %ecx
+.global io_ring_enter
+io_ring_enter:
+    push %ebx
+    mov $0x1aa, %eax
+    mov 8(%esp), %ebx
+    mov 12(%esp), %ecx
+    call *syscall_entry
+    pop %ebx
+    ret
+
+# Destroys an I/O ring.
+# Ring identifier at %esp + 4 goes into %ebx
+.global io_ring_close
+io_ring_close:
+    push %ebx
+    mov $0x1ab, %eax
+    mov 8(%esp), %ebx
+    call *syscall_entry
+    pop %ebx
     ret
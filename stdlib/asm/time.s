@@ -0,0 +1,8 @@
+.section .text
+
+# Reads the time stamp counter, for working out the time from the time page.
+# The 64 bit value is returned in %edx:%eax.
+.global read_tsc
+read_tsc:
+    rdtsc
+    ret
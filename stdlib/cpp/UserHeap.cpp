@@ -1,6 +1,8 @@
-#include "../include/unistd.h"
 #include "../include/UserHeap.h"
 
+#include "../include/cstring"
+#include "../include/unistd.h"
+
 #include <stddef.h>
 #include <stdint.h>
 
@@ -23,30 +25,31 @@ alignas(UserHeap) char user_heap_space[sizeof(UserHeap) / sizeof(char)];
 /******************************************************************************
  ******************************************************************************/
 
+constexpr size_t UserHeap::class_sizes[];
+
+/******************************************************************************/
+
 UserHeap::UserHeap(void* s) :
-    start {static_cast<BlockData*>(s)},
-    last {static_cast<BlockData*>(s)}
+    start {nullptr},
+    end {nullptr},
+    end_prev_free {false},
+    runs {},
+    free_spans {},
+    span_map {0}
 {
-    // Set the block data size as heap_align aligned.
-    data_size = (((sizeof(BlockData) - 1) >> heap_align_power) + 1) <<
-        heap_align_power;
+    // Spans start on page boundaries, so round the start of the heap up.
+    uintptr_t addr = reinterpret_cast<uintptr_t>(s);
+    addr = (addr + page_size - 1) & ~(page_size - 1);
 
-    // System call to allocate enough space for the empty block. Really this
-    // will allocate a whole page, but since we don't know the page size, we
-    // won't worry about that.
-    if (brk(static_cast<uint8_t*>(s) + data_size) != 0)
-    {
-        // Failure. We don't have a heap. Setting start to nullptr will ensure
-        // all allocations fail immediately.
-        start = nullptr;
-    }
-    else
+    // Move the break point to the start. Memory is only requested when
+    // something is allocated.
+    if (brk(reinterpret_cast<void*>(addr)) == 0)
     {
-        // Initialise a BlockData.
-        start->size = 0;
-        start->next = nullptr;
-        start->free = true;
+        start = reinterpret_cast<uint8_t*>(addr);
+        end = start;
     }
+    // Otherwise, we don't have a heap. Leaving start as nullptr will ensure
+    // all allocations fail immediately.
 }
 
 /******************************************************************************/
@@ -59,11 +62,7 @@ void* UserHeap::calloc(size_t nitems, size_t size)
         return nullptr;
 
     // Set all the memory to zero.
-    for (size_t i = 0; i < nitems*size; ++i)
-    {
-        char* ptr = static_cast<char*>(result) + i;
-        *ptr = 0;
-    }
+    memset(result, 0, nitems * size);
 
     return result;
 }
@@ -79,19 +78,29 @@ void UserHeap::free(void* addr)
     // realloced, the static_cast will get us in trouble. Fortunately, the
     // C standard says free only has to work for previously allocated memory, so
     // it's the caller's fault if they've done something stupid.
-    // We need to reduce the address so we're pointing at the metadata, not the
-    // actual value.
-    BlockData* current = reinterpret_cast<BlockData*>(
-        reinterpret_cast<size_t>(addr) - data_size);
-    current->free = true;
-
-    // Let's see if we can merge with the block after. Checking the block
-    // before is prohibitively slow unless we change BlockData to be a doubly-
-    // linked list. Don't merge with the last BlockData.
-    while (current->next->free && current->next->next != nullptr)
+    Span* s = span_of(addr);
+
+    if (s->size_class == large_class)
     {
-        current->size += data_size + current->next->size;
-        current->next = current->next->next;
+        free_span(s);
+        return;
+    }
+
+    // Put the object back on the run's free list. If the run was full, it has
+    // space again.
+    size_t cls = s->size_class;
+    if (s->free_list == nullptr)
+        push(runs[cls], s);
+    *static_cast<void**>(addr) = s->free_list;
+    s->free_list = addr;
+    --s->in_use;
+
+    // Give back an empty run. Keeping spare runs would pin the memory above
+    // them, so the top of the heap could never be trimmed.
+    if (s->in_use == 0)
+    {
+        unlink(runs[cls], s);
+        free_span(s);
     }
 }
 
@@ -107,73 +116,300 @@ void* UserHeap::malloc(size_t size)
     if (size <= 0)
         return nullptr;
 
-    // Align size to heap_align bytes.
-    size = (((size - 1) >> heap_align_power) + 1) << heap_align_power;
+    if (size > max_small)
+    {
+        // Large allocation. Gets its own span.
+        Span* s = allocate_span((size + span_size + page_size - 1) / page_size);
+        if (s == nullptr)
+            return nullptr;
+        s->size_class = large_class;
+        return reinterpret_cast<uint8_t*>(s) + span_size;
+    }
+
+    // Small allocation. Take an object from a run of the right class.
+    size_t cls = class_index(size);
+    Span* s = runs[cls];
+    if (s == nullptr)
+    {
+        s = new_run(cls);
+        if (s == nullptr)
+            return nullptr;
+    }
 
-    BlockData* result = find_free_block(size);
+    void* result = s->free_list;
+    s->free_list = *static_cast<void**>(result);
+    ++s->in_use;
 
-    if (result == last)
-        // No exisiting blocks large enough, create a new one at the end.
-        result = new_block(size);
+    // Full runs come off the list, they're put back when something is freed.
+    if (s->free_list == nullptr)
+        unlink(runs[cls], s);
 
-    // Return a pointer to the space, not the metadata.
-    return
-        reinterpret_cast<void*>(reinterpret_cast<size_t>(result) + data_size);
+    return result;
 }
 
 /******************************************************************************/
 
-UserHeap::BlockData* UserHeap::find_free_block(size_t size)
+void* UserHeap::realloc(void* ptr, size_t size)
 {
-    // Start from the beginning of the heap.
-    BlockData* current = start;
+    if (ptr == nullptr)
+        return malloc(size);
+
+    if (size == 0)
+    {
+        free(ptr);
+        return nullptr;
+    }
+
+    // Work out how much space there already is.
+    Span* s = span_of(ptr);
+    size_t old_size = (s->size_class == large_class ?
+        s->pages * page_size - span_size : class_sizes[s->size_class]);
 
-    // Iterate through the heap.
-    while (current->next != nullptr && (size > current->size ||
-        !current->free))
-        current = current->next;
+    // Keep the existing space if it's big enough and not much too big.
+    if (size <= old_size && size > old_size / 2)
+        return ptr;
 
-    // Check whether there's enough space at the end of the block to split off.
-    if (current->next != nullptr &&
-        current->size >= size + data_size + heap_align)
+    void* result = malloc(size);
+    if (result == nullptr)
+        return nullptr;
+    memcpy(result, ptr, (size < old_size ? size : old_size));
+    free(ptr);
+
+    return result;
+}
+
+/******************************************************************************/
+
+UserHeap::Span* UserHeap::allocate_span(size_t pages)
+{
+    // Spans in the list that fits might still be too small, so check them
+    // individually. Anything in a higher list is big enough.
+    size_t n = span_bin(pages);
+    Span* s = free_spans[n];
+    while (s != nullptr && s->pages < pages)
+        s = s->next;
+    if (s == nullptr)
+    {
+        uint32_t higher = span_map & ~((2u << n) - 1);
+        if (higher == 0)
+        {
+            // Nothing free is big enough. Get more memory and try again, which
+            // is sure to work.
+            if (!extend(pages))
+                return nullptr;
+            return allocate_span(pages);
+        }
+        s = free_spans[__builtin_ctz(higher)];
+    }
+    bin_remove(s);
+
+    if (s->pages > pages)
+    {
+        // Split off the remainder as a free span. The span after it already
+        // knows it has a free span before it.
+        Span* rest = reinterpret_cast<Span*>(
+            reinterpret_cast<uint8_t*>(s) + pages * page_size);
+        rest->pages = s->pages - pages;
+        rest->prev_free = false;
+        s->pages = pages;
+        bin_insert(rest);
+    }
+    else
+        set_next_prev_free(s, false);
+
+    s->in_use = 0;
+    s->free_list = nullptr;
+    s->prev = nullptr;
+    s->next = nullptr;
+    return s;
+}
+
+/******************************************************************************/
+
+size_t UserHeap::class_index(size_t size)
+{
+    // The smallest classes go up in steps of heap_align.
+    if (size <= class_sizes[7])
+        return (size - 1) / heap_align;
+
+    size_t i = 8;
+    while (size > class_sizes[i])
+        ++i;
+    return i;
+}
+
+/******************************************************************************/
+
+bool UserHeap::extend(size_t pages)
+{
+    // A free span at the top of the heap will be merged with the new memory,
+    // so only the difference is needed.
+    size_t have = 0;
+    if (end_prev_free)
+        have = *reinterpret_cast<size_t*>(end - sizeof(size_t));
+    size_t need = (pages > have ? pages - have : 1);
+
+    // Ask for a batch of pages at a time, so small allocations don't need a
+    // system call each. If that's too much, try for just what's needed.
+    size_t grow = (need > grow_pages ? need : grow_pages);
+    if (brk(end + grow * page_size) != 0)
     {
-        BlockData* nb = reinterpret_cast<BlockData*>(
-            reinterpret_cast<size_t>(current) + size + data_size);
-        nb->free = true;
-        nb->size = current->size - size - data_size;
-        nb->next = current->next;
-        current->size = size;
-        current->next = nb;
+        grow = need;
+        if (brk(end + grow * page_size) != 0)
+            return false;
     }
 
-    if (current->next != nullptr)
-        current->free = false;
+    // Make the new memory into a free span.
+    Span* s = reinterpret_cast<Span*>(end);
+    s->pages = grow;
+    s->prev_free = end_prev_free;
+    end += grow * page_size;
+    end_prev_free = false;
+    free_span(s, false);
 
-    return current;
+    return true;
 }
 
 /******************************************************************************/
 
-UserHeap::BlockData* UserHeap::new_block(size_t size)
+void UserHeap::free_span(Span* s, bool trim)
 {
-    // Expand the heap memory area.
-    if (brk(reinterpret_cast<uint8_t*>(last) + 2 * data_size + size) != 0)
+    // Merge with the span after.
+    Span* next = reinterpret_cast<Span*>(
+        reinterpret_cast<uint8_t*>(s) + s->pages * page_size);
+    if (reinterpret_cast<uint8_t*>(next) != end &&
+        next->size_class == free_class)
+    {
+        bin_remove(next);
+        s->pages += next->pages;
+    }
+
+    // Merge with the span before, found from its last word.
+    if (s->prev_free)
+    {
+        size_t prev_pages = *reinterpret_cast<size_t*>(
+            reinterpret_cast<uint8_t*>(s) - sizeof(size_t));
+        Span* prev = reinterpret_cast<Span*>(
+            reinterpret_cast<uint8_t*>(s) - prev_pages * page_size);
+        bin_remove(prev);
+        prev->pages += s->pages;
+        s = prev;
+    }
+
+    // Give memory back to the kernel if there's a lot free at the top.
+    uint8_t* s_end = reinterpret_cast<uint8_t*>(s) + s->pages * page_size;
+    if (trim && s_end == end && s->pages >= trim_pages)
+    {
+        uint8_t* new_end = reinterpret_cast<uint8_t*>(s) +
+            grow_pages * page_size;
+        if (brk(new_end) == 0)
+        {
+            s->pages = grow_pages;
+            end = new_end;
+        }
+    }
+
+    bin_insert(s);
+}
+
+/******************************************************************************/
+
+UserHeap::Span* UserHeap::new_run(size_t cls)
+{
+    Span* s = allocate_span(1);
+    if (s == nullptr)
         return nullptr;
+    s->size_class = cls;
+
+    // Thread all the objects onto the free list, in address order.
+    size_t sz = class_sizes[cls];
+    uint8_t* base = reinterpret_cast<uint8_t*>(s) + span_size;
+    for (size_t i = max_small / sz; i > 0; --i)
+    {
+        void* obj = base + (i - 1) * sz;
+        *static_cast<void**>(obj) = s->free_list;
+        s->free_list = obj;
+    }
+
+    push(runs[cls], s);
+    return s;
+}
+
+/******************************************************************************/
+
+void UserHeap::set_next_prev_free(Span* s, bool free)
+{
+    uint8_t* next = reinterpret_cast<uint8_t*>(s) + s->pages * page_size;
+    if (next == end)
+        end_prev_free = free;
+    else
+        reinterpret_cast<Span*>(next)->prev_free = free;
+}
+
+/******************************************************************************/
+
+UserHeap::Span* UserHeap::span_of(const void* ptr)
+{
+    return reinterpret_cast<Span*>(
+        reinterpret_cast<uintptr_t>(ptr) & ~(page_size - 1));
+}
+
+/******************************************************************************/
+
+void UserHeap::push(Span*& list, Span* s)
+{
+    s->prev = nullptr;
+    s->next = list;
+    if (list != nullptr)
+        list->prev = s;
+    list = s;
+}
+
+/******************************************************************************/
+
+void UserHeap::unlink(Span*& list, Span* s)
+{
+    if (s->prev != nullptr)
+        s->prev->next = s->next;
+    else
+        list = s->next;
+    if (s->next != nullptr)
+        s->next->prev = s->prev;
+    s->prev = nullptr;
+    s->next = nullptr;
+}
 
-    // Change last to reflect the new block.
-    last->size = size;
-    last->free = false;
-    BlockData* prev_last = last;
+/******************************************************************************/
 
-    // Create a new empty last.
-    last = reinterpret_cast<BlockData*>(reinterpret_cast<size_t>(last) + size
-        + data_size);
-    last->size = 0;
-    last->free = true;
-    last->next = nullptr;
-    prev_last->next = last;
+size_t UserHeap::span_bin(size_t pages)
+{
+    size_t n = 31 - __builtin_clz(pages);
+    return (n < span_bins ? n : span_bins - 1);
+}
+
+/******************************************************************************/
 
-    return prev_last;
+void UserHeap::bin_insert(Span* s)
+{
+    // Mark as free, with the size in the last word for the span after.
+    s->size_class = free_class;
+    *reinterpret_cast<size_t*>(reinterpret_cast<uint8_t*>(s) +
+        s->pages * page_size - sizeof(size_t)) = s->pages;
+    set_next_prev_free(s, true);
+
+    size_t n = span_bin(s->pages);
+    push(free_spans[n], s);
+    span_map |= (1 << n);
+}
+
+/******************************************************************************/
+
+void UserHeap::bin_remove(Span* s)
+{
+    size_t n = span_bin(s->pages);
+    unlink(free_spans[n], s);
+    if (free_spans[n] == nullptr)
+        span_map &= ~(1 << n);
 }
 
 /******************************************************************************
@@ -14,12 +14,16 @@ namespace NMSP {
 namespace helper {
 
 extern "C" void hang(int);
+extern "C" void init_syscall_entry();
 
 // This function is nothrow, as we can't handle exceptions in the calling
 // assembly routine. All exceptions must be caught.
 void initialise_standard_library() noexcept
 {
     try {
+        // Choose how to make system calls, before making any.
+        init_syscall_entry();
+
         // The nothrow oject is used by new for allocations, but is a global
         // object. We need to contruct it here or we'll get problems. It doesn't
         // matter if it gets initialised again.
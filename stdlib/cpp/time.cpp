@@ -0,0 +1,117 @@
+#include "../include/time.h"
+
+#include "../include/atomic"
+
+// The time functions have no use in the kernel library.
+#ifndef KLIB
+
+/******************************************************************************
+ ******************************************************************************/
+
+// Reads the time stamp counter. Defined in time.s in assembly.
+extern "C" uint64_t read_tsc();
+
+/******************************************************************************/
+
+// Reads a consistent copy of the time page. The kernel writes it at most once a
+// timer tick, so a retry is rare.
+static time_page read_time_page()
+{
+    const volatile time_page* tp =
+        reinterpret_cast<const volatile time_page*>(TIME_PAGE_ADDR);
+    time_page ret;
+    uint32_t seq;
+
+    do {
+        seq = tp->seq;
+        NMSP::atomic_thread_fence(NMSP::memory_order_acquire);
+        ret.mono_ns = tp->mono_ns;
+        ret.boot_sec = tp->boot_sec;
+        ret.tsc_base = tp->tsc_base;
+        ret.tsc_mult = tp->tsc_mult;
+        ret.tsc_shift = tp->tsc_shift;
+        NMSP::atomic_thread_fence(NMSP::memory_order_acquire);
+    } while ((seq & 1) != 0 || seq != tp->seq);
+
+    ret.seq = seq;
+    ret.pad = 0;
+    return ret;
+}
+
+/******************************************************************************/
+
+// Gets the time since boot from a copy of the time page, in nanoseconds.
+static uint64_t since_boot_ns(const time_page& t)
+{
+    if (t.tsc_mult == 0)
+        return t.mono_ns;
+
+    uint64_t tsc = read_tsc();
+    if (tsc <= t.tsc_base)
+        return t.mono_ns;
+
+    // Multiply the two halves of the count separately, so that nothing
+    // overflows, whatever the count. The same sums as the kernel's clock.
+    uint64_t counts = tsc - t.tsc_base;
+    uint64_t high = (counts >> 32) * t.tsc_mult;
+    uint64_t low = (counts & 0xFFFFFFFF) * t.tsc_mult;
+    return t.mono_ns + (high << (32 - t.tsc_shift)) + (low >> t.tsc_shift);
+}
+
+/******************************************************************************/
+
+int clock_gettime(clockid_t clk, timespec* tp)
+{
+    if (tp == nullptr)
+        return -1;
+
+    time_page t = read_time_page();
+    uint64_t ns = since_boot_ns(t);
+    int64_t sec = static_cast<int64_t>(ns / 1000000000);
+    long nsec = static_cast<long>(ns % 1000000000);
+
+    switch (clk)
+    {
+    case CLOCK_REALTIME:
+        sec += t.boot_sec;
+        break;
+    case CLOCK_MONOTONIC:
+        break;
+    default:
+        return -1;
+    }
+
+    tp->tv_sec = static_cast<time_t>(sec);
+    tp->tv_nsec = nsec;
+    return 0;
+}
+
+/******************************************************************************/
+
+int gettimeofday(timeval* tv, void* tz)
+{
+    if (tv == nullptr || tz != nullptr)
+        return -1;
+
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+    return 0;
+}
+
+/******************************************************************************/
+
+time_t time(time_t* t)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (t != nullptr)
+        *t = ts.tv_sec;
+    return ts.tv_sec;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+#endif /* not KLIB */
@@ -0,0 +1,26 @@
+#include "../include/unistd.h"
+
+#include "../include/time.h"
+
+// unistd has no use in the kernel library.
+#ifndef KLIB
+
+/******************************************************************************
+ ******************************************************************************/
+
+unsigned int sleep(unsigned int seconds)
+{
+    timespec req {static_cast<time_t>(seconds), 0};
+    timespec rem {0, 0};
+
+    if (nanosleep(&req, &rem) != 0)
+        return seconds;
+
+    // Round any remaining part second up.
+    return static_cast<unsigned int>(rem.tv_sec) + (rem.tv_nsec != 0);
+}
+
+/******************************************************************************
+ ******************************************************************************/
+
+#endif /* not KLIB */
@@ -7,6 +7,7 @@
 #endif /* NMSP */
 
 #include <stddef.h>
+#include <stdint.h>
 
 namespace NMSP {
 
@@ -16,14 +17,26 @@ namespace NMSP {
 namespace helper {
 
 /**
-    Class to manage dynamic memory allocation.
+    Class to manage dynamic memory allocation. The heap is a series of spans of
+    whole pages, obtained from the kernel with brk. Small allocations are
+    rounded up to one of a set of size classes, and come from single page runs
+    that only hold objects of one class, each with its own free list, so
+    allocating and freeing them doesn't involve any searching. Larger
+    allocations get a span of their own. Free spans are merged with their
+    neighbours and kept on lists segregated by size.
+
+    The break point is moved up in batches rather than for every allocation,
+    and only moved back down when a lot of memory at the top of the heap is
+    free, so a program that repeatedly allocates and frees doesn't make a
+    system call every time.
  */
 class UserHeap {
 public:
     /**
         Construction only needs to know the start of the heap.
 
-        @param s Memory address for the start of the heap.
+        @param s Memory address for the start of the heap. Will be rounded up
+               to a page boundary.
      */
     explicit UserHeap(void* s);
 
@@ -31,7 +44,14 @@ public:
         Default constructor. Sets the start of the heap to nullptr so that
         future allocations will fail.
      */
-    UserHeap() : start {nullptr}, last {nullptr}, data_size {0} {}
+    UserHeap() :
+        start {nullptr},
+        end {nullptr},
+        end_prev_free {false},
+        runs {},
+        free_spans {},
+        span_map {0}
+    {}
 
     /**
         Allocates memory of the size given and initialises to zero.
@@ -74,43 +94,103 @@ public:
     void* realloc(void* ptr, size_t size);
 
 private:
-    // Stores meta information about each block.
-    struct BlockData {
-        // Size of the block, in bytes.
-        size_t size = 0;
-        // Pointer to the next block.
-        BlockData* next = nullptr;
-        // Whether the block is currently available.
-        bool free = true;
+    // Header at the start of every span. Pointers handed out are never more
+    // than a page from the start of their span, so the header can be found by
+    // rounding down to a page boundary.
+    struct Span {
+        // Size class of the objects in the span, or large_class or free_class.
+        size_t size_class;
+        // Number of pages in the span.
+        size_t pages;
+        // Whether the span immediately before this one is free. Free spans
+        // have their size in pages in their last word, so it can be found.
+        bool prev_free;
+        // Number of objects allocated, for runs of small objects.
+        size_t in_use;
+        // First free object, for runs of small objects. Each free object holds
+        // a pointer to the next.
+        void* free_list;
+        // Links for the list of free spans or runs of the same class.
+        Span* prev;
+        Span* next;
     };
 
-    // Memory address of the start of the heap.
-    BlockData* start;
-    // Memory address of the end of the heap. This will be a valid BlockData,
-    // with it's size as 0 and it's next as nullptr.
-    BlockData* last;
-
-    // Size of the BlockData. Even though we expect this to be 12 bytes, we'll
-    // set it up in the constructor to be aligned to heap_align.
-    size_t data_size;
-
-    // This is the value to align the heap to. Having the power is convenient
-    // for bitwise operations.
+    // Page size assumed for brk.
+    static constexpr size_t page_size = 4096;
+    // This is the value to align the heap to.
     static constexpr size_t heap_align = 16;
-    static constexpr size_t heap_align_power = 4;
-
-    // Starting from the beginning of the heap, return the first free block
-    // of sufficient size, or last if none is found. Splits the block if there
-    // is enough trailing space.
-    // If the optional alignment is given, only return a free block if there's
-    // space to fit in the aligned data. Splits the start off, if there's enough
-    // leading space.
-    BlockData* find_free_block(size_t size);
-
-    // Creates a new block of the specified size at the end of the heap. If
-    // align is not zero, the space created will be aligned as specified. This
-    // may mean creating two new blocks.
-    BlockData* new_block(size_t size);
+    // Space for the Span header, aligned to heap_align.
+    static constexpr size_t span_size =
+        ((sizeof(Span) + heap_align - 1) / heap_align) * heap_align;
+    // Number of small size classes.
+    static constexpr size_t classes = 22;
+    // Sizes of the small classes. Each is a multiple of heap_align and the
+    // larger ones are chosen to waste as little of a page as possible.
+    static constexpr size_t class_sizes[classes] = {16, 32, 48, 64, 80, 96,
+        112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 1008, 1344,
+        2032, 4064};
+    // Largest small allocation.
+    static constexpr size_t max_small = page_size - span_size;
+    static_assert(class_sizes[classes - 1] == max_small,
+        "Largest size class must fill a page");
+    // Size class values for spans that aren't runs of small objects.
+    static constexpr size_t large_class = classes;
+    static constexpr size_t free_class = classes + 1;
+    // Number of lists of free spans. List n holds spans of at least 2^n pages
+    // and less than twice that, the last holds everything bigger.
+    static constexpr size_t span_bins = 16;
+    // Minimum number of pages to move the break point up by.
+    static constexpr size_t grow_pages = 16;
+    // Give memory back when there are this many free pages at the top of the
+    // heap, leaving grow_pages free.
+    static constexpr size_t trim_pages = 64;
+
+    // Start of the first span.
+    uint8_t* start;
+    // End of the last span, which is also the break point.
+    uint8_t* end;
+    // Whether the last span is free.
+    bool end_prev_free;
+    // Runs with at least one free object for each small size class.
+    Span* runs[classes];
+    // Lists of free spans.
+    Span* free_spans[span_bins];
+    // Bit n is set when free_spans[n] is not empty.
+    uint32_t span_map;
+
+    // Gets a span of at least the given number of pages, getting more memory
+    // from the kernel if needed. Returns nullptr if no memory is available.
+    Span* allocate_span(size_t pages);
+
+    // Gets the size class for a small allocation.
+    static size_t class_index(size_t size);
+
+    // Adds memory to the top of the heap for a free span of at least the given
+    // number of pages. Returns false if the kernel won't give any more.
+    bool extend(size_t pages);
+
+    // Returns a span to the free lists, merging it with free neighbours. If
+    // trim is true and the result is at the top of the heap and big enough,
+    // some of it is given back to the kernel.
+    void free_span(Span* s, bool trim = true);
+
+    // Makes a new run for a small size class, returning nullptr for failure.
+    Span* new_run(size_t cls);
+
+    // Records whether the span s is free in the span after it.
+    void set_next_prev_free(Span* s, bool free);
+
+    // Gets the span for a pointer that was handed out.
+    static Span* span_of(const void* ptr);
+
+    // Adds and removes spans from lists.
+    static void push(Span*& list, Span* s);
+    static void unlink(Span*& list, Span* s);
+    // Gets the free span list for a number of pages.
+    static size_t span_bin(size_t pages);
+    // Adds and removes spans from the free span lists.
+    void bin_insert(Span* s);
+    void bin_remove(Span* s);
 };
 
 /**
@@ -0,0 +1,99 @@
+#ifndef EPOLL_H
+#define EPOLL_H
+
+#include <stdint.h>
+
+// Use std as the default namespace.
+#ifndef NMSP
+#define NMSP std
+#endif /* NMSP */
+
+// The epoll syscalls have no use in the kernel library.
+#ifndef KLIB
+
+// These are in the default namespace and have C linkage.
+extern "C" {
+
+/**
+    Events that can be registered for and reported.
+ */
+/** There is data to read. */
+#define EPOLLIN 0x1
+/** Exceptional condition. */
+#define EPOLLPRI 0x2
+/** It is possible to write. */
+#define EPOLLOUT 0x4
+/** Error on the file. Only reported. */
+#define EPOLLERR 0x8
+/** Hang up on the file. Only reported. */
+#define EPOLLHUP 0x10
+
+/**
+    Operations for epoll_ctl.
+ */
+/** Register a file descriptor. */
+#define EPOLL_CTL_ADD 1
+/** Remove a file descriptor. */
+#define EPOLL_CTL_DEL 2
+/** Change the events for a file descriptor. */
+#define EPOLL_CTL_MOD 3
+
+/**
+    An event to register for or that has happened.
+ */
+struct epoll_event {
+    /** Bitmask of EPOLL* events. */
+    uint32_t events;
+    /** File descriptor the event is for. */
+    int32_t fd;
+};
+
+// List of epoll syscalls. These functions are defined in syscalls.s in
+// assembly.
+
+/**
+    Creates an interest set. File descriptors stay registered with the set
+    between waits. The identifier is not a file descriptor, use epoll_close to
+    get rid of it.
+
+    @param size Ignored, but must be positive, from %ebx.
+    @return Identifier of the set, -1 on error.
+ */
+int32_t epoll_create(int size);
+
+/**
+    Adds, removes or changes a file descriptor in an interest set. Remove file
+    descriptors before closing them.
+
+    @param epfd Identifier of the set, from %ebx.
+    @param op One of the EPOLL_CTL_* operations, from %ecx.
+    @param fd File descriptor, from %edx.
+    @param event Events to register for. May be nullptr for EPOLL_CTL_DEL,
+           from %esi.
+    @return 0 on success, -1 on error.
+ */
+int32_t epoll_ctl(int epfd, int op, int fd, epoll_event* event);
+
+/**
+    Waits for file descriptors in an interest set to become ready. Descriptors
+    are reported for as long as they stay ready.
+
+    @param epfd Identifier of the set, from %ebx.
+    @param events Array to fill in with the ready descriptors, from %ecx.
+    @param maxevents Size of the array, from %edx.
+    @param timeout Milliseconds to wait for. Negative waits forever, from %esi.
+    @return Number of descriptors ready, 0 on timeout, -1 on error.
+ */
+int32_t epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout);
+
+/**
+    Destroys an interest set.
+
+    @param epfd Identifier of the set, from %ebx.
+    @return 0 on success, -1 on error.
+ */
+int32_t epoll_close(int epfd);
+
+} // end extern "C"
+#endif /* not KLIB */
+#endif /* EPOLL_H */
@@ -0,0 +1,159 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Use std as the default namespace.
+#ifndef NMSP
+#define NMSP std
+#endif /* NMSP */
+
+// The I/O ring syscalls have no use in the kernel library.
+#ifndef KLIB
+
+// These are in the default namespace and have C linkage.
+extern "C" {
+
+/**
+    Operations that can be submitted.
+ */
+/** Does nothing, completing with 0. */
+#define IORING_OP_NOP 0
+/** read(fd, addr, len). */
+#define IORING_OP_READ 1
+/** write(fd, addr, len). */
+#define IORING_OP_WRITE 2
+/** open(addr, flags, mode). */
+#define IORING_OP_OPEN 3
+/** close(fd). */
+#define IORING_OP_CLOSE 4
+/** llseek(fd, off, addr, flags), with flags as whence and addr the result. */
+#define IORING_OP_LLSEEK 5
+/** unlink(addr). */
+#define IORING_OP_UNLINK 6
+
+/** Largest number of entries in a ring. */
+#define IORING_MAX_ENTRIES 4096
+
+/**
+    Start of a ring, followed by the submission entries and then the completion
+    entries. The counters run freely and are masked with entries - 1 to index
+    the arrays. Fill in entries at sq_tail then move it on, and take
+    completions from cq_head then move it on. The kernel only reads and writes
+    the ring during io_ring_enter.
+ */
+struct io_ring {
+    /** Next submission for the kernel to take. Written by the kernel. */
+    uint32_t sq_head;
+    /** One past the last submission. */
+    uint32_t sq_tail;
+    /** Next completion to take. */
+    uint32_t cq_head;
+    /** One past the last completion. Written by the kernel. */
+    uint32_t cq_tail;
+    /** Number of entries in each ring. Written by the kernel. */
+    uint32_t entries;
+};
+
+/**
+    Submission entry.
+ */
+struct io_sqe {
+    /** One of the IORING_OP_* operations. */
+    uint32_t opcode;
+    /** File descriptor for operations that take one. */
+    int32_t fd;
+    /** Buffer, file name or result address. */
+    uint32_t addr;
+    /** Byte count for read and write. */
+    uint32_t len;
+    /** Offset for llseek. */
+    int64_t off;
+    /** Flags for open, or whence for llseek. */
+    uint32_t flags;
+    /** Mode for open. */
+    uint32_t mode;
+    /** Copied to the completion, to identify it. */
+    uint32_t user_data;
+};
+
+/**
+    Completion entry.
+ */
+struct io_cqe {
+    /** user_data of the submission. */
+    uint32_t user_data;
+    /** Return value of the operation, as from the equivalent syscall. */
+    int32_t res;
+};
+
+/**
+    Gets the amount of memory a ring needs.
+
+    @param entries Number of entries in the ring.
+    @return Size in bytes.
+ */
+inline size_t io_ring_size(uint32_t entries)
+{
+    return sizeof(io_ring) + entries * (sizeof(io_sqe) + sizeof(io_cqe));
+}
+
+/**
+    Gets the submission entries of a ring.
+
+    @param ring Ring set up by io_ring_setup.
+    @return Start of the submission entries.
+ */
+inline io_sqe* io_ring_sqes(io_ring* ring)
+{
+    return reinterpret_cast<io_sqe*>(ring + 1);
+}
+
+/**
+    Gets the completion entries of a ring.
+
+    @param ring Ring set up by io_ring_setup.
+    @return Start of the completion entries.
+ */
+inline io_cqe* io_ring_cqes(io_ring* ring)
+{
+    return reinterpret_cast<io_cqe*>(io_ring_sqes(ring) + ring->entries);
+}
+
+// List of I/O ring syscalls. These functions are defined in syscalls.s in
+// assembly.
+
+/**
+    Sets up a ring in memory provided by the process. The memory is cleared.
+    It must stay allocated until the ring is closed.
+
+    @param ring Memory of at least io_ring_size(entries) bytes, from %ebx.
+    @param entries Number of entries, a power of 2 up to IORING_MAX_ENTRIES,
+           from %ecx.
+    @return Identifier of the ring, -1 on error.
+ */
+int32_t io_ring_setup(io_ring* ring, uint32_t entries);
+
+/**
+    Has the kernel carry out submitted entries. Every entry taken has finished
+    by the time this returns, with its result on the completion ring. Entries
+    are only taken while there's room for their results.
+
+    @param id Identifier of the ring, from %ebx.
+    @param to_submit Most entries to take, from %ecx.
+    @return Number of entries taken, -1 on error.
+ */
+int32_t io_ring_enter(int id, uint32_t to_submit);
+
+/**
+    Destroys a ring. The memory can then be reused.
+
+    @param id Identifier of the ring, from %ebx.
+    @return 0 on success, -1 on error.
+ */
+int32_t io_ring_close(int id);
+
+} // end extern "C"
+#endif /* not KLIB */
+#endif /* IO_RING_H */
@@ -0,0 +1,123 @@
+#ifndef TIME_H
+#define TIME_H
+
+#include <stdint.h>
+
+// Use std as the default namespace.
+#ifndef NMSP
+#define NMSP std
+#endif /* NMSP */
+
+// The time syscalls have no use in the kernel library.
+#ifndef KLIB
+
+// These are in the default namespace and have C linkage.
+extern "C" {
+
+/**
+    Type for times in whole seconds.
+ */
+typedef int32_t time_t;
+
+/**
+    A time interval, in seconds and nanoseconds.
+ */
+struct timespec {
+    /** Whole seconds. */
+    time_t tv_sec;
+    /** Nanoseconds, from 0 to 999999999. */
+    long tv_nsec;
+};
+
+/**
+    A time, in seconds and microseconds.
+ */
+struct timeval {
+    /** Whole seconds. */
+    time_t tv_sec;
+    /** Microseconds, from 0 to 999999. */
+    long tv_usec;
+};
+
+/**
+    Type for clock identifiers.
+ */
+typedef int32_t clockid_t;
+
+/** Wall clock time, since the Unix epoch. */
+#define CLOCK_REALTIME 0
+/** Time since boot, which never goes backwards. */
+#define CLOCK_MONOTONIC 1
+
+/** User space address of the time page the kernel publishes the time on. */
+#define TIME_PAGE_ADDR 0x1000
+
+/**
+    Contents of the time page. The kernel increments seq before and after each
+    update, so it's odd while an update is in progress. If tsc_mult isn't 0,
+    the time since boot is mono_ns plus the TSC counts since tsc_base,
+    multiplied by tsc_mult and shifted right by tsc_shift. Otherwise it's
+    mono_ns, which the kernel updates on every timer tick.
+ */
+struct time_page {
+    /** Sequence count, odd while the page is being written. */
+    uint32_t seq;
+    /** Padding, to keep the times aligned. */
+    uint32_t pad;
+    /** Nanoseconds since boot, at the last update or at tsc_base. */
+    uint64_t mono_ns;
+    /** Seconds since the Unix epoch at boot. */
+    int64_t boot_sec;
+    /** TSC value at mono_ns. */
+    uint64_t tsc_base;
+    /** Multiplier for converting TSC counts to nanoseconds, or 0. */
+    uint32_t tsc_mult;
+    /** Right shift after multiplying by tsc_mult. */
+    uint32_t tsc_shift;
+};
+
+/**
+    Gets the time from a clock. Reads the time page, so doesn't need a
+    syscall. The resolution is that of the TSC if the kernel publishes it, or
+    of the system timer otherwise.
+
+    @param clk CLOCK_REALTIME or CLOCK_MONOTONIC.
+    @param tp Filled in with the time.
+    @return 0 on success, -1 on error.
+ */
+int clock_gettime(clockid_t clk, timespec* tp);
+
+/**
+    Gets the wall clock time. Reads the time page, so doesn't need a syscall.
+
+    @param tv Filled in with the time since the Unix epoch.
+    @param tz Obsolete, must be nullptr.
+    @return 0 on success, -1 on error.
+ */
+int gettimeofday(timeval* tv, void* tz);
+
+/**
+    Gets the wall clock time, in whole seconds.
+
+    @param t If not nullptr, also filled in with the time.
+    @return Seconds since the Unix epoch.
+ */
+time_t time(time_t* t);
+
+// List of time syscalls. These functions are defined in syscalls.s in
+// assembly.
+
+/**
+    Suspends the process for at least the requested time, which is rounded up to
+    the resolution of the system timer. Other processes run in the meantime.
+
+    @param req Time to sleep for, from %ebx.
+    @param rem If not nullptr, gets the time remaining if the sleep was cut
+           short, from %ecx.
+    @return 0 on success, -1 on error.
+ */
+int32_t nanosleep(const timespec* req, timespec* rem);
+
+} // end extern "C"
+#endif /* not KLIB */
+#endif /* TIME_H */
@@ -173,6 +173,16 @@ int32_t llseek(int fd, int32_t offset_high, int32_t offset_low,
  */
 int32_t yield();
 
+// Library functions built on the syscalls. These are defined in unistd.cpp.
+
+/**
+    Suspends the process for the given number of seconds, without using any CPU
+    time.
+
+    @param seconds Number of seconds to sleep for.
+    @return 0 if the full time elapsed, otherwise the number of seconds left.
+ */
+unsigned int sleep(unsigned int seconds);
 
 } // end extern "C"
 #endif /* not KLIB */
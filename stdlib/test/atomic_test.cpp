@@ -0,0 +1,193 @@
+#include <iostream>
+
+#include "../include/atomic"
+#include "../include/type_traits"
+
+using namespace klib;
+
+int main()
+{
+    size_t fail_count = 0;
+
+    // Types
+    if (!is_same<typename atomic<int>::value_type, int>::value)
+    {
+        ++fail_count;
+        std::cout << "FAILED atomic<int>::value_type\n";
+    }
+    if (!is_same<typename atomic<int*>::value_type, int*>::value)
+    {
+        ++fail_count;
+        std::cout << "FAILED atomic<int*>::value_type\n";
+    }
+
+    // atomic_flag
+    {
+        atomic_flag f = ATOMIC_FLAG_INIT;
+        if (f.test_and_set())
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic_flag::test_and_set() when clear\n";
+        }
+        if (!f.test_and_set())
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic_flag::test_and_set() when set\n";
+        }
+        f.clear();
+        if (f.test_and_set(memory_order_acquire))
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic_flag::clear()\n";
+        }
+    }
+
+    // is_lock_free
+    {
+        atomic<int> a {0};
+        if (!a.is_lock_free())
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::is_lock_free()\n";
+        }
+    }
+
+    // load, store, conversion and assignment
+    {
+        atomic<int> a {5};
+        if (a.load() != 5)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::atomic(int)\n";
+        }
+        a.store(6, memory_order_release);
+        if (a.load(memory_order_acquire) != 6)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::store(int)\n";
+        }
+        if ((a = 7) != 7 || static_cast<int>(a) != 7)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::operator=(int)\n";
+        }
+    }
+
+    // exchange
+    {
+        atomic<bool> a {false};
+        if (a.exchange(true) != false || a.load() != true)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<bool>::exchange(bool)\n";
+        }
+    }
+
+    // compare_exchange
+    {
+        atomic<int> a {1};
+        int expected = 2;
+        if (a.compare_exchange_strong(expected, 3) || expected != 1 ||
+            a.load() != 1)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::compare_exchange_strong() "
+                "mismatch\n";
+        }
+        if (!a.compare_exchange_strong(expected, 3) || a.load() != 3)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::compare_exchange_strong() "
+                "match\n";
+        }
+        expected = 3;
+        while (!a.compare_exchange_weak(expected, 4, memory_order_acq_rel))
+            ;
+        if (a.load() != 4)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int>::compare_exchange_weak()\n";
+        }
+    }
+
+    // Arithmetic and bitwise operations
+    {
+        atomic<unsigned> a {10};
+        if (a.fetch_add(5) != 10 || a.load() != 15)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::fetch_add()\n";
+        }
+        if (a.fetch_sub(3) != 15 || a.load() != 12)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::fetch_sub()\n";
+        }
+        if (a.fetch_and(0x6) != 12 || a.load() != 4)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::fetch_and()\n";
+        }
+        if (a.fetch_or(0x3) != 4 || a.load() != 7)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::fetch_or()\n";
+        }
+        if (a.fetch_xor(0x5) != 7 || a.load() != 2)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::fetch_xor()\n";
+        }
+        if (++a != 3 || a++ != 3 || a.load() != 4)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::operator++\n";
+        }
+        if (--a != 3 || a-- != 3 || a.load() != 2)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::operator--\n";
+        }
+        if ((a += 8) != 10 || (a -= 4) != 6)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::operator+= and -=\n";
+        }
+        if ((a &= 0x4) != 4 || (a |= 0x1) != 5 || (a ^= 0x7) != 2)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<unsigned>::operator&=, |= and ^=\n";
+        }
+    }
+
+    // Pointer arithmetic
+    {
+        int arr[4] {0, 1, 2, 3};
+        atomic<int*> p {arr};
+        if (p.fetch_add(2) != arr || p.load() != arr + 2)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int*>::fetch_add()\n";
+        }
+        if (p.fetch_sub(1) != arr + 2 || *p.load() != 1)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int*>::fetch_sub()\n";
+        }
+        if (++p != arr + 2 || --p != arr + 1 || (p += 2) != arr + 3)
+        {
+            ++fail_count;
+            std::cout << "FAILED atomic<int*> operators\n";
+        }
+    }
+
+    // Fences
+    atomic_thread_fence(memory_order_seq_cst);
+    atomic_signal_fence(memory_order_seq_cst);
+
+    // End
+    if (fail_count == 0)
+        std::cout << "All tests passed\n";
+    else
+        std::cout << fail_count << " tests failed\n";
+}